@@ -60,6 +60,7 @@ LOCAL_SRC_FILES := \
 	sockets.c \
 	services.c \
 	file_sync_client.c \
+	lz.c \
 	$(EXTRA_SRCS) \
 	$(USB_SRCS) \
 	utils.c \
@@ -117,6 +118,7 @@ LOCAL_SRC_FILES := \
 	sockets.c \
 	services.c \
 	file_sync_service.c \
+	lz.c \
 	jdwp_service.c \
 	framebuffer_service.c \
 	remount_service.c \
@@ -163,6 +165,7 @@ LOCAL_SRC_FILES := \
 	sockets.c \
 	services.c \
 	file_sync_client.c \
+	lz.c \
 	get_my_path_linux.c \
 	usb_linux.c \
 	utils.c \
@@ -18,6 +18,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <ctype.h>
 #include <stdarg.h>
 #include <errno.h>
@@ -40,6 +41,8 @@
 ADB_MUTEX_DEFINE( D_lock );
 #endif
 
+ADB_MUTEX_DEFINE( apacket_lock );
+
 int HOST = 0;
 
 static const char *adb_device_banner = "device";
@@ -132,19 +135,185 @@ void  adb_trace_init(void)
 }
 
 
+/* Freed packets are kept for reuse, up to APACKET_POOL_MAX of them.
+** At most APACKET_POOL_LARGE of those keep a payload buffer from
+** reserve_apacket(); the others go back to their own buffer.
+*/
+#define APACKET_POOL_MAX    64
+#define APACKET_POOL_LARGE  8
+
+static apacket *apacket_pool;
+static int apacket_pool_count;
+static int apacket_pool_large;
+
 apacket *get_apacket(void)
 {
-    apacket *p = malloc(sizeof(apacket));
-    if(p == 0) fatal("failed to allocate an apacket");
-    memset(p, 0, sizeof(apacket) - MAX_PAYLOAD);
+    apacket *p;
+
+    adb_mutex_lock(&apacket_lock);
+    p = apacket_pool;
+    if(p) {
+        apacket_pool = p->next;
+        apacket_pool_count--;
+        if(p->data != p->buf) apacket_pool_large--;
+    }
+    adb_mutex_unlock(&apacket_lock);
+
+    if(p == 0) {
+        p = malloc(sizeof(apacket));
+        if(p == 0) fatal("failed to allocate an apacket");
+        p->data = p->buf;
+        p->size = sizeof(p->buf);
+    }
+    memset(p, 0, offsetof(apacket, buf));
     return p;
 }
 
+/* Makes room for a payload of size bytes, keeping what is already there */
+void reserve_apacket(apacket *p, unsigned size)
+{
+    unsigned char *data;
+
+    if(size <= p->size) return;
+    data = malloc(size);
+    if(data == 0) fatal("failed to allocate an apacket payload");
+    memcpy(data, p->data, p->size);
+    if(p->data != p->buf) free(p->data);
+    p->data = data;
+    p->size = size;
+}
+
 void put_apacket(apacket *p)
 {
-    free(p);
+#ifdef HAVE_SPLICE
+    if(p->pipe) {
+        put_apipe(p->pipe);
+        p->pipe = 0;
+    }
+#endif
+    adb_mutex_lock(&apacket_lock);
+    if(apacket_pool_count < APACKET_POOL_MAX) {
+        if(p->data != p->buf) {
+            if(apacket_pool_large < APACKET_POOL_LARGE) {
+                apacket_pool_large++;
+            } else {
+                free(p->data);
+                p->data = p->buf;
+                p->size = sizeof(p->buf);
+            }
+        }
+        p->next = apacket_pool;
+        apacket_pool = p;
+        apacket_pool_count++;
+        p = 0;
+    }
+    adb_mutex_unlock(&apacket_lock);
+
+    if(p) {
+        if(p->data != p->buf) free(p->data);
+        free(p);
+    }
+}
+
+#ifdef HAVE_SPLICE
+/* Empty pipes are kept for reuse too. Each one costs two fds, so only
+** APIPE_MAX can be live at once; past that, payloads go through memory.
+*/
+#define APIPE_POOL_MAX  16
+#define APIPE_MAX       64
+
+static apipe *apipe_pool;
+static int apipe_pool_count;
+static int apipe_count;
+
+apipe *get_apipe(void)
+{
+    apipe *ap;
+    int n;
+
+    adb_mutex_lock(&apacket_lock);
+    ap = apipe_pool;
+    if(ap) {
+        apipe_pool = ap->next;
+        apipe_pool_count--;
+    } else if(apipe_count < APIPE_MAX) {
+        apipe_count++;
+    } else {
+        adb_mutex_unlock(&apacket_lock);
+        return 0;
+    }
+    adb_mutex_unlock(&apacket_lock);
+
+    if(ap == 0) {
+        ap = malloc(sizeof(apipe));
+        if(ap == 0 || pipe(ap->fd) < 0) {
+            free(ap);
+            adb_mutex_lock(&apacket_lock);
+            apipe_count--;
+            adb_mutex_unlock(&apacket_lock);
+            return 0;
+        }
+        close_on_exec(ap->fd[0]);
+        close_on_exec(ap->fd[1]);
+        ap->size = 65536;
+#ifdef F_SETPIPE_SZ
+            /* room for a whole payload, if the kernel lets us have it.
+            ** data spliced from a socket rarely fills whole pages, so
+            ** ask for twice that many.
+            */
+        fcntl(ap->fd[1], F_SETPIPE_SZ, 2 * MAX_PAYLOAD);
+        n = fcntl(ap->fd[1], F_GETPIPE_SZ);
+        if(n > 0) ap->size = n;
+#endif
+    }
+    ap->next = 0;
+    ap->held = 0;
+    return ap;
+}
+
+void put_apipe(apipe *ap)
+{
+        /* a pipe with data left in it is no use to anyone else */
+    if(ap->held == 0) {
+        adb_mutex_lock(&apacket_lock);
+        if(apipe_pool_count < APIPE_POOL_MAX) {
+            ap->next = apipe_pool;
+            apipe_pool = ap;
+            apipe_pool_count++;
+            ap = 0;
+        }
+        adb_mutex_unlock(&apacket_lock);
+        if(ap == 0) return;
+    }
+
+    adb_close(ap->fd[0]);
+    adb_close(ap->fd[1]);
+    free(ap);
+    adb_mutex_lock(&apacket_lock);
+    apipe_count--;
+    adb_mutex_unlock(&apacket_lock);
 }
 
+/* Moves a payload held in a pipe back into the packet's own memory,
+** for anything that needs to look at it or can't splice it.
+*/
+void unsplice_apacket(apacket *p)
+{
+    apipe *ap = p->pipe;
+
+    if(ap == 0) return;
+    reserve_apacket(p, ap->held);
+    if(readx(ap->fd[0], p->data, ap->held)) {
+        fatal_errno("could not read payload back from pipe");
+    }
+    p->ptr = p->data;
+    p->len = ap->held;
+    ap->held = 0;
+    put_apipe(ap);
+    p->pipe = 0;
+}
+#endif
+
 void handle_online(void)
 {
     D("adb: online\n");
@@ -224,7 +393,7 @@ static void send_connect(atransport *t)
     cp->msg.command = A_CNXN;
     cp->msg.arg0 = A_VERSION;
     cp->msg.arg1 = MAX_PAYLOAD;
-    snprintf((char*) cp->data, sizeof cp->data, "%s::",
+    snprintf((char*) cp->data, cp->size, "%s::",
             HOST ? "host" : adb_device_banner);
     cp->msg.data_length = strlen((char*) cp->data) + 1;
     send_packet(cp, t);
@@ -302,6 +471,22 @@ void parse_banner(char *banner, atransport *t)
     t->connection_state = CS_HOST;
 }
 
+/* Settles the protocol version and the payload size from the peer's CNXN.
+** Peers before A_VERSION_SKIP_CHECKSUM take MAX_PAYLOAD_V1 whatever they
+** advertise.
+*/
+static void update_version(atransport *t, unsigned version, unsigned max_payload)
+{
+    t->protocol_version = version < A_VERSION ? version : A_VERSION;
+    if(t->protocol_version < A_VERSION_SKIP_CHECKSUM) {
+        t->max_payload = MAX_PAYLOAD_V1;
+    } else {
+        t->max_payload = max_payload < MAX_PAYLOAD ? max_payload : MAX_PAYLOAD;
+        if(t->max_payload < MAX_PAYLOAD_V1) t->max_payload = MAX_PAYLOAD_V1;
+    }
+    D("%s: protocol %08x, max payload %d\n", t->serial, t->protocol_version, t->max_payload);
+}
+
 void handle_packet(apacket *p, atransport *t)
 {
     asocket *s;
@@ -325,11 +510,11 @@ void handle_packet(apacket *p, atransport *t)
         return;
 
     case A_CNXN: /* CONNECT(version, maxdata, "system-id-string") */
-            /* XXX verify version, etc */
         if(t->connection_state != CS_OFFLINE) {
             t->connection_state = CS_OFFLINE;
             handle_offline(t);
         }
+        update_version(t, p->msg.arg0, p->msg.arg1);
         parse_banner((char*) p->data, t);
         handle_online();
         if(!HOST) send_connect(t);
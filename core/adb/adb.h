@@ -21,7 +21,8 @@
 
 #include "transport.h"  /* readx(), writex() */
 
-#define MAX_PAYLOAD 4096
+#define MAX_PAYLOAD_V1  (4*1024)    // Largest payload an A_VERSION_MIN peer accepts
+#define MAX_PAYLOAD     (256*1024)  // Largest payload we accept; see handle_packet()
 
 #define A_SYNC 0x434e5953
 #define A_CNXN 0x4e584e43
@@ -30,7 +31,10 @@
 #define A_CLSE 0x45534c43
 #define A_WRTE 0x45545257
 
-#define A_VERSION 0x01000000        // ADB protocol version
+#define A_VERSION_MIN 0x01000000            // Original protocol, MAX_PAYLOAD_V1 payloads
+#define A_VERSION_SKIP_CHECKSUM 0x01000001  // Payloads up to the peer's maxdata,
+                                            // data_check neither set nor checked
+#define A_VERSION 0x01000001                // ADB protocol version
 
 #define ADB_VERSION_MAJOR 1         // Used for help/version information
 #define ADB_VERSION_MINOR 0         // Used for help/version information
@@ -39,6 +43,7 @@
 
 typedef struct amessage amessage;
 typedef struct apacket apacket;
+typedef struct apipe apipe;
 typedef struct asocket asocket;
 typedef struct alistener alistener;
 typedef struct aservice aservice;
@@ -62,8 +67,27 @@ struct apacket
     unsigned len;
     unsigned char *ptr;
 
+        /* if set, the payload is held in this pipe rather than at data */
+    apipe *pipe;
+
     amessage msg;
-    unsigned char data[MAX_PAYLOAD];
+        /* follows msg, so that a small packet goes out in one write */
+    unsigned char buf[MAX_PAYLOAD_V1];
+
+        /* payload: buf, or a larger buffer from reserve_apacket() */
+    unsigned char *data;
+    unsigned size;          /* bytes available at data */
+};
+
+/* A pipe a payload can be spliced into and out of, so that it goes
+** from one socket to another without being copied through our memory.
+*/
+struct apipe
+{
+    apipe *next;
+    int fd[2];
+    unsigned size;          /* capacity */
+    unsigned held;          /* bytes in the pipe */
 };
 
 /* An asocket represents one half of a connection between a local and
@@ -125,6 +149,10 @@ struct asocket {
         /* socket-type-specific extradata */
     void *extra;
 
+        /* for local asockets: set if fd can be spliced to and from
+        */
+    int splice;
+
     	/* A socket is bound to atransport */
     atransport *transport;
 };
@@ -173,11 +201,25 @@ struct atransport
     int fd;
     int transport_socket;
     fdevent transport_fde;
+        /* packets waiting for room on transport_socket, oldest first */
+    apacket *send_first;
+    apacket *send_last;
     int ref_count;
     unsigned sync_token;
     int connection_state;
     transport_type type;
 
+        /* settled with the other end in the CNXN exchange; until then
+        ** A_VERSION_MIN and MAX_PAYLOAD_V1
+        */
+    unsigned protocol_version;
+    unsigned max_payload;
+
+        /* set if read_from_remote and write_to_remote can take
+        ** payloads held in pipes
+        */
+    int splice;
+
         /* usb handle or socket fd as needed */
     usb_handle *usb;
     int sfd;
@@ -239,6 +281,16 @@ void fatal_errno(const char *fmt, ...);
 void handle_packet(apacket *p, atransport *t);
 void send_packet(apacket *p, atransport *t);
 
+#ifdef HAVE_SPLICE
+apipe *get_apipe(void);
+void put_apipe(apipe *ap);
+void unsplice_apacket(apacket *p);
+
+/* payloads can only skip our memory once nobody checksums them */
+#define transport_splices(t) \
+    ((t)->splice && (t)->protocol_version >= A_VERSION_SKIP_CHECKSUM)
+#endif
+
 void get_my_path(char *s, size_t maxLen);
 int launch_server(int server_port);
 int adb_main(int is_daemon, int server_port);
@@ -317,10 +369,11 @@ char * get_log_file_path(const char * log_name);
 
 /* packet allocator */
 apacket *get_apacket(void);
+void reserve_apacket(apacket *p, unsigned size);
 void put_apacket(apacket *p);
 
 int check_header(apacket *p);
-int check_data(apacket *p);
+int check_data(apacket *p, atransport *t);
 
 /* define ADB_TRACE to 1 to enable tracing support, or 0 to disable it */
 
@@ -184,6 +184,7 @@ void help()
         "                                 1 or all, adb, sockets, packets, rwx, usb, sync, sysdeps, transport, jdwp\n"
         "  ANDROID_SERIAL               - The serial number to connect to. -s takes priority over this if given.\n"
         "  ANDROID_LOG_TAGS             - When used with the logcat option, only these debug tags are printed.\n"
+        "  ADB_SYNC_COMPRESS            - When 0, push, pull and sync don't ask the device to compress file data.\n"
         );
 }
 
@@ -102,17 +102,26 @@ static fdevent list_pending = {
 static fdevent **fd_table = 0;
 static int fd_table_max = 0;
 
-#ifdef CRAPTASTIC
-//HAVE_EPOLL
+#ifdef HAVE_EPOLL
 
 #include <sys/epoll.h>
 
+/* Backend-private state bits. FDE_POLLED is set while the fd is in
+** the epoll set; FDE_NOPOLL marks an fd epoll refuses to watch
+** (regular files), which select() would always report as ready.
+*/
+#define FDE_POLLED     0x0800
+#define FDE_NOPOLL     0x1000
+
+#define FDE_MAX_EVENTS 256
+
 static int epoll_fd = -1;
+static int nopoll_count = 0;
 
 static void fdevent_init()
 {
-        /* XXX: what's a good size for the passed in hint? */
-    epoll_fd = epoll_create(256);
+        /* the size is only a hint to older kernels */
+    epoll_fd = epoll_create(FDE_MAX_EVENTS);
 
     if(epoll_fd < 0) {
         perror("epoll_create() failed");
@@ -123,91 +132,144 @@ static void fdevent_init()
     fcntl(epoll_fd, F_SETFD, FD_CLOEXEC);
 }
 
-static void fdevent_connect(fdevent *fde)
+static unsigned fdevent_epoll_events(unsigned events)
 {
-    struct epoll_event ev;
+    unsigned ev = 0;
 
-    memset(&ev, 0, sizeof(ev));
-    ev.events = 0;
-    ev.data.ptr = fde;
-
-#if 0
-    if(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fde->fd, &ev)) {
-        perror("epoll_ctl() failed\n");
-        exit(1);
-    }
-#endif
+        /* FDE_DONT_CLOSE shares the event mask, so only
+        ** look at the bits that map to something to poll
+        */
+    if(events & FDE_READ) ev |= EPOLLIN;
+    if(events & FDE_WRITE) ev |= EPOLLOUT;
+    if(events & FDE_ERROR) ev |= EPOLLPRI;
+    return ev;
 }
 
-static void fdevent_disconnect(fdevent *fde)
+static void fdevent_epoll_ctl(fdevent *fde, int op, unsigned events)
 {
     struct epoll_event ev;
 
     memset(&ev, 0, sizeof(ev));
-    ev.events = 0;
+    ev.events = events;
     ev.data.ptr = fde;
 
-        /* technically we only need to delete if we
-        ** were actively monitoring events, but let's
-        ** be aggressive and do it anyway, just in case
-        ** something's out of sync
+    if(epoll_ctl(epoll_fd, op, fde->fd, &ev) == 0) return;
+
+        /* an fd that was closed behind our back and reused may
+        ** still (or no longer) be in the set; just retry
         */
-    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fde->fd, &ev);
+    if(op == EPOLL_CTL_ADD && errno == EEXIST) {
+        op = EPOLL_CTL_MOD;
+    } else if(op == EPOLL_CTL_MOD && errno == ENOENT) {
+        op = EPOLL_CTL_ADD;
+    } else if(op == EPOLL_CTL_DEL && (errno == ENOENT || errno == EBADF)) {
+        return;
+    } else if(op == EPOLL_CTL_ADD && errno == EPERM) {
+        D("fd %d can't be polled, always ready\n", fde->fd);
+        fde->state |= FDE_NOPOLL;
+        nopoll_count++;
+        return;
+    } else {
+        FATAL("epoll_ctl(%d) on fd %d failed: %s\n", op, fde->fd,
+              strerror(errno));
+    }
+
+    if(epoll_ctl(epoll_fd, op, fde->fd, &ev)) {
+        FATAL("epoll_ctl(%d) on fd %d failed: %s\n", op, fde->fd,
+              strerror(errno));
+    }
 }
 
-static void fdevent_update(fdevent *fde, unsigned events)
+static void fdevent_connect(fdevent *fde)
 {
-    struct epoll_event ev;
-    int active;
-
-    active = (fde->state & FDE_EVENTMASK) != 0;
+        /* nothing to do until events are wanted */
+}
 
-    memset(&ev, 0, sizeof(ev));
-    ev.events = 0;
-    ev.data.ptr = fde;
+static void fdevent_disconnect(fdevent *fde)
+{
+        /* this must happen before the fd is closed, or if the
+        ** fd is left open (FDE_DONT_CLOSE) no events for this
+        ** fde would ever be reported again
+        */
+    if(fde->state & FDE_POLLED) {
+        fdevent_epoll_ctl(fde, EPOLL_CTL_DEL, 0);
+    }
+    if(fde->state & FDE_NOPOLL) {
+        nopoll_count--;
+    }
+    fde->state &= ~(FDE_POLLED | FDE_NOPOLL);
+}
 
-    if(events & FDE_READ) ev.events |= EPOLLIN;
-    if(events & FDE_WRITE) ev.events |= EPOLLOUT;
-    if(events & FDE_ERROR) ev.events |= (EPOLLERR | EPOLLHUP);
+static void fdevent_update(fdevent *fde, unsigned events)
+{
+    unsigned ev = fdevent_epoll_events(events);
 
     fde->state = (fde->state & FDE_STATEMASK) | events;
 
-    if(active) {
-            /* we're already active. if we're changing to *no*
-            ** events being monitored, we need to delete, otherwise
-            ** we need to just modify
-            */
-        if(ev.events) {
-            if(epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fde->fd, &ev)) {
-                perror("epoll_ctl() failed\n");
-                exit(1);
-            }
+    if(fde->state & FDE_NOPOLL) return;
+
+    if(fde->state & FDE_POLLED) {
+        if(ev) {
+            fdevent_epoll_ctl(fde, EPOLL_CTL_MOD, ev);
         } else {
-            if(epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fde->fd, &ev)) {
-                perror("epoll_ctl() failed\n");
-                exit(1);
-            }
+            fdevent_epoll_ctl(fde, EPOLL_CTL_DEL, 0);
+            fde->state &= ~FDE_POLLED;
         }
-    } else {
-            /* we're not active.  if we're watching events, we need
-            ** to add, otherwise we can just do nothing
-            */
-        if(ev.events) {
-            if(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fde->fd, &ev)) {
-                perror("epoll_ctl() failed\n");
-                exit(1);
-            }
+    } else if(ev) {
+        fdevent_epoll_ctl(fde, EPOLL_CTL_ADD, ev);
+        if(!(fde->state & FDE_NOPOLL)) {
+            fde->state |= FDE_POLLED;
+        }
+    }
+}
+
+static void fdevent_queue(fdevent *fde, unsigned events)
+{
+    fde->events |= events;
+
+    D("got events fde->fd=%d events=%04x, state=%04x\n",
+        fde->fd, fde->events, fde->state);
+    if(fde->state & FDE_PENDING) return;
+    fde->state |= FDE_PENDING;
+    fdevent_plist_enqueue(fde);
+}
+
+/* Queues the fds epoll can't watch that want events.
+** Returns the number queued.
+*/
+static int fdevent_queue_nopoll(void)
+{
+    int i, n = 0;
+    fdevent *fde;
+    unsigned ready;
+
+    if(nopoll_count == 0) return 0;
+
+    for(i = 0; i < fd_table_max; i++) {
+        fde = fd_table[i];
+        if(fde == 0 || !(fde->state & FDE_NOPOLL)) continue;
+        ready = fde->state & (FDE_READ | FDE_WRITE);
+        if(ready) {
+            fdevent_queue(fde, ready);
+            n++;
         }
     }
+    return n;
 }
 
 static void fdevent_process()
 {
-    struct epoll_event events[256];
+    struct epoll_event events[FDE_MAX_EVENTS];
     fdevent *fde;
+    unsigned wanted, ready;
     int i, n;
 
-    n = epoll_wait(epoll_fd, events, 256, -1);
+    if(fdevent_queue_nopoll()) {
+            /* don't block, those are ready right now */
+        n = epoll_wait(epoll_fd, events, FDE_MAX_EVENTS, 0);
+    } else {
+        n = epoll_wait(epoll_fd, events, FDE_MAX_EVENTS, -1);
+    }
 
     if(n < 0) {
         if(errno == EINTR) return;
@@ -218,20 +280,28 @@ static void fdevent_process()
     for(i = 0; i < n; i++) {
         struct epoll_event *ev = events + i;
         fde = ev->data.ptr;
+        wanted = fde->state & (FDE_READ | FDE_WRITE | FDE_ERROR);
 
-        if(ev->events & EPOLLIN) {
-            fde->events |= FDE_READ;
-        }
-        if(ev->events & EPOLLOUT) {
-            fde->events |= FDE_WRITE;
-        }
-        if(ev->events & (EPOLLERR | EPOLLHUP)) {
-            fde->events |= FDE_ERROR;
-        }
-        if(fde->events) {
-            if(fde->state & FDE_PENDING) continue;
-            fde->state |= FDE_PENDING;
-            fdevent_plist_enqueue(fde);
+            /* report hangups and errors the way select() does:
+            ** as readable and/or writable, so that the next read
+            ** or write picks them up
+            */
+        ready = 0;
+        if(ev->events & (EPOLLIN | EPOLLHUP | EPOLLERR)) ready |= FDE_READ;
+        if(ev->events & (EPOLLOUT | EPOLLERR)) ready |= FDE_WRITE;
+        if(ev->events & EPOLLPRI) ready |= FDE_ERROR;
+        ready &= wanted;
+
+        if(ready) {
+            fdevent_queue(fde, ready);
+        } else if(ev->events & (EPOLLHUP | EPOLLERR)) {
+                /* epoll reports these even when not asked for and
+                ** would keep waking us up; park the fd until its
+                ** events are next changed, as select() would
+                */
+            D("parking hung up fd %d\n", fde->fd);
+            fdevent_epoll_ctl(fde, EPOLL_CTL_DEL, 0);
+            fde->state &= ~FDE_POLLED;
         }
     }
 }
@@ -447,7 +517,7 @@ static void fdevent_register(fdevent *fde)
         if(fd_table == 0) {
             FATAL("could not expand fd_table to %d entries\n", fd_table_max);
         }
-        memset(fd_table + oldmax, 0, sizeof(int) * (fd_table_max - oldmax));
+        memset(fd_table + oldmax, 0, sizeof(fdevent*) * (fd_table_max - oldmax));
     }
 
     fd_table[fde->fd] = fde;
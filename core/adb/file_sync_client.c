@@ -30,6 +30,7 @@
 #include "adb.h"
 #include "adb_client.h"
 #include "file_sync_service.h"
+#include "lz.h"
 
 
 static unsigned total_bytes;
@@ -74,22 +75,29 @@ void sync_quit(int fd)
 
 typedef void (*sync_ls_cb)(unsigned mode, unsigned size, unsigned time, const char *name, void *cookie);
 
-int sync_ls(int fd, const char *path, sync_ls_cb func, void *cookie)
+/* Sends a request for path, header and name in one write */
+static int sync_request(int fd, unsigned id, const char *path)
 {
+    char buf[sizeof(unsigned) * 2 + 1024];
     syncmsg msg;
-    char buf[257];
     int len;
 
     len = strlen(path);
-    if(len > 1024) goto fail;
+    if(len > 1024) return -1;
 
-    msg.req.id = ID_LIST;
+    msg.req.id = id;
     msg.req.namelen = htoll(len);
+    memcpy(buf, &msg.req, sizeof(msg.req));
+    memcpy(buf + sizeof(msg.req), path, len);
 
-    if(writex(fd, &msg.req, sizeof(msg.req)) ||
-       writex(fd, path, len)) {
-        goto fail;
-    }
+    return writex(fd, buf, sizeof(msg.req) + len);
+}
+
+static int sync_finish_ls(int fd, sync_ls_cb func, void *cookie)
+{
+    syncmsg msg;
+    char buf[257];
+    int len;
 
     for(;;) {
         if(readx(fd, &msg.dent, sizeof(msg.dent))) break;
@@ -108,11 +116,20 @@ int sync_ls(int fd, const char *path, sync_ls_cb func, void *cookie)
              buf, cookie);
     }
 
-fail:
     adb_close(fd);
     return -1;
 }
 
+int sync_ls(int fd, const char *path, sync_ls_cb func, void *cookie)
+{
+    if(sync_request(fd, ID_LIST, path)) {
+        adb_close(fd);
+        return -1;
+    }
+
+    return sync_finish_ls(fd, func, cookie);
+}
+
 typedef struct syncsendbuf syncsendbuf;
 
 struct syncsendbuf {
@@ -122,6 +139,70 @@ struct syncsendbuf {
 };
 
 static syncsendbuf send_buffer;
+static syncsendbuf zsend_buffer;
+
+/* Set while the service compresses file data, see sync_connect() */
+static int sync_compressed;
+
+/* Packs file data into zbuf as a ZDAT message, if the session is
+** compressed and that saves enough. Returns the size of the compressed
+** data, or 0 if it should go as DATA instead.
+*/
+static int compress_data(const char *data, int len, syncsendbuf *zbuf)
+{
+    int zlen;
+
+    if(!sync_compressed)
+        return 0;
+
+    zlen = lz_compress(data, len, zbuf->data, len - len / SYNC_ZGAIN);
+    if(zlen == 0)
+        return 0;
+    zbuf->id = ID_ZDAT;
+    zbuf->size = htoll(zlen);
+    return zlen;
+}
+
+/* Sends len bytes of file data from sbuf, compressed if it can be */
+static int write_data_block(int fd, syncsendbuf *sbuf, int len)
+{
+    syncsendbuf *zbuf = &zsend_buffer;
+    int zlen;
+
+    zlen = compress_data(sbuf->data, len, zbuf);
+    if(zlen > 0)
+        return writex(fd, zbuf, sizeof(unsigned) * 2 + zlen);
+
+    sbuf->id = ID_DATA;
+    sbuf->size = htoll(len);
+    return writex(fd, sbuf, sizeof(unsigned) * 2 + len);
+}
+
+/* Opens a sync session, and asks the service to compress file data
+** unless ADB_SYNC_COMPRESS is 0. A service that can't answers FAIL and
+** hangs up, so then the session is simply opened again.
+*/
+static int sync_connect(void)
+{
+    const char *env = getenv("ADB_SYNC_COMPRESS");
+    syncmsg msg;
+    int fd;
+
+    sync_compressed = 0;
+    fd = adb_connect("sync:");
+    if(fd < 0 || (env != 0 && !strcmp(env, "0")))
+        return fd;
+
+    if(sync_request(fd, ID_COMP, SYNC_CODEC) == 0 &&
+       readx(fd, &msg.status, sizeof(msg.status)) == 0 &&
+       msg.status.id == ID_OKAY) {
+        sync_compressed = 1;
+        return fd;
+    }
+
+    adb_close(fd);
+    return adb_connect("sync:");
+}
 
 int sync_readtime(int fd, const char *path, unsigned *timestamp)
 {
@@ -217,7 +298,6 @@ static int write_data_file(int fd, const char *path, syncsendbuf *sbuf)
         return -1;
     }
 
-    sbuf->id = ID_DATA;
     for(;;) {
         int ret;
 
@@ -232,8 +312,7 @@ static int write_data_file(int fd, const char *path, syncsendbuf *sbuf)
             break;
         }
 
-        sbuf->size = htoll(ret);
-        if(writex(fd, sbuf, sizeof(unsigned) * 2 + ret)){
+        if(write_data_block(fd, sbuf, ret)){
             err = -1;
             break;
         }
@@ -249,7 +328,6 @@ static int write_data_buffer(int fd, char* file_buffer, int size, syncsendbuf *s
     int err = 0;
     int total = 0;
 
-    sbuf->id = ID_DATA;
     while (total < size) {
         int count = size - total;
         if (count > SYNC_DATA_MAX) {
@@ -257,8 +335,7 @@ static int write_data_buffer(int fd, char* file_buffer, int size, syncsendbuf *s
         }
 
         memcpy(sbuf->data, &file_buffer[total], count);
-        sbuf->size = htoll(count);
-        if(writex(fd, sbuf, sizeof(unsigned) * 2 + count)){
+        if(write_data_block(fd, sbuf, count)){
             err = -1;
             break;
         }
@@ -294,6 +371,34 @@ static int write_data_link(int fd, const char *path, syncsendbuf *sbuf)
 }
 #endif
 
+/* Reads the reply to a SEND, which is either OKAY or FAIL */
+static int sync_finish_send(int fd, const char *lpath, const char *rpath)
+{
+    syncmsg msg;
+    char reason[257];
+    int len;
+
+    if(readx(fd, &msg.status, sizeof(msg.status)))
+        return -1;
+
+    if(msg.status.id != ID_OKAY) {
+        if(msg.status.id == ID_FAIL) {
+            len = ltohl(msg.status.msglen);
+            if(len > 256) len = 256;
+            if(readx(fd, reason, len)) {
+                return -1;
+            }
+            reason[len] = 0;
+        } else
+            strcpy(reason, "unknown reason");
+
+        fprintf(stderr,"failed to copy '%s' to '%s': %s\n", lpath, rpath, reason);
+        return -1;
+    }
+
+    return 0;
+}
+
 static int sync_send(int fd, const char *lpath, const char *rpath,
                      unsigned mtime, mode_t mode, int verifyApk)
 {
@@ -393,25 +498,7 @@ static int sync_send(int fd, const char *lpath, const char *rpath,
     if(writex(fd, &msg.data, sizeof(msg.data)))
         goto fail;
 
-    if(readx(fd, &msg.status, sizeof(msg.status)))
-        return -1;
-
-    if(msg.status.id != ID_OKAY) {
-        if(msg.status.id == ID_FAIL) {
-            len = ltohl(msg.status.msglen);
-            if(len > 256) len = 256;
-            if(readx(fd, sbuf->data, len)) {
-                return -1;
-            }
-            sbuf->data[len] = 0;
-        } else
-            strcpy(sbuf->data, "unknown reason");
-
-        fprintf(stderr,"failed to copy '%s' to '%s': %s\n", lpath, rpath, sbuf->data);
-        return -1;
-    }
-
-    return 0;
+    return sync_finish_send(fd, lpath, rpath);
 
 fail:
     fprintf(stderr,"protocol failure\n");
@@ -438,7 +525,7 @@ static int mkdirs(char *name)
     return 0;
 }
 
-int sync_recv(int fd, const char *rpath, const char *lpath)
+static int sync_finish_recv(int fd, const char *rpath, const char *lpath)
 {
     syncmsg msg;
     int len;
@@ -446,22 +533,12 @@ int sync_recv(int fd, const char *rpath, const char *lpath)
     char *buffer = send_buffer.data;
     unsigned id;
 
-    len = strlen(rpath);
-    if(len > 1024) return -1;
-
-    msg.req.id = ID_RECV;
-    msg.req.namelen = htoll(len);
-    if(writex(fd, &msg.req, sizeof(msg.req)) ||
-       writex(fd, rpath, len)) {
-        return -1;
-    }
-
     if(readx(fd, &msg.data, sizeof(msg.data))) {
         return -1;
     }
     id = msg.data.id;
 
-    if((id == ID_DATA) || (id == ID_DONE)) {
+    if((id == ID_DATA) || (id == ID_ZDAT) || (id == ID_DONE)) {
         adb_unlink(lpath);
         mkdirs((char *)lpath);
         lfd = adb_creat(lpath, 0644);
@@ -483,14 +560,25 @@ int sync_recv(int fd, const char *rpath, const char *lpath)
     handle_data:
         len = ltohl(msg.data.size);
         if(id == ID_DONE) break;
-        if(id != ID_DATA) goto remote_error;
+        if(id != ID_DATA && !(id == ID_ZDAT && sync_compressed)) goto remote_error;
         if(len > SYNC_DATA_MAX) {
             fprintf(stderr,"data overrun\n");
             adb_close(lfd);
             return -1;
         }
 
-        if(readx(fd, buffer, len)) {
+        if(id == ID_ZDAT) {
+            if(readx(fd, zsend_buffer.data, len)) {
+                adb_close(lfd);
+                return -1;
+            }
+            len = lz_decompress(zsend_buffer.data, len, buffer, SYNC_DATA_MAX);
+            if(len < 0) {
+                fprintf(stderr,"corrupt compressed data\n");
+                adb_close(lfd);
+                return -1;
+            }
+        } else if(readx(fd, buffer, len)) {
             adb_close(lfd);
             return -1;
         }
@@ -527,6 +615,14 @@ remote_error:
     return 0;
 }
 
+int sync_recv(int fd, const char *rpath, const char *lpath)
+{
+    if(sync_request(fd, ID_RECV, rpath))
+        return -1;
+
+    return sync_finish_recv(fd, rpath, lpath);
+}
+
 
 
 /* --- */
@@ -540,7 +636,7 @@ static void do_sync_ls_cb(unsigned mode, unsigned size, unsigned time,
 
 int do_sync_ls(const char *path)
 {
-    int fd = adb_connect("sync:");
+    int fd = sync_connect();
     if(fd < 0) {
         fprintf(stderr,"error: %s\n", adb_error());
         return 1;
@@ -671,6 +767,327 @@ static int local_build_list(copyinfo **filelist,
 }
 
 
+/* Replies to this many pushed files, or requests for this many pulled
+** ones, may be outstanding at a time. Both are small enough that the
+** socket buffers on the way always hold them, so neither side can end
+** up blocked writing to the other.
+*/
+#define SYNC_WINDOW 128
+
+/* A run of local file data, read ahead of the sync socket on a
+** separate thread. The blocks go back and forth between the threads as
+** pointers over a pair of sockets, full ones to be sent and empty ones
+** to be refilled, so the read-ahead never takes more than the pool.
+*/
+typedef struct syncblock syncblock;
+
+struct syncblock {
+    copyinfo *ci;
+    int first;
+    int last;
+    int len;        /* -1 if the file couldn't be opened or read */
+    int zlen;
+    syncsendbuf sbuf;
+    syncsendbuf zbuf;
+};
+
+#define SYNC_READAHEAD_BLOCKS 16
+
+typedef struct {
+    copyinfo *filelist;
+    int full_fd;
+    int empty_fd;
+} syncreader;
+
+static syncblock *reader_get_block(syncreader *r, copyinfo *ci, int first)
+{
+    syncblock *b;
+
+        /* EOF here means the sender has given up */
+    if(readx(r->empty_fd, &b, sizeof(b)))
+        return 0;
+
+    b->ci = ci;
+    b->first = first;
+    b->last = 0;
+    b->len = 0;
+    b->zlen = 0;
+    return b;
+}
+
+static int reader_put_block(syncreader *r, syncblock *b)
+{
+    return writex(r->full_fd, &b, sizeof(b));
+}
+
+/* Hands over a block that ends the push, because its file can't be read */
+static int reader_fail_block(syncreader *r, syncblock *b)
+{
+    b->len = -1;
+    b->last = 1;
+    reader_put_block(r, b);
+    return -1;
+}
+
+static int read_file_blocks(syncreader *r, copyinfo *ci)
+{
+    syncblock *b;
+    int lfd, ret, last;
+
+    b = reader_get_block(r, ci, 1);
+    if(b == 0)
+        return -1;
+
+#ifdef HAVE_SYMLINKS
+    if(S_ISLNK(ci->mode)) {
+        ret = readlink(ci->src, b->sbuf.data, SYNC_DATA_MAX-1);
+        if(ret < 0) {
+            fprintf(stderr, "error reading link '%s': %s\n", ci->src, strerror(errno));
+            return reader_fail_block(r, b);
+        }
+        b->sbuf.data[ret] = '\0';
+        b->len = ret + 1;
+        b->last = 1;
+        return reader_put_block(r, b);
+    }
+#endif
+
+    lfd = adb_open(ci->src, O_RDONLY);
+    if(lfd < 0) {
+        fprintf(stderr,"cannot open '%s': %s\n", ci->src, strerror(errno));
+        return reader_fail_block(r, b);
+    }
+
+    for(;;) {
+        ret = adb_read(lfd, b->sbuf.data, SYNC_DATA_MAX);
+        if(ret < 0) {
+            if(errno == EINTR)
+                continue;
+            fprintf(stderr,"cannot read '%s': %s\n", ci->src, strerror(errno));
+            ret = 0;
+        }
+
+            /* a short read is the end of a regular file */
+        b->len = ret;
+        if(ret > 0)
+            b->zlen = compress_data(b->sbuf.data, ret, &b->zbuf);
+        b->last = last = (ret < SYNC_DATA_MAX);
+        if(reader_put_block(r, b))
+            break;
+        if(last) {
+            adb_close(lfd);
+            return 0;
+        }
+
+        b = reader_get_block(r, ci, 0);
+        if(b == 0)
+            break;
+    }
+
+    adb_close(lfd);
+    return -1;
+}
+
+static void *sync_reader_thread(void *arg)
+{
+    syncreader *r = arg;
+    int full_fd = r->full_fd;
+    copyinfo *ci;
+
+    for(ci = r->filelist; ci != 0; ci = ci->next) {
+        if(ci->flag == 0 && read_file_blocks(r, ci))
+            break;
+    }
+
+        /* the sender takes this as "no more blocks in use" */
+    adb_close(full_fd);
+    return 0;
+}
+
+/* Messages for small files are collected here, so that a whole
+** SEND ... DONE sequence usually goes out in a single write.
+*/
+static char send_queue[SYNC_DATA_MAX + 2048];
+static int send_queued;
+
+static int flush_send_queue(int fd)
+{
+    int len = send_queued;
+
+    send_queued = 0;
+    if(len == 0) return 0;
+    return writex(fd, send_queue, len);
+}
+
+static int queue_send(int fd, const void *ptr, int len)
+{
+    if(send_queued + len > (int) sizeof(send_queue)) {
+        if(flush_send_queue(fd)) return -1;
+        if(len > (int) sizeof(send_queue)) return writex(fd, ptr, len);
+    }
+    memcpy(send_queue + send_queued, ptr, len);
+    send_queued += len;
+    return 0;
+}
+
+static int queue_block(int fd, syncblock *b)
+{
+    copyinfo *ci = b->ci;
+    syncmsg msg;
+
+        /* nothing has been sent for the file yet, and nothing will be */
+    if(b->len < 0) {
+        fprintf(stderr,"protocol failure\n");
+        return -1;
+    }
+
+    if(b->first) {
+        char tmp[64];
+        int len = strlen(ci->dst);
+        int r;
+
+        if(len > 1024) {
+            fprintf(stderr,"protocol failure\n");
+            return -1;
+        }
+
+        fprintf(stderr,"push: %s -> %s\n", ci->src, ci->dst);
+
+        snprintf(tmp, sizeof(tmp), ",%d", ci->mode);
+        r = strlen(tmp);
+
+        msg.req.id = ID_SEND;
+        msg.req.namelen = htoll(len + r);
+        if(queue_send(fd, &msg.req, sizeof(msg.req)) ||
+           queue_send(fd, ci->dst, len) || queue_send(fd, tmp, r)) {
+            return -1;
+        }
+    }
+
+    if(b->zlen > 0) {
+        if(queue_send(fd, &b->zbuf, sizeof(unsigned) * 2 + b->zlen))
+            return -1;
+        total_bytes += b->len;
+    } else if(b->len > 0) {
+        b->sbuf.id = ID_DATA;
+        b->sbuf.size = htoll(b->len);
+        if(queue_send(fd, &b->sbuf, sizeof(unsigned) * 2 + b->len))
+            return -1;
+        total_bytes += b->len;
+    }
+
+    if(b->last) {
+        msg.data.id = ID_DONE;
+        msg.data.size = htoll(ci->time);
+        if(queue_send(fd, &msg.data, sizeof(msg.data)))
+            return -1;
+    }
+    return 0;
+}
+
+/* Returns the next file in the list that is to be copied */
+static copyinfo *next_to_copy(copyinfo *ci)
+{
+    while(ci != 0 && ci->flag != 0)
+        ci = ci->next;
+    return ci;
+}
+
+/* Pushes every file in the list that isn't flagged as up to date, without
+** waiting for each one to be acknowledged before starting on the next.
+** The service handles requests in order and answers every SEND exactly
+** once, so replies are matched to files simply by counting.
+*/
+static int sync_send_list(int fd, copyinfo *filelist, int *pushed)
+{
+    syncreader reader;
+    syncblock *blocks, *b;
+    copyinfo *acked = next_to_copy(filelist);
+    adb_thread_t thread;
+    int full[2], empty[2];
+    int sent = 0, done = 0, err = 0;
+    int i;
+
+    blocks = malloc(sizeof(syncblock) * SYNC_READAHEAD_BLOCKS);
+    if(blocks == 0) {
+        fprintf(stderr,"out of memory\n");
+        return -1;
+    }
+    if(adb_socketpair(full)) {
+        free(blocks);
+        return -1;
+    }
+    if(adb_socketpair(empty)) {
+        adb_close(full[0]);
+        adb_close(full[1]);
+        free(blocks);
+        return -1;
+    }
+
+    for(i = 0; i < SYNC_READAHEAD_BLOCKS; i++) {
+        b = blocks + i;
+        writex(empty[0], &b, sizeof(b));
+    }
+
+    reader.filelist = filelist;
+    reader.full_fd = full[1];
+    reader.empty_fd = empty[1];
+
+    if(adb_thread_create(&thread, sync_reader_thread, &reader)) {
+        fprintf(stderr,"cannot create read-ahead thread\n");
+        adb_close(full[0]);
+        adb_close(full[1]);
+        adb_close(empty[0]);
+        adb_close(empty[1]);
+        free(blocks);
+        return -1;
+    }
+
+    while(readx(full[0], &b, sizeof(b)) == 0) {
+        err = queue_block(fd, b);
+        if(!err && b->last)
+            sent++;
+        writex(empty[0], &b, sizeof(b));
+        if(err)
+            break;
+
+        if(sent - done >= SYNC_WINDOW) {
+            if(flush_send_queue(fd) ||
+               sync_finish_send(fd, acked->src, acked->dst)) {
+                err = -1;
+                break;
+            }
+            acked = next_to_copy(acked->next);
+            done++;
+        }
+    }
+
+    if(!err && flush_send_queue(fd))
+        err = -1;
+    send_queued = 0;
+
+    while(!err && done < sent) {
+        if(sync_finish_send(fd, acked->src, acked->dst)) {
+            err = -1;
+            break;
+        }
+        acked = next_to_copy(acked->next);
+        done++;
+    }
+
+        /* stop the reader, and wait until it's done with the blocks */
+    adb_close(empty[0]);
+    while(readx(full[0], &b, sizeof(b)) == 0)
+        ;
+    adb_close(full[0]);
+    adb_close(empty[1]);
+    free(blocks);
+
+    *pushed = done;
+    return err;
+}
+
+
 static int copy_local_dir_remote(int fd, const char *lpath, const char *rpath, int checktimestamps, int listonly)
 {
     copyinfo *filelist = 0;
@@ -716,15 +1133,16 @@ static int copy_local_dir_remote(int fd, const char *lpath, const char *rpath, i
             }
         }
     }
+    if(!listonly && sync_send_list(fd, filelist, &pushed)) {
+        return 1;
+    }
     for(ci = filelist; ci != 0; ci = next) {
         next = ci->next;
         if(ci->flag == 0) {
-            fprintf(stderr,"%spush: %s -> %s\n", listonly ? "would " : "", ci->src, ci->dst);
-            if(!listonly &&
-               sync_send(fd, ci->src, ci->dst, ci->time, ci->mode, 0 /* no verify APK */)){
-                return 1;
+            if(listonly) {
+                fprintf(stderr,"would push: %s -> %s\n", ci->src, ci->dst);
+                pushed++;
             }
-            pushed++;
         } else {
             skipped++;
         }
@@ -745,7 +1163,7 @@ int do_sync_push(const char *lpath, const char *rpath, int verifyApk)
     unsigned mode;
     int fd;
 
-    fd = adb_connect("sync:");
+    fd = sync_connect();
     if(fd < 0) {
         fprintf(stderr,"error: %s\n", adb_error());
         return 1;
@@ -843,7 +1261,10 @@ static int remote_build_list(int syncfd, copyinfo **filelist,
                              const char *rpath, const char *lpath)
 {
     copyinfo *dirlist = NULL;
+    copyinfo *ci, *next, *ahead, *tail;
     sync_ls_build_list_cb_args args;
+    int requested = 0;
+    int listed = 0;
 
     args.filelist = filelist;
     args.dirlist = &dirlist;
@@ -855,14 +1276,42 @@ static int remote_build_list(int syncfd, copyinfo **filelist,
         return 1;
     }
 
-    /* Recurse into each directory we found. */
-    while (dirlist != NULL) {
-        copyinfo *next = dirlist->next;
-        if (remote_build_list(syncfd, filelist, dirlist->src, dirlist->dst)) {
+    /* Then list each directory found, keeping the requests for the
+     * next few in flight; directories found on the way are appended. */
+    ahead = dirlist;
+    for (tail = dirlist; tail != NULL && tail->next != NULL; tail = tail->next)
+        ;
+    for (ci = dirlist; ci != NULL; ci = next) {
+        copyinfo *found = NULL;
+
+        while (ahead != NULL && requested - listed < SYNC_WINDOW) {
+            if (sync_request(syncfd, ID_LIST, ahead->src)) {
+                adb_close(syncfd);
+                return 1;
+            }
+            requested++;
+            ahead = ahead->next;
+        }
+
+        args.dirlist = &found;
+        args.rpath = ci->src;
+        args.lpath = ci->dst;
+        if (sync_finish_ls(syncfd, sync_ls_build_list_cb, (void *)&args)) {
             return 1;
         }
-        free(dirlist);
-        dirlist = next;
+        listed++;
+
+        if (found != NULL) {
+            tail->next = found;
+            for (tail = found; tail->next != NULL; tail = tail->next)
+                ;
+            if (ahead == NULL) {
+                ahead = found;
+            }
+        }
+
+        next = ci->next;
+        free(ci);
     }
 
     return 0;
@@ -872,7 +1321,8 @@ static int copy_remote_dir_local(int fd, const char *rpath, const char *lpath,
                                  int checktimestamps)
 {
     copyinfo *filelist = 0;
-    copyinfo *ci, *next;
+    copyinfo *ci, *next, *ahead;
+    int requested = 0;
     int pulled = 0;
     int skipped = 0;
 
@@ -919,11 +1369,24 @@ static int copy_remote_dir_local(int fd, const char *rpath, const char *lpath,
         }
     }
 #endif
+    /* Keep the requests for the next few files in flight, so the
+     * service never has to wait for us to ask for the next one. */
+    ahead = filelist;
     for (ci = filelist; ci != 0; ci = next) {
+        while (ahead != 0 && requested - pulled < SYNC_WINDOW) {
+            if (ahead->flag == 0) {
+                if (sync_request(fd, ID_RECV, ahead->src)) {
+                    return 1;
+                }
+                requested++;
+            }
+            ahead = ahead->next;
+        }
+
         next = ci->next;
         if (ci->flag == 0) {
             fprintf(stderr, "pull: %s -> %s\n", ci->src, ci->dst);
-            if (sync_recv(fd, ci->src, ci->dst)) {
+            if (sync_finish_recv(fd, ci->src, ci->dst)) {
                 return 1;
             }
             pulled++;
@@ -947,7 +1410,7 @@ int do_sync_pull(const char *rpath, const char *lpath)
 
     int fd;
 
-    fd = adb_connect("sync:");
+    fd = sync_connect();
     if(fd < 0) {
         fprintf(stderr,"error: %s\n", adb_error());
         return 1;
@@ -1007,7 +1470,7 @@ int do_sync_sync(const char *lpath, const char *rpath, int listonly)
 {
     fprintf(stderr,"syncing %s...\n",rpath);
 
-    int fd = adb_connect("sync:");
+    int fd = sync_connect();
     if(fd < 0) {
         fprintf(stderr,"error: %s\n", adb_error());
         return 1;
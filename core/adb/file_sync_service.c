@@ -30,6 +30,77 @@
 #define TRACE_TAG  TRACE_SYNC
 #include "adb.h"
 #include "file_sync_service.h"
+#include "lz.h"
+
+/* Size of the buffer file data is collected in before it is written */
+#define SYNC_WRITE_MAX (256*1024)
+
+/* The sync socket is read through a large buffer, so that a run of
+** small files costs a few reads rather than several each. Replies are
+** held until the service next has to wait for the client, so a client
+** that streams many files gets its OKAYs back in a few writes.
+*/
+typedef struct {
+    int fd;
+    int compress;
+    unsigned in_pos;
+    unsigned in_len;
+    unsigned out_len;
+    char in[SYNC_DATA_MAX];
+    char out[sizeof(syncmsg) + SYNC_DATA_MAX];
+    char z[SYNC_DATA_MAX];
+} syncsock;
+
+static int sync_flush(syncsock *s)
+{
+    unsigned len = s->out_len;
+
+    s->out_len = 0;
+    if(len == 0) return 0;
+    return writex(s->fd, s->out, len);
+}
+
+static int sync_writex(syncsock *s, const void *ptr, unsigned len)
+{
+    if(s->out_len + len > sizeof(s->out)) {
+        if(sync_flush(s)) return -1;
+        if(len > sizeof(s->out)) return writex(s->fd, ptr, len);
+    }
+    memcpy(s->out + s->out_len, ptr, len);
+    s->out_len += len;
+    return 0;
+}
+
+static int sync_readx(syncsock *s, void *ptr, unsigned len)
+{
+    char *p = ptr;
+    unsigned n;
+    int r;
+
+    while(len > 0) {
+        if(s->in_pos == s->in_len) {
+                /* the client may be waiting on what we're holding */
+            if(sync_flush(s)) return -1;
+            if(len >= sizeof(s->in)) return readx(s->fd, p, len);
+
+            r = adb_read(s->fd, s->in, sizeof(s->in));
+            if(r <= 0) {
+                if((r < 0) && (errno == EINTR)) continue;
+                return -1;
+            }
+            s->in_pos = 0;
+            s->in_len = r;
+        }
+
+        n = s->in_len - s->in_pos;
+        if(n > len) n = len;
+        memcpy(p, s->in + s->in_pos, n);
+        s->in_pos += n;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
 
 static int mkdirs(char *name)
 {
@@ -53,7 +124,7 @@ static int mkdirs(char *name)
     return 0;
 }
 
-static int do_stat(int s, const char *path)
+static int do_stat(syncsock *s, const char *path)
 {
     syncmsg msg;
     struct stat st;
@@ -70,10 +141,10 @@ static int do_stat(int s, const char *path)
         msg.stat.time = htoll(st.st_mtime);
     }
 
-    return writex(s, &msg.stat, sizeof(msg.stat));
+    return sync_writex(s, &msg.stat, sizeof(msg.stat));
 }
 
-static int do_list(int s, const char *path)
+static int do_list(syncsock *s, const char *path)
 {
     DIR *d;
     struct dirent *de;
@@ -108,8 +179,8 @@ static int do_list(int s, const char *path)
             msg.dent.time = htoll(st.st_mtime);
             msg.dent.namelen = htoll(len);
 
-            if(writex(s, &msg.dent, sizeof(msg.dent)) ||
-               writex(s, de->d_name, len)) {
+            if(sync_writex(s, &msg.dent, sizeof(msg.dent)) ||
+               sync_writex(s, de->d_name, len)) {
                 return -1;
             }
         }
@@ -123,10 +194,10 @@ done:
     msg.dent.size = 0;
     msg.dent.time = 0;
     msg.dent.namelen = 0;
-    return writex(s, &msg.dent, sizeof(msg.dent));
+    return sync_writex(s, &msg.dent, sizeof(msg.dent));
 }
 
-static int fail_message(int s, const char *reason)
+static int fail_message(syncsock *s, const char *reason)
 {
     syncmsg msg;
     int len = strlen(reason);
@@ -135,23 +206,55 @@ static int fail_message(int s, const char *reason)
 
     msg.data.id = ID_FAIL;
     msg.data.size = htoll(len);
-    if(writex(s, &msg.data, sizeof(msg.data)) ||
-       writex(s, reason, len)) {
+    if(sync_writex(s, &msg.data, sizeof(msg.data)) ||
+       sync_writex(s, reason, len)) {
         return -1;
     } else {
         return 0;
     }
 }
 
-static int fail_errno(int s)
+static int fail_errno(syncsock *s)
 {
     return fail_message(s, strerror(errno));
 }
 
-static int handle_send_file(int s, char *path, mode_t mode, char *buffer)
+/* Writes out the file data collected so far. If that fails the file
+** is removed and the client told why; the rest of the data is dropped.
+*/
+static int flush_file(syncsock *s, int *fd, char *path, char *buffer, unsigned len)
+{
+    int saved_errno;
+
+    if(*fd < 0 || len == 0 || writex(*fd, buffer, len) == 0)
+        return 0;
+
+    saved_errno = errno;
+    adb_close(*fd);
+    adb_unlink(path);
+    *fd = -1;
+    errno = saved_errno;
+    return fail_errno(s);
+}
+
+static int do_comp(syncsock *s, const char *codec)
+{
+    syncmsg msg;
+
+    if(strcmp(codec, SYNC_CODEC))
+        return fail_message(s, "unknown codec");
+
+    s->compress = 1;
+    msg.status.id = ID_OKAY;
+    msg.status.msglen = 0;
+    return sync_writex(s, &msg.status, sizeof(msg.status));
+}
+
+static int handle_send_file(syncsock *s, char *path, mode_t mode, char *buffer)
 {
     syncmsg msg;
     unsigned int timestamp = 0;
+    unsigned int filled = 0;
     int fd;
 
     fd = adb_open_mode(path, O_WRONLY | O_CREAT | O_EXCL, mode);
@@ -169,12 +272,13 @@ static int handle_send_file(int s, char *path, mode_t mode, char *buffer)
     }
 
     for(;;) {
-        unsigned int len;
+        unsigned int len, room;
+        int zlen;
 
-        if(readx(s, &msg.data, sizeof(msg.data)))
+        if(sync_readx(s, &msg.data, sizeof(msg.data)))
             goto fail;
 
-        if(msg.data.id != ID_DATA) {
+        if(msg.data.id != ID_DATA && !(msg.data.id == ID_ZDAT && s->compress)) {
             if(msg.data.id == ID_DONE) {
                 timestamp = ltohl(msg.data.size);
                 break;
@@ -187,21 +291,34 @@ static int handle_send_file(int s, char *path, mode_t mode, char *buffer)
             fail_message(s, "oversize data message");
             goto fail;
         }
-        if(readx(s, buffer, len))
-            goto fail;
 
-        if(fd < 0)
-            continue;
-        if(writex(fd, buffer, len)) {
-            int saved_errno = errno;
-            adb_close(fd);
-            adb_unlink(path);
-            fd = -1;
-            errno = saved_errno;
-            if(fail_errno(s)) return -1;
+            /* collect several DATA messages per write; a ZDAT may
+            ** expand to a whole block */
+        room = (msg.data.id == ID_ZDAT) ? SYNC_DATA_MAX : len;
+        if(filled + room > SYNC_WRITE_MAX) {
+            if(flush_file(s, &fd, path, buffer, filled))
+                return -1;
+            filled = 0;
+        }
+        if(msg.data.id == ID_ZDAT) {
+            if(sync_readx(s, s->z, len))
+                goto fail;
+            zlen = lz_decompress(s->z, len, buffer + filled, SYNC_DATA_MAX);
+            if(zlen < 0) {
+                fail_message(s, "corrupt compressed data");
+                goto fail;
+            }
+            len = zlen;
+        } else if(sync_readx(s, buffer + filled, len)) {
+            goto fail;
         }
+        if(fd >= 0)
+            filled += len;
     }
 
+    if(flush_file(s, &fd, path, buffer, filled))
+        return -1;
+
     if(fd >= 0) {
         struct utimbuf u;
         adb_close(fd);
@@ -211,7 +328,7 @@ static int handle_send_file(int s, char *path, mode_t mode, char *buffer)
 
         msg.status.id = ID_OKAY;
         msg.status.msglen = 0;
-        if(writex(s, &msg.status, sizeof(msg.status)))
+        if(sync_writex(s, &msg.status, sizeof(msg.status)))
             return -1;
     }
     return 0;
@@ -224,13 +341,13 @@ fail:
 }
 
 #ifdef HAVE_SYMLINKS
-static int handle_send_link(int s, char *path, char *buffer)
+static int handle_send_link(syncsock *s, char *path, char *buffer)
 {
     syncmsg msg;
     unsigned int len;
     int ret;
 
-    if(readx(s, &msg.data, sizeof(msg.data)))
+    if(sync_readx(s, &msg.data, sizeof(msg.data)))
         return -1;
 
     if(msg.data.id != ID_DATA) {
@@ -243,7 +360,7 @@ static int handle_send_link(int s, char *path, char *buffer)
         fail_message(s, "oversize data message");
         return -1;
     }
-    if(readx(s, buffer, len))
+    if(sync_readx(s, buffer, len))
         return -1;
 
     ret = symlink(buffer, path);
@@ -256,13 +373,13 @@ static int handle_send_link(int s, char *path, char *buffer)
         return -1;
     }
 
-    if(readx(s, &msg.data, sizeof(msg.data)))
+    if(sync_readx(s, &msg.data, sizeof(msg.data)))
         return -1;
 
     if(msg.data.id == ID_DONE) {
         msg.status.id = ID_OKAY;
         msg.status.msglen = 0;
-        if(writex(s, &msg.status, sizeof(msg.status)))
+        if(sync_writex(s, &msg.status, sizeof(msg.status)))
             return -1;
     } else {
         fail_message(s, "invalid data message: expected ID_DONE");
@@ -273,7 +390,7 @@ static int handle_send_link(int s, char *path, char *buffer)
 }
 #endif /* HAVE_SYMLINKS */
 
-static int do_send(int s, char *path, char *buffer)
+static int do_send(syncsock *s, char *path, char *buffer)
 {
     char *tmp;
     mode_t mode;
@@ -316,7 +433,34 @@ static int do_send(int s, char *path, char *buffer)
     return ret;
 }
 
-static int do_recv(int s, const char *path, char *buffer)
+/* Sends a block of file data, compressed if the client asked for that
+** and it shrinks enough.
+*/
+static int send_data(syncsock *s, const char *data, int len)
+{
+    syncmsg msg;
+    int zlen = 0;
+
+    if(s->compress)
+        zlen = lz_compress(data, len, s->z, len - len / SYNC_ZGAIN);
+
+    if(zlen > 0) {
+        msg.data.id = ID_ZDAT;
+        msg.data.size = htoll(zlen);
+        data = s->z;
+        len = zlen;
+    } else {
+        msg.data.id = ID_DATA;
+        msg.data.size = htoll(len);
+    }
+    if(sync_writex(s, &msg.data, sizeof(msg.data)) ||
+       sync_writex(s, data, len)) {
+        return -1;
+    }
+    return 0;
+}
+
+static int do_recv(syncsock *s, const char *path, char *buffer)
 {
     syncmsg msg;
     int fd, r;
@@ -327,7 +471,6 @@ static int do_recv(int s, const char *path, char *buffer)
         return 0;
     }
 
-    msg.data.id = ID_DATA;
     for(;;) {
         r = adb_read(fd, buffer, SYNC_DATA_MAX);
         if(r <= 0) {
@@ -337,9 +480,7 @@ static int do_recv(int s, const char *path, char *buffer)
             adb_close(fd);
             return r;
         }
-        msg.data.size = htoll(r);
-        if(writex(s, &msg.data, sizeof(msg.data)) ||
-           writex(s, buffer, r)) {
+        if(send_data(s, buffer, r)) {
             adb_close(fd);
             return -1;
         }
@@ -349,7 +490,7 @@ static int do_recv(int s, const char *path, char *buffer)
 
     msg.data.id = ID_DONE;
     msg.data.size = 0;
-    if(writex(s, &msg.data, sizeof(msg.data))) {
+    if(sync_writex(s, &msg.data, sizeof(msg.data))) {
         return -1;
     }
 
@@ -362,23 +503,30 @@ void file_sync_service(int fd, void *cookie)
     char name[1025];
     unsigned namelen;
 
-    char *buffer = malloc(SYNC_DATA_MAX);
-    if(buffer == 0) goto fail;
+    char *buffer = malloc(SYNC_WRITE_MAX);
+    syncsock *s = malloc(sizeof(syncsock));
+    if(buffer == 0 || s == 0) goto fail;
+
+    s->fd = fd;
+    s->compress = 0;
+    s->in_pos = 0;
+    s->in_len = 0;
+    s->out_len = 0;
 
     for(;;) {
         D("sync: waiting for command\n");
 
-        if(readx(fd, &msg.req, sizeof(msg.req))) {
-            fail_message(fd, "command read failure");
+        if(sync_readx(s, &msg.req, sizeof(msg.req))) {
+            fail_message(s, "command read failure");
             break;
         }
         namelen = ltohl(msg.req.namelen);
         if(namelen > 1024) {
-            fail_message(fd, "invalid namelen");
+            fail_message(s, "invalid namelen");
             break;
         }
-        if(readx(fd, name, namelen)) {
-            fail_message(fd, "filename read failure");
+        if(sync_readx(s, name, namelen)) {
+            fail_message(s, "filename read failure");
             break;
         }
         name[namelen] = 0;
@@ -388,26 +536,33 @@ void file_sync_service(int fd, void *cookie)
 
         switch(msg.req.id) {
         case ID_STAT:
-            if(do_stat(fd, name)) goto fail;
+            if(do_stat(s, name)) goto fail;
             break;
         case ID_LIST:
-            if(do_list(fd, name)) goto fail;
+            if(do_list(s, name)) goto fail;
             break;
         case ID_SEND:
-            if(do_send(fd, name, buffer)) goto fail;
+            if(do_send(s, name, buffer)) goto fail;
             break;
         case ID_RECV:
-            if(do_recv(fd, name, buffer)) goto fail;
+            if(do_recv(s, name, buffer)) goto fail;
+            break;
+        case ID_COMP:
+            if(do_comp(s, name)) goto fail;
             break;
         case ID_QUIT:
             goto fail;
         default:
-            fail_message(fd, "unknown command");
+            fail_message(s, "unknown command");
             goto fail;
         }
     }
 
 fail:
+    if(s != 0) {
+        sync_flush(s);
+        free(s);
+    }
     if(buffer != 0) free(buffer);
     D("sync: done\n");
     adb_close(fd);
@@ -45,6 +45,8 @@ static inline unsigned __swap_uint32(unsigned x)
 #define ID_OKAY MKID('O','K','A','Y')
 #define ID_FAIL MKID('F','A','I','L')
 #define ID_QUIT MKID('Q','U','I','T')
+#define ID_COMP MKID('C','O','M','P')
+#define ID_ZDAT MKID('Z','D','A','T')
 
 typedef union {
     unsigned id;
@@ -84,4 +86,17 @@ int do_sync_pull(const char *rpath, const char *lpath);
 
 #define SYNC_DATA_MAX (64*1024)
 
+/* A COMP request naming SYNC_CODEC is answered OKAY by a service that can
+** compress, and from then on file data may go either way as ZDAT as well
+** as DATA. A ZDAT holds one SYNC_CODEC block of at most SYNC_DATA_MAX
+** bytes, that decompresses to at most SYNC_DATA_MAX bytes. Older services
+** answer FAIL and close the connection.
+**
+** A block is only sent as ZDAT when that saves at least 1/SYNC_ZGAIN of
+** it. The compressor gives up on data that won't shrink in a fraction of
+** the time it takes to send, so every block is tried.
+*/
+#define SYNC_CODEC "lz4"
+#define SYNC_ZGAIN 16
+
 #endif
@@ -164,16 +164,18 @@ jdwp_process_free( JdwpProcess*  proc )
         proc->prev->next = proc->next;
         proc->next->prev = proc->prev;
 
+        /* the fde doesn't own the socket, but must let go of
+         * it before it is closed */
+        if (proc->fde != NULL) {
+            fdevent_destroy(proc->fde);
+            proc->fde = NULL;
+        }
+
         if (proc->socket >= 0) {
             adb_shutdown(proc->socket);
             adb_close(proc->socket);
             proc->socket = -1;
         }
-
-        if (proc->fde != NULL) {
-            fdevent_destroy(proc->fde);
-            proc->fde = NULL;
-        }
         proc->pid = -1;
 
         for (n = 0; n < proc->out_count; n++) {
@@ -588,7 +590,7 @@ jdwp_socket_ready( asocket*  s )
     */
     if (jdwp->pass == 0) {
         apacket*  p = get_apacket();
-        p->len = jdwp_process_list((char*)p->data, MAX_PAYLOAD);
+        p->len = jdwp_process_list((char*)p->data, p->size);
         peer->enqueue(peer, p);
         jdwp->pass = 1;
     }
@@ -677,7 +679,7 @@ jdwp_tracker_ready( asocket*  s )
     if (t->need_update) {
         apacket*  p = get_apacket();
         t->need_update = 0;
-        p->len = jdwp_process_list_msg((char*)p->data, sizeof(p->data));
+        p->len = jdwp_process_list_msg((char*)p->data, p->size);
         s->peer->enqueue(s->peer, p);
     }
 }
@@ -0,0 +1,214 @@
+/*
+ * Copyright (C) 2012 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "lz.h"
+#include <string.h>
+
+#define  MIN_MATCH     4
+#define  LAST_LITERALS 5   /* a block always ends with this many literals */
+#define  MATCH_LIMIT   12  /* and no match starts in its last 12 bytes */
+#define  HASH_BITS     12
+#define  SKIP_SHIFT    6   /* step up the search after every 64 misses */
+
+static unsigned
+read32 (const unsigned char*  p)
+{
+    unsigned  v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+static unsigned
+hash32 (unsigned  v)
+{
+    return (v * 2654435761U) >> (32 - HASH_BITS);
+}
+
+/* writes the part of a length that didn't fit in its token nibble */
+static unsigned char*
+put_length (unsigned char*  op, unsigned  len)
+{
+    while (len >= 255) {
+        *op++ = 255;
+        len  -= 255;
+    }
+    *op++ = (unsigned char) len;
+    return op;
+}
+
+int
+lz_compress (const void*  src, int  len, void*  dst, int  max)
+{
+    const unsigned char*  in     = src;
+    const unsigned char*  ip     = in;
+    const unsigned char*  anchor = in;
+    const unsigned char*  mlimit = in + len - MATCH_LIMIT;
+    const unsigned char*  iend   = in + len - LAST_LITERALS;
+    unsigned char*        op     = dst;
+    unsigned char*        oend   = op + max;
+    unsigned short        table[1 << HASH_BITS];
+    unsigned              misses = 0;
+    unsigned              lits;
+
+    if (len < 0 || len > LZ_BLOCK_MAX)
+        return 0;
+
+    /* positions fit in 16 bits, and so does any offset between them */
+    memset(table, 0, sizeof(table));
+
+    if (len > MATCH_LIMIT) {
+        ip++;
+        while (ip <= mlimit) {
+            const unsigned char*  ref;
+            const unsigned char*  m;
+            unsigned char*        token;
+            unsigned              h = hash32(read32(ip));
+            unsigned              off, mlen;
+
+            ref      = in + table[h];
+            table[h] = (unsigned short)(ip - in);
+            if (read32(ref) != read32(ip)) {
+                ip += 1 + (misses++ >> SKIP_SHIFT);
+                continue;
+            }
+            misses = 0;
+
+            while (ip > anchor && ref > in && ip[-1] == ref[-1]) {
+                ip--;
+                ref--;
+            }
+            m = ip + MIN_MATCH;
+            for (ref += MIN_MATCH; m < iend && *m == *ref; m++, ref++)
+                ;
+
+            lits = ip - anchor;
+            mlen = m - ip - MIN_MATCH;
+            off  = m - ref;
+            if (oend - op < (int)(lits + lits/255 + mlen/255 + 5))
+                return 0;
+
+            token = op++;
+            if (lits >= 15) {
+                *token = 15 << 4;
+                op = put_length(op, lits - 15);
+            } else {
+                *token = lits << 4;
+            }
+            memcpy(op, anchor, lits);
+            op += lits;
+
+            *op++ = (unsigned char) off;
+            *op++ = (unsigned char)(off >> 8);
+            if (mlen >= 15) {
+                *token |= 15;
+                op = put_length(op, mlen - 15);
+            } else {
+                *token |= mlen;
+            }
+
+            ip = anchor = m;
+            if (ip <= mlimit)
+                table[hash32(read32(ip - 2))] = (unsigned short)(ip - 2 - in);
+        }
+    }
+
+    lits = in + len - anchor;
+    if (oend - op < (int)(lits + lits/255 + 2))
+        return 0;
+
+    if (lits >= 15) {
+        *op++ = 15 << 4;
+        op = put_length(op, lits - 15);
+    } else {
+        *op++ = lits << 4;
+    }
+    memcpy(op, anchor, lits);
+    op += lits;
+
+    return op - (unsigned char*) dst;
+}
+
+/* reads the rest of a length whose token nibble was 15 */
+static const unsigned char*
+get_length (const unsigned char*  ip, const unsigned char*  iend, unsigned*  plen)
+{
+    unsigned  b;
+
+    do {
+        if (ip >= iend)
+            return NULL;
+        b      = *ip++;
+        *plen += b;
+    } while (b == 255);
+
+    return ip;
+}
+
+int
+lz_decompress (const void*  src, int  len, void*  dst, int  max)
+{
+    const unsigned char*  ip   = src;
+    const unsigned char*  iend = ip + len;
+    unsigned char*        op   = dst;
+    unsigned char*        oend = op + max;
+
+    for (;;) {
+        const unsigned char*  ref;
+        unsigned              token, n, off;
+
+        if (ip >= iend)
+            return -1;
+        token = *ip++;
+
+        n = token >> 4;
+        if (n == 15 && (ip = get_length(ip, iend, &n)) == NULL)
+            return -1;
+        if (n > (unsigned)(iend - ip) || n > (unsigned)(oend - op))
+            return -1;
+        memcpy(op, ip, n);
+        op += n;
+        ip += n;
+
+        /* the last sequence has no match */
+        if (ip == iend)
+            break;
+
+        if (iend - ip < 2)
+            return -1;
+        off = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (off == 0 || off > (unsigned)(op - (unsigned char*) dst))
+            return -1;
+
+        n = token & 15;
+        if (n == 15 && (ip = get_length(ip, iend, &n)) == NULL)
+            return -1;
+        n += MIN_MATCH;
+        if (n > (unsigned)(oend - op))
+            return -1;
+
+        /* a match may overlap what it's copying, to repeat a pattern */
+        ref = op - off;
+        if (off >= n) {
+            memcpy(op, ref, n);
+            op += n;
+        } else {
+            while (n-- > 0)
+                *op++ = *ref++;
+        }
+    }
+
+    return op - (unsigned char*) dst;
+}
@@ -0,0 +1,40 @@
+/*
+ * Copyright (C) 2012 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef _ADB_LZ_H
+#define _ADB_LZ_H
+
+/* a small, fast LZ77 codec for single blocks of up to LZ_BLOCK_MAX bytes.
+ *
+ * the output is an LZ4 block: a series of (literals, match) sequences,
+ * each with a one-byte token holding both lengths. there is no header;
+ * whoever sends a block is expected to frame it.
+ */
+#define LZ_BLOCK_MAX  65536
+
+/* compresses 'len' bytes from 'src' into 'dst'. returns the compressed
+ * size, or 0 if it would not fit in 'max' bytes. since the compressor
+ * gives up as soon as it runs out of room, passing a 'max' a little
+ * smaller than 'len' is a cheap way of skipping data that won't shrink.
+ */
+extern int  lz_compress( const void*  src, int  len, void*  dst, int  max );
+
+/* decompresses a 'len' byte block from 'src' into 'dst'. returns the
+ * decompressed size, or -1 if the block is corrupt or would expand
+ * to more than 'max' bytes.
+ */
+extern int  lz_decompress( const void*  src, int  len, void*  dst, int  max );
+
+#endif /* _ADB_LZ_H */
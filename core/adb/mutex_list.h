@@ -7,6 +7,7 @@
 #error ADB_MUTEX not defined when including this file
 #endif
 ADB_MUTEX(dns_lock)
+ADB_MUTEX(apacket_lock)
 ADB_MUTEX(socket_list_lock)
 ADB_MUTEX(transport_lock)
 #if ADB_HOST
@@ -20,6 +20,11 @@
 #include <errno.h>
 #include <string.h>
 #include <ctype.h>
+#ifdef HAVE_SPLICE
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#endif
 
 #include "sysdeps.h"
 
@@ -29,6 +34,9 @@
 ADB_MUTEX_DEFINE( socket_list_lock );
 
 static void local_socket_close_locked(asocket *s);
+#ifdef HAVE_SPLICE
+static int remote_socket_enqueue(asocket *s, apacket *p);
+#endif
 
 int sendfailmsg(int fd, const char *reason)
 {
@@ -127,11 +135,74 @@ restart:
     adb_mutex_unlock(&socket_list_lock);
 }
 
+/* Largest payload s may hand its peer: what the transport behind either
+** of them settled on, or MAX_PAYLOAD between two local sockets.
+*/
+static unsigned get_max_payload(asocket *s)
+{
+    unsigned max_payload = MAX_PAYLOAD;
+
+    if(s->transport && s->transport->max_payload < max_payload)
+        max_payload = s->transport->max_payload;
+    if(s->peer && s->peer->transport && s->peer->transport->max_payload < max_payload)
+        max_payload = s->peer->transport->max_payload;
+    return max_payload;
+}
+
+/* Reads into a packet's payload, which already holds len bytes, without
+** going past max. Payloads held in a pipe are spliced into it instead.
+*/
+static int read_payload(int fd, apacket *p, unsigned len, unsigned max)
+{
+#ifdef HAVE_SPLICE
+    if(p->pipe) {
+        int r = splice(fd, NULL, p->pipe->fd[1], NULL, max - len,
+                       SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if(r > 0) p->pipe->held += r;
+        return r;
+    }
+#endif
+        /* start with the packet's own buffer; only a stream
+        ** that fills it gets a full-sized payload
+        */
+    if(len == p->size)
+        reserve_apacket(p, max);
+    return adb_read(fd, p->data + len, (p->size < max ? p->size : max) - len);
+}
+
+/* Writes what it can of the rest of a packet's payload, and consumes it */
+static int write_payload(int fd, apacket *p)
+{
+    int r;
+
+#ifdef HAVE_SPLICE
+    if(p->pipe) {
+        r = splice(p->pipe->fd[0], NULL, fd, NULL, p->len,
+                   SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if(r > 0) {
+            p->pipe->held -= r;
+            p->len -= r;
+        }
+        return r;
+    }
+#endif
+    r = adb_write(fd, p->ptr, p->len);
+    if(r > 0) {
+        p->ptr += r;
+        p->len -= r;
+    }
+    return r;
+}
+
 static int local_socket_enqueue(asocket *s, apacket *p)
 {
     D("LS(%d): enqueue %d\n", s->id, p->len);
 
     p->ptr = p->data;
+#ifdef HAVE_SPLICE
+    if(!s->splice)
+        unsplice_apacket(p);
+#endif
 
         /* if there is already data queue'd, we will receive
         ** events when it's time to write.  just add this to
@@ -145,10 +216,8 @@ static int local_socket_enqueue(asocket *s, apacket *p)
         ** would block or there is an error/eof
         */
     while(p->len > 0) {
-        int r = adb_write(s->fd, p->ptr, p->len);
+        int r = write_payload(s->fd, p);
         if(r > 0) {
-            p->len -= r;
-            p->ptr += r;
             continue;
         }
         if((r == 0) || (errno != EAGAIN)) {
@@ -267,10 +336,8 @@ static void local_socket_event_func(int fd, unsigned ev, void *_s)
 
         while((p = s->pkt_first) != 0) {
             while(p->len > 0) {
-                int r = adb_write(fd, p->ptr, p->len);
+                int r = write_payload(fd, p);
                 if(r > 0) {
-                    p->ptr += r;
-                    p->len -= r;
                     continue;
                 }
                 if(r < 0) {
@@ -312,17 +379,26 @@ static void local_socket_event_func(int fd, unsigned ev, void *_s)
 
     if(ev & FDE_READ){
         apacket *p = get_apacket();
-        unsigned char *x = p->data;
-        size_t avail = MAX_PAYLOAD;
+        unsigned max_payload = get_max_payload(s);
+        unsigned len = 0;
         int r;
         int is_eof = 0;
 
-        while(avail > 0) {
-            r = adb_read(fd, x, avail);
-            D("LS(%d): post adb_read(fd=%d,...) r=%d (errno=%d) avail=%d\n", s->id, s->fd, r, r<0?errno:0, avail);
+#ifdef HAVE_SPLICE
+            /* data headed straight out over a transport that can take
+            ** it from a pipe never needs to be copied into our memory
+            */
+        if(s->splice && s->peer && s->peer->enqueue == remote_socket_enqueue &&
+           transport_splices(s->peer->transport) && (p->pipe = get_apipe()) != 0) {
+            if(max_payload > p->pipe->size)
+                max_payload = p->pipe->size;
+        }
+#endif
+        while(len < max_payload) {
+            r = read_payload(fd, p, len, max_payload);
+            D("LS(%d): post adb_read(fd=%d,...) r=%d (errno=%d) len=%d\n", s->id, s->fd, r, r<0?errno:0, len);
             if(r > 0) {
-                avail -= r;
-                x += r;
+                len += r;
                 continue;
             }
             if(r < 0) {
@@ -336,10 +412,10 @@ static void local_socket_event_func(int fd, unsigned ev, void *_s)
         }
         D("LS(%d): fd=%d post avail loop. r=%d is_eof=%d forced_eof=%d\n",
           s->id, s->fd, r, is_eof, s->fde.force_eof);
-        if((avail == MAX_PAYLOAD) || (s->peer == 0)) {
+        if((len == 0) || (s->peer == 0)) {
             put_apacket(p);
         } else {
-            p->len = MAX_PAYLOAD - avail;
+            p->len = len;
 
             r = s->peer->enqueue(s->peer, p);
             D("LS(%d): fd=%d post peer->enqueue(). r=%d\n", s->id, s->fd, r);
@@ -391,6 +467,17 @@ asocket *create_local_socket(int fd)
     s->enqueue = local_socket_enqueue;
     s->ready = local_socket_ready;
     s->close = local_socket_close;
+#ifdef HAVE_SPLICE
+    {
+        struct sockaddr_storage addr;
+        socklen_t alen = sizeof(addr);
+
+            /* TCP sockets could be spliced long before unix ones */
+        if(getsockname(fd, (struct sockaddr*) &addr, &alen) == 0 &&
+           (addr.ss_family == AF_INET || addr.ss_family == AF_INET6))
+            s->splice = 1;
+    }
+#endif
     install_local_socket(s);
 
     fdevent_install(&s->fde, fd, local_socket_event_func, s);
@@ -527,7 +614,7 @@ void connect_to_remote(asocket *s, const char *destination)
     apacket *p = get_apacket();
     int len = strlen(destination) + 1;
 
-    if(len > (MAX_PAYLOAD-1)) {
+    if(len > (MAX_PAYLOAD_V1-1)) {
         fatal("destination oversized");
     }
 
@@ -632,7 +719,7 @@ static int smart_socket_enqueue(asocket *s, apacket *p)
         s->pkt_first = p;
         s->pkt_last = p;
     } else {
-        if((s->pkt_first->len + p->len) > MAX_PAYLOAD) {
+        if((s->pkt_first->len + p->len) > s->pkt_first->size) {
             D("SS(%d): overflow\n", s->id);
             put_apacket(p);
             goto fail;
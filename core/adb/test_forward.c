@@ -0,0 +1,299 @@
+/* a simple stress test: forwards many concurrent TCP connections through
+** the ADB server and a device to an echo server, and checks what comes back.
+**
+** the echo server runs on this machine, so the "device" must be one that can
+** reach it on localhost, e.g. an adbd built for the host and listening on
+** the emulator port 5555 as emulator-5554:
+**
+**   ulimit -n 8192
+**   test_forward [connections [rounds]]
+**
+** with -t it instead streams that many megabytes through one connection,
+** and reports the throughput of the forward, in each direction at once:
+**
+**   test_forward -t [megabytes]
+*/
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+
+#define  ADB_PORT      5037
+#define  LOCAL_PORT    6100
+#define  ECHO_PORT     6200
+#define  MESSAGE_SIZE  1024
+#define  MAX_CONNS     4000
+#define  STREAM_CHUNK  (256*1024)
+
+static void
+panic( const char*  msg )
+{
+    fprintf(stderr, "PANIC: %s: %s\n", msg, strerror(errno));
+    exit(1);
+}
+
+static int
+unix_write( int  fd, const char*  buf, int  len )
+{
+    int  result = 0;
+    while (len > 0) {
+        int  len2 = write(fd, buf, len);
+        if (len2 < 0) {
+            if (errno == EINTR || errno == EAGAIN)
+                continue;
+            return -1;
+        }
+        result += len2;
+        len -= len2;
+        buf += len2;
+    }
+    return  result;
+}
+
+static int
+unix_read( int  fd, char*  buf, int  len )
+{
+    int  result = 0;
+    while (len > 0) {
+        int  len2 = read(fd, buf, len);
+        if (len2 < 0) {
+            if (errno == EINTR || errno == EAGAIN)
+                continue;
+            return -1;
+        }
+        if (len2 == 0)
+            break;
+        result += len2;
+        len -= len2;
+        buf += len2;
+    }
+    return  result;
+}
+
+static int
+loopback_socket( int  port, int  listening )
+{
+    struct sockaddr_in  addr;
+    int                 s, n = 1;
+
+    memset( &addr, 0, sizeof(addr) );
+    addr.sin_family      = AF_INET;
+    addr.sin_port        = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    s = socket( PF_INET, SOCK_STREAM, 0 );
+    if (s < 0)
+        return -1;
+
+    if (listening) {
+        setsockopt( s, SOL_SOCKET, SO_REUSEADDR, &n, sizeof(n) );
+        if (bind(s, (struct sockaddr*) &addr, sizeof(addr)) < 0 ||
+            listen(s, 128) < 0) {
+            close(s);
+            return -1;
+        }
+    } else if (connect(s, (struct sockaddr*) &addr, sizeof(addr)) < 0) {
+        close(s);
+        return -1;
+    }
+    return s;
+}
+
+/* echoes everything back on every connection, until killed */
+static void*
+echo_thread( void*  arg )
+{
+    static struct pollfd  fds[MAX_CONNS + 1];
+    static char           buffer[STREAM_CHUNK];
+    int                   nfds = 1;
+
+    fds[0].fd     = (int)(long) arg;
+    fds[0].events = POLLIN;
+
+    for (;;) {
+        int  i;
+
+        if (poll(fds, nfds, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            panic("echo poll");
+        }
+
+        if (fds[0].revents & POLLIN) {
+            int  s = accept(fds[0].fd, NULL, NULL);
+            if (s >= 0 && nfds <= MAX_CONNS) {
+                fds[nfds].fd      = s;
+                fds[nfds].events  = POLLIN;
+                fds[nfds].revents = 0;
+                nfds++;
+            } else if (s >= 0) {
+                close(s);
+            }
+        }
+
+        for (i = 1; i < nfds; i++) {
+            int  len;
+
+            if (!fds[i].revents)
+                continue;
+
+            len = read(fds[i].fd, buffer, sizeof buffer);
+            if (len > 0 && unix_write(fds[i].fd, buffer, len) == len)
+                continue;
+
+            close(fds[i].fd);
+            fds[i--] = fds[--nfds];
+        }
+    }
+    return NULL;
+}
+
+/* asks the ADB server to forward LOCAL_PORT to ECHO_PORT on the device */
+static void
+setup_forward( void )
+{
+    char  request[64], buffer[128];
+    int   len, s;
+
+    s = loopback_socket( ADB_PORT, 0 );
+    if (s < 0) panic( "could not connect to server" );
+
+    snprintf( request, sizeof request, "host:forward:tcp:%d;tcp:%d",
+              LOCAL_PORT, ECHO_PORT );
+    len = snprintf( buffer, sizeof buffer, "%04x%s", (unsigned) strlen(request), request );
+    if (unix_write(s, buffer, len) < 0)
+        panic( "could not send request" );
+
+    if (unix_read(s, buffer, 8) != 8 || memcmp(buffer, "OKAYOKAY", 8)) {
+        errno = 0;
+        panic( "forward request failed" );
+    }
+    close(s);
+}
+
+/* byte n of the stream is n % 251, so a chunk starting at offset n
+** is the pattern from n % 251 on */
+static char       stream_pattern[STREAM_CHUNK + 251];
+static long long  stream_total;
+
+static void*
+stream_thread( void*  arg )
+{
+    int        s = (int)(long) arg;
+    long long  off;
+
+    for (off = 0; off < stream_total; off += STREAM_CHUNK) {
+        if (unix_write(s, stream_pattern + off % 251, STREAM_CHUNK) != STREAM_CHUNK)
+            panic( "could not send stream" );
+    }
+    return NULL;
+}
+
+/* sends data through the forward while reading its echo back */
+static int
+stream_test( long long  total )
+{
+    static char      buf[STREAM_CHUNK];
+    long long        off;
+    pthread_t        thread;
+    struct timespec  start, end;
+    double           secs;
+    int              i, s, bad = 0;
+
+    for (i = 0; i < (int) sizeof(stream_pattern); i++)
+        stream_pattern[i] = (char)(i % 251);
+
+    s = loopback_socket( LOCAL_PORT, 0 );
+    if (s < 0)
+        panic( "could not connect to forward" );
+
+    stream_total = total;
+    clock_gettime( CLOCK_MONOTONIC, &start );
+    if (pthread_create(&thread, NULL, stream_thread, (void*)(long) s) != 0)
+        panic( "could not start stream thread" );
+
+    for (off = 0; off < total; off += STREAM_CHUNK) {
+        if (unix_read(s, buf, STREAM_CHUNK) != STREAM_CHUNK)
+            panic( "could not receive stream" );
+        if (memcmp(buf, stream_pattern + off % 251, STREAM_CHUNK))
+            bad++;
+    }
+    clock_gettime( CLOCK_MONOTONIC, &end );
+    pthread_join( thread, NULL );
+    close(s);
+
+    secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf( "%lld MB each way in %.2f s: %.1f MB/s, %d bad chunks\n",
+            total >> 20, secs, (total >> 20) / secs, bad );
+    return bad != 0;
+}
+
+int  main( int  argc, char**  argv )
+{
+    static int       conns[MAX_CONNS];
+    char             message[MESSAGE_SIZE], reply[MESSAGE_SIZE];
+    int              stream = argc > 1 && !strcmp(argv[1], "-t");
+    int              count  = argc > 1 ? atoi(argv[1]) : 500;
+    int              rounds = argc > 2 ? atoi(argv[2]) : 50;
+    int              i, r, s, bad = 0;
+    pthread_t        thread;
+    struct timespec  start, end;
+
+    if (count < 1 || count > MAX_CONNS)
+        count = MAX_CONNS;
+
+    s = loopback_socket( ECHO_PORT, 1 );
+    if (s < 0) panic( "could not start echo server" );
+    if (pthread_create(&thread, NULL, echo_thread, (void*)(long) s) != 0)
+        panic( "could not start echo thread" );
+
+    setup_forward();
+
+    if (stream)
+        return stream_test( (argc > 2 ? atoll(argv[2]) : 1024) << 20 );
+
+    /* the forward listener has a tiny backlog, so let each
+     * connection get through before opening the next one */
+    for (i = 0; i < count; i++) {
+        conns[i] = loopback_socket( LOCAL_PORT, 0 );
+        if (conns[i] < 0)
+            panic( "could not connect to forward" );
+        if (unix_write(conns[i], "h", 1) != 1 || unix_read(conns[i], reply, 1) != 1)
+            panic( "could not open connection" );
+    }
+    printf( "%d connections open\n", count );
+
+    for (i = 0; i < MESSAGE_SIZE; i++)
+        message[i] = 'a' + i % 26;
+
+    clock_gettime( CLOCK_MONOTONIC, &start );
+    for (r = 0; r < rounds; r++) {
+        /* everything in flight at once, then collect it */
+        for (i = 0; i < count; i++) {
+            message[0] = 'A' + (i + r) % 26;
+            if (unix_write(conns[i], message, MESSAGE_SIZE) != MESSAGE_SIZE)
+                panic( "could not send data" );
+        }
+        for (i = 0; i < count; i++) {
+            message[0] = 'A' + (i + r) % 26;
+            if (unix_read(conns[i], reply, MESSAGE_SIZE) != MESSAGE_SIZE ||
+                memcmp(message, reply, MESSAGE_SIZE))
+                bad++;
+        }
+    }
+    clock_gettime( CLOCK_MONOTONIC, &end );
+
+    for (i = 0; i < count; i++)
+        close(conns[i]);
+
+    printf( "%d rounds in %.2f s, %d bad replies\n", rounds,
+            (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9, bad );
+    return bad != 0;
+}
@@ -129,6 +129,10 @@ dump_packet(const char* name, const char* func, apacket* p)
 
     D("%s: %s: [%s] arg0=%s arg1=%s (len=%d) ",
         name, func, cmd, arg0, arg1, len);
+#ifdef HAVE_SPLICE
+    if (p->pipe)
+        len = 0;  /* the payload isn't in memory */
+#endif
     dump_hex(p->data, len);
 }
 #endif /* ADB_TRACE */
@@ -189,6 +193,8 @@ write_packet(int  fd, const char* name, apacket** ppacket)
         } else {
             D("%s: write_packet (fd=%d) error ret=%d errno=%d: %s\n", name, fd, r, errno, strerror(errno));
             if((r < 0) && (errno == EINTR)) continue;
+                /* never leave part of a packet address behind */
+            if((r < 0) && (errno == EAGAIN) && (len < (int) sizeof(ppacket))) continue;
             return -1;
         }
     }
@@ -207,26 +213,58 @@ static void transport_socket_events(int fd, unsigned events, void *_t)
             handle_packet(p, (atransport *) _t);
         }
     }
+    if(events & FDE_WRITE){
+        while(t->send_first) {
+            apacket *p = t->send_first;
+            apacket *next = p->next;
+
+                /* p belongs to the output thread once written */
+            if(write_packet(fd, t->serial, &p)) {
+                if(errno == EAGAIN) return;
+                fatal_errno("cannot enqueue packet on transport socket");
+            }
+            t->send_first = next;
+        }
+        t->send_last = 0;
+        fdevent_del(&t->transport_fde, FDE_WRITE);
+    }
 }
 
-void send_packet(apacket *p, atransport *t)
+/* Sum of the payload bytes, as carried in amessage.data_check */
+static unsigned calculate_checksum(const unsigned char *x, unsigned count)
 {
-    unsigned char *x;
-    unsigned sum;
-    unsigned count;
+    unsigned sum = 0;
 
-    p->msg.magic = p->msg.command ^ 0xffffffff;
-
-    count = p->msg.data_length;
-    x = (unsigned char *) p->data;
-    sum = 0;
-    while(count-- > 0){
+    while(count > 0 && ((unsigned long) x & 3)) {
         sum += *x++;
+        count--;
     }
-    p->msg.data_check = sum;
 
-    print_packet("send", p);
+        /* add four bytes at a time into two 16-bit lanes; each round adds
+        ** at most 510 to a lane, so fold them every 128 words
+        */
+    while(count >= 4) {
+        const unsigned *w = (const unsigned *) x;
+        unsigned words = count / 4 < 128 ? count / 4 : 128;
+        unsigned lanes = 0;
+
+        count -= words * 4;
+        x += words * 4;
+        while(words-- > 0) {
+            unsigned v = *w++;
+            lanes += (v & 0x00ff00ff) + ((v >> 8) & 0x00ff00ff);
+        }
+        sum += (lanes & 0xffff) + (lanes >> 16);
+    }
 
+    while(count-- > 0) {
+        sum += *x++;
+    }
+    return sum;
+}
+
+void send_packet(apacket *p, atransport *t)
+{
     if (t == NULL) {
         D("Transport is null \n");
         // Zap errno because print_packet() and other stuff have errno effect.
@@ -234,9 +272,38 @@ void send_packet(apacket *p, atransport *t)
         fatal_errno("Transport is null");
     }
 
-    if(write_packet(t->transport_socket, t->serial, &p)){
-        fatal_errno("cannot enqueue packet on transport socket");
+    p->msg.magic = p->msg.command ^ 0xffffffff;
+        /* CNXN is read before the peer knows our version, so sum it anyway */
+    if(t->protocol_version >= A_VERSION_SKIP_CHECKSUM && p->msg.command != A_CNXN) {
+        p->msg.data_check = 0;
+    } else {
+        p->msg.data_check = calculate_checksum(p->data, p->msg.data_length);
+    }
+
+    print_packet("send", p);
+
+    if(t->send_first == 0) {
+        if(write_packet(t->transport_socket, t->serial, &p) == 0) {
+            return;
+        }
+        if(errno != EAGAIN) {
+            fatal_errno("cannot enqueue packet on transport socket");
+        }
+            /* the output thread is behind, and with enough sockets
+            ** open the socketpair fills up; rather than block the
+            ** event loop, hold on to the packet until there's room
+            */
+        D("%s: transport socket full, queueing packets\n", t->serial);
+        fdevent_add(&t->transport_fde, FDE_WRITE);
+    }
+
+    p->next = 0;
+    if(t->send_last) {
+        t->send_last->next = p;
+    } else {
+        t->send_first = p;
     }
+    t->send_last = p;
 }
 
 /* The transport is opened by transport_register_func before
@@ -590,6 +657,12 @@ static void transport_registration_func(int _fd, unsigned ev, void *data)
         fdevent_remove(&(t->transport_fde));
         adb_close(t->fd);
 
+        while(t->send_first) {
+            apacket *p = t->send_first;
+            t->send_first = p->next;
+            put_apacket(p);
+        }
+
         adb_mutex_lock(&transport_lock);
         t->next->prev = t->prev;
         t->prev->next = t->next;
@@ -1060,19 +1133,14 @@ int check_header(apacket *p)
     return 0;
 }
 
-int check_data(apacket *p)
+/* Both ends trust TCP and USB once they speak A_VERSION_SKIP_CHECKSUM */
+int check_data(apacket *p, atransport *t)
 {
-    unsigned count, sum;
-    unsigned char *x;
-
-    count = p->msg.data_length;
-    x = p->data;
-    sum = 0;
-    while(count-- > 0) {
-        sum += *x++;
+    if(t->protocol_version >= A_VERSION_SKIP_CHECKSUM) {
+        return 0;
     }
 
-    if(sum != p->msg.data_check) {
+    if(calculate_checksum(p->data, p->msg.data_length) != p->msg.data_check) {
         return -1;
     } else {
         return 0;
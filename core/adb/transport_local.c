@@ -21,6 +21,10 @@
 
 #include "sysdeps.h"
 #include <sys/types.h>
+#ifdef HAVE_SPLICE
+#include <fcntl.h>
+#include <sys/socket.h>
+#endif
 
 #define  TRACE_TAG  TRACE_TRANSPORT
 #include "adb.h"
@@ -52,6 +56,70 @@ ADB_MUTEX_DEFINE( local_transports_lock );
 static atransport*  local_transports[ ADB_LOCAL_TRANSPORT_MAX ];
 #endif /* ADB_HOST */
 
+#ifdef HAVE_SPLICE
+/* Splices a payload from the socket into the packet's pipe. TCP hands
+** over data in whatever pieces it arrived in, and each takes a slot of
+** the pipe, so it can fill up short of the payload; the rest is then
+** read into memory after what it holds.
+*/
+static int remote_read_pipe(apacket *p, atransport *t)
+{
+    apipe *ap = p->pipe;
+    unsigned len = p->msg.data_length;
+    unsigned got;
+
+    while(ap->held < len) {
+        int r = splice(t->sfd, NULL, ap->fd[1], NULL, len - ap->held,
+                       SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if(r > 0) {
+            ap->held += r;
+            continue;
+        }
+        if(r < 0 && errno == EINTR) continue;
+        if(r < 0 && errno == EAGAIN) break;
+        return -1;
+    }
+
+    if(ap->held < len) {
+        got = ap->held;
+        unsplice_apacket(p);
+        reserve_apacket(p, len);
+        if(readx(t->sfd, p->data + got, len - got)) return -1;
+    }
+    return 0;
+}
+
+static int remote_write_pipe(apacket *p, atransport *t)
+{
+    apipe *ap = p->pipe;
+    char *msg = (char*) &p->msg;
+    int n = sizeof(amessage);
+
+        /* the header goes out in the same segment as the payload */
+    while(n > 0) {
+        int r = send(t->sfd, msg, n, MSG_MORE);
+        if(r > 0) {
+            msg += r;
+            n -= r;
+            continue;
+        }
+        if(r < 0 && errno == EINTR) continue;
+        return -1;
+    }
+
+    while(ap->held > 0) {
+        int r = splice(ap->fd[0], NULL, t->sfd, NULL, ap->held, SPLICE_F_MOVE);
+        if(r > 0) {
+            ap->held -= r;
+            continue;
+        }
+        if(r < 0 && errno == EINTR) continue;
+        return -1;
+    }
+    return 0;
+}
+#endif
+
 static int remote_read(apacket *p, atransport *t)
 {
     if(readx(t->sfd, &p->msg, sizeof(amessage))){
@@ -70,12 +138,25 @@ static int remote_read(apacket *p, atransport *t)
         return -1;
     }
 
+#ifdef HAVE_SPLICE
+        /* stream data is only passed on, so it can stay out of memory */
+    if(p->msg.command == A_WRTE && p->msg.data_length > sizeof(p->buf) &&
+       transport_splices(t) && (p->pipe = get_apipe()) != 0) {
+        if(remote_read_pipe(p, t)) {
+            D("remote local: terminated (data)\n");
+            return -1;
+        }
+        return 0;
+    }
+#endif
+
+    reserve_apacket(p, p->msg.data_length);
     if(readx(t->sfd, p->data, p->msg.data_length)){
         D("remote local: terminated (data)\n");
         return -1;
     }
 
-    if(check_data(p)) {
+    if(check_data(p, t)) {
         D("bad data: terminated (data)\n");
         return -1;
     }
@@ -93,7 +174,22 @@ static int remote_write(apacket *p, atransport *t)
     D("write remote packet: %04x arg0=%0x arg1=%0x data_length=%0x data_check=%0x magic=%0x\n",
       p->msg.command, p->msg.arg0, p->msg.arg1, p->msg.data_length, p->msg.data_check, p->msg.magic);
 #endif
-    if(writex(t->sfd, &p->msg, sizeof(amessage) + length)) {
+#ifdef HAVE_SPLICE
+    if(p->pipe) {
+        if(remote_write_pipe(p, t)) {
+            D("remote local: write terminated\n");
+            return -1;
+        }
+        return 0;
+    }
+#endif
+    if(p->data == p->buf) {
+        if(writex(t->sfd, &p->msg, sizeof(amessage) + length)) {
+            D("remote local: write terminated\n");
+            return -1;
+        }
+    } else if(writex(t->sfd, &p->msg, sizeof(amessage)) ||
+              writex(t->sfd, p->data, length)) {
         D("remote local: write terminated\n");
         return -1;
     }
@@ -287,6 +383,11 @@ int init_socket_transport(atransport *t, int s, int adb_port, int local)
     t->connection_state = CS_OFFLINE;
     t->type = kTransportLocal;
     t->adb_port = 0;
+    t->protocol_version = A_VERSION_MIN;
+    t->max_payload = MAX_PAYLOAD_V1;
+#ifdef HAVE_SPLICE
+    t->splice = 1;
+#endif
 
 #if ADB_HOST
     if (HOST && local) {
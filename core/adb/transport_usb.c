@@ -65,13 +65,14 @@ static int remote_read(apacket *p, atransport *t)
     }
 
     if(p->msg.data_length) {
+        reserve_apacket(p, p->msg.data_length);
         if(usb_read(t->usb, p->data, p->msg.data_length)){
             D("remote usb: terminated (data)\n");
             return -1;
         }
     }
 
-    if(check_data(p)) {
+    if(check_data(p, t)) {
         D("remote usb: check_data failed\n");
         return -1;
     }
@@ -90,7 +91,7 @@ static int remote_write(apacket *p, atransport *t)
         return -1;
     }
     if(p->msg.data_length == 0) return 0;
-    if(usb_write(t->usb, &p->data, size)) {
+    if(usb_write(t->usb, p->data, size)) {
         D("remote usb: 2 - write terminated\n");
         return -1;
     }
@@ -120,6 +121,8 @@ void init_usb_transport(atransport *t, usb_handle *h, int state)
     t->connection_state = state;
     t->type = kTransportUsb;
     t->usb = h;
+    t->protocol_version = A_VERSION_MIN;
+    t->max_payload = MAX_PAYLOAD_V1;
 
 #if ADB_HOST
     HOST = 1;
@@ -99,11 +99,18 @@ int usb_read(usb_handle *h, void *data, int len)
     int n;
 
     D("about to read (fd=%d, len=%d)\n", h->fd, len);
-    n = adb_read(h->fd, data, len);
-    if(n != len) {
-        D("ERROR: fd = %d, n = %d, errno = %d (%s)\n",
-            h->fd, n, errno, strerror(errno));
-        return -1;
+    while(len > 0) {
+            /* the gadget driver refuses reads larger than its 4K buffer */
+        int xfer = (len > 4096) ? 4096 : len;
+
+        n = adb_read(h->fd, data, xfer);
+        if(n != xfer) {
+            D("ERROR: fd = %d, n = %d, errno = %d (%s)\n",
+                h->fd, n, errno, strerror(errno));
+            return -1;
+        }
+        len -= xfer;
+        data = (char *)data + xfer;
     }
     D("[ done fd=%d ]\n", h->fd);
     return 0;
@@ -16,12 +16,14 @@ LOCAL_PATH:= $(call my-dir)
 
 include $(CLEAR_VARS)
 
-LOCAL_C_INCLUDES := $(LOCAL_PATH)/../mkbootimg
-LOCAL_SRC_FILES := protocol.c engine.c bootimg.c fastboot.c 
+LOCAL_C_INCLUDES := $(LOCAL_PATH)/../mkbootimg \
+  $(LOCAL_PATH)/../../extras/ext4_utils
+LOCAL_SRC_FILES := protocol.c engine.c bootimg.c fastboot.c sparse.c unzip.c
 LOCAL_MODULE := fastboot
 
 ifeq ($(HOST_OS),linux)
   LOCAL_SRC_FILES += usb_linux.c util_linux.c
+  LOCAL_LDLIBS += -lpthread
 endif
 
 ifeq ($(HOST_OS),darwin)
@@ -57,6 +59,18 @@ include $(CLEAR_VARS)
 LOCAL_SRC_FILES := usbtest.c usb_linux.c
 LOCAL_MODULE := usbtest
 include $(BUILD_HOST_EXECUTABLE)
+
+# fastboot talking to a stand-in device instead of USB; see test_sparse.sh
+include $(CLEAR_VARS)
+LOCAL_C_INCLUDES := $(LOCAL_PATH)/../mkbootimg \
+  $(LOCAL_PATH)/../../extras/ext4_utils
+LOCAL_SRC_FILES := protocol.c engine.c bootimg.c fastboot.c sparse.c unzip.c \
+  usb_loopback.c util_linux.c
+LOCAL_MODULE := fastboot_loopback
+LOCAL_MODULE_TAGS := tests
+LOCAL_LDLIBS += -lpthread
+LOCAL_STATIC_LIBRARIES := libzipfile libunz
+include $(BUILD_HOST_EXECUTABLE)
 endif
 
 ifeq ($(HOST_OS),windows)
@@ -34,7 +34,7 @@
 
 #include "fastboot.h"
 
-double now()
+double now(void)
 {
     struct timeval tv;
     gettimeofday(&tv, NULL);
@@ -60,6 +60,8 @@ char *mkmsg(const char *fmt, ...)
 #define OP_COMMAND    2
 #define OP_QUERY      3
 #define OP_NOTICE     4
+#define OP_DOWNLOAD_SPARSE 5
+#define OP_DOWNLOAD_UNZIP  6
 
 typedef struct Action Action;
 
@@ -77,11 +79,16 @@ struct Action
     int (*func)(Action *a, int status, char *resp);
 
     double start;
+    double inflate;  /* OP_DOWNLOAD_UNZIP: time spent inflating the data */
+    double wait;     /* and how much of it the download waited for */
 };
 
 static Action *action_list = 0;
 static Action *action_last = 0;
 
+static double unzip_inflate = 0;
+static double unzip_wait = 0;
+
 static int cb_default(Action *a, int status, char *resp)
 {
     if (status) {
@@ -146,6 +153,46 @@ void fb_queue_flash(const char *ptn, void *data, unsigned sz)
     a->msg = mkmsg("writing '%s'", ptn);
 }
 
+void fb_queue_flash_sparse(const char *ptn, sparse_part *part, unsigned sz)
+{
+    Action *a;
+
+    a = queue_action(OP_DOWNLOAD_SPARSE, "");
+    a->data = part;
+    a->size = 0;
+    a->msg = mkmsg("sending sparse '%s' (%d KB)", ptn, sz / 1024);
+
+    a = queue_action(OP_COMMAND, "flash:%s", ptn);
+    a->msg = mkmsg("writing '%s'", ptn);
+}
+
+static int cb_unzip(Action *a, int status, char *resp)
+{
+    if (status) {
+        fprintf(stderr,"FAILED (%s)\n", resp);
+    } else {
+        double split = now();
+        fprintf(stderr,"OKAY [%7.3fs] (inflating %.3fs, waited %.3fs)\n",
+                (split - a->start), a->inflate, a->wait);
+        a->start = split;
+    }
+    return status;
+}
+
+void fb_queue_flash_unzip(const char *ptn, unzip_piece *piece, unsigned sz, int sparse)
+{
+    Action *a;
+
+    a = queue_action(OP_DOWNLOAD_UNZIP, "");
+    a->data = piece;
+    a->size = 0;
+    a->msg = mkmsg("sending %s'%s' (%d KB)", sparse ? "sparse " : "", ptn, sz / 1024);
+    a->func = cb_unzip;
+
+    a = queue_action(OP_COMMAND, "flash:%s", ptn);
+    a->msg = mkmsg("writing '%s'", ptn);
+}
+
 static int match(char *str, const char **value, unsigned count)
 {
     const char *val;
@@ -330,6 +377,17 @@ int fb_execute_queue(usb_handle *usb)
             status = fb_download_data(usb, a->data, a->size);
             status = a->func(a, status, status ? fb_get_error() : "");
             if (status) break;
+        } else if (a->op == OP_DOWNLOAD_SPARSE) {
+            status = fb_download_data_sparse(usb, a->data);
+            status = a->func(a, status, status ? fb_get_error() : "");
+            if (status) break;
+        } else if (a->op == OP_DOWNLOAD_UNZIP) {
+            status = fb_download_data_unzip(usb, a->data);
+            unzip_piece_done(a->data, &a->inflate, &a->wait);
+            unzip_inflate += a->inflate;
+            unzip_wait += a->wait;
+            status = a->func(a, status, status ? fb_get_error() : "");
+            if (status) break;
         } else if (a->op == OP_COMMAND) {
             status = fb_command(usb, a->cmd);
             status = a->func(a, status, status ? fb_get_error() : "");
@@ -345,6 +403,10 @@ int fb_execute_queue(usb_handle *usb)
         }
     }
 
+    if (unzip_inflate > 0) {
+        fprintf(stderr,"inflating took %.3fs, %.3fs of which held up sending\n",
+                unzip_inflate, unzip_wait);
+    }
     fprintf(stderr,"finished. total time: %.3fs\n", (now() - start));
     return status;
 }
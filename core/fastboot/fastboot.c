@@ -58,6 +58,8 @@ static const char *product = 0;
 static const char *cmdline = 0;
 static int wipe_data = 0;
 static unsigned short vendor_id = 0;
+static long long sparse_limit = -1;
+static long long target_sparse_limit = -1;
 
 static unsigned base_addr = 0x10000000;
 
@@ -210,6 +212,85 @@ void list_devices(void) {
     usb_open(list_devices_callback);
 }
 
+/* An image to flash: all of it in memory, or the sparse pieces it is
+ * sent in when the device can't take it in one download.
+ */
+struct image {
+    void *data;
+    unsigned sz;
+    sparse_part **parts;
+};
+
+static long long get_target_sparse_limit(usb_handle *usb)
+{
+    char response[FB_RESPONSE_SZ + 1];
+    long long limit = 0;
+
+    if (fb_command_response(usb, "getvar:max-download-size", response) == 0) {
+        limit = strtoul(response, 0, 0);
+        if (limit > 0) {
+            fprintf(stderr, "target reported max download size of %lld bytes\n", limit);
+        }
+    }
+    return limit;
+}
+
+static long long get_sparse_limit(long long size)
+{
+    long long limit;
+
+    if (sparse_limit == 0) {
+        return 0;
+    } else if (sparse_limit > 0) {
+        limit = sparse_limit;
+    } else {
+        if (target_sparse_limit == -1) {
+            target_sparse_limit = get_target_sparse_limit(open_device());
+        }
+        limit = target_sparse_limit;
+    }
+
+    if (limit > 0 && size > limit) {
+        return limit;
+    }
+    return 0;
+}
+
+int load_image(const char *fn, struct image *img)
+{
+    sparse_file *s;
+    long long limit;
+
+    memset(img, 0, sizeof(*img));
+
+    s = sparse_file_open(fn);
+    if (s == 0) return -1;
+
+    limit = get_sparse_limit(sparse_file_size(s));
+    if (limit == 0) {
+        sparse_file_close(s);
+        img->data = load_file(fn, &img->sz);
+        return img->data ? 0 : -1;
+    }
+
+    img->parts = sparse_file_split(s, limit);
+    if (img->parts == 0) die("max download size of %lld bytes is too small", limit);
+    return 0;
+}
+
+void queue_flash_image(const char *pname, struct image *img)
+{
+    sparse_part **part;
+
+    if (img->parts == 0) {
+        fb_queue_flash(pname, img->data, img->sz);
+        return;
+    }
+    for (part = img->parts; *part; part++) {
+        fb_queue_flash_sparse(pname, *part, sparse_part_len(*part));
+    }
+}
+
 void usage(void)
 {
     fprintf(stderr,
@@ -238,6 +319,9 @@ void usage(void)
             "  -i <vendor id>                           specify a custom USB vendor id\n"
             "  -b <base_addr>                           specify a custom kernel base address\n"
             "  -n <page size>                           specify the nand page size. default: 2048\n"
+            "  -S <size>[K|M|G]                         send images larger than size in sparse\n"
+            "                                           pieces. default: the device's max\n"
+            "                                           download size, 0 to disable\n"
         );
 }
 
@@ -433,6 +517,13 @@ void do_update_signature(zipfile_t zip, char *fn)
     fb_queue_command("signature", "installing signature");
 }
 
+/* Queues an image from an update package, to be inflated while the
+ * queue runs rather than up front */
+static void queue_flash_zipentry(const char *pname, zipentry_t entry)
+{
+    unzip_queue_flash(pname, entry, get_sparse_limit(get_zipentry_size(entry)));
+}
+
 void do_update(char *fn)
 {
     void *zdata;
@@ -440,6 +531,7 @@ void do_update(char *fn)
     void *data;
     unsigned sz;
     zipfile_t zip;
+    zipentry_t entry;
 
     queue_info_dump();
 
@@ -468,21 +560,26 @@ void do_update(char *fn)
 
     setup_requirements(data, sz);
 
-    data = unzip_file(zip, "boot.img", &sz);
-    if (data == 0) die("update package missing boot.img");
+    entry = lookup_zipentry(zip, "boot.img");
+    if (entry == 0) die("update package missing boot.img");
     do_update_signature(zip, "boot.sig");
-    fb_queue_flash("boot", data, sz);
+    queue_flash_zipentry("boot", entry);
 
-    data = unzip_file(zip, "recovery.img", &sz);
-    if (data != 0) {
+    entry = lookup_zipentry(zip, "recovery.img");
+    if (entry != 0) {
         do_update_signature(zip, "recovery.sig");
-        fb_queue_flash("recovery", data, sz);
+        queue_flash_zipentry("recovery", entry);
+    } else {
+        fprintf(stderr, "archive does not contain 'recovery.img'\n");
     }
 
-    data = unzip_file(zip, "system.img", &sz);
-    if (data == 0) die("update package missing system.img");
+    entry = lookup_zipentry(zip, "system.img");
+    if (entry == 0) die("update package missing system.img");
     do_update_signature(zip, "system.sig");
-    fb_queue_flash("system", data, sz);
+    queue_flash_zipentry("system", entry);
+
+        /* images are inflated as the queue gets to them */
+    unzip_start();
 }
 
 void do_send_signature(char *fn)
@@ -508,6 +605,7 @@ void do_flashall(void)
     char *fname;
     void *data;
     unsigned sz;
+    struct image img;
 
     queue_info_dump();
 
@@ -520,23 +618,20 @@ void do_flashall(void)
     setup_requirements(data, sz);
 
     fname = find_item("boot", product);
-    data = load_file(fname, &sz);
-    if (data == 0) die("could not load boot.img");
+    if (load_image(fname, &img)) die("could not load boot.img");
     do_send_signature(fname);
-    fb_queue_flash("boot", data, sz);
+    queue_flash_image("boot", &img);
 
     fname = find_item("recovery", product);
-    data = load_file(fname, &sz);
-    if (data != 0) {
+    if (load_image(fname, &img) == 0) {
         do_send_signature(fname);
-        fb_queue_flash("recovery", data, sz);
+        queue_flash_image("recovery", &img);
     }
 
     fname = find_item("system", product);
-    data = load_file(fname, &sz);
-    if (data == 0) die("could not load system.img");
+    if (load_image(fname, &img)) die("could not load system.img");
     do_send_signature(fname);
-    fb_queue_flash("system", data, sz);
+    queue_flash_image("system", &img);
 }
 
 #define skip(n) do { argc -= (n); argv += (n); } while (0)
@@ -560,6 +655,30 @@ int do_oem_command(int argc, char **argv)
     return 0;
 }
 
+static long long parse_num(const char *arg)
+{
+    char *endptr;
+    unsigned long long num;
+
+    num = strtoull(arg, &endptr, 0);
+    if (endptr == arg) return -1;
+
+    if (*endptr == 'k' || *endptr == 'K') {
+        num <<= 10;
+        endptr++;
+    } else if (*endptr == 'm' || *endptr == 'M') {
+        num <<= 20;
+        endptr++;
+    } else if (*endptr == 'g' || *endptr == 'G') {
+        num <<= 30;
+        endptr++;
+    }
+
+        /* download sizes go over the wire as 32 bits */
+    if (*endptr != '\0' || num > 0xffffffffULL) return -1;
+    return num;
+}
+
 int main(int argc, char **argv)
 {
     int wants_wipe = 0;
@@ -567,6 +686,7 @@ int main(int argc, char **argv)
     int wants_reboot_bootloader = 0;
     void *data;
     unsigned sz;
+    struct image img;
     unsigned page_size = 2048;
     int status;
 
@@ -602,6 +722,11 @@ int main(int argc, char **argv)
             page_size = (unsigned)strtoul(argv[1], NULL, 0);
             if (!page_size) die("invalid page size");
             skip(2);
+        } else if(!strcmp(*argv, "-S")) {
+            require(2);
+            sparse_limit = parse_num(argv[1]);
+            if (sparse_limit < 0) die("invalid sparse limit '%s'", argv[1]);
+            skip(2);
         } else if(!strcmp(*argv, "-s")) {
             require(2);
             serial = argv[1];
@@ -677,9 +802,8 @@ int main(int argc, char **argv)
                 skip(2);
             }
             if (fname == 0) die("cannot determine image filename for '%s'", pname);
-            data = load_file(fname, &sz);
-            if (data == 0) die("cannot load '%s'\n", fname);
-            fb_queue_flash(pname, data, sz);
+            if (load_image(fname, &img)) die("cannot load '%s'\n", fname);
+            queue_flash_image(pname, &img);
         } else if(!strcmp(*argv, "flash:raw")) {
             char *pname = argv[1];
             char *kname = argv[2];
@@ -29,12 +29,20 @@
 #ifndef _FASTBOOT_H_
 #define _FASTBOOT_H_
 
+#include <zipfile/zipfile.h>
+
 #include "usb.h"
 
+typedef struct sparse_file sparse_file;
+typedef struct sparse_part sparse_part;
+typedef struct unzip_piece unzip_piece;
+
 /* protocol.c - fastboot protocol */
 int fb_command(usb_handle *usb, const char *cmd);
 int fb_command_response(usb_handle *usb, const char *cmd, char *response);
 int fb_download_data(usb_handle *usb, const void *data, unsigned size);
+int fb_download_data_sparse(usb_handle *usb, sparse_part *part);
+int fb_download_data_unzip(usb_handle *usb, unzip_piece *piece);
 char *fb_get_error(void);
 
 #define FB_COMMAND_SZ 64
@@ -42,6 +50,8 @@ char *fb_get_error(void);
 
 /* engine.c - high level command queue engine */
 void fb_queue_flash(const char *ptn, void *data, unsigned sz);;
+void fb_queue_flash_sparse(const char *ptn, sparse_part *part, unsigned sz);
+void fb_queue_flash_unzip(const char *ptn, unzip_piece *piece, unsigned sz, int sparse);
 void fb_queue_erase(const char *ptn);
 void fb_queue_require(const char *prod, const char *var, int invert,
         unsigned nvalues, const char **value);
@@ -52,6 +62,32 @@ void fb_queue_command(const char *cmd, const char *msg);
 void fb_queue_download(const char *name, void *data, unsigned size);
 void fb_queue_notice(const char *notice);
 int fb_execute_queue(usb_handle *usb);
+double now(void);
+
+/* sparse.c - sending images in pieces the device can take */
+typedef int (*sparse_read_fn)(void *priv, long long off, void *data, unsigned len);
+
+sparse_file *sparse_file_open(const char *fn);
+/* A plain image of size bytes whose data comes from read, in order */
+sparse_file *sparse_file_new(long long size, sparse_read_fn read, void *priv);
+long long sparse_file_size(sparse_file *s);
+void sparse_file_close(sparse_file *s);
+sparse_part **sparse_file_split(sparse_file *s, unsigned max);
+unsigned sparse_part_len(sparse_part *part);
+/* The blocks [start, end) of its file a part carries data for */
+void sparse_part_blocks(sparse_part *part, unsigned *start, unsigned *end);
+int sparse_part_write(sparse_part *part,
+        int (*write)(void *priv, const void *data, unsigned len), void *priv);
+
+#define SPARSE_BLOCK_SIZE 4096
+
+/* unzip.c - inflating update package images while they are sent */
+void unzip_queue_flash(const char *ptn, zipentry_t entry, unsigned limit);
+void unzip_start(void);
+unsigned unzip_piece_len(unzip_piece *piece);
+int unzip_piece_write(unzip_piece *piece,
+        int (*write)(void *priv, const void *data, unsigned len), void *priv);
+void unzip_piece_done(unzip_piece *piece, double *inflate, double *wait);
 
 /* util stuff */
 void die(const char *fmt, ...);
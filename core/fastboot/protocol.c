@@ -100,13 +100,11 @@ static int check_response(usb_handle *usb, unsigned size,
     return -1;
 }
 
-static int _command_send(usb_handle *usb, const char *cmd,
-                         const void *data, unsigned size,
-                         char *response)
+static int _command_start(usb_handle *usb, const char *cmd, unsigned size,
+                          unsigned data_okay, char *response)
 {
     int cmdsize = strlen(cmd);
-    int r;
-    
+
     if(response) {
         response[0] = 0;
     }
@@ -122,32 +120,54 @@ static int _command_send(usb_handle *usb, const char *cmd,
         return -1;
     }
 
+    return check_response(usb, size, data_okay, response);
+}
+
+static int _command_data(usb_handle *usb, const void *data, unsigned size)
+{
+    int r;
+
+    r = usb_write(usb, data, size);
+    if(r < 0) {
+        sprintf(ERROR, "data transfer failure (%s)", strerror(errno));
+        usb_close(usb);
+        return -1;
+    }
+    if(r != ((int) size)) {
+        sprintf(ERROR, "data transfer failure (short transfer)");
+        usb_close(usb);
+        return -1;
+    }
+
+    return r;
+}
+
+static int _command_end(usb_handle *usb)
+{
+    return check_response(usb, 0, 0, 0) < 0 ? -1 : 0;
+}
+
+static int _command_send(usb_handle *usb, const char *cmd,
+                         const void *data, unsigned size,
+                         char *response)
+{
+    int r;
+
     if(data == 0) {
-        return check_response(usb, size, 0, response);
+        return _command_start(usb, cmd, size, 0, response);
     }
 
-    r = check_response(usb, size, 1, 0);
+    r = _command_start(usb, cmd, size, 1, 0);
     if(r < 0) {
         return -1;
     }
     size = r;
 
-    if(size) {
-        r = usb_write(usb, data, size);
-        if(r < 0) {
-            sprintf(ERROR, "data transfer failure (%s)", strerror(errno));
-            usb_close(usb);
-            return -1;
-        }
-        if(r != ((int) size)) {
-            sprintf(ERROR, "data transfer failure (short transfer)");
-            usb_close(usb);
-            return -1;
-        }
+    if(size && _command_data(usb, data, size) < 0) {
+        return -1;
     }
-    
-    r = check_response(usb, 0, 0, 0);
-    if(r < 0) {
+
+    if(_command_end(usb) < 0) {
         return -1;
     } else {
         return size;
@@ -179,3 +199,99 @@ int fb_download_data(usb_handle *usb, const void *data, unsigned size)
     }
 }
 
+
+/* Sparse images and images from update packages are written out a piece
+ * at a time. Pieces are gathered into whole USB packets, since a short
+ * one ends the transfer.
+ */
+#define USB_BUF_SIZE 512
+static char usb_buf[USB_BUF_SIZE];
+static unsigned usb_buf_len;
+
+static int fb_download_data_write(void *priv, const void *data, unsigned len)
+{
+    usb_handle *usb = priv;
+    const char *ptr = data;
+    unsigned n;
+
+    if(usb_buf_len) {
+        n = USB_BUF_SIZE - usb_buf_len;
+        if(n > len) n = len;
+        memcpy(usb_buf + usb_buf_len, ptr, n);
+        usb_buf_len += n;
+        ptr += n;
+        len -= n;
+        if(usb_buf_len < USB_BUF_SIZE) {
+            return 0;
+        }
+        if(_command_data(usb, usb_buf, USB_BUF_SIZE) < 0) {
+            return -1;
+        }
+        usb_buf_len = 0;
+    }
+
+    n = len - len % USB_BUF_SIZE;
+    if(n && _command_data(usb, ptr, n) < 0) {
+        return -1;
+    }
+
+    memcpy(usb_buf, ptr + n, len - n);
+    usb_buf_len = len - n;
+    return 0;
+}
+
+typedef int (*download_writer)(void *item,
+        int (*write)(void *priv, const void *data, unsigned len), void *priv);
+
+/* Sends size bytes that writer puts out for item, as one download */
+static int fb_download_data_stream(usb_handle *usb, unsigned size,
+                                   download_writer writer, void *item)
+{
+    char cmd[64];
+    int r;
+
+    sprintf(cmd, "download:%08x", size);
+    r = _command_start(usb, cmd, size, 1, 0);
+    if(r < 0) {
+        return -1;
+    }
+    if(r != (int) size) {
+        sprintf(ERROR, "device wants %d bytes of a %d byte image", r, size);
+        usb_close(usb);
+        return -1;
+    }
+
+    usb_buf_len = 0;
+    if(writer(item, fb_download_data_write, usb)) {
+        return -1;
+    }
+    if(usb_buf_len && _command_data(usb, usb_buf, usb_buf_len) < 0) {
+        return -1;
+    }
+
+    return _command_end(usb);
+}
+
+static int write_sparse_part(void *item,
+        int (*write)(void *priv, const void *data, unsigned len), void *priv)
+{
+    return sparse_part_write(item, write, priv);
+}
+
+static int write_unzip_piece(void *item,
+        int (*write)(void *priv, const void *data, unsigned len), void *priv)
+{
+    return unzip_piece_write(item, write, priv);
+}
+
+int fb_download_data_sparse(usb_handle *usb, sparse_part *part)
+{
+    return fb_download_data_stream(usb, sparse_part_len(part),
+                                   write_sparse_part, part);
+}
+
+int fb_download_data_unzip(usb_handle *usb, unzip_piece *piece)
+{
+    return fb_download_data_stream(usb, unzip_piece_len(piece),
+                                   write_unzip_piece, piece);
+}
@@ -0,0 +1,461 @@
+/*
+ * Copyright (C) 2012 The Android Open Source Project
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* Images too big for the device's download buffer are sent as a series
+ * of sparse images, each of which covers the whole partition but only
+ * carries data for part of it; the rest is "don't care", which the
+ * bootloader leaves alone. Their data is read as it is sent, from disk
+ * or, through a read callback, from an update package being inflated.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+
+#include "fastboot.h"
+
+/* sparse_format.h expects whoever includes it to define these */
+typedef uint16_t __le16;
+typedef uint32_t __le32;
+#include <sparse_format.h>
+
+#if defined(__APPLE__) && defined(__MACH__)
+#define lseek64 lseek
+#endif
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+#define SPARSE_MAJOR_VER   1
+#define SPARSE_HEADER_LEN  (sizeof(sparse_header_t))
+#define CHUNK_HEADER_LEN   (sizeof(chunk_header_t))
+#define COPY_BUF_SIZE      (1024 * 1024)
+
+typedef struct sparse_chunk sparse_chunk;
+
+struct sparse_chunk
+{
+    unsigned type;          /* CHUNK_TYPE_RAW, _FILL or _DONT_CARE */
+    unsigned block;         /* first block of the image it covers */
+    unsigned blocks;
+    int64_t offset;         /* raw: where its data starts in the file */
+    uint32_t fill;          /* fill: the value repeated */
+};
+
+struct sparse_file
+{
+    int fd;
+    sparse_read_fn read;    /* used instead of fd, if set */
+    void *priv;
+    int64_t size;           /* of the file; raw data past it reads as zeros */
+    unsigned blk_sz;
+    unsigned total_blks;
+    sparse_chunk *chunks;
+    unsigned count;
+};
+
+struct sparse_part
+{
+    sparse_file *file;
+    unsigned first, last;   /* the chunks it takes data from, last excluded */
+    unsigned start, end;    /* the blocks it has data for, end excluded */
+};
+
+static int read_all(int fd, void *data, unsigned len)
+{
+    char *ptr = data;
+
+    while(len > 0) {
+        int r = read(fd, ptr, len);
+        if(r < 0 && errno == EINTR) continue;
+        if(r <= 0) return -1;
+        ptr += r;
+        len -= r;
+    }
+    return 0;
+}
+
+static sparse_chunk *add_chunk(sparse_file *s, unsigned type, unsigned blocks)
+{
+    sparse_chunk *c;
+
+    if((s->count & 63) == 0) {
+        c = realloc(s->chunks, (s->count + 64) * sizeof(sparse_chunk));
+        if(c == 0) die("out of memory");
+        s->chunks = c;
+    }
+    c = s->chunks + s->count++;
+    memset(c, 0, sizeof(*c));
+    c->type = type;
+    c->block = s->total_blks;
+    c->blocks = blocks;
+    s->total_blks += blocks;
+    return c;
+}
+
+/* Reads the chunk list of an image that is already sparse. CRC32 chunks
+ * are dropped, since they would not match any one piece of it. */
+static int read_sparse_chunks(sparse_file *s)
+{
+    sparse_header_t header;
+    chunk_header_t chunk;
+    int64_t pos, start;
+    sparse_chunk *c;
+    unsigned n;
+
+    if(read_all(s->fd, &header, sizeof(header))) return -1;
+    if(header.major_version != SPARSE_MAJOR_VER ||
+       header.file_hdr_sz < SPARSE_HEADER_LEN ||
+       header.chunk_hdr_sz < CHUNK_HEADER_LEN ||
+       header.blk_sz == 0 || (header.blk_sz & 3)) {
+        fprintf(stderr, "unsupported sparse image\n");
+        return -1;
+    }
+    s->blk_sz = header.blk_sz;
+
+    pos = header.file_hdr_sz;
+    for(n = 0; n < header.total_chunks; n++) {
+        start = pos;
+        if(lseek64(s->fd, pos, SEEK_SET) != pos ||
+           read_all(s->fd, &chunk, sizeof(chunk))) {
+            fprintf(stderr, "sparse image is truncated\n");
+            return -1;
+        }
+        pos += header.chunk_hdr_sz;
+
+        switch(chunk.chunk_type) {
+        case CHUNK_TYPE_RAW:
+            c = add_chunk(s, CHUNK_TYPE_RAW, chunk.chunk_sz);
+            c->offset = pos;
+            pos += (int64_t) chunk.chunk_sz * s->blk_sz;
+            break;
+        case CHUNK_TYPE_FILL:
+            c = add_chunk(s, CHUNK_TYPE_FILL, chunk.chunk_sz);
+            if(lseek64(s->fd, pos, SEEK_SET) != pos ||
+               read_all(s->fd, &c->fill, sizeof(c->fill))) {
+                fprintf(stderr, "sparse image is truncated\n");
+                return -1;
+            }
+            pos += sizeof(c->fill);
+            break;
+        case CHUNK_TYPE_DONT_CARE:
+            add_chunk(s, CHUNK_TYPE_DONT_CARE, chunk.chunk_sz);
+            break;
+        case CHUNK_TYPE_CRC32:
+            pos += 4;
+            break;
+        default:
+            fprintf(stderr, "unknown sparse chunk type 0x%04x\n", chunk.chunk_type);
+            return -1;
+        }
+        if(pos - start != chunk.total_sz || pos > s->size) {
+            fprintf(stderr, "sparse image is truncated\n");
+            return -1;
+        }
+    }
+
+    if(s->total_blks != header.total_blks) {
+        fprintf(stderr, "sparse image has %u blocks, expected %u\n",
+                s->total_blks, header.total_blks);
+        return -1;
+    }
+    return 0;
+}
+
+sparse_file *sparse_file_open(const char *fn)
+{
+    sparse_file *s;
+    uint32_t magic = 0;
+    sparse_chunk *c;
+
+    s = calloc(1, sizeof(sparse_file));
+    if(s == 0) die("out of memory");
+
+    s->fd = open(fn, O_RDONLY | O_BINARY);
+    if(s->fd < 0) goto oops;
+
+    s->size = lseek64(s->fd, 0, SEEK_END);
+    if(s->size < 0 || lseek64(s->fd, 0, SEEK_SET) != 0) goto oops;
+
+    if(s->size >= (int64_t) SPARSE_HEADER_LEN &&
+       read_all(s->fd, &magic, sizeof(magic)) == 0 &&
+       magic == SPARSE_HEADER_MAGIC) {
+        if(lseek64(s->fd, 0, SEEK_SET) != 0 || read_sparse_chunks(s)) goto oops;
+    } else {
+            /* a plain image is one raw chunk, its last block padded */
+        s->blk_sz = SPARSE_BLOCK_SIZE;
+        c = add_chunk(s, CHUNK_TYPE_RAW,
+                      (s->size + SPARSE_BLOCK_SIZE - 1) / SPARSE_BLOCK_SIZE);
+        c->offset = 0;
+    }
+    return s;
+
+oops:
+    if(s->fd >= 0) close(s->fd);
+    free(s->chunks);
+    free(s);
+    return 0;
+}
+
+sparse_file *sparse_file_new(long long size, sparse_read_fn read, void *priv)
+{
+    sparse_file *s;
+    sparse_chunk *c;
+
+    s = calloc(1, sizeof(sparse_file));
+    if(s == 0) die("out of memory");
+
+    s->fd = -1;
+    s->read = read;
+    s->priv = priv;
+    s->size = size;
+    s->blk_sz = SPARSE_BLOCK_SIZE;
+    c = add_chunk(s, CHUNK_TYPE_RAW,
+                  (s->size + SPARSE_BLOCK_SIZE - 1) / SPARSE_BLOCK_SIZE);
+    c->offset = 0;
+    return s;
+}
+
+long long sparse_file_size(sparse_file *s)
+{
+    return s->size;
+}
+
+void sparse_file_close(sparse_file *s)
+{
+    if(s->fd >= 0) close(s->fd);
+    free(s->chunks);
+    free(s);
+}
+
+/* Bytes it takes to send that many blocks of a chunk. A raw chunk can
+ * hold 4GB or more; only the pieces of it that fit in a part go out. */
+static int64_t chunk_len(sparse_chunk *c, unsigned blocks, unsigned blk_sz)
+{
+    if(c->type == CHUNK_TYPE_RAW)
+        return CHUNK_HEADER_LEN + (int64_t) blocks * blk_sz;
+    if(c->type == CHUNK_TYPE_FILL) return CHUNK_HEADER_LEN + sizeof(c->fill);
+    return CHUNK_HEADER_LEN;
+}
+
+sparse_part **sparse_file_split(sparse_file *s, unsigned max)
+{
+    sparse_part **parts = 0;
+    sparse_part *p;
+    unsigned count = 0;
+    unsigned pos = 0;
+    unsigned i = 0;
+    unsigned room, len;
+
+        /* leave room for a don't care chunk at either end */
+    if(max < SPARSE_HEADER_LEN + 3 * CHUNK_HEADER_LEN + s->blk_sz) return 0;
+    room = max - SPARSE_HEADER_LEN - 2 * CHUNK_HEADER_LEN;
+
+    do {
+        p = calloc(1, sizeof(sparse_part));
+        parts = realloc(parts, (count + 2) * sizeof(sparse_part*));
+        if(p == 0 || parts == 0) die("out of memory");
+        parts[count++] = p;
+        parts[count] = 0;
+
+        p->file = s;
+        p->first = i;
+        p->start = pos;
+        for(len = 0; i < s->count; i++) {
+            sparse_chunk *c = s->chunks + i;
+            unsigned n = c->block + c->blocks - pos;
+            int64_t clen = chunk_len(c, n, s->blk_sz);
+
+            if(len + clen > room) {
+                    /* a raw chunk can be cut anywhere between blocks */
+                if(c->type == CHUNK_TYPE_RAW &&
+                   room - len >= CHUNK_HEADER_LEN + s->blk_sz) {
+                    pos += (room - len - CHUNK_HEADER_LEN) / s->blk_sz;
+                }
+                break;
+            }
+            len += clen;
+            pos += n;
+        }
+        p->end = pos;
+        p->last = i;
+        if(i < s->count && pos > s->chunks[i].block) p->last++;
+    } while(i < s->count);
+
+    return parts;
+}
+
+/* Calls func for each chunk of a part, clipped to the blocks it covers */
+static int each_chunk(sparse_part *p,
+                      int (*func)(sparse_part *p, sparse_chunk *c, void *arg),
+                      void *arg)
+{
+    sparse_file *s = p->file;
+    sparse_chunk skip;
+    unsigned i;
+    int r;
+
+    memset(&skip, 0, sizeof(skip));
+    skip.type = CHUNK_TYPE_DONT_CARE;
+    if(p->start > 0) {
+        skip.blocks = p->start;
+        if((r = func(p, &skip, arg))) return r;
+    }
+
+    for(i = p->first; i < p->last; i++) {
+        sparse_chunk c = s->chunks[i];
+        unsigned end = c.block + c.blocks;
+
+        if(c.block < p->start) {
+            if(c.type == CHUNK_TYPE_RAW)
+                c.offset += (int64_t)(p->start - c.block) * s->blk_sz;
+            c.block = p->start;
+        }
+        if(end > p->end) end = p->end;
+        c.blocks = end - c.block;
+        if((r = func(p, &c, arg))) return r;
+    }
+
+    if(p->end < s->total_blks) {
+        skip.block = p->end;
+        skip.blocks = s->total_blks - p->end;
+        if((r = func(p, &skip, arg))) return r;
+    }
+    return 0;
+}
+
+static int count_chunk(sparse_part *p, sparse_chunk *c, void *arg)
+{
+    unsigned *len = arg;
+
+    len[0] += chunk_len(c, c->blocks, p->file->blk_sz);
+    len[1]++;
+    return 0;
+}
+
+unsigned sparse_part_len(sparse_part *p)
+{
+    unsigned len[2] = { SPARSE_HEADER_LEN, 0 };
+
+    each_chunk(p, count_chunk, len);
+    return len[0];
+}
+
+void sparse_part_blocks(sparse_part *p, unsigned *start, unsigned *end)
+{
+    *start = p->start;
+    *end = p->end;
+}
+
+struct part_writer
+{
+    int (*write)(void *priv, const void *data, unsigned len);
+    void *priv;
+    char *buf;
+};
+
+static int write_chunk(sparse_part *p, sparse_chunk *c, void *arg)
+{
+    struct part_writer *w = arg;
+    sparse_file *s = p->file;
+    chunk_header_t chunk;
+    int64_t off, left;
+
+    memset(&chunk, 0, sizeof(chunk));
+    chunk.chunk_type = c->type;
+    chunk.chunk_sz = c->blocks;
+    chunk.total_sz = chunk_len(c, c->blocks, s->blk_sz);
+    if(w->write(w->priv, &chunk, sizeof(chunk))) return -1;
+
+    if(c->type == CHUNK_TYPE_FILL)
+        return w->write(w->priv, &c->fill, sizeof(c->fill));
+    if(c->type != CHUNK_TYPE_RAW)
+        return 0;
+
+    off = c->offset;
+    left = (int64_t) c->blocks * s->blk_sz;
+    if(s->read == 0 && lseek64(s->fd, off, SEEK_SET) != off) {
+        fprintf(stderr, "cannot seek image (%s)\n", strerror(errno));
+        return -1;
+    }
+    while(left > 0) {
+        unsigned n = left > COPY_BUF_SIZE ? COPY_BUF_SIZE : left;
+        unsigned avail = 0;
+
+        if(off < s->size)
+            avail = s->size - off < n ? s->size - off : n;
+        if(s->read) {
+            if(s->read(s->priv, off, w->buf, avail)) return -1;
+        } else if(read_all(s->fd, w->buf, avail)) {
+            fprintf(stderr, "cannot read image (%s)\n", strerror(errno));
+            return -1;
+        }
+        memset(w->buf + avail, 0, n - avail);
+        if(w->write(w->priv, w->buf, n)) return -1;
+        off += n;
+        left -= n;
+    }
+    return 0;
+}
+
+int sparse_part_write(sparse_part *p,
+                      int (*write)(void *priv, const void *data, unsigned len),
+                      void *priv)
+{
+    struct part_writer w;
+    sparse_header_t header;
+    unsigned len[2] = { SPARSE_HEADER_LEN, 0 };
+    int r;
+
+    each_chunk(p, count_chunk, len);
+
+    memset(&header, 0, sizeof(header));
+    header.magic = SPARSE_HEADER_MAGIC;
+    header.major_version = SPARSE_MAJOR_VER;
+    header.minor_version = 0;
+    header.file_hdr_sz = SPARSE_HEADER_LEN;
+    header.chunk_hdr_sz = CHUNK_HEADER_LEN;
+    header.blk_sz = p->file->blk_sz;
+    header.total_blks = p->file->total_blks;
+    header.total_chunks = len[1];
+    if(write(priv, &header, sizeof(header))) return -1;
+
+    w.write = write;
+    w.priv = priv;
+    w.buf = malloc(COPY_BUF_SIZE);
+    if(w.buf == 0) die("out of memory");
+    r = each_chunk(p, write_chunk, &w);
+    free(w.buf);
+    return r;
+}
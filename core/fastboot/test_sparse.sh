@@ -0,0 +1,77 @@
+#!/bin/bash
+#
+# Flashes images too big for one download through fastboot_loopback, a
+# fastboot built against a stand-in device, and checks what it wrote.
+# Needs fastboot_loopback in PATH; the sparse input case also needs
+# make_ext4fs and simg2img, and the update package case zip, and each is
+# skipped without them.
+
+MAX=$((4 * 1024 * 1024))
+DIR=$(mktemp -d)
+trap "rm -rf $DIR" EXIT
+cd $DIR
+
+rtrn=0
+
+function check() {
+    if cmp -s "$2" "$3"
+    then
+        echo "PASS: $1"
+    else
+        echo "FAILURE: $1"
+        rtrn=$(expr $rtrn + 1)
+    fi
+}
+
+# a raw image that doesn't end on a block boundary
+head -c 10000000 /dev/urandom > raw.img
+head -c 3000000 /dev/zero >> raw.img
+head -c 1234567 /dev/urandom >> raw.img
+FASTBOOT_LOOPBACK_MAX=$MAX fastboot_loopback flash system raw.img 2> log
+if ! grep -q "sending sparse" log
+then
+    echo "FAILURE: raw image was not split"
+    rtrn=$(expr $rtrn + 1)
+fi
+head -c $(stat -c %s raw.img) system.img > flashed.img
+check "raw image in sparse pieces" raw.img flashed.img
+
+# with splitting off, the device should turn the same image down
+FASTBOOT_LOOPBACK_MAX=$MAX fastboot_loopback -S 0 flash cache raw.img 2> log
+if grep -q "data too large" log
+then
+    echo "PASS: -S 0 sends the image whole"
+else
+    echo "FAILURE: -S 0 sends the image whole"
+    rtrn=$(expr $rtrn + 1)
+fi
+
+if which make_ext4fs simg2img > /dev/null
+then
+    mkdir files
+    for i in 1 2 3 4 5 6 7 8; do head -c 1500000 /dev/urandom > files/$i; done
+    make_ext4fs -s -l 64M sparse.img files > /dev/null
+    simg2img sparse.img expected.img
+    FASTBOOT_LOOPBACK_MAX=$MAX fastboot_loopback flash userdata sparse.img 2> log
+    check "sparse image in sparse pieces" expected.img userdata.img
+else
+    echo "SKIPPED: sparse image (no make_ext4fs or simg2img)"
+fi
+
+if which zip > /dev/null
+then
+    mkdir update
+    echo "require board=loopback" > update/android-info.txt
+    head -c 1000000 /dev/urandom > update/boot.img
+    head -c 5000000 /dev/zero > update/system.img
+    cat raw.img >> update/system.img
+    (cd update && zip -q ../update.zip android-info.txt boot.img system.img)
+    FASTBOOT_LOOPBACK_MAX=$MAX fastboot_loopback update update.zip 2> log
+    check "boot from an update package" update/boot.img boot.img
+    head -c $(stat -c %s update/system.img) system.img > flashed.img
+    check "system from an update package in sparse pieces" update/system.img flashed.img
+else
+    echo "SKIPPED: update package (no zip)"
+fi
+
+exit $rtrn
@@ -0,0 +1,342 @@
+/*
+ * Copyright (C) 2012 The Android Open Source Project
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* Images from an update package are inflated in the order the queue
+ * sends them, a download's worth at a time. Where there are threads, a
+ * worker inflates ahead of the queue and a download goes out as its data
+ * comes in, so the next image is being inflated while this one is sent;
+ * otherwise each download is inflated just before it is sent.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef HAVE_PTHREADS
+#include <pthread.h>
+#endif
+
+#include "fastboot.h"
+
+/* downloads being inflated or sent at once */
+#define UNZIP_AHEAD 2
+
+/* how much is inflated before the sender is told it can have it */
+#define UNZIP_STEP (1024 * 1024)
+
+typedef struct unzip_image unzip_image;
+
+struct unzip_image
+{
+    zipentry_t entry;
+    zipstream_t stream;
+    char *name;
+    unsigned size;
+    sparse_file *file;      /* set if it goes in sparse pieces */
+    unzip_piece *sending;   /* the piece sparse_part_write() is on */
+};
+
+struct unzip_piece
+{
+    unzip_piece *next;
+    unzip_image *image;
+
+    sparse_part *part;      /* the sparse piece, or 0 for the whole image */
+    int open, close;        /* the image's first and last piece */
+
+    char *data;             /* len bytes of the image from off on */
+    unsigned off, len;
+    unsigned size;          /* the download */
+    unsigned ready;         /* data[0..ready) has been inflated */
+    int state;              /* 0 while being inflated, 1 when done, -1 on error */
+
+    double inflate;         /* time spent inflating it */
+    double wait;            /* time its download spent waiting for data */
+};
+
+static unzip_piece *unzip_first = 0;
+static unzip_piece *unzip_last = 0;
+
+#ifdef HAVE_PTHREADS
+static pthread_mutex_t unzip_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t unzip_cond = PTHREAD_COND_INITIALIZER;
+static int unzip_ahead = 0;
+#endif
+
+static unzip_piece *add_piece(unzip_image *img)
+{
+    unzip_piece *p = calloc(1, sizeof(unzip_piece));
+    if (p == 0) die("out of memory");
+
+    p->image = img;
+    if (unzip_last) {
+        unzip_last->next = p;
+    } else {
+        unzip_first = p;
+    }
+    unzip_last = p;
+    return p;
+}
+
+static int is_sparse(unzip_image *img)
+{
+    zipstream_t stream;
+    unsigned magic = 0;
+
+    stream = open_zipstream(img->entry);
+    if (stream == 0) return 0;
+    read_zipstream(stream, &magic, sizeof(magic));
+    close_zipstream(stream);
+    return magic == 0xed26ff3a;
+}
+
+static int read_piece(void *priv, long long off, void *data, unsigned len);
+
+void unzip_queue_flash(const char *ptn, zipentry_t entry, unsigned limit)
+{
+    unzip_image *img;
+    unzip_piece *p;
+    sparse_part **parts = 0;
+    unsigned i, start, end;
+
+    img = calloc(1, sizeof(unzip_image));
+    if (img == 0) die("out of memory");
+    img->entry = entry;
+    img->name = get_zipentry_name(entry);
+    img->size = get_zipentry_size(entry);
+
+        /* an image that is sparse already would need its own chunks
+         * split up, so it goes whole, as it always has */
+    if (limit > 0 && img->size > limit && !is_sparse(img)) {
+        img->file = sparse_file_new(img->size, read_piece, img);
+        parts = sparse_file_split(img->file, limit);
+    }
+
+    if (parts == 0) {
+        if (img->file) sparse_file_close(img->file);
+        img->file = 0;
+        p = add_piece(img);
+        p->open = p->close = 1;
+        p->len = p->size = img->size;
+        fb_queue_flash_unzip(ptn, p, p->size, 0);
+        return;
+    }
+
+    for (i = 0; parts[i]; i++) {
+        p = add_piece(img);
+        p->part = parts[i];
+        p->open = i == 0;
+        p->close = parts[i + 1] == 0;
+        sparse_part_blocks(p->part, &start, &end);
+        p->off = start * SPARSE_BLOCK_SIZE;
+        p->len = (end - start) * SPARSE_BLOCK_SIZE;
+        if (p->len > img->size - p->off) {
+            p->len = img->size - p->off;
+        }
+        p->size = sparse_part_len(p->part);
+        fb_queue_flash_unzip(ptn, p, p->size, 1);
+    }
+    free(parts);
+}
+
+static void set_ready(unzip_piece *p, unsigned ready)
+{
+#ifdef HAVE_PTHREADS
+    pthread_mutex_lock(&unzip_lock);
+    p->ready = ready;
+    pthread_cond_broadcast(&unzip_cond);
+    pthread_mutex_unlock(&unzip_lock);
+#else
+    p->ready = ready;
+#endif
+}
+
+/* Inflates the part of its image a piece holds */
+static int inflate_piece(unzip_piece *p)
+{
+    unzip_image *img = p->image;
+    unsigned done, n;
+    char *data;
+
+    if (p->open) {
+        img->stream = open_zipstream(img->entry);
+    }
+    if (img->stream == 0) return -1;
+
+    data = malloc(p->len ? p->len : 1);
+    if (data == 0) return -1;
+    p->data = data;
+
+    for (done = 0; done < p->len; done += n) {
+        n = p->len - done < UNZIP_STEP ? p->len - done : UNZIP_STEP;
+        if (read_zipstream(img->stream, data + done, n) != (int) n) return -1;
+        set_ready(p, done + n);
+    }
+    set_ready(p, p->len);
+
+    if (p->close) {
+        close_zipstream(img->stream);
+        img->stream = 0;
+    }
+    return 0;
+}
+
+static int make_piece(unzip_piece *p)
+{
+    double start = now();
+    int r = inflate_piece(p);
+
+    p->inflate = now() - start;
+    return r ? -1 : 1;
+}
+
+#ifdef HAVE_PTHREADS
+static void *unzip_thread(void *arg)
+{
+    unzip_piece *p;
+
+    for (p = unzip_first; p; p = p->next) {
+        int state;
+
+        pthread_mutex_lock(&unzip_lock);
+        while (unzip_ahead >= UNZIP_AHEAD) {
+            pthread_cond_wait(&unzip_cond, &unzip_lock);
+        }
+        unzip_ahead++;
+        pthread_mutex_unlock(&unzip_lock);
+
+        state = make_piece(p);
+
+        pthread_mutex_lock(&unzip_lock);
+        p->state = state;
+        pthread_cond_broadcast(&unzip_cond);
+        pthread_mutex_unlock(&unzip_lock);
+    }
+    return 0;
+}
+#endif
+
+void unzip_start(void)
+{
+#ifdef HAVE_PTHREADS
+    pthread_t thread;
+
+    if (unzip_first == 0) return;
+    if (pthread_create(&thread, 0, unzip_thread, 0) != 0) {
+        die("cannot start unzip thread");
+    }
+    pthread_detach(thread);
+#endif
+}
+
+/* Waits for more than sent bytes of a piece to be ready, or for all of
+ * it, and returns how much is */
+static unsigned wait_ready(unzip_piece *p, unsigned sent)
+{
+    double start = now();
+    unsigned ready;
+    int state;
+
+#ifdef HAVE_PTHREADS
+    pthread_mutex_lock(&unzip_lock);
+    while (p->ready == sent && p->state == 0) {
+        pthread_cond_wait(&unzip_cond, &unzip_lock);
+    }
+    ready = p->ready;
+    state = p->state;
+    pthread_mutex_unlock(&unzip_lock);
+#else
+    if (p->state == 0) p->state = make_piece(p);
+    ready = p->ready;
+    state = p->state;
+#endif
+
+    if (state < 0) die("failed to unzip '%s' from archive", p->image->name);
+    p->wait += now() - start;
+    return ready;
+}
+
+/* Gives sparse_part_write() image data from the piece it is sending,
+ * once that much of it has been inflated */
+static int read_piece(void *priv, long long off, void *data, unsigned len)
+{
+    unzip_piece *p = ((unzip_image *) priv)->sending;
+    unsigned start = off - p->off;
+    unsigned ready = 0;
+
+    while (ready < start + len) {
+        ready = wait_ready(p, ready);
+    }
+    memcpy(data, p->data + start, len);
+    return 0;
+}
+
+unsigned unzip_piece_len(unzip_piece *p)
+{
+    return p->size;
+}
+
+int unzip_piece_write(unzip_piece *p,
+        int (*write)(void *priv, const void *data, unsigned len), void *priv)
+{
+    unsigned sent = 0, ready;
+
+    if (p->part) {
+        p->image->sending = p;
+        return sparse_part_write(p->part, write, priv);
+    }
+
+    while (sent < p->len) {
+        ready = wait_ready(p, sent);
+        if (write(priv, p->data + sent, ready - sent)) return -1;
+        sent = ready;
+    }
+    return 0;
+}
+
+void unzip_piece_done(unzip_piece *p, double *inflate, double *wait)
+{
+    unsigned ready = 0;
+
+        /* the whole piece is inflated before its buffer goes */
+    while (ready < p->len) {
+        ready = wait_ready(p, ready);
+    }
+    *inflate = p->inflate;
+    *wait = p->wait;
+
+    free(p->data);
+    p->data = 0;
+
+#ifdef HAVE_PTHREADS
+    pthread_mutex_lock(&unzip_lock);
+    unzip_ahead--;
+    pthread_cond_broadcast(&unzip_cond);
+    pthread_mutex_unlock(&unzip_lock);
+#endif
+}
@@ -0,0 +1,313 @@
+/*
+ * Copyright (C) 2012 The Android Open Source Project
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* A stand-in fastboot device, linked in place of the real USB code so
+ * that fastboot can be tested without hardware. It answers the protocol
+ * itself and flashes each partition into <partition>.img in the current
+ * directory, expanding sparse images the way a bootloader would.
+ *
+ *   FASTBOOT_LOOPBACK_MAX   max-download-size to report, default 256M
+ *   FASTBOOT_LOOPBACK_RATE  limit downloads to this many MB/s, like a
+ *                           real USB link
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+#include "usb.h"
+
+typedef uint16_t __le16;
+typedef uint32_t __le32;
+#include <sparse_format.h>
+
+struct usb_handle
+{
+    char reply[65];         /* what the next read returns, if anything */
+    unsigned max;
+
+    char *buf;              /* the current download */
+    unsigned size;
+    unsigned got;
+    int downloading;
+
+    double rate;            /* bytes per second, 0 for unlimited */
+    double busy;            /* when the link is done with what it has */
+};
+
+static double now(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, 0);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static void reply(usb_handle *h, const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(h->reply, sizeof(h->reply), fmt, ap);
+    va_end(ap);
+}
+
+static int write_at(int fd, const void *data, size_t len, off64_t off)
+{
+    const char *ptr = data;
+
+    while(len > 0) {
+        ssize_t r = pwrite64(fd, ptr, len, off);
+        if(r < 0 && errno == EINTR) continue;
+        if(r <= 0) return -1;
+        ptr += r;
+        off += r;
+        len -= r;
+    }
+    return 0;
+}
+
+/* Writes out the blocks a sparse image has data for */
+static const char *flash_sparse(int fd, const char *data, unsigned len)
+{
+    const sparse_header_t *header = (const void*) data;
+    const char *end = data + len;
+    off64_t off = 0;
+    unsigned n;
+
+    if(len < sizeof(*header) || header->file_hdr_sz < sizeof(*header) ||
+       header->chunk_hdr_sz < sizeof(chunk_header_t)) {
+        return "bad sparse header";
+    }
+    data += header->file_hdr_sz;
+
+    for(n = 0; n < header->total_chunks; n++) {
+        const chunk_header_t *chunk = (const void*) data;
+        off64_t bytes;
+
+        if(end - data < header->chunk_hdr_sz ||
+           end - data < chunk->total_sz) {
+            return "sparse image is truncated";
+        }
+        bytes = (off64_t) chunk->chunk_sz * header->blk_sz;
+        data += header->chunk_hdr_sz;
+
+        switch(chunk->chunk_type) {
+        case CHUNK_TYPE_RAW:
+            if(chunk->total_sz != header->chunk_hdr_sz + bytes) {
+                return "bad raw chunk";
+            }
+            if(write_at(fd, data, bytes, off)) return "write failed";
+            break;
+        case CHUNK_TYPE_FILL: {
+            uint32_t fill[1024];
+            off64_t done;
+            unsigned i;
+
+            if(chunk->total_sz != header->chunk_hdr_sz + 4) {
+                return "bad fill chunk";
+            }
+            for(i = 0; i < 1024; i++) memcpy(&fill[i], data, 4);
+            for(done = 0; done < bytes; done += sizeof(fill)) {
+                size_t n = bytes - done < (off64_t) sizeof(fill) ? bytes - done : sizeof(fill);
+                if(write_at(fd, fill, n, off + done)) return "write failed";
+            }
+            break;
+        }
+        case CHUNK_TYPE_DONT_CARE:
+        case CHUNK_TYPE_CRC32:
+            break;
+        default:
+            return "unknown chunk type";
+        }
+        if(chunk->chunk_type != CHUNK_TYPE_CRC32) off += bytes;
+        data = (const char*) chunk + chunk->total_sz;
+    }
+
+    if(off != (off64_t) header->total_blks * header->blk_sz) {
+        return "sparse image has the wrong size";
+    }
+    if(lseek64(fd, 0, SEEK_END) < off && ftruncate64(fd, off)) {
+        return "write failed";
+    }
+    return 0;
+}
+
+static void flash(usb_handle *h, const char *ptn)
+{
+    char fn[128];
+    const char *err = 0;
+    int sparse;
+    int fd;
+
+    sparse = h->got >= 4 && *(uint32_t*) h->buf == SPARSE_HEADER_MAGIC;
+    snprintf(fn, sizeof(fn), "%s.img", ptn);
+    fd = open(fn, O_WRONLY | O_CREAT | (sparse ? 0 : O_TRUNC), 0644);
+    if(fd < 0) {
+        reply(h, "FAILcannot open %s", fn);
+        return;
+    }
+
+    if(sparse) {
+        err = flash_sparse(fd, h->buf, h->got);
+    } else if(write_at(fd, h->buf, h->got, 0)) {
+        err = "write failed";
+    }
+    close(fd);
+
+    if(err) {
+        reply(h, "FAIL%s", err);
+    } else {
+        reply(h, "OKAY");
+    }
+}
+
+static void command(usb_handle *h, const char *cmd)
+{
+    if(!strcmp(cmd, "getvar:max-download-size")) {
+        reply(h, "OKAY0x%08x", h->max);
+    } else if(!strcmp(cmd, "getvar:product")) {
+        reply(h, "OKAYloopback");
+    } else if(!strncmp(cmd, "getvar:", 7)) {
+        reply(h, "OKAY");
+    } else if(!strncmp(cmd, "download:", 9)) {
+        unsigned size = strtoul(cmd + 9, 0, 16);
+        if(size > h->max) {
+            reply(h, "FAILdata too large");
+            return;
+        }
+        free(h->buf);
+        h->buf = malloc(size ? size : 1);
+        if(h->buf == 0) {
+            reply(h, "FAILout of memory");
+            return;
+        }
+        h->size = size;
+        h->got = 0;
+        h->downloading = size > 0;
+        reply(h, "DATA%08x", size);
+    } else if(!strncmp(cmd, "flash:", 6)) {
+        flash(h, cmd + 6);
+    } else if(!strncmp(cmd, "erase:", 6)) {
+        char fn[128];
+        snprintf(fn, sizeof(fn), "%s.img", cmd + 6);
+        unlink(fn);
+        reply(h, "OKAY");
+    } else if(!strcmp(cmd, "reboot") || !strcmp(cmd, "reboot-bootloader") ||
+              !strcmp(cmd, "continue") || !strcmp(cmd, "signature") ||
+              !strcmp(cmd, "boot")) {
+        reply(h, "OKAY");
+    } else {
+        reply(h, "FAILunknown command");
+    }
+}
+
+usb_handle *usb_open(ifc_match_func callback)
+{
+    usb_ifc_info info;
+    usb_handle *h;
+    const char *x;
+
+    memset(&info, 0, sizeof(info));
+    info.dev_vendor = 0x18d1;
+    info.ifc_class = 0xff;
+    info.ifc_subclass = 0x42;
+    info.ifc_protocol = 0x03;
+    info.has_bulk_in = 1;
+    info.has_bulk_out = 1;
+    info.writable = 1;
+    strcpy(info.serial_number, "loopback");
+    if(callback(&info) != 0) return 0;
+
+    h = calloc(1, sizeof(usb_handle));
+    if(h == 0) return 0;
+    h->max = 256 * 1024 * 1024;
+    if((x = getenv("FASTBOOT_LOOPBACK_MAX")) != 0) h->max = strtoul(x, 0, 0);
+    if((x = getenv("FASTBOOT_LOOPBACK_RATE")) != 0) h->rate = atof(x) * 1024 * 1024;
+    return h;
+}
+
+int usb_close(usb_handle *h)
+{
+    return 0;
+}
+
+int usb_read(usb_handle *h, void *_data, int len)
+{
+    int n = strlen(h->reply);
+
+    if(n == 0) {
+        errno = EIO;
+        return -1;
+    }
+    if(n > len) n = len;
+    memcpy(_data, h->reply, n);
+    h->reply[0] = 0;
+    return n;
+}
+
+int usb_write(usb_handle *h, const void *_data, int len)
+{
+    char cmd[65];
+
+    if(!h->downloading) {
+        if(len > 64) {
+            errno = EIO;
+            return -1;
+        }
+        memcpy(cmd, _data, len);
+        cmd[len] = 0;
+        command(h, cmd);
+        return len;
+    }
+
+    if(len > (int)(h->size - h->got)) {
+        errno = EIO;
+        return -1;
+    }
+    memcpy(h->buf + h->got, _data, len);
+    h->got += len;
+
+        /* time the link spends idle can't be made up later */
+    if(h->rate > 0) {
+        double t = now();
+        if(h->busy < t) h->busy = t;
+        h->busy += len / h->rate;
+        if(h->busy > t) usleep((h->busy - t) * 1000000);
+    }
+
+    if(h->got == h->size) {
+        h->downloading = 0;
+        reply(h, "OKAY");
+    }
+    return len;
+}
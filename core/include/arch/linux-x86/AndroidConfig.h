@@ -145,6 +145,11 @@
  */
 #define HAVE_EPOLL
 
+/*
+ * Define this if we have linux style splice()
+ */
+#define HAVE_SPLICE
+
 /*
  * Endianness of the target machine.  Choose one:
  *
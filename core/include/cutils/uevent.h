@@ -26,6 +26,8 @@ extern "C" {
 
 int uevent_open_socket(int buf_sz, bool passcred);
 ssize_t uevent_kernel_multicast_recv(int socket, void *buffer, size_t length);
+int uevent_kernel_multicast_recv_batch(int socket, void *buffer, size_t slot_size,
+                                       int nslots, ssize_t *lengths);
 
 #ifdef __cplusplus
 }
@@ -24,6 +24,8 @@ class SocketClient;
 class FrameworkListener : public SocketListener {
 public:
     static const int CMD_ARGS_MAX = 16;
+    /* Largest single command we will buffer while waiting for its NUL */
+    static const int CMD_BUF_MAX = 64 * 1024;
 private:
     FrameworkCommandCollection *mCommands;
 
@@ -26,6 +26,8 @@ class NetlinkEvent {
     int  mAction;
     char *mSubsystem;
     char *mParams[NL_PARAMS_MAX];
+    /* True when the strings above point into the decoded buffer */
+    bool mBorrowed;
 
 public:
     const static int NlActionUnknown;
@@ -38,6 +40,7 @@ public:
     NetlinkEvent();
     virtual ~NetlinkEvent();
 
+    /* ASCII events reference |buffer|, which must outlive the event */
     bool decode(char *buffer, int size, int format = NetlinkListener::NETLINK_FORMAT_ASCII);
     const char *findParam(const char *paramName);
 
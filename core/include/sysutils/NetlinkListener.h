@@ -24,6 +24,10 @@ class NetlinkListener : public SocketListener {
     char mBuffer[64 * 1024];
     int mFormat;
 
+    /* ASCII uevents are received in batches of fixed-size slots of mBuffer */
+    static const int UEVENT_SLOTS = 16;
+    static const int UEVENT_SLOT_SIZE = (64 * 1024) / UEVENT_SLOTS;
+
 public:
     static const int NETLINK_FORMAT_ASCII = 0;
     static const int NETLINK_FORMAT_BINARY = 1;
@@ -43,6 +47,9 @@ public:
 protected:
     virtual bool onDataAvailable(SocketClient *cli);
     virtual void onEvent(NetlinkEvent *evt) = 0;
+
+private:
+    void dispatchEvent(char *buffer, ssize_t count);
 };
 
 #endif
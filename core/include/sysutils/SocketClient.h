@@ -24,6 +24,11 @@ class SocketClient {
     pthread_mutex_t mRefCountMutex;
     int mRefCount;
 
+    /* Bytes received but not yet consumed by the listener */
+    char   *mRecvBuf;
+    size_t  mRecvLen;
+    size_t  mRecvSize;
+
 public:
     SocketClient(int sock, bool owned);
     virtual ~SocketClient();
@@ -40,6 +45,15 @@ public:
     // Sending binary data:
     int sendData(const void *data, int len);
 
+    // Receive buffering for stream-framed listeners.  recvMore() reads
+    // whatever is available into the tail of the buffer, growing it up
+    // to maxSize; recvConsume() discards bytes from the head once they
+    // have been dispatched.
+    ssize_t recvMore(size_t maxSize);
+    char *getRecvBuffer() { return mRecvBuf; }
+    size_t getRecvLength() const { return mRecvLen; }
+    void recvConsume(size_t len);
+
     // Optional reference counting.  Reference count starts at 1.  If
     // it's decremented to 0, it deletes itself.
     // SocketListener creates a SocketClient (at refcount 1) and calls
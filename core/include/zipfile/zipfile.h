@@ -25,6 +25,7 @@ extern "C" {
 
 typedef void* zipfile_t;
 typedef void* zipentry_t;
+typedef void* zipstream_t;
 
 // Provide a buffer.  Returns NULL on failure.
 zipfile_t init_zipfile(const void* data, size_t size);
@@ -47,6 +48,17 @@ char* get_zipentry_name(zipentry_t entry);
 // by get_zipentry_size.  Returns nonzero on failure.
 int decompress_zipentry(zipentry_t entry, void* buf, int bufsize);
 
+// Start decompressing an entry a piece at a time, for entries too big
+// to want all at once.  Returns NULL on failure.
+zipstream_t open_zipstream(zipentry_t entry);
+
+// Decompress up to len more bytes of the entry into buf.  Returns how
+// many, which is less than len only at the end, or -1 on failure.
+int read_zipstream(zipstream_t stream, void* buf, int len);
+
+// Release the stream's resources.
+void close_zipstream(zipstream_t stream);
+
 // iterate through the entries in the zip file.  pass a pointer to
 // a void* initialized to NULL to start.  Returns NULL when done
 zipentry_t iterate_zipfile(zipfile_t file, void** cookie);
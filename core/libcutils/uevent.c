@@ -21,11 +21,39 @@
 #include <string.h>
 #include <strings.h>
 #include <sys/socket.h>
+#include <sys/syscall.h>
 #include <sys/un.h>
 #include <unistd.h>
 
 #include <linux/netlink.h>
 
+/**
+ * Returns true if a received netlink message was multicast by the kernel
+ * with root credentials attached.
+ */
+static bool uevent_from_kernel(struct msghdr *hdr) {
+    struct sockaddr_nl *addr = (struct sockaddr_nl *) hdr->msg_name;
+
+    if (addr->nl_groups == 0 || addr->nl_pid != 0) {
+        /* ignoring non-kernel or unicast netlink message */
+        return false;
+    }
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(hdr);
+    if (cmsg == NULL || cmsg->cmsg_type != SCM_CREDENTIALS) {
+        /* ignoring netlink message with no sender credentials */
+        return false;
+    }
+
+    struct ucred *cred = (struct ucred *)CMSG_DATA(cmsg);
+    if (cred->uid != 0) {
+        /* ignoring netlink message from non-root user */
+        return false;
+    }
+
+    return true;
+}
+
 /**
  * Like recv(), but checks that messages actually originate from the kernel.
  */
@@ -48,20 +76,7 @@ ssize_t uevent_kernel_multicast_recv(int socket, void *buffer, size_t length) {
         return n;
     }
 
-    if (addr.nl_groups == 0 || addr.nl_pid != 0) {
-        /* ignoring non-kernel or unicast netlink message */
-        goto out;
-    }
-
-    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&hdr);
-    if (cmsg == NULL || cmsg->cmsg_type != SCM_CREDENTIALS) {
-        /* ignoring netlink message with no sender credentials */
-        goto out;
-    }
-
-    struct ucred *cred = (struct ucred *)CMSG_DATA(cmsg);
-    if (cred->uid != 0) {
-        /* ignoring netlink message from non-root user */
+    if (!uevent_from_kernel(&hdr)) {
         goto out;
     }
 
@@ -74,6 +89,73 @@ out:
     return -1;
 }
 
+#define UEVENT_BATCH_MAX 32
+
+/* Layout-compatible with the kernel's struct mmsghdr */
+struct uevent_mmsghdr {
+    struct msghdr msg_hdr;
+    unsigned int  msg_len;
+};
+
+/**
+ * Receives up to 'nslots' queued uevents with a single recvmmsg() call.
+ * Message i is stored at buffer + i * slot_size and its length in
+ * lengths[i]; messages that did not come from the kernel are cleared and
+ * reported with a length of -1.  Does not block once at least one
+ * message is available.  Returns the number of slots filled, 0 if
+ * nothing was queued, or -1 on error.  Falls back to a single recvmsg()
+ * on kernels without recvmmsg().
+ */
+int uevent_kernel_multicast_recv_batch(int socket, void *buffer, size_t slot_size,
+                                       int nslots, ssize_t *lengths) {
+#ifdef __NR_recvmmsg
+    struct uevent_mmsghdr msgs[UEVENT_BATCH_MAX];
+    struct iovec iovs[UEVENT_BATCH_MAX];
+    struct sockaddr_nl addrs[UEVENT_BATCH_MAX];
+    char controls[UEVENT_BATCH_MAX][CMSG_SPACE(sizeof(struct ucred))];
+    int i, n;
+
+    if (nslots > UEVENT_BATCH_MAX)
+        nslots = UEVENT_BATCH_MAX;
+
+    memset(msgs, 0, sizeof(msgs[0]) * nslots);
+    for (i = 0; i < nslots; i++) {
+        iovs[i].iov_base = (char *) buffer + i * slot_size;
+        iovs[i].iov_len = slot_size;
+        msgs[i].msg_hdr.msg_name = &addrs[i];
+        msgs[i].msg_hdr.msg_namelen = sizeof(addrs[i]);
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+        msgs[i].msg_hdr.msg_control = controls[i];
+        msgs[i].msg_hdr.msg_controllen = sizeof(controls[i]);
+    }
+
+    n = syscall(__NR_recvmmsg, socket, msgs, nslots, MSG_DONTWAIT, NULL);
+    if (n < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return 0;
+        if (errno != ENOSYS)
+            return -1;
+    } else {
+        for (i = 0; i < n; i++) {
+            if (uevent_from_kernel(&msgs[i].msg_hdr)) {
+                lengths[i] = msgs[i].msg_len;
+            } else {
+                /* clear residual potentially malicious data */
+                bzero(iovs[i].iov_base, slot_size);
+                lengths[i] = -1;
+            }
+        }
+        return n;
+    }
+#endif
+
+    lengths[0] = uevent_kernel_multicast_recv(socket, buffer, slot_size);
+    if (lengths[0] < 0 && errno != EIO)
+        return -1;
+    return lengths[0] == 0 ? 0 : 1;
+}
+
 int uevent_open_socket(int buf_sz, bool passcred)
 {
     struct sockaddr_nl addr;
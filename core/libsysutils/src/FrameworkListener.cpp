@@ -31,26 +31,36 @@ FrameworkListener::FrameworkListener(const char *socketName) :
 }
 
 bool FrameworkListener::onDataAvailable(SocketClient *c) {
-    char buffer[255];
-    int len;
+    ssize_t len;
 
-    len = TEMP_FAILURE_RETRY(read(c->getSocket(), buffer, sizeof(buffer)));
+    len = c->recvMore(CMD_BUF_MAX);
     if (len < 0) {
-        SLOGE("read() failed (%s)", strerror(errno));
+        if (errno == EMSGSIZE)
+            c->sendMsg(500, "Command too long", false);
+        else
+            SLOGE("read() failed (%s)", strerror(errno));
         return false;
     } else if (!len)
         return false;
 
-    int offset = 0;
-    int i;
-
-    for (i = 0; i < len; i++) {
-        if (buffer[i] == '\0') {
-            /* IMPORTANT: dispatchCommand() expects a zero-terminated string */
-            dispatchCommand(c, buffer + offset);
-            offset = i + 1;
-        }
+    /*
+     * The buffer may hold any number of complete commands followed by
+     * the start of one that has not fully arrived yet.  Dispatch the
+     * complete ones and keep the remainder for the next read.
+     */
+    char *buffer = c->getRecvBuffer();
+    size_t avail = c->getRecvLength();
+    size_t offset = 0;
+
+    while (offset < avail) {
+        char *end = (char *) memchr(buffer + offset, '\0', avail - offset);
+        if (!end)
+            break;
+        /* IMPORTANT: dispatchCommand() expects a zero-terminated string */
+        dispatchCommand(c, buffer + offset);
+        offset = end - buffer + 1;
     }
+    c->recvConsume(offset);
     return true;
 }
 
@@ -58,25 +68,26 @@ void FrameworkListener::registerCmd(FrameworkCommand *cmd) {
     mCommands->push_back(cmd);
 }
 
+/*
+ * Splits |data| into arguments in place.  Unescaping only ever shrinks
+ * the string, so each argument is written back over the bytes it was
+ * parsed from and argv[] points straight into the receive buffer.
+ */
 void FrameworkListener::dispatchCommand(SocketClient *cli, char *data) {
     FrameworkCommandCollection::iterator i;
     int argc = 0;
     char *argv[FrameworkListener::CMD_ARGS_MAX];
-    char tmp[255];
     char *p = data;
-    char *q = tmp;
-    char *qlimit = tmp + sizeof(tmp) - 1;
+    char *q = data;
+    char *arg = data;
     bool esc = false;
     bool quote = false;
     int k;
 
     memset(argv, 0, sizeof(argv));
-    memset(tmp, 0, sizeof(tmp));
     while(*p) {
         if (*p == '\\') {
             if (esc) {
-                if (q >= qlimit)
-                    goto overflow;
                 *q++ = '\\';
                 esc = false;
             } else
@@ -85,16 +96,12 @@ void FrameworkListener::dispatchCommand(SocketClient *cli, char *data) {
             continue;
         } else if (esc) {
             if (*p == '"') {
-                if (q >= qlimit)
-                    goto overflow;
                 *q++ = '"';
             } else if (*p == '\\') {
-                if (q >= qlimit)
-                    goto overflow;
                 *q++ = '\\';
             } else {
                 cli->sendMsg(500, "Unsupported escape sequence", false);
-                goto out;
+                return;
             }
             p++;
             esc = false;
@@ -110,25 +117,22 @@ void FrameworkListener::dispatchCommand(SocketClient *cli, char *data) {
             continue;
         }
 
-        if (q >= qlimit)
-            goto overflow;
-        *q = *p++;
-        if (!quote && *q == ' ') {
-            *q = '\0';
+        if (!quote && *p == ' ') {
+            *q++ = '\0';
+            p++;
             if (argc >= CMD_ARGS_MAX)
                 goto overflow;
-            argv[argc++] = strdup(tmp);
-            memset(tmp, 0, sizeof(tmp));
-            q = tmp;
+            argv[argc++] = arg;
+            arg = q;
             continue;
         }
-        q++;
+        *q++ = *p++;
     }
 
     *q = '\0';
     if (argc >= CMD_ARGS_MAX)
         goto overflow;
-    argv[argc++] = strdup(tmp);
+    argv[argc++] = arg;
 #if 0
     for (k = 0; k < argc; k++) {
         SLOGD("arg[%d] = '%s'", k, argv[k]);
@@ -137,7 +141,7 @@ void FrameworkListener::dispatchCommand(SocketClient *cli, char *data) {
 
     if (quote) {
         cli->sendMsg(500, "Unclosed quotes error", false);
-        goto out;
+        return;
     }
 
     for (i = mCommands->begin(); i != mCommands->end(); ++i) {
@@ -147,18 +151,13 @@ void FrameworkListener::dispatchCommand(SocketClient *cli, char *data) {
             if (c->runCommand(cli, argc, argv)) {
                 SLOGW("Handler '%s' error (%s)", c->getCommand(), strerror(errno));
             }
-            goto out;
+            return;
         }
     }
 
     cli->sendMsg(500, "Command not recognized", false);
-out:
-    int j;
-    for (j = 0; j < argc; j++)
-        free(argv[j]);
     return;
 
 overflow:
     cli->sendMsg(500, "Command too long", false);
-    goto out;
 }
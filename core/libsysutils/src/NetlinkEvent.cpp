@@ -44,10 +44,13 @@ NetlinkEvent::NetlinkEvent() {
     memset(mParams, 0, sizeof(mParams));
     mPath = NULL;
     mSubsystem = NULL;
+    mBorrowed = false;
 }
 
 NetlinkEvent::~NetlinkEvent() {
     int i;
+    if (mBorrowed)
+        return;
     if (mPath)
         free(mPath);
     if (mSubsystem)
@@ -158,7 +161,8 @@ has_prefix(const char* str, const char* end, const char* prefix, size_t prefixle
 
 /*
  * Parse an ASCII-formatted message from a NETLINK_KOBJECT_UEVENT
- * netlink socket.
+ * netlink socket.  The message is a series of NUL-terminated strings,
+ * so path, subsystem and params simply point into |buffer|.
  */
 bool NetlinkEvent::parseAsciiNetlinkMessage(char *buffer, int size) {
     const char *s = buffer;
@@ -172,6 +176,7 @@ bool NetlinkEvent::parseAsciiNetlinkMessage(char *buffer, int size) {
 
     /* Ensure the buffer is zero-terminated, the code below depends on this */
     buffer[size-1] = '\0';
+    mBorrowed = true;
 
     end = s + size;
     while (s < end) {
@@ -183,7 +188,7 @@ bool NetlinkEvent::parseAsciiNetlinkMessage(char *buffer, int size) {
                     return false;
                 }
             }
-            mPath = strdup(p+1);
+            mPath = (char *) p+1;
             first = 0;
         } else {
             const char* a;
@@ -197,9 +202,9 @@ bool NetlinkEvent::parseAsciiNetlinkMessage(char *buffer, int size) {
             } else if ((a = HAS_CONST_PREFIX(s, end, "SEQNUM=")) != NULL) {
                 mSeq = atoi(a);
             } else if ((a = HAS_CONST_PREFIX(s, end, "SUBSYSTEM=")) != NULL) {
-                mSubsystem = strdup(a);
+                mSubsystem = (char *) a;
             } else if (param_idx < NL_PARAMS_MAX) {
-                mParams[param_idx++] = strdup(s);
+                mParams[param_idx++] = (char *) s;
             }
         }
         s += strlen(s) + 1;
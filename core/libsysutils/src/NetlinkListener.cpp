@@ -46,19 +46,42 @@ bool NetlinkListener::onDataAvailable(SocketClient *cli)
     int socket = cli->getSocket();
     ssize_t count;
 
-    count = TEMP_FAILURE_RETRY(uevent_kernel_multicast_recv(socket, mBuffer, sizeof(mBuffer)));
-    if (count < 0) {
-        SLOGE("recvmsg failed (%s)", strerror(errno));
+    if (mFormat == NETLINK_FORMAT_BINARY) {
+        /* A single read may already carry several rtnetlink messages */
+        count = TEMP_FAILURE_RETRY(uevent_kernel_multicast_recv(socket, mBuffer, sizeof(mBuffer)));
+        if (count < 0) {
+            SLOGE("recvmsg failed (%s)", strerror(errno));
+            return false;
+        }
+        dispatchEvent(mBuffer, count);
+        return true;
+    }
+
+    /*
+     * Drain everything the kernel has queued in one go; during hotplug
+     * storms this saves a select() + recvmsg() round per uevent.
+     */
+    ssize_t lengths[UEVENT_SLOTS];
+    int n = TEMP_FAILURE_RETRY(uevent_kernel_multicast_recv_batch(socket, mBuffer,
+            UEVENT_SLOT_SIZE, UEVENT_SLOTS, lengths));
+    if (n < 0) {
+        SLOGE("recvmmsg failed (%s)", strerror(errno));
         return false;
     }
 
-    NetlinkEvent *evt = new NetlinkEvent();
-    if (!evt->decode(mBuffer, count, mFormat)) {
+    for (int i = 0; i < n; i++) {
+        if (lengths[i] > 0)
+            dispatchEvent(mBuffer + i * UEVENT_SLOT_SIZE, lengths[i]);
+    }
+    return true;
+}
+
+void NetlinkListener::dispatchEvent(char *buffer, ssize_t count) {
+    NetlinkEvent evt;
+
+    if (!evt.decode(buffer, count, mFormat)) {
         SLOGE("Error decoding NetlinkEvent");
     } else {
-        onEvent(evt);
+        onEvent(&evt);
     }
-
-    delete evt;
-    return true;
 }
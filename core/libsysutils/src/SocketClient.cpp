@@ -3,7 +3,9 @@
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <pthread.h>
+#include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #define LOG_TAG "SocketClient"
 #include <cutils/log.h>
@@ -17,6 +19,9 @@ SocketClient::SocketClient(int socket, bool owned)
         , mUid(-1)
         , mGid(-1)
         , mRefCount(1)
+        , mRecvBuf(NULL)
+        , mRecvLen(0)
+        , mRecvSize(0)
 {
     pthread_mutex_init(&mWriteMutex, NULL);
     pthread_mutex_init(&mRefCountMutex, NULL);
@@ -38,6 +43,7 @@ SocketClient::~SocketClient()
     if (mSocketOwned) {
         close(mSocket);
     }
+    free(mRecvBuf);
 }
 
 int SocketClient::sendMsg(int code, const char *msg, bool addErrno) {
@@ -111,6 +117,40 @@ int SocketClient::sendData(const void* data, int len) {
     return 0;
 }
 
+ssize_t SocketClient::recvMore(size_t maxSize) {
+    if (mRecvLen == mRecvSize) {
+        size_t newSize = mRecvSize ? mRecvSize * 2 : 1024;
+        if (newSize > maxSize)
+            newSize = maxSize;
+        if (newSize <= mRecvLen) {
+            errno = EMSGSIZE;
+            return -1;
+        }
+        char *buf = (char *) realloc(mRecvBuf, newSize);
+        if (!buf) {
+            errno = ENOMEM;
+            return -1;
+        }
+        mRecvBuf = buf;
+        mRecvSize = newSize;
+    }
+
+    ssize_t rc = TEMP_FAILURE_RETRY(read(mSocket, mRecvBuf + mRecvLen,
+                                         mRecvSize - mRecvLen));
+    if (rc > 0)
+        mRecvLen += rc;
+    return rc;
+}
+
+void SocketClient::recvConsume(size_t len) {
+    if (len >= mRecvLen) {
+        mRecvLen = 0;
+        return;
+    }
+    memmove(mRecvBuf, mRecvBuf + len, mRecvLen - len);
+    mRecvLen -= len;
+}
+
 void SocketClient::incRef() {
     pthread_mutex_lock(&mRefCountMutex);
     mRefCount++;
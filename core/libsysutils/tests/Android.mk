@@ -0,0 +1,10 @@
+# Build the uevent replay benchmark.
+LOCAL_PATH := $(call my-dir)
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := uevent_replay.cpp
+LOCAL_MODULE := uevent_replay
+LOCAL_MODULE_TAGS := tests
+LOCAL_SHARED_LIBRARIES := libsysutils libcutils
+
+include $(BUILD_EXECUTABLE)
@@ -0,0 +1,270 @@
+/*
+ * Copyright (C) 2012 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Replays a recorded uevent stream through NetlinkListener and reports
+ * how quickly it keeps up.
+ *
+ *   uevent_replay -r <file> [seconds]   record the uevents the kernel sends
+ *   uevent_replay <file> [rounds]       replay a recording
+ *
+ * A recording holds the raw messages, each preceded by its length as a
+ * host-order 32-bit integer.  Replay runs two passes:
+ *
+ *   decode  every recorded message is decoded into a NetlinkEvent, rounds
+ *           times over, which times the parser on its own.
+ *   kernel  every recorded device is made to send a "change" uevent again
+ *           through /sys<DEVPATH>/uevent, rounds times over and as fast as
+ *           the kernel takes them, while a NetlinkListener with vold's
+ *           64KB receive buffer counts what it gets.  Events it was too
+ *           slow for are dropped by the kernel and reported as lost.
+ *
+ * The kernel pass needs root.  Devices that have gone away since the
+ * recording are skipped.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <stdint.h>
+
+#include <cutils/uevent.h>
+#include <sysutils/NetlinkEvent.h>
+#include <sysutils/NetlinkListener.h>
+
+#define MSG_MAX (8 * 1024)
+
+struct Message {
+    char *data;
+    int len;
+};
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+class CountingListener : public NetlinkListener {
+public:
+    volatile int mEvents;
+    volatile int mWakeups;
+
+    CountingListener(int socket) :
+            NetlinkListener(socket, NETLINK_FORMAT_ASCII), mEvents(0), mWakeups(0) {
+    }
+
+protected:
+    virtual bool onDataAvailable(SocketClient *cli) {
+        mWakeups++;
+        return NetlinkListener::onDataAvailable(cli);
+    }
+
+    virtual void onEvent(NetlinkEvent *evt) {
+        if (evt->getAction() == NetlinkEvent::NlActionChange)
+            mEvents++;
+    }
+};
+
+static int record(const char *fn, int seconds) {
+    char buf[MSG_MAX];
+    FILE *out;
+    int sock, count = 0;
+    double end;
+
+    sock = uevent_open_socket(256 * 1024, true);
+    if (sock < 0) {
+        fprintf(stderr, "cannot open uevent socket: %s\n", strerror(errno));
+        return 1;
+    }
+    out = fopen(fn, "w");
+    if (!out) {
+        fprintf(stderr, "cannot create %s: %s\n", fn, strerror(errno));
+        return 1;
+    }
+
+    end = now() + seconds;
+    while (now() < end) {
+        fd_set fds;
+        struct timeval tv = { 0, 100000 };
+
+        FD_ZERO(&fds);
+        FD_SET(sock, &fds);
+        if (select(sock + 1, &fds, NULL, NULL, &tv) <= 0)
+            continue;
+
+        ssize_t n = uevent_kernel_multicast_recv(sock, buf, sizeof(buf));
+        if (n <= 0)
+            continue;
+        uint32_t len = n;
+        fwrite(&len, sizeof(len), 1, out);
+        fwrite(buf, 1, n, out);
+        count++;
+    }
+    fclose(out);
+    printf("recorded %d uevents\n", count);
+    return 0;
+}
+
+static int load(const char *fn, Message **msgs) {
+    FILE *in = fopen(fn, "r");
+    int count = 0, size = 0;
+    uint32_t len;
+
+    if (!in) {
+        fprintf(stderr, "cannot open %s: %s\n", fn, strerror(errno));
+        return -1;
+    }
+    *msgs = NULL;
+    while (fread(&len, sizeof(len), 1, in) == 1 && len > 0 && len <= MSG_MAX) {
+        if (count == size) {
+            size = size ? size * 2 : 256;
+            *msgs = (Message *) realloc(*msgs, size * sizeof(Message));
+        }
+        (*msgs)[count].data = (char *) malloc(len);
+        (*msgs)[count].len = len;
+        if (fread((*msgs)[count].data, 1, len, in) != len)
+            break;
+        count++;
+    }
+    fclose(in);
+    return count;
+}
+
+static void decodePass(Message *msgs, int count, int rounds) {
+    char buf[MSG_MAX];
+    double start = now();
+    int bad = 0;
+
+    for (int r = 0; r < rounds; r++) {
+        for (int i = 0; i < count; i++) {
+            NetlinkEvent evt;
+
+            /* decode() writes into the buffer, as into a fresh receive */
+            memcpy(buf, msgs[i].data, msgs[i].len);
+            if (!evt.decode(buf, msgs[i].len))
+                bad++;
+        }
+    }
+
+    double secs = now() - start;
+    printf("decode: %d uevents in %.3f s: %.0f uevents/s, %d undecodable\n",
+           count * rounds, secs, count * rounds / secs, bad);
+}
+
+/* Opens /sys<DEVPATH>/uevent for every recorded device */
+static int openDevices(Message *msgs, int count, int *fds) {
+    int n = 0;
+
+    for (int i = 0; i < count; i++) {
+        const char *at = (const char *) memchr(msgs[i].data, '@', msgs[i].len);
+        char path[512];
+
+        if (!at || strnlen(at, msgs[i].data + msgs[i].len - at) >= 256)
+            continue;
+        snprintf(path, sizeof(path), "/sys%s/uevent", at + 1);
+        int fd = open(path, O_WRONLY);
+        if (fd >= 0)
+            fds[n++] = fd;
+    }
+    return n;
+}
+
+static int kernelPass(Message *msgs, int count, int rounds) {
+    int *fds = (int *) malloc(count * sizeof(int));
+    int ndevs = openDevices(msgs, count, fds);
+    int sent = 0;
+
+    if (ndevs == 0) {
+        printf("kernel: skipped, none of the recorded devices can be poked\n");
+        return 0;
+    }
+
+    int sock = uevent_open_socket(64 * 1024, true);
+    if (sock < 0) {
+        fprintf(stderr, "cannot open uevent socket: %s\n", strerror(errno));
+        return 1;
+    }
+    CountingListener *nl = new CountingListener(sock);
+    if (nl->startListener()) {
+        fprintf(stderr, "cannot start listener: %s\n", strerror(errno));
+        return 1;
+    }
+
+    double start = now();
+    for (int r = 0; r < rounds; r++) {
+        for (int i = 0; i < ndevs; i++) {
+            if (write(fds[i], "change", 6) == 6)
+                sent++;
+        }
+    }
+
+    /* wait for the listener to drain; once nothing has come in for a
+     * while, the rest were lost */
+    double last = now(), end = last;
+    int seen = -1;
+    while (nl->mEvents < sent && now() - last < 2) {
+        if (nl->mEvents != seen) {
+            seen = nl->mEvents;
+            last = end = now();
+        }
+        usleep(10000);
+    }
+    if (nl->mEvents == sent)
+        end = now();
+    double secs = end - start;
+    int got = nl->mEvents, wakeups = nl->mWakeups;
+
+    nl->stopListener();
+    close(sock);
+    for (int i = 0; i < ndevs; i++)
+        close(fds[i]);
+    free(fds);
+
+    printf("kernel: %d uevents from %d devices, %d received in %d wakeups "
+           "(%.1f per wakeup), %d lost, %.0f uevents/s\n",
+           sent, ndevs, got, wakeups, wakeups ? (double) got / wakeups : 0.0,
+           sent - got, got / secs);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    Message *msgs;
+    int count, rounds;
+
+    if (argc > 2 && !strcmp(argv[1], "-r"))
+        return record(argv[2], argc > 3 ? atoi(argv[3]) : 10);
+
+    if (argc < 2) {
+        fprintf(stderr, "usage: uevent_replay -r <file> [seconds]\n"
+                        "       uevent_replay <file> [rounds]\n");
+        return 1;
+    }
+
+    count = load(argv[1], &msgs);
+    if (count <= 0) {
+        fprintf(stderr, "no uevents in %s\n", argv[1]);
+        return 1;
+    }
+    rounds = argc > 2 ? atoi(argv[2]) : 100;
+
+    decodePass(msgs, count, rounds);
+    return kernelPass(msgs, count, rounds);
+}
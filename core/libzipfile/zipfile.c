@@ -128,6 +128,91 @@ decompress_zipentry(zipentry_t e, void* buf, int bufsize)
     }
 }
 
+typedef struct Zipstream {
+    Zipentry* entry;
+    unsigned int done;          // bytes of the entry returned so far
+    z_stream zstream;
+} Zipstream;
+
+zipstream_t
+open_zipstream(zipentry_t e)
+{
+    Zipentry* entry = (Zipentry*)e;
+    Zipstream* stream;
+
+    if (entry->compressionMethod != STORED && entry->compressionMethod != DEFLATED) {
+        return NULL;
+    }
+
+    stream = malloc(sizeof(Zipstream));
+    if (stream == NULL) return NULL;
+    memset(stream, 0, sizeof(Zipstream));
+    stream->entry = entry;
+
+    if (entry->compressionMethod == DEFLATED) {
+        stream->zstream.next_in = (void*)entry->data;
+        stream->zstream.avail_in = entry->compressedSize;
+        stream->zstream.data_type = Z_UNKNOWN;
+
+        // no zlib header, as in uninflate()
+        if (inflateInit2(&stream->zstream, -MAX_WBITS) != Z_OK) {
+            free(stream);
+            return NULL;
+        }
+    }
+    return stream;
+}
+
+int
+read_zipstream(zipstream_t s, void* buf, int len)
+{
+    Zipstream* stream = (Zipstream*)s;
+    Zipentry* entry = stream->entry;
+    unsigned int left = entry->uncompressedSize - stream->done;
+    int zerr;
+
+    if ((unsigned int)len > left) {
+        len = left;
+    }
+    if (len <= 0) {
+        return 0;
+    }
+
+    if (entry->compressionMethod == STORED) {
+        memcpy(buf, entry->data + stream->done, len);
+        stream->done += len;
+        return len;
+    }
+
+    stream->zstream.next_out = buf;
+    stream->zstream.avail_out = len;
+    while (stream->zstream.avail_out > 0) {
+        zerr = inflate(&stream->zstream, Z_NO_FLUSH);
+        if (zerr == Z_STREAM_END) {
+            break;
+        }
+        if (zerr != Z_OK) {
+            fprintf(stderr, "zerr=%d total_out=%lu\n", zerr, stream->zstream.total_out);
+            return -1;
+        }
+    }
+
+    len -= stream->zstream.avail_out;
+    stream->done += len;
+    return len;
+}
+
+void
+close_zipstream(zipstream_t s)
+{
+    Zipstream* stream = (Zipstream*)s;
+
+    if (stream->entry->compressionMethod == DEFLATED) {
+        inflateEnd(&stream->zstream);
+    }
+    free(stream);
+}
+
 void
 dump_zipfile(FILE* to, zipfile_t file)
 {
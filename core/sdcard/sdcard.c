@@ -20,12 +20,15 @@
 #include <unistd.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <sys/mount.h>
 #include <sys/stat.h>
 #include <sys/statfs.h>
+#include <sys/syscall.h>
 #include <sys/uio.h>
 #include <dirent.h>
 #include <ctype.h>
+#include <time.h>
 
 #include <private/android_filesystem_config.h>
 
@@ -56,6 +59,17 @@
  * kernel, you must rollback the refcount to reflect the reference the
  * kernel did not actually acquire
  *
+ * Threading:
+ *
+ * Several handler threads read requests from /dev/fuse; the kernel hands
+ * each request to exactly one of them.  The node tree (links, names,
+ * refcounts) and the id/generation counters are protected by fuse->lock.
+ * Paths are built under the lock into the handler's own buffer and the
+ * actual filesystem calls are made without it, so a slow read on one
+ * file does not hold up a lookup on another.  File and directory handles
+ * belong to a single open file; the kernel does not release one while a
+ * request on it is still outstanding, so they need no locking.
+ *
  */
 
 #define FUSE_TRACE 0
@@ -72,6 +86,31 @@
 
 #define MOUNT_POINT "/mnt/sdcard"
 
+#define DEFAULT_NUM_THREADS 2
+#define MAX_NUM_THREADS 32
+
+/* Seconds the kernel may cache lookups and attributes, unless -e/-a say otherwise */
+#define DEFAULT_ENTRY_VALID 10
+#define DEFAULT_ATTR_VALID 10
+
+/* Largest FUSE_READ we answer; also passed to the kernel as max_read */
+#define MAX_READ (128 * 1024)
+
+/* Largest FUSE_WRITE payload we accept.  Kernels cap this further
+ * (32 pages on most), but never above what we offer at FUSE_INIT.
+ */
+#define MAX_WRITE (256 * 1024)
+
+/* Room for the request header and fuse_write_in in front of the data */
+#define MAX_REQUEST_SIZE (MAX_WRITE + 4096)
+
+#ifndef F_SETPIPE_SZ
+#define F_SETPIPE_SZ 1031
+#endif
+#ifndef SPLICE_F_MOVE
+#define SPLICE_F_MOVE 1
+#endif
+
 struct handle {
     struct node *node;
     int fd;
@@ -80,21 +119,59 @@ struct handle {
 struct dirhandle {
     struct node *node;
     DIR *d;
+    __u64 offset;               /* offset of the next entry to send */
+    struct dirent *next;        /* read from d but not sent yet, or NULL */
+};
+
+/* On-disk name of one directory entry, in a name_index */
+struct name_entry {
+    struct name_entry *next;
+    __u32 hash;
+    char name[];
+};
+
+/*
+ * Every on-disk name in a directory, hashed by case-folded name, so
+ * that resolving a name that differs only by case takes no readdir.
+ * Built from one readdir, kept up to date by the daemon's own creates,
+ * renames and deletes, and rebuilt after NAME_INDEX_TTL to pick up
+ * changes made behind our back.
+ */
+struct name_index {
+    struct name_entry **buckets;
+    __u32 size;                 /* number of buckets, a power of 2 */
+    __u32 count;
+    time_t built;
 };
 
 struct node {
     __u64 nid;
     __u64 gen;
 
-    struct node *next;          /* per-dir sibling list */
-    struct node *child;         /* first contained file by this dir */
-    struct node *all;           /* global node list */
+    struct node *next;          /* next in parent's hash bucket */
+    struct node *nid_next;      /* next in fuse's nid hash bucket */
     struct node *parent;        /* containing directory */
 
+    /* Contained files, hashed by case-folded name (see name_hash) */
+    struct node **children;
+    __u32 children_size;        /* number of buckets; 0 or a power of 2 */
+    __u32 child_count;
+
+    /* Lazily built index of the on-disk names in this directory */
+    struct name_index *name_index;
+    __u32 name_index_gen;       /* bumped whenever the daemon changes the directory */
+
+    __u32 name_hash;
     __u32 refcount;
     __u32 namelen;
 
     char *name;
+    /* Absolute path on disk, built on demand by node_path_locked() and
+     * dropped by forget_paths() when the node or an ancestor is renamed.
+     */
+    char *path;
+    __u32 pathlen;
+
     /* If non-null, this is the real name of the file in the underlying storage.
      * This may differ from the field "name" only by case.
      * strlen(actual_name) will always equal strlen(name), so it is safe to use
@@ -104,17 +181,43 @@ struct node {
 };
 
 struct fuse {
+    pthread_mutex_t lock;
+
     __u64 next_generation;
     __u64 next_node_id;
 
     int fd;
 
-    struct node *all;
+    __u64 entry_valid;
+    __u64 attr_valid;
+
+    /* Every node but the root, hashed by nid */
+    struct node **nodes;
+    __u32 nodes_size;           /* number of buckets; 0 or a power of 2 */
+    __u32 node_count;
 
     struct node root;
     char rootpath[1024];
 };
 
+/* Per-thread state; each handler reads and answers its own requests */
+struct fuse_handler {
+    struct fuse *fuse;
+    int token;
+
+    /*
+     * READ replies are spliced: file data goes into data_pipe, is moved
+     * behind the reply header in reply_pipe, and the whole reply is
+     * spliced to /dev/fuse, without passing through read_buffer.  Both
+     * are -1 when the kernel can't do this.
+     */
+    int data_pipe[2];
+    int reply_pipe[2];
+
+    unsigned char request_buffer[MAX_REQUEST_SIZE];
+    unsigned char read_buffer[MAX_READ];
+};
+
 static unsigned uid = -1;
 static unsigned gid = -1;
 
@@ -123,73 +226,120 @@ static unsigned gid = -1;
 #define NO_CASE_SENSITIVE_MATCH 0
 #define CASE_SENSITIVE_MATCH 1
 
+/* Hash tables start this big, double when full and shrink when 1/8 full */
+#define MIN_HASH_SIZE 8
+
+/* Seconds before a directory's name index is rebuilt from disk */
+#define NAME_INDEX_TTL 30
+
 /*
- * Get the real-life absolute path to a node.
+ * Returns the absolute path to a node, building and caching it (and the
+ * paths of its ancestors) if needed.  A child's path is only ever cached
+ * while its parent's is.  Returns 0 if the path is too long or we are out
+ * of memory.  Caller must hold fuse->lock.
+ */
+static const char *node_path_locked(struct node *node)
+{
+    const char *name = node->actual_name ? node->actual_name : node->name;
+    const char *parent_path = "";
+    __u32 parent_len = 0;
+    int slash = 0;
+
+    if (node->path)
+        return node->path;
+
+    /* the root's name is the absolute path of the backing directory */
+    if (node->parent) {
+        parent_path = node_path_locked(node->parent);
+        if (!parent_path)
+            return 0;
+        parent_len = node->parent->pathlen;
+        /* avoid double slash at beginning of path */
+        slash = (parent_len == 0 || parent_path[parent_len - 1] != '/');
+    }
+    if (parent_len + slash + node->namelen >= PATH_BUFFER_SIZE)
+        return 0;
+
+    node->path = malloc(parent_len + slash + node->namelen + 1);
+    if (!node->path)
+        return 0;
+    memcpy(node->path, parent_path, parent_len);
+    if (slash)
+        node->path[parent_len] = '/';
+    memcpy(node->path + parent_len + slash, name, node->namelen + 1);
+    node->pathlen = parent_len + slash + node->namelen;
+    return node->path;
+}
+
+/* Drops the cached paths of a node and everything below it.  Caller must hold fuse->lock. */
+static void forget_paths(struct node *node)
+{
+    struct node *child;
+    __u32 i;
+
+    if (!node->path)
+        return;
+    free(node->path);
+    node->path = 0;
+    for (i = 0; i < node->children_size; i++)
+        for (child = node->children[i]; child; child = child->next)
+            forget_paths(child);
+}
+
+/*
+ * Get the real-life absolute path to a node.  Caller must hold fuse->lock.
  *   node: start at this node
  *   buf: storage for returned string
  *   name: append this string to path if set
  */
-char *do_node_get_path(struct node *node, char *buf, const char *name, int match_case_insensitive)
+static char *node_get_path_locked(struct node *node, char *buf, const char *name)
 {
-    struct node *in_node = node;
-    const char *in_name = name;
-    char *out = buf + PATH_BUFFER_SIZE - 1;
-    int len;
-    out[0] = 0;
+    const char *path = node_path_locked(node);
+    __u32 len, namelen;
+    int slash;
 
-    if (name) {
-        len = strlen(name);
-        goto start;
+    if (!path)
+        return 0;
+    len = node->pathlen;
+    if (!name) {
+        memcpy(buf, path, len + 1);
+        return buf;
     }
 
-    while (node) {
-        name = (node->actual_name ? node->actual_name : node->name);
-        len = node->namelen;
-        node = node->parent;
-    start:
-        if ((len + 1) > (out - buf))
-            return 0;
-        out -= len;
-        memcpy(out, name, len);
-        /* avoid double slash at beginning of path */
-        if (out[0] != '/') {
-            out --;
-            out[0] = '/';
-        }
-    }
+    namelen = strlen(name);
+    slash = (len == 0 || path[len - 1] != '/');
+    if (len + slash + namelen >= PATH_BUFFER_SIZE)
+        return 0;
+    memcpy(buf, path, len);
+    if (slash)
+        buf[len] = '/';
+    memcpy(buf + len + slash, name, namelen + 1);
+    return buf;
+}
+
+static void fixup_path_case(struct fuse *fuse, struct node *dir, char *path);
+
+char *do_node_get_path(struct fuse *fuse, struct node *node, char *buf, const char *name,
+                       int match_case_insensitive)
+{
+    char *out;
+
+    pthread_mutex_lock(&fuse->lock);
+    out = node_get_path_locked(node, buf, name);
+    pthread_mutex_unlock(&fuse->lock);
 
     /* If we are searching for a file within node (rather than computing node's path)
      * and fail, then we need to look for a case insensitive match.
      */
-    if (in_name && match_case_insensitive && access(out, F_OK) != 0) {
-        char *path, buffer[PATH_BUFFER_SIZE];
-        DIR* dir;
-        struct dirent* entry;
-        path = do_node_get_path(in_node, buffer, NULL, NO_CASE_SENSITIVE_MATCH);
-        dir = opendir(path);
-        if (!dir) {
-            ERROR("opendir %s failed: %s", path, strerror(errno));
-            return out;
-        }
-
-        while ((entry = readdir(dir))) {
-            if (!strcasecmp(entry->d_name, in_name)) {
-                /* we have a match - replace the name */
-                len = strlen(in_name);
-                memcpy(buf + PATH_BUFFER_SIZE - len - 1, entry->d_name, len);
-                break;
-            }
-        }
-        closedir(dir);
-    }
-
-   return out;
+    if (out && name && match_case_insensitive)
+        fixup_path_case(fuse, node, out);
+    return out;
 }
 
-char *node_get_path(struct node *node, char *buf, const char *name)
+char *node_get_path(struct fuse *fuse, struct node *node, char *buf, const char *name)
 {
     /* We look for case insensitive matches by default */
-    return do_node_get_path(node, buf, name, CASE_SENSITIVE_MATCH);
+    return do_node_get_path(fuse, node, buf, name, CASE_SENSITIVE_MATCH);
 }
 
 void attr_from_stat(struct fuse_attr *attr, struct stat *s)
@@ -221,13 +371,15 @@ void attr_from_stat(struct fuse_attr *attr, struct stat *s)
     attr->gid = AID_SDCARD_RW;
 }
 
-int node_get_attr(struct node *node, struct fuse_attr *attr)
+int node_get_attr(struct fuse *fuse, struct node *node, struct fuse_attr *attr)
 {
     int res;
     struct stat s;
     char *path, buffer[PATH_BUFFER_SIZE];
 
-    path = node_get_path(node, buffer, 0);
+    path = node_get_path(fuse, node, buffer, 0);
+    if (!path)
+        return -1;
     res = lstat(path, &s);
     if (res < 0) {
         ERROR("lstat('%s') errno %d\n", path, errno);
@@ -240,49 +392,353 @@ int node_get_attr(struct node *node, struct fuse_attr *attr)
     return 0;
 }
 
+/* Case-folded FNV-1a, so names that differ only by case share a bucket */
+static __u32 name_hash(const char *name)
+{
+    __u32 hash = 2166136261u;
+
+    while (*name) {
+        hash ^= (unsigned char) tolower((unsigned char) *name++);
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static void resize_children(struct node *dir, __u32 size)
+{
+    struct node **children = calloc(size, sizeof(*children));
+    __u32 i;
+
+    if (!children) {
+        if (dir->children)
+            return;     /* keep the old table, with longer chains */
+        ERROR("calloc failed - out of memory\n");
+        exit(1);
+    }
+    for (i = 0; i < dir->children_size; i++) {
+        struct node *node = dir->children[i];
+        while (node) {
+            struct node *next = node->next;
+            struct node **bucket = &children[node->name_hash & (size - 1)];
+            node->next = *bucket;
+            *bucket = node;
+            node = next;
+        }
+    }
+    free(dir->children);
+    dir->children = children;
+    dir->children_size = size;
+}
+
+/* Caller must hold fuse->lock. */
 static void add_node_to_parent(struct node *node, struct node *parent) {
+    struct node **bucket;
+
+    if (parent->child_count >= parent->children_size)
+        resize_children(parent, parent->children_size ?
+                        parent->children_size * 2 : MIN_HASH_SIZE);
+    bucket = &parent->children[node->name_hash & (parent->children_size - 1)];
     node->parent = parent;
-    node->next = parent->child;
-    parent->child = node;
+    node->next = *bucket;
+    *bucket = node;
+    parent->child_count++;
     parent->refcount++;
 }
 
-/* Check to see if our parent directory already has a file with a name
- * that differs only by case.  If we find one, store it in the actual_name
- * field so node_get_path will map it to this file in the underlying storage.
+/* Unlinks node from its parent's table; the caller drops the parent's ref. */
+static void remove_node_from_parent(struct node *node)
+{
+    struct node *parent = node->parent;
+    struct node **link = &parent->children[node->name_hash & (parent->children_size - 1)];
+
+    while (*link != node)
+        link = &(*link)->next;
+    *link = node->next;
+    node->next = 0;
+    node->parent = 0;
+    parent->child_count--;
+    if (parent->children_size > MIN_HASH_SIZE &&
+            parent->child_count < parent->children_size / 8)
+        resize_children(parent, parent->children_size / 4);
+}
+
+static inline __u32 nid_hash(__u64 nid)
+{
+    return (__u32) (nid ^ (nid >> 32));
+}
+
+static void resize_node_table(struct fuse *fuse, __u32 size)
+{
+    struct node **nodes = calloc(size, sizeof(*nodes));
+    __u32 i;
+
+    if (!nodes) {
+        if (fuse->nodes)
+            return;     /* keep the old table, with longer chains */
+        ERROR("calloc failed - out of memory\n");
+        exit(1);
+    }
+    for (i = 0; i < fuse->nodes_size; i++) {
+        struct node *node = fuse->nodes[i];
+        while (node) {
+            struct node *next = node->nid_next;
+            struct node **bucket = &nodes[nid_hash(node->nid) & (size - 1)];
+            node->nid_next = *bucket;
+            *bucket = node;
+            node = next;
+        }
+    }
+    free(fuse->nodes);
+    fuse->nodes = nodes;
+    fuse->nodes_size = size;
+}
+
+/* Caller must hold fuse->lock. */
+static void add_node_to_table(struct fuse *fuse, struct node *node)
+{
+    struct node **bucket;
+
+    if (fuse->node_count >= fuse->nodes_size)
+        resize_node_table(fuse, fuse->nodes_size ? fuse->nodes_size * 2 : MIN_HASH_SIZE);
+    bucket = &fuse->nodes[nid_hash(node->nid) & (fuse->nodes_size - 1)];
+    node->nid_next = *bucket;
+    *bucket = node;
+    fuse->node_count++;
+}
+
+/* Caller must hold fuse->lock. */
+static void remove_node_from_table(struct fuse *fuse, struct node *node)
+{
+    struct node **link = &fuse->nodes[nid_hash(node->nid) & (fuse->nodes_size - 1)];
+
+    while (*link != node)
+        link = &(*link)->nid_next;
+    *link = node->nid_next;
+    node->nid_next = 0;
+    fuse->node_count--;
+    if (fuse->nodes_size > MIN_HASH_SIZE && fuse->node_count < fuse->nodes_size / 8)
+        resize_node_table(fuse, fuse->nodes_size / 4);
+}
+
+static time_t now_sec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+
+static void free_name_index(struct name_index *index)
+{
+    __u32 i;
+
+    if (!index)
+        return;
+    for (i = 0; i < index->size; i++) {
+        struct name_entry *entry = index->buckets[i];
+        while (entry) {
+            struct name_entry *next = entry->next;
+            free(entry);
+            entry = next;
+        }
+    }
+    free(index->buckets);
+    free(index);
+}
+
+static void resize_name_index(struct name_index *index, __u32 size)
+{
+    struct name_entry **buckets = calloc(size, sizeof(*buckets));
+    __u32 i;
+
+    if (!buckets)
+        return;     /* keep the old table, with longer chains */
+    for (i = 0; i < index->size; i++) {
+        struct name_entry *entry = index->buckets[i];
+        while (entry) {
+            struct name_entry *next = entry->next;
+            struct name_entry **bucket = &buckets[entry->hash & (size - 1)];
+            entry->next = *bucket;
+            *bucket = entry;
+            entry = next;
+        }
+    }
+    free(index->buckets);
+    index->buckets = buckets;
+    index->size = size;
+}
+
+static int name_index_add(struct name_index *index, const char *name)
+{
+    int len = strlen(name);
+    __u32 hash = name_hash(name);
+    struct name_entry *entry;
+    struct name_entry **bucket;
+
+    for (entry = index->buckets[hash & (index->size - 1)]; entry; entry = entry->next) {
+        if (!strcmp(entry->name, name))
+            return 0;
+    }
+    entry = malloc(sizeof(*entry) + len + 1);
+    if (!entry)
+        return -1;
+    entry->hash = hash;
+    memcpy(entry->name, name, len + 1);
+    if (index->count >= index->size)
+        resize_name_index(index, index->size * 2);
+    bucket = &index->buckets[entry->hash & (index->size - 1)];
+    entry->next = *bucket;
+    *bucket = entry;
+    index->count++;
+    return 0;
+}
+
+static void name_index_remove(struct name_index *index, const char *name)
+{
+    struct name_entry **link = &index->buckets[name_hash(name) & (index->size - 1)];
+
+    for (; *link; link = &(*link)->next) {
+        if (!strcmp((*link)->name, name)) {
+            struct name_entry *entry = *link;
+            *link = entry->next;
+            free(entry);
+            index->count--;
+            return;
+        }
+    }
+}
+
+/*
+ * Finds an on-disk name that differs from name only by case and copies
+ * it over out, which may be name itself.  Returns 1 if there is one.
  */
-static void node_find_actual_name(struct node *node)
+static int name_index_find_other_case(struct name_index *index, const char *name, char *out)
 {
-    char *path, buffer[PATH_BUFFER_SIZE];
-    const char *node_name = node->name;
+    struct name_entry *entry;
+
+    for (entry = index->buckets[name_hash(name) & (index->size - 1)]; entry;
+            entry = entry->next) {
+        if (!strcasecmp(entry->name, name) && strcmp(entry->name, name)) {
+            memcpy(out, entry->name, strlen(name));
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Reads the whole directory.  This does I/O, so call it without fuse->lock held. */
+static struct name_index *build_name_index(const char *path)
+{
+    struct name_index *index;
     DIR* dir;
     struct dirent* entry;
 
-    if (!node->parent) return;
-
-    path = node_get_path(node->parent, buffer, 0);
     dir = opendir(path);
     if (!dir) {
         ERROR("opendir %s failed: %s", path, strerror(errno));
-        return;
+        return 0;
+    }
+    index = calloc(1, sizeof(*index));
+    if (index) {
+        index->size = MIN_HASH_SIZE;
+        index->buckets = calloc(index->size, sizeof(*index->buckets));
+        index->built = now_sec();
+    }
+    if (!index || !index->buckets) {
+        ERROR("calloc failed - out of memory\n");
+        exit(1);
     }
-
     while ((entry = readdir(dir))) {
-        const char *test_name = entry->d_name;
-        if (strcmp(test_name, node_name) && !strcasecmp(test_name, node_name)) {
-            /* we have a match - differs but only by case */
-            node->actual_name = strdup(test_name);
-            if (!node->actual_name) {
-                ERROR("strdup failed - out of memory\n");
-                exit(1);
-            }
-            break;
+        if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, ".."))
+            continue;
+        if (name_index_add(index, entry->d_name)) {
+            ERROR("malloc failed - out of memory\n");
+            exit(1);
         }
     }
     closedir(dir);
+    return index;
+}
+
+/*
+ * Records that the daemon added (added != 0) or removed name in dir.
+ * Caller must hold fuse->lock.
+ */
+static void node_name_changed(struct node *dir, const char *name, int added)
+{
+    dir->name_index_gen++;
+    if (!dir->name_index)
+        return;
+    if (!added) {
+        name_index_remove(dir->name_index, name);
+    } else if (name_index_add(dir->name_index, name)) {
+        /* can't keep it complete; rebuild on next use */
+        free_name_index(dir->name_index);
+        dir->name_index = 0;
+    }
+}
+
+/*
+ * Check to see if the directory dir, found at dir_path, has a file with
+ * a name that differs from name only by case.  If so, copy it over out
+ * (which may be name itself) and return 1.  Builds the directory's name
+ * index if it has none yet; call without fuse->lock held.
+ */
+static int find_other_case(struct fuse *fuse, struct node *dir, const char *dir_path,
+                           const char *name, char *out)
+{
+    struct name_index *index = 0;
+    __u32 gen;
+    int found = 0;
+
+    pthread_mutex_lock(&fuse->lock);
+    if (dir->name_index && now_sec() - dir->name_index->built >= NAME_INDEX_TTL) {
+        free_name_index(dir->name_index);
+        dir->name_index = 0;
+    }
+    if (!dir->name_index) {
+        gen = dir->name_index_gen;
+        pthread_mutex_unlock(&fuse->lock);
+        index = build_name_index(dir_path);
+        pthread_mutex_lock(&fuse->lock);
+        /* Only keep it if nothing changed while we were reading, and no
+         * other thread got there first.
+         */
+        if (index && !dir->name_index && dir->name_index_gen == gen) {
+            dir->name_index = index;
+            index = 0;
+        }
+    }
+    if (index)
+        found = name_index_find_other_case(index, name, out);
+    else if (dir->name_index)
+        found = name_index_find_other_case(dir->name_index, name, out);
+    pthread_mutex_unlock(&fuse->lock);
+
+    free_name_index(index);
+    return found;
+}
+
+/*
+ * If path, a file in directory dir, does not exist, look for an entry
+ * whose name differs from the last component only by case, and use that
+ * instead.  This does I/O, so call it without fuse->lock held.
+ */
+static void fixup_path_case(struct fuse *fuse, struct node *dir, char *path)
+{
+    char *slash = strrchr(path, '/');
+
+    if (!slash || access(path, F_OK) == 0)
+        return;
+
+    *slash = 0;
+    find_other_case(fuse, dir, slash == path ? "/" : path, slash + 1, slash + 1);
+    *slash = '/';
 }
 
-struct node *node_create(struct node *parent, const char *name, __u64 nid, __u64 gen)
+/* Takes ownership of actual_name.  Caller must hold fuse->lock. */
+struct node *node_create(struct node *parent, const char *name, __u64 nid, __u64 gen,
+                         char *actual_name)
 {
     struct node *node;
     int namelen = strlen(name);
@@ -299,37 +755,58 @@ struct node *node_create(struct node *parent, const char *name, __u64 nid, __u64
 
     node->nid = nid;
     node->gen = gen;
-    add_node_to_parent(node, parent);
     memcpy(node->name, name, namelen + 1);
     node->namelen = namelen;
-    node_find_actual_name(node);
+    node->name_hash = name_hash(name);
+    node->actual_name = actual_name;
+    add_node_to_parent(node, parent);
     return node;
 }
 
-static char *rename_node(struct node *node, const char *name)
+/*
+ * Takes ownership of actual_name.  Caller must hold fuse->lock, and must
+ * take the node out of its parent's table first, as the name hash changes.
+ */
+static char *rename_node(struct node *node, const char *name, char *actual_name)
 {
-    node->namelen = strlen(name);
-    char *newname = realloc(node->name, node->namelen + 1);
-    if (newname == 0)
+    int namelen = strlen(name);
+    char *newname;
+
+    /* the node may be moving too, so drop the paths even if this fails */
+    forget_paths(node);
+    newname = realloc(node->name, namelen + 1);
+    if (newname == 0) {
+        free(actual_name);
         return 0;
+    }
     node->name = newname;
-    memcpy(node->name, name, node->namelen + 1);
-    node_find_actual_name(node);
+    node->namelen = namelen;
+    memcpy(node->name, name, namelen + 1);
+    node->name_hash = name_hash(name);
+    free(node->actual_name);
+    node->actual_name = actual_name;
     return node->name;
 }
 
 void fuse_init(struct fuse *fuse, int fd, const char *path)
 {
+    pthread_mutex_init(&fuse->lock, NULL);
+
     fuse->fd = fd;
     fuse->next_node_id = 2;
     fuse->next_generation = 0;
 
-    fuse->all = &fuse->root;
+    fuse->nodes = 0;
+    fuse->nodes_size = 0;
+    fuse->node_count = 0;
+
+    fuse->entry_valid = DEFAULT_ENTRY_VALID;
+    fuse->attr_valid = DEFAULT_ATTR_VALID;
 
     memset(&fuse->root, 0, sizeof(fuse->root));
     fuse->root.nid = FUSE_ROOT_ID; /* 1 */
     fuse->root.refcount = 2;
-    rename_node(&fuse->root, path);
+    rename_node(&fuse->root, path, 0);
 }
 
 static inline void *id_to_ptr(__u64 nid)
@@ -343,30 +820,34 @@ static inline __u64 ptr_to_id(void *ptr)
 }
 
 
+/* Returns 0 for ids we never handed out.  Caller must hold fuse->lock. */
 struct node *lookup_by_inode(struct fuse *fuse, __u64 nid)
 {
-    if (nid == FUSE_ROOT_ID) {
-        return &fuse->root;
-    } else {
-        return id_to_ptr(nid);
-    }
-}
+    struct node *node;
 
-struct node *lookup_child_by_name(struct node *node, const char *name)
-{
-    for (node = node->child; node; node = node->next) {
-        if (!strcmp(name, node->name)) {
+    if (nid == FUSE_ROOT_ID)
+        return &fuse->root;
+    if (!fuse->nodes_size)
+        return 0;
+    for (node = fuse->nodes[nid_hash(nid) & (fuse->nodes_size - 1)]; node;
+            node = node->nid_next) {
+        if (node->nid == nid)
             return node;
-        }
     }
     return 0;
 }
 
-struct node *lookup_child_by_inode(struct node *node, __u64 nid)
+/* Caller must hold fuse->lock. */
+struct node *lookup_child_by_name(struct node *node, const char *name)
 {
-    for (node = node->child; node; node = node->next) {
-        if (node->nid == nid) {
-            return node;
+    struct node *child;
+
+    if (!node->children_size)
+        return 0;
+    for (child = node->children[name_hash(name) & (node->children_size - 1)]; child;
+            child = child->next) {
+        if (!strcmp(name, child->name)) {
+            return child;
         }
     }
     return 0;
@@ -381,86 +862,37 @@ static void dec_refcount(struct node *node) {
     }
  }
 
-static struct node *remove_child(struct node *parent, __u64 nid)
+/* Returns child if it was still in parent.  Caller must hold fuse->lock. */
+static struct node *remove_child(struct node *parent, struct node *child)
 {
-    struct node *prev = 0;
-    struct node *node;
-
-    for (node = parent->child; node; node = node->next) {
-        if (node->nid == nid) {
-            if (prev) {
-                prev->next = node->next;
-            } else {
-                parent->child = node->next;
-            }
-            node->next = 0;
-            node->parent = 0;
-            dec_refcount(parent);
-            return node;
-        }
-        prev = node;
-    }
-    return 0;
-}
-
-struct node *node_lookup(struct fuse *fuse, struct node *parent, const char *name,
-                         struct fuse_attr *attr)
-{
-    int res;
-    struct stat s;
-    char *path, buffer[PATH_BUFFER_SIZE];
-    struct node *node;
-
-    path = node_get_path(parent, buffer, name);
-        /* XXX error? */
-
-    res = lstat(path, &s);
-    if (res < 0)
+    if (child->parent != parent)
         return 0;
-    
-    node = lookup_child_by_name(parent, name);
-    if (!node) {
-        node = node_create(parent, name, fuse->next_node_id++, fuse->next_generation++);
-        if (!node)
-            return 0;
-        node->nid = ptr_to_id(node);
-        node->all = fuse->all;
-        fuse->all = node;
-    }
-
-    attr_from_stat(attr, &s);
-    attr->ino = node->nid;
-
-    return node;
+    remove_node_from_parent(child);
+    dec_refcount(parent);
+    return child;
 }
 
-void node_release(struct node *node)
+/* Caller must hold fuse->lock. */
+void node_release(struct fuse *fuse, struct node *node)
 {
     TRACE("RELEASE %p (%s) rc=%d\n", node, node->name, node->refcount);
     dec_refcount(node);
     if (node->refcount == 0) {
-        if (node->parent->child == node) {
-            node->parent->child = node->parent->child->next;
-        } else {
-            struct node *node2;
-
-            node2 = node->parent->child;
-            while (node2->next != node)
-                node2 = node2->next;
-            node2->next = node->next;            
-        }
+        struct node *parent = node->parent;
 
         TRACE("DESTROY %p (%s)\n", node, node->name);
 
-        node_release(node->parent);
-
-        node->parent = 0;
-        node->next = 0;
+        remove_node_from_parent(node);
+        remove_node_from_table(fuse, node);
+        node_release(fuse, parent);
 
             /* TODO: remove debugging - poison memory */
         memset(node->name, 0xef, node->namelen);
         free(node->name);
         free(node->actual_name);
+        free(node->path);
+        free(node->children);
+        free_name_index(node->name_index);
         memset(node, 0xfc, sizeof(*node));
         free(node);
     }
@@ -499,30 +931,163 @@ void fuse_reply(struct fuse *fuse, __u64 unique, void *data, int len)
     }
 }
 
-void lookup_entry(struct fuse *fuse, struct node *node,
+void lookup_entry(struct fuse *fuse, struct node *parent,
                   const char *name, __u64 unique)
 {
     struct fuse_entry_out out;
-    
+    char *path, buffer[PATH_BUFFER_SIZE];
+    const char *disk_name;
+    char *actual_name = 0;
+    struct node *node;
+    struct stat s;
+
     memset(&out, 0, sizeof(out));
 
-    node = node_lookup(fuse, node, name, &out.attr);
-    if (!node) {
+    pthread_mutex_lock(&fuse->lock);
+    path = node_get_path_locked(parent, buffer, name);
+    pthread_mutex_unlock(&fuse->lock);
+
+    if (!path) {
         fuse_status(fuse, unique, -ENOENT);
         return;
     }
-    
+    fixup_path_case(fuse, parent, path);
+    if (lstat(path, &s) < 0) {
+        fuse_status(fuse, unique, -ENOENT);
+        return;
+    }
+
+    /* If the file exists only under a name differing by case, a new node
+     * for it maps to that name in the underlying storage.
+     */
+    disk_name = strrchr(path, '/') + 1;
+    if (strcmp(disk_name, name)) {
+        actual_name = strdup(disk_name);
+        if (!actual_name) {
+            ERROR("strdup failed - out of memory\n");
+            exit(1);
+        }
+    }
+
+    pthread_mutex_lock(&fuse->lock);
+    /* another thread may have created the node while we were unlocked */
+    node = lookup_child_by_name(parent, name);
+    if (!node) {
+        node = node_create(parent, name, fuse->next_node_id++, fuse->next_generation++,
+                           actual_name);
+        if (!node) {
+            pthread_mutex_unlock(&fuse->lock);
+            free(actual_name);
+            fuse_status(fuse, unique, -ENOENT);
+            return;
+        }
+        actual_name = 0;
+        add_node_to_table(fuse, node);
+    }
     node->refcount++;
 //    fprintf(stderr,"ACQUIRE %p (%s) rc=%d\n", node, node->name, node->refcount);
     out.nodeid = node->nid;
     out.generation = node->gen;
-    out.entry_valid = 10;
-    out.attr_valid = 10;
+    pthread_mutex_unlock(&fuse->lock);
+    free(actual_name);
+
+    attr_from_stat(&out.attr, &s);
+    out.attr.ino = out.nodeid;
+    out.entry_valid = fuse->entry_valid;
+    out.attr_valid = fuse->attr_valid;
     
     fuse_reply(fuse, unique, &out, sizeof(out));
 }
 
-void handle_fuse_request(struct fuse *fuse, struct fuse_in_header *hdr, void *data, unsigned len)
+static inline ssize_t sys_splice(int fd_in, loff_t *off_in, int fd_out, loff_t *off_out,
+                                 size_t len, unsigned int flags)
+{
+    return syscall(__NR_splice, fd_in, off_in, fd_out, off_out, len, flags);
+}
+
+static void close_pipe(int fds[2])
+{
+    if (fds[0] >= 0) {
+        close(fds[0]);
+        close(fds[1]);
+    }
+    fds[0] = fds[1] = -1;
+}
+
+/*
+ * Pipes big enough for a whole READ reply (the kernel rounds the size up
+ * to a power of two pages), with non-blocking read ends.
+ */
+static int open_pipe(int fds[2])
+{
+    if (pipe(fds) < 0) {
+        fds[0] = fds[1] = -1;
+        return -1;
+    }
+    if (fcntl(fds[1], F_SETPIPE_SZ, MAX_READ * 2) < 0 ||
+            fcntl(fds[0], F_SETFL, O_NONBLOCK) < 0) {
+        close_pipe(fds);
+        return -1;
+    }
+    return 0;
+}
+
+static void drain_pipe(struct fuse_handler *handler, int fd)
+{
+    while (read(fd, handler->read_buffer, sizeof(handler->read_buffer)) > 0)
+        ;
+}
+
+static void handler_init_splice(struct fuse_handler *handler)
+{
+    if (open_pipe(handler->data_pipe) < 0 || open_pipe(handler->reply_pipe) < 0) {
+        TRACE("[%d] splice unavailable (%d), copying read data\n", handler->token, errno);
+        close_pipe(handler->data_pipe);
+        close_pipe(handler->reply_pipe);
+    }
+}
+
+/*
+ * Answers a READ by splicing the file data to /dev/fuse.  Returns -1,
+ * with nothing sent, if the data could not be spliced; the caller then
+ * falls back to pread().
+ */
+static int reply_read_spliced(struct fuse *fuse, struct fuse_handler *handler, __u64 unique,
+                              int fd, __u32 size, __u64 offset)
+{
+    struct fuse_out_header hdr;
+    loff_t off = offset;
+    ssize_t n;
+
+    if (handler->data_pipe[0] < 0)
+        return -1;
+
+    n = sys_splice(fd, &off, handler->data_pipe[1], NULL, size, SPLICE_F_MOVE);
+    if (n < 0)
+        return -1;
+
+    hdr.len = sizeof(hdr) + n;
+    hdr.error = 0;
+    hdr.unique = unique;
+    if (write(handler->reply_pipe[1], &hdr, sizeof(hdr)) != sizeof(hdr) ||
+            (n && sys_splice(handler->data_pipe[0], NULL, handler->reply_pipe[1], NULL,
+                             n, SPLICE_F_MOVE) != n)) {
+        drain_pipe(handler, handler->data_pipe[0]);
+        drain_pipe(handler, handler->reply_pipe[0]);
+        return -1;
+    }
+
+    if (sys_splice(handler->reply_pipe[0], NULL, fuse->fd, NULL, hdr.len, SPLICE_F_MOVE)
+            != (ssize_t) hdr.len) {
+        /* the data is gone from the pipe either way, like a failed writev */
+        ERROR("*** REPLY FAILED *** %d\n", errno);
+        drain_pipe(handler, handler->reply_pipe[0]);
+    }
+    return 0;
+}
+
+void handle_fuse_request(struct fuse *fuse, struct fuse_handler *handler,
+                         struct fuse_in_header *hdr, void *data, unsigned len)
 {
     struct node *node;
 
@@ -534,7 +1099,9 @@ void handle_fuse_request(struct fuse *fuse, struct fuse_in_header *hdr, void *da
     len -= hdr->len;
 
     if (hdr->nodeid) {
+        pthread_mutex_lock(&fuse->lock);
         node = lookup_by_inode(fuse, hdr->nodeid);
+        pthread_mutex_unlock(&fuse->lock);
         if (!node) {
             fuse_status(fuse, hdr->unique, -ENOENT);
             return;
@@ -551,10 +1118,12 @@ void handle_fuse_request(struct fuse *fuse, struct fuse_in_header *hdr, void *da
     }
     case FUSE_FORGET: {
         struct fuse_forget_in *req = data;
+        pthread_mutex_lock(&fuse->lock);
         TRACE("FORGET %llx (%s) #%lld\n", hdr->nodeid, node->name, req->nlookup);
             /* no reply */
         while (req->nlookup--)
-            node_release(node);
+            node_release(fuse, node);
+        pthread_mutex_unlock(&fuse->lock);
         return;
     }
     case FUSE_GETATTR: { /* getattr_in -> attr_out */
@@ -564,8 +1133,8 @@ void handle_fuse_request(struct fuse *fuse, struct fuse_in_header *hdr, void *da
         TRACE("GETATTR flags=%x fh=%llx\n", req->getattr_flags, req->fh);
 
         memset(&out, 0, sizeof(out));
-        node_get_attr(node, &out.attr);
-        out.attr_valid = 10;
+        node_get_attr(fuse, node, &out.attr);
+        out.attr_valid = fuse->attr_valid;
 
         fuse_reply(fuse, hdr->unique, &out, sizeof(out));
         return;
@@ -583,7 +1152,7 @@ void handle_fuse_request(struct fuse *fuse, struct fuse_in_header *hdr, void *da
         /* XXX: incomplete implementation on purpose.   chmod/chown
          * should NEVER be implemented.*/
 
-        path = node_get_path(node, buffer, 0);
+        path = node_get_path(fuse, node, buffer, 0);
         if (req->valid & FATTR_SIZE)
             res = truncate(path, req->size);
         if (res)
@@ -620,8 +1189,8 @@ void handle_fuse_request(struct fuse *fuse, struct fuse_in_header *hdr, void *da
 
         getout:
         memset(&out, 0, sizeof(out));
-        node_get_attr(node, &out.attr);
-        out.attr_valid = 10;
+        node_get_attr(fuse, node, &out.attr);
+        out.attr_valid = fuse->attr_valid;
 
         if (res)
             fuse_status(fuse, hdr->unique, -errno);
@@ -638,13 +1207,16 @@ void handle_fuse_request(struct fuse *fuse, struct fuse_in_header *hdr, void *da
         int res;
 
         TRACE("MKNOD %s @ %llx\n", name, hdr->nodeid);
-        path = node_get_path(node, buffer, name);
+        path = node_get_path(fuse, node, buffer, name);
 
         req->mode = (req->mode & (~0777)) | 0664;
         res = mknod(path, req->mode, req->rdev); /* XXX perm?*/
         if (res < 0) {
             fuse_status(fuse, hdr->unique, -errno);
         } else {
+            pthread_mutex_lock(&fuse->lock);
+            node_name_changed(node, strrchr(path, '/') + 1, 1);
+            pthread_mutex_unlock(&fuse->lock);
             lookup_entry(fuse, node, name, hdr->unique);
         }
         return;
@@ -657,13 +1229,16 @@ void handle_fuse_request(struct fuse *fuse, struct fuse_in_header *hdr, void *da
         int res;
 
         TRACE("MKDIR %s @ %llx 0%o\n", name, hdr->nodeid, req->mode);
-        path = node_get_path(node, buffer, name);
+        path = node_get_path(fuse, node, buffer, name);
 
         req->mode = (req->mode & (~0777)) | 0775;
         res = mkdir(path, req->mode);
         if (res < 0) {
             fuse_status(fuse, hdr->unique, -errno);
         } else {
+            pthread_mutex_lock(&fuse->lock);
+            node_name_changed(node, strrchr(path, '/') + 1, 1);
+            pthread_mutex_unlock(&fuse->lock);
             lookup_entry(fuse, node, name, hdr->unique);
         }
         return;
@@ -672,18 +1247,28 @@ void handle_fuse_request(struct fuse *fuse, struct fuse_in_header *hdr, void *da
         char *path, buffer[PATH_BUFFER_SIZE];
         int res;
         TRACE("UNLINK %s @ %llx\n", (char*) data, hdr->nodeid);
-        path = node_get_path(node, buffer, (char*) data);
-        res = unlink(path);
-        fuse_status(fuse, hdr->unique, res ? -errno : 0);
+        path = node_get_path(fuse, node, buffer, (char*) data);
+        res = unlink(path) ? -errno : 0;
+        if (!res) {
+            pthread_mutex_lock(&fuse->lock);
+            node_name_changed(node, strrchr(path, '/') + 1, 0);
+            pthread_mutex_unlock(&fuse->lock);
+        }
+        fuse_status(fuse, hdr->unique, res);
         return;
     }
     case FUSE_RMDIR: { /* bytez[] -> */
         char *path, buffer[PATH_BUFFER_SIZE];
         int res;
         TRACE("RMDIR %s @ %llx\n", (char*) data, hdr->nodeid);
-        path = node_get_path(node, buffer, (char*) data);
-        res = rmdir(path);
-        fuse_status(fuse, hdr->unique, res ? -errno : 0);
+        path = node_get_path(fuse, node, buffer, (char*) data);
+        res = rmdir(path) ? -errno : 0;
+        if (!res) {
+            pthread_mutex_lock(&fuse->lock);
+            node_name_changed(node, strrchr(path, '/') + 1, 0);
+            pthread_mutex_unlock(&fuse->lock);
+        }
+        fuse_status(fuse, hdr->unique, res);
         return;
     }
     case FUSE_RENAME: { /* rename_in, oldname, newname ->  */
@@ -692,50 +1277,77 @@ void handle_fuse_request(struct fuse *fuse, struct fuse_in_header *hdr, void *da
         char *newname = oldname + strlen(oldname) + 1;
         char *oldpath, oldbuffer[PATH_BUFFER_SIZE];
         char *newpath, newbuffer[PATH_BUFFER_SIZE];
+        char *actual_name = 0;
         struct node *target;
         struct node *newparent;
         int res;
 
         TRACE("RENAME %s->%s @ %llx\n", oldname, newname, hdr->nodeid);
 
-        target = lookup_child_by_name(node, oldname);
-        if (!target) {
+        pthread_mutex_lock(&fuse->lock);
+        newparent = lookup_by_inode(fuse, req->newdir);
+        if (!newparent) {
+            pthread_mutex_unlock(&fuse->lock);
             fuse_status(fuse, hdr->unique, -ENOENT);
             return;
         }
-        oldpath = node_get_path(node, oldbuffer, oldname);
-
-        newparent = lookup_by_inode(fuse, req->newdir);
-        if (!newparent) {
+        target = lookup_child_by_name(node, oldname);
+        if (!target) {
+            pthread_mutex_unlock(&fuse->lock);
             fuse_status(fuse, hdr->unique, -ENOENT);
             return;
         }
-        if (newparent == node) {
-            /* Special case for renaming a file where destination
-             * is same path differing only by case.
-             * In this case we don't want to look for a case insensitive match.
+        /* keep target alive while we rename without the lock */
+        target->refcount++;
+        oldpath = node_get_path_locked(node, oldbuffer, oldname);
+        newpath = node_get_path_locked(newparent, newbuffer, newname);
+        pthread_mutex_unlock(&fuse->lock);
+
+        if (!oldpath || !newpath) {
+            res = -ENAMETOOLONG;
+            goto renamed;
+        }
+        fixup_path_case(fuse, node, oldpath);
+        if (newparent != node) {
+            /* Renaming a file where destination is same path differing
+             * only by case must not look for a case insensitive match.
              * This allows commands like "mv foo FOO" to work as expected.
              */
-            newpath = do_node_get_path(newparent, newbuffer, newname, NO_CASE_SENSITIVE_MATCH);
-        } else {
-            newpath = node_get_path(newparent, newbuffer, newname);
+            fixup_path_case(fuse, newparent, newpath);
         }
-
-        if (!remove_child(node, target->nid)) {
-            ERROR("RENAME remove_child not found");
-            fuse_status(fuse, hdr->unique, -ENOENT);
-            return;
-        }
-        if (!rename_node(target, newname)) {
-            fuse_status(fuse, hdr->unique, -ENOMEM);
-            return;
+        /* Replacing a file under a name differing by case keeps its name */
+        if (strcmp(strrchr(newpath, '/') + 1, newname)) {
+            actual_name = strdup(strrchr(newpath, '/') + 1);
+            if (!actual_name) {
+                ERROR("strdup failed - out of memory\n");
+                exit(1);
+            }
         }
-        add_node_to_parent(target, newparent);
 
-        res = rename(oldpath, newpath);
+        res = rename(oldpath, newpath) ? -errno : 0;
         TRACE("RENAME result %d\n", res);
 
-        fuse_status(fuse, hdr->unique, res ? -errno : 0);
+    renamed:
+        pthread_mutex_lock(&fuse->lock);
+        if (!res) {
+            node_name_changed(node, strrchr(oldpath, '/') + 1, 0);
+            node_name_changed(newparent, strrchr(newpath, '/') + 1, 1);
+            if (!remove_child(node, target)) {
+                ERROR("RENAME remove_child not found");
+                free(actual_name);
+                res = -ENOENT;
+            } else {
+                if (!rename_node(target, newname, actual_name))
+                    res = -ENOMEM;
+                add_node_to_parent(target, newparent);
+            }
+        } else {
+            free(actual_name);
+        }
+        node_release(fuse, target);
+        pthread_mutex_unlock(&fuse->lock);
+
+        fuse_status(fuse, hdr->unique, res);
         return;
     }
 //    case FUSE_LINK:        
@@ -751,7 +1363,7 @@ void handle_fuse_request(struct fuse *fuse, struct fuse_in_header *hdr, void *da
             return;
         }
 
-        path = node_get_path(node, buffer, 0);
+        path = node_get_path(fuse, node, buffer, 0);
         TRACE("OPEN %llx '%s' 0%o fh=%p\n", hdr->nodeid, path, req->flags, h);
         h->fd = open(path, req->flags);
         if (h->fd < 0) {
@@ -767,21 +1379,22 @@ void handle_fuse_request(struct fuse *fuse, struct fuse_in_header *hdr, void *da
         return;
     }
     case FUSE_READ: { /* read_in -> byte[] */
-        char buffer[128 * 1024];
         struct fuse_read_in *req = data;
         struct handle *h = id_to_ptr(req->fh);
         int res;
         TRACE("READ %p(%d) %u@%llu\n", h, h->fd, req->size, req->offset);
-        if (req->size > sizeof(buffer)) {
+        if (req->size > MAX_READ) {
             fuse_status(fuse, hdr->unique, -EINVAL);
             return;
         }
-        res = pread64(h->fd, buffer, req->size, req->offset);
+        if (!reply_read_spliced(fuse, handler, hdr->unique, h->fd, req->size, req->offset))
+            return;
+        res = pread64(h->fd, handler->read_buffer, req->size, req->offset);
         if (res < 0) {
             fuse_status(fuse, hdr->unique, -errno);
             return;
         }
-        fuse_reply(fuse, hdr->unique, buffer, res);
+        fuse_reply(fuse, hdr->unique, handler->read_buffer, res);
         return;
     }
     case FUSE_WRITE: { /* write_in, byte[write_in.size] -> write_out */
@@ -796,8 +1409,9 @@ void handle_fuse_request(struct fuse *fuse, struct fuse_in_header *hdr, void *da
             return;
         }
         out.size = res;
+        out.padding = 0;
         fuse_reply(fuse, hdr->unique, &out, sizeof(out));
-        goto oops;
+        return;
     }
     case FUSE_STATFS: { /* getattr_in -> attr_out */
         struct statfs stat;
@@ -852,7 +1466,7 @@ void handle_fuse_request(struct fuse *fuse, struct fuse_in_header *hdr, void *da
             return;
         }
 
-        path = node_get_path(node, buffer, 0);
+        path = node_get_path(fuse, node, buffer, 0);
         TRACE("OPENDIR %llx '%s'\n", hdr->nodeid, path);
         h->d = opendir(path);
         if (h->d == 0) {
@@ -861,35 +1475,57 @@ void handle_fuse_request(struct fuse *fuse, struct fuse_in_header *hdr, void *da
             free(h);
             return;
         }
+        h->offset = 0;
+        h->next = 0;
         out.fh = ptr_to_id(h);
         fuse_reply(fuse, hdr->unique, &out, sizeof(out));
         return;
     }
-    case FUSE_READDIR: {
+    case FUSE_READDIR: { /* read_in -> dirent[] */
         struct fuse_read_in *req = data;
-        char buffer[8192];
-        struct fuse_dirent *fde = (struct fuse_dirent*) buffer;
+        unsigned char *buffer = handler->read_buffer;
+        __u32 size = req->size < MAX_READ ? req->size : MAX_READ;
+        __u32 len = 0;
         struct dirent *de;
         struct dirhandle *h = id_to_ptr(req->fh);
-        TRACE("READDIR %p\n", h);
-        if (req->offset == 0) {
-            /* rewinddir() might have been called above us, so rewind here too */
+        TRACE("READDIR %p off=%lld size=%d\n", h, req->offset, req->size);
+        if (req->offset != h->offset) {
+            /* rewinddir() was called above us, or the kernel didn't take
+             * all of our last reply; go back to where it wants to be.
+             * Entries are numbered from 1, so offset 0 is the beginning.
+             */
             TRACE("calling rewinddir()\n");
             rewinddir(h->d);
+            h->next = 0;
+            for (h->offset = 0; h->offset < req->offset; h->offset++)
+                if (!readdir(h->d))
+                    break;
         }
-        de = readdir(h->d);
-        if (!de) {
-            fuse_status(fuse, hdr->unique, 0);
-            return;
+        /* fill the reply with as many entries as fit, rather than one per request */
+        for (;;) {
+            struct fuse_dirent *fde = (struct fuse_dirent*) (buffer + len);
+            __u32 namelen, reclen;
+
+            de = h->next ? h->next : readdir(h->d);
+            h->next = 0;
+            if (!de)
+                break;
+            namelen = strlen(de->d_name);
+            reclen = FUSE_DIRENT_ALIGN(FUSE_NAME_OFFSET + namelen);
+            if (len + reclen > size) {
+                /* readdir() keeps it valid until we call it again */
+                h->next = de;
+                break;
+            }
+            fde->ino = FUSE_UNKNOWN_INO;
+            fde->off = ++h->offset;
+            fde->type = de->d_type;
+            fde->namelen = namelen;
+            memcpy(fde->name, de->d_name, namelen);
+            memset(fde->name + namelen, 0, reclen - FUSE_NAME_OFFSET - namelen);
+            len += reclen;
         }
-        fde->ino = FUSE_UNKNOWN_INO;
-        /* increment the offset so we can detect when rewinddir() seeks back to the beginning */
-        fde->off = req->offset + 1;
-        fde->type = de->d_type;
-        fde->namelen = strlen(de->d_name);
-        memcpy(fde->name, de->d_name, fde->namelen + 1);
-        fuse_reply(fuse, hdr->unique, fde,
-                   FUSE_DIRENT_ALIGN(sizeof(struct fuse_dirent) + fde->namelen));
+        fuse_reply(fuse, hdr->unique, buffer, len);
         return;
     }
     case FUSE_RELEASEDIR: { /* release_in -> */
@@ -912,10 +1548,11 @@ void handle_fuse_request(struct fuse *fuse, struct fuse_in_header *hdr, void *da
         out.major = FUSE_KERNEL_VERSION;
         out.minor = FUSE_KERNEL_MINOR_VERSION;
         out.max_readahead = req->max_readahead;
-        out.flags = FUSE_ATOMIC_O_TRUNC;
+        /* Without FUSE_BIG_WRITES the kernel sends writes one page at a time */
+        out.flags = FUSE_ATOMIC_O_TRUNC | (req->flags & (FUSE_BIG_WRITES | FUSE_ASYNC_READ));
         out.max_background = 32;
         out.congestion_threshold = 32;
-        out.max_write = 256 * 1024;
+        out.max_write = MAX_WRITE;
 
         fuse_reply(fuse, hdr->unique, &out, sizeof(out));
         return;
@@ -925,7 +1562,6 @@ void handle_fuse_request(struct fuse *fuse, struct fuse_in_header *hdr, void *da
         ERROR("NOTIMPL op=%d uniq=%llx nid=%llx\n",
                 hdr->opcode, hdr->unique, hdr->nodeid);
 
-        oops:
         h.len = sizeof(h);
         h.error = -ENOSYS;
         h.unique = hdr->unique;
@@ -935,26 +1571,37 @@ void handle_fuse_request(struct fuse *fuse, struct fuse_in_header *hdr, void *da
     }   
 }
 
-void handle_fuse_requests(struct fuse *fuse)
+void handle_fuse_requests(struct fuse_handler *handler)
 {
-    unsigned char req[256 * 1024 + 128];
+    struct fuse *fuse = handler->fuse;
+    unsigned char *req = handler->request_buffer;
     int len;
     
     for (;;) {
-        len = read(fuse->fd, req, 8192);
+        len = read(fuse->fd, req, sizeof(handler->request_buffer));
         if (len < 0) {
             if (errno == EINTR)
                 continue;
-            ERROR("handle_fuse_requests: errno=%d\n", errno);
+            ERROR("[%d] handle_fuse_requests: errno=%d\n", handler->token, errno);
             return;
         }
-        handle_fuse_request(fuse, (void*) req, (void*) (req + sizeof(struct fuse_in_header)), len);
+        handle_fuse_request(fuse, handler, (void*) req,
+                            (void*) (req + sizeof(struct fuse_in_header)), len);
     }
 }
 
+static void *start_handler(void *data)
+{
+    handle_fuse_requests(data);
+    /* the filesystem is gone; take the other handlers down with us */
+    exit(0);
+    return 0;
+}
+
 static int usage()
 {
-    ERROR("usage: sdcard [-l -f] <path> <uid> <gid>\n\n\t-l force file names to lower case when creating new files\n\t-f fix up file system before starting (repairs bad file name case and group ownership)\n");
+    ERROR("usage: sdcard [-l -f] [-t<threads>] [-e<seconds>] [-a<seconds>] <path> <uid> <gid>\n\n\t-l force file names to lower case when creating new files\n\t-f fix up file system before starting (repairs bad file name case and group ownership)\n\t-t number of threads handling requests (default %d)\n\t-e seconds the kernel may cache name lookups (default %d)\n\t-a seconds the kernel may cache file attributes (default %d)\n",
+          DEFAULT_NUM_THREADS, DEFAULT_ENTRY_VALID, DEFAULT_ATTR_VALID);
     return -1;
 }
 
@@ -965,11 +1612,27 @@ int main(int argc, char **argv)
     int fd;
     int res;
     const char *path = NULL;
+    int num_threads = DEFAULT_NUM_THREADS;
+    __u64 entry_valid = DEFAULT_ENTRY_VALID;
+    __u64 attr_valid = DEFAULT_ATTR_VALID;
+    struct fuse_handler *handlers[MAX_NUM_THREADS];
+    pthread_t thread;
     int i;
 
     for (i = 1; i < argc; i++) {
         char* arg = argv[i];
-        if (!path)
+        if (!strncmp(arg, "-t", 2)) {
+            const char *value = arg[2] ? arg + 2 : (i + 1 < argc ? argv[++i] : "");
+            num_threads = strtoul(value, 0, 10);
+            if (num_threads < 1 || num_threads > MAX_NUM_THREADS) {
+                ERROR("number of threads must be between 1 and %d\n", MAX_NUM_THREADS);
+                return usage();
+            }
+        } else if (!strncmp(arg, "-e", 2)) {
+            entry_valid = strtoul(arg[2] ? arg + 2 : (i + 1 < argc ? argv[++i] : ""), 0, 10);
+        } else if (!strncmp(arg, "-a", 2)) {
+            attr_valid = strtoul(arg[2] ? arg + 2 : (i + 1 < argc ? argv[++i] : ""), 0, 10);
+        } else if (!path)
             path = arg;
         else if (uid == -1)
             uid = strtoul(arg, 0, 10);
@@ -1000,7 +1663,7 @@ int main(int argc, char **argv)
     }
 
     sprintf(opts, "fd=%i,rootmode=40000,default_permissions,allow_other,"
-            "user_id=%d,group_id=%d", fd, uid, gid);
+            "user_id=%d,group_id=%d,max_read=%d", fd, uid, gid, MAX_READ);
     
     res = mount("/dev/fuse", MOUNT_POINT, "fuse", MS_NOSUID | MS_NODEV, opts);
     if (res < 0) {
@@ -1018,9 +1681,31 @@ int main(int argc, char **argv)
     }
 
     fuse_init(&fuse, fd, path);
+    fuse.entry_valid = entry_valid;
+    fuse.attr_valid = attr_valid;
+
+    for (i = 0; i < num_threads; i++) {
+        handlers[i] = malloc(sizeof(struct fuse_handler));
+        if (!handlers[i]) {
+            ERROR("cannot allocate handler %d\n", i);
+            return -1;
+        }
+        handlers[i]->fuse = &fuse;
+        handlers[i]->token = i;
+        handler_init_splice(handlers[i]);
+    }
 
     umask(0);
-    handle_fuse_requests(&fuse);
+
+    /* handler 0 runs on the main thread */
+    for (i = 1; i < num_threads; i++) {
+        res = pthread_create(&thread, NULL, start_handler, handlers[i]);
+        if (res) {
+            ERROR("cannot start handler thread %d (%d)\n", i, res);
+            return -1;
+        }
+    }
+    handle_fuse_requests(handlers[0]);
     
     return 0;
 }
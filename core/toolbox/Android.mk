@@ -99,3 +99,11 @@ ALL_DEFAULT_INSTALLED_MODULES += $(SYMLINKS)
 # local module name
 ALL_MODULES.$(LOCAL_MODULE).INSTALLED := \
     $(ALL_MODULES.$(LOCAL_MODULE).INSTALLED) $(SYMLINKS)
+
+# newfs_msdos as a library, so vold can format without a fork/exec
+include $(CLEAR_VARS)
+LOCAL_SRC_FILES := newfs_msdos.c
+LOCAL_CFLAGS := -DNEWFS_MSDOS_LIBRARY
+LOCAL_MODULE := libnewfs_msdos
+LOCAL_MODULE_TAGS := optional
+include $(BUILD_STATIC_LIBRARY)
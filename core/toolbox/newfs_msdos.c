@@ -52,12 +52,21 @@ static const char rcsid[] =
 #include <fcntl.h>
 #include <inttypes.h>
 #include <paths.h>
+#include <setjmp.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 #include <unistd.h>
 
+#ifdef NEWFS_MSDOS_LIBRARY
+#define LOG_TAG "newfs_msdos"
+#include <cutils/log.h>
+#endif
+
+#include "newfs_msdos.h"
+
 #define MAXU16	  0xffff	/* maximum unsigned 16-bit quantity */
 #define BPN	  4		/* bits per nibble */
 #define NPB	  2		/* nibbles per byte */
@@ -69,6 +78,7 @@ static const char rcsid[] =
 #define DEFBLK	  4096		/* default block size */
 #define DEFBLK16  2048		/* default block size FAT16 */
 #define DEFRDE	  512		/* default root directory entries */
+#define WRBATCH	  65536		/* bytes of metadata per write */
 #define RESFTE	  2		/* reserved FAT entries */
 #define MINCLS12  1		/* minimum FAT12 clusters */
 #define MINCLS16  0x1000	/* minimum FAT16 clusters */
@@ -233,6 +243,86 @@ static int oklabel(const char *);
 static void mklabel(u_int8_t *, const char *);
 static void setstr(u_int8_t *, const char *, size_t);
 static void usage(void);
+static int newfs_msdos(int, char *[]);
+
+/*
+ * Errors unwind back to newfs_msdos_format() instead of exiting, so the
+ * formatter can also run inside a long-lived process such as vold.
+ * What it opened or allocated is released there either way, and the
+ * static state below is reset for the next call.
+ */
+static jmp_buf fail_env;
+static int fail_fd = -1, fail_fd1 = -1;
+static u_int8_t *fail_buf;
+static char *fail_fname, *fail_bname;
+static newfs_msdos_progress_t progress_fn;
+static void *progress_cookie;
+
+static void
+vreport(int error, const char *fmt, va_list ap)
+{
+    char msg[256];
+
+    msg[0] = 0;
+    if (fmt)
+	vsnprintf(msg, sizeof(msg), fmt, ap);
+#ifdef NEWFS_MSDOS_LIBRARY
+    if (error)
+	LOGE("%s%s%s", msg, fmt ? ": " : "", strerror(error));
+    else
+	LOGW("%s", msg);
+#else
+    if (error)
+	fprintf(stderr, "newfs_msdos: %s%s%s\n", msg, fmt ? ": " : "",
+		strerror(error));
+    else
+	fprintf(stderr, "newfs_msdos: %s\n", msg);
+#endif
+}
+
+static void __attribute__((noreturn))
+fail_err(__unused int eval, const char *fmt, ...)
+{
+    int error = errno;
+    va_list ap;
+
+    va_start(ap, fmt);
+    vreport(error, fmt, ap);
+    va_end(ap);
+    longjmp(fail_env, 1);
+}
+
+static void __attribute__((noreturn))
+fail_errx(__unused int eval, const char *fmt, ...)
+{
+    va_list ap;
+
+    va_start(ap, fmt);
+    vreport(0, fmt, ap);
+    va_end(ap);
+    longjmp(fail_env, 1);
+}
+
+static void
+fail_warnx(const char *fmt, ...)
+{
+    va_list ap;
+
+    va_start(ap, fmt);
+    vreport(0, fmt, ap);
+    va_end(ap);
+}
+
+static void __attribute__((noreturn))
+fail_exit(__unused int status)
+{
+    longjmp(fail_env, 1);
+}
+
+#define err	fail_err
+#define errx	fail_errx
+#define warnx	fail_warnx
+#define exit	fail_exit
 
 #ifdef ANDROID
 #define powerof2(x)     ((((x) - 1) & (x)) == 0)
@@ -241,11 +331,45 @@ static void usage(void);
 #define MIN(a, b) ((a) < (b) ? (a) : (b))
 
 #endif
+int
+newfs_msdos_main(int argc, char *argv[])
+{
+    return newfs_msdos_format(argc, argv, NULL, NULL);
+}
+
+int
+newfs_msdos_format(int argc, char *argv[], newfs_msdos_progress_t progress,
+		   void *cookie)
+{
+    int rc = 1;
+
+    progress_fn = progress;
+    progress_cookie = cookie;
+    /* Restart option parsing, for callers that format more than once */
+    optreset = 1;
+    optind = 1;
+    if (!setjmp(fail_env))
+	rc = newfs_msdos(argc, argv);
+    if (fail_fd != -1)
+	close(fail_fd);
+    if (fail_fd1 != -1)
+	close(fail_fd1);
+    free(fail_buf);
+    free(fail_fname);
+    free(fail_bname);
+    fail_fd = fail_fd1 = -1;
+    fail_buf = NULL;
+    fail_fname = fail_bname = NULL;
+    progress_fn = NULL;
+    progress_cookie = NULL;
+    return rc;
+}
+
 /*
  * Construct a FAT12, FAT16, or FAT32 file system.
  */
-int
-newfs_msdos_main(int argc, char *argv[])
+static int
+newfs_msdos(int argc, char *argv[])
 {
     static const char opts[] = "@:NB:C:F:I:L:O:S:a:b:c:e:f:h:i:k:m:n:o:r:s:u:";
     const char *opt_B = NULL, *opt_L = NULL, *opt_O = NULL, *opt_f = NULL;
@@ -264,11 +388,13 @@ newfs_msdos_main(int argc, char *argv[])
     struct bsxbpb *bsxbpb;
     struct bsx *bsx;
     struct de *de;
-    u_int8_t *img;
+    u_int8_t *img, *wbuf;
     const char *fname, *dtype, *bname;
     ssize_t n;
     time_t now;
     u_int fat, bss, rds, cls, dir, lsn, x, x1, x2;
+    u_int nwr, last;
+    size_t len;
     int ch, fd, fd1;
     off_t opt_create = 0, opt_ofs = 0;
 
@@ -366,7 +492,7 @@ newfs_msdos_main(int argc, char *argv[])
     fname = *argv++;
     if (!opt_create && !strchr(fname, '/')) {
 	snprintf(buf, sizeof(buf), "%s%s", _PATH_DEV, fname);
-	if (!(fname = strdup(buf)))
+	if (!(fname = fail_fname = strdup(buf)))
 	    err(1, NULL);
     }
     dtype = *argv;
@@ -376,10 +502,12 @@ newfs_msdos_main(int argc, char *argv[])
 	fd = open(fname, O_RDWR | O_CREAT | O_TRUNC, 0644);
 	if (fd == -1)
 	    errx(1, "failed to create %s", fname);
+	fail_fd = fd;
 	if (ftruncate(fd, opt_create))
 	    errx(1, "failed to initialize %jd bytes", (intmax_t)opt_create);
     } else if ((fd = open(fname, opt_N ? O_RDONLY : O_RDWR)) == -1)
 	err(1, "%s", fname);
+    fail_fd = fd;
     if (fstat(fd, &sb))
 	err(1, "%s", fname);
     if (opt_create) {
@@ -498,10 +626,11 @@ newfs_msdos_main(int argc, char *argv[])
 	bname = opt_B;
 	if (!strchr(bname, '/')) {
 	    snprintf(buf, sizeof(buf), "/boot/%s", bname);
-	    if (!(bname = strdup(buf)))
+	    if (!(bname = fail_bname = strdup(buf)))
 		err(1, NULL);
 	}
-	if ((fd1 = open(bname, O_RDONLY)) == -1 || fstat(fd1, &sb))
+	fail_fd1 = fd1 = open(bname, O_RDONLY);
+	if (fd1 == -1 || fstat(fd1, &sb))
 	    err(1, "%s", bname);
 	if (!S_ISREG(sb.st_mode) || sb.st_size % bpb.bps ||
 	    sb.st_size < bpb.bps || sb.st_size > bpb.bps * MAXU16)
@@ -616,10 +745,14 @@ newfs_msdos_main(int argc, char *argv[])
 	gettimeofday(&tv, NULL);
 	now = tv.tv_sec;
 	tm = localtime(&now);
-	if (!(img = malloc(bpb.bps)))
+	/* Sectors are built in place and written out WRBATCH at a time */
+	nwr = MAX(WRBATCH / bpb.bps, 1);
+	if (!(fail_buf = wbuf = malloc(nwr * bpb.bps)))
 	    err(1, NULL);
 	dir = bpb.res + (bpb.spf ? bpb.spf : bpb.bspf) * bpb.nft;
-	for (lsn = 0; lsn < dir + (fat == 32 ? bpb.spc : rds); lsn++) {
+	last = dir + (fat == 32 ? bpb.spc : rds);
+	for (lsn = 0; lsn < last; lsn++) {
+	    img = wbuf + (lsn % nwr) * bpb.bps;
 	    x = lsn;
 	    if (opt_B &&
 		fat == 32 && bpb.bkbs != MAXU16 &&
@@ -717,12 +850,15 @@ newfs_msdos_main(int argc, char *argv[])
 		    (u_int)tm->tm_mday;
 		mk2(de->date, x);
 	    }
-	    if ((n = write(fd, img, bpb.bps)) == -1)
+	    if ((lsn + 1) % nwr && lsn + 1 != last)
+		continue;
+	    len = (lsn % nwr + 1) * bpb.bps;
+	    if ((n = write(fd, wbuf, len)) == -1)
 		err(1, "%s", fname);
-	    if ((unsigned)n != bpb.bps) {
+	    if ((size_t)n != len)
 		errx(1, "%s: can't write sector %u", fname, lsn);
-                exit(1);
-            }
+	    if (progress_fn)
+		progress_fn(progress_cookie, lsn + 1, last);
 	}
     }
     return 0;
@@ -968,6 +1104,7 @@ argtooff(const char *arg, const char *msg)
     char *s;
     off_t x;
 
+    errno = 0;
     x = strtoll(arg, &s, 0);
     /* allow at most one extra char */
     if (errno || x < 0 || (s[0] && s[1]) )
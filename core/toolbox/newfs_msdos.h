@@ -0,0 +1,41 @@
+/*
+ * Copyright (C) 2012 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _NEWFS_MSDOS_H
+#define _NEWFS_MSDOS_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Called as the file system metadata is written; done counts up to total */
+typedef void (*newfs_msdos_progress_t)(void *cookie, unsigned int done,
+                                       unsigned int total);
+
+/*
+ * Runs newfs_msdos with the given command line inside the calling
+ * process.  Returns 0 on success and 1 on failure, like the tool's exit
+ * status; errors are reported instead of exiting.  Not reentrant: it
+ * uses getopt() and static state.
+ */
+int newfs_msdos_format(int argc, char *argv[], newfs_msdos_progress_t progress,
+                       void *cookie);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
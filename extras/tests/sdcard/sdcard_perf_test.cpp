@@ -29,6 +29,7 @@
 #include <cstdio>
 #include <cstdlib>
 #include <ctime>
+#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <getopt.h>
@@ -56,6 +57,18 @@
 //  read:        Open a file read it and close.
 //  read_write:  Combine readers and writers.
 //  open_create: Open|create an non existing file.
+//  read_stat:   Cold readers run alongside processes that only stat and
+//               open a small file. The open timings show how long
+//               metadata requests wait behind reads in the sdcard daemon.
+//  lookup:      Stat, in random order, every file of a directory holding
+//               --iterations files, with cold caches.
+//  list_stat:   Same directory, but list it and stat each entry, the way
+//               a media scanner or 'ls -l' does.
+//  scan:        Spread --iterations files over a few folders and walk
+//               them several times like the media scanner: list each
+//               folder and stat each entry. The first pass is cold, the
+//               next ones show what the kernel's entry and attribute
+//               caches save.
 //
 // For each run you can control how many processes will run the test in
 // parallel to simulate a real load (--procnb flag)
@@ -72,6 +85,9 @@
 // Examples:
 // adb shell /system/bin/sdcard_perf_test --test=read --size=1000 --chunk-size=100 --procnb=1 --iterations=10 --dump > /tmp/data.txt
 // adb shell /system/bin/sdcard_perf_test --test=write --size=1000 --chunk-size=100 --procnb=1 --iterations=100 --dump > /tmp/data.txt
+// adb shell /system/bin/sdcard_perf_test --test=read_stat --size=4000 --chunk-size=128 --procnb=8 --iterations=10
+// adb shell /system/bin/sdcard_perf_test --test=lookup --procnb=1 --iterations=50000
+// adb shell /system/bin/sdcard_perf_test --test=scan --procnb=1 --iterations=20000
 //
 // To watch the memory: cat /proc/meminfo
 // If the phone crashes, look at /proc/last_kmsg on reboot.
@@ -125,7 +141,7 @@ struct option long_options[] = {
 
 void usage()
 {
-    printf("sdcard_perf_test --test=write|read|read_write|open_create [options]\n\n"
+    printf("sdcard_perf_test --test=write|read|read_write|open_create|read_stat|lookup|list_stat|scan [options]\n\n"
            "  -t --test:        Select the test.\n"
            "  -s --size:        Size in kbytes of the data.\n"
            "  -S --chunk-size:  Size of a chunk. Default to size ie 1 chunk.\n"
@@ -519,6 +535,305 @@ bool testReadWrite(TestCase *testCase)
     }
 }
 
+// ----------------------------------------------------------------------
+// READ STAT
+
+// Stat and open a small existing file over and over. Run next to
+// readers, the open latency tells whether the sdcard daemon answers
+// metadata requests while reads on other files are in flight.
+bool testStat(TestCase *testCase)
+{
+    char filename[80] = {'\0',};
+    struct stat st;
+
+    sprintf(filename, "%s/stat-%d", kTestDir, testCase->pid());
+    int fd = open(filename, O_RDWR | O_CREAT, 0660);
+    if (fd < 0)
+    {
+        fprintf(stderr, "Create failed %d %s.", errno, strerror(errno));
+        return false;
+    }
+    close(fd);
+
+    testCase->signalParentAndWait();
+    testCase->testTimer()->start();
+
+    // Opens are much cheaper than reads; do more of them so both
+    // sides keep going for the whole test.
+    const size_t iter = testCase->iter() * TestCase::kReadWriteFactor;
+    for (size_t i = 0; i < iter; ++i)
+    {
+        if (stat(filename, &st) < 0)
+        {
+            fprintf(stderr, "Stat failed %d %s.", errno, strerror(errno));
+            return false;
+        }
+        testCase->openTimer()->start();
+        fd = open(filename, O_RDONLY);
+        testCase->openTimer()->stop();
+        if (fd < 0)
+        {
+            return false;
+        }
+        close(fd);
+    }
+    testCase->testTimer()->stop();
+    return true;
+}
+
+// Even PID stat, odd PID run the read test.
+bool testReadStat(TestCase *testCase)
+{
+    if (getpid() & 0x1) {
+        return testRead(testCase);
+    } else {
+        return testStat(testCase);
+    }
+}
+
+// ----------------------------------------------------------------------
+// LOOKUP and LIST STAT
+
+// Fill a directory with iter() empty files, then drop the caches so
+// the first access to each name goes all the way to the sdcard daemon.
+bool createDirectory(char *dirname, TestCase *testCase)
+{
+    char filename[PATH_MAX];
+
+    sprintf(dirname, "%s/dir-%d", kTestDir, testCase->pid());
+    if (mkdir(dirname, 0770) < 0)
+    {
+        fprintf(stderr, "Mkdir failed %d %s.", errno, strerror(errno));
+        return false;
+    }
+    for (size_t i = 0; i < testCase->iter(); ++i)
+    {
+        sprintf(filename, "%s/IMG_%06d.jpg", dirname, i);
+        int fd = open(filename, O_RDWR | O_CREAT, 0660);
+        if (fd < 0)
+        {
+            fprintf(stderr, "Create failed %d %s.", errno, strerror(errno));
+            return false;
+        }
+        close(fd);
+    }
+    android::syncAndDropCaches();
+    return true;
+}
+
+// cleanup() only removes plain files.
+void removeDirectory(const char *dirname, TestCase *testCase)
+{
+    char filename[PATH_MAX];
+
+    for (size_t i = 0; i < testCase->iter(); ++i)
+    {
+        sprintf(filename, "%s/IMG_%06d.jpg", dirname, i);
+        unlink(filename);
+    }
+    rmdir(dirname);
+}
+
+bool testLookup(TestCase *testCase)
+{
+    char dirname[80] = {'\0',};
+    char filename[PATH_MAX];
+    struct stat st;
+
+    if (!createDirectory(dirname, testCase))
+    {
+        return false;
+    }
+
+    const size_t iter = testCase->iter();
+    size_t *order = new size_t[iter];
+    for (size_t i = 0; i < iter; ++i)
+    {
+        order[i] = i;
+    }
+    srand(testCase->pid());
+    for (size_t i = iter - 1; i > 0; --i)
+    {
+        size_t j = rand() % (i + 1);
+        size_t tmp = order[i];
+        order[i] = order[j];
+        order[j] = tmp;
+    }
+
+    testCase->signalParentAndWait();
+    testCase->testTimer()->start();
+    for (size_t i = 0; i < iter; ++i)
+    {
+        sprintf(filename, "%s/IMG_%06d.jpg", dirname, order[i]);
+        testCase->statTimer()->start();
+        int res = stat(filename, &st);
+        testCase->statTimer()->stop();
+        if (res < 0)
+        {
+            fprintf(stderr, "Stat failed %d %s.", errno, strerror(errno));
+            delete [] order;
+            return false;
+        }
+    }
+    testCase->testTimer()->stop();
+    delete [] order;
+    removeDirectory(dirname, testCase);
+    return true;
+}
+
+bool testListStat(TestCase *testCase)
+{
+    char dirname[80] = {'\0',};
+    char filename[PATH_MAX];
+    struct stat st;
+
+    if (!createDirectory(dirname, testCase))
+    {
+        return false;
+    }
+
+    testCase->signalParentAndWait();
+    testCase->testTimer()->start();
+    DIR *dir = opendir(dirname);
+    if (!dir)
+    {
+        fprintf(stderr, "Opendir failed %d %s.", errno, strerror(errno));
+        return false;
+    }
+    struct dirent *de;
+    while ((de = readdir(dir)) != NULL)
+    {
+        snprintf(filename, sizeof(filename), "%s/%s", dirname, de->d_name);
+        testCase->statTimer()->start();
+        int res = stat(filename, &st);
+        testCase->statTimer()->stop();
+        if (res < 0)
+        {
+            fprintf(stderr, "Stat failed %d %s.", errno, strerror(errno));
+            closedir(dir);
+            return false;
+        }
+    }
+    closedir(dir);
+    testCase->testTimer()->stop();
+    removeDirectory(dirname, testCase);
+    return true;
+}
+
+// Number of folders the scan test spreads its files over.
+const size_t kScanFolders = 10;
+
+bool createTree(char *dirname, TestCase *testCase)
+{
+    char filename[PATH_MAX];
+
+    sprintf(dirname, "%s/tree-%d", kTestDir, testCase->pid());
+    if (mkdir(dirname, 0770) < 0)
+    {
+        fprintf(stderr, "Mkdir failed %d %s.", errno, strerror(errno));
+        return false;
+    }
+    for (size_t i = 0; i < kScanFolders; ++i)
+    {
+        sprintf(filename, "%s/folder-%d", dirname, i);
+        if (mkdir(filename, 0770) < 0)
+        {
+            fprintf(stderr, "Mkdir failed %d %s.", errno, strerror(errno));
+            return false;
+        }
+    }
+    for (size_t i = 0; i < testCase->iter(); ++i)
+    {
+        sprintf(filename, "%s/folder-%d/IMG_%06d.jpg", dirname, i % kScanFolders, i);
+        int fd = open(filename, O_RDWR | O_CREAT, 0660);
+        if (fd < 0)
+        {
+            fprintf(stderr, "Create failed %d %s.", errno, strerror(errno));
+            return false;
+        }
+        close(fd);
+    }
+    android::syncAndDropCaches();
+    return true;
+}
+
+void removeTree(const char *dirname, TestCase *testCase)
+{
+    char filename[PATH_MAX];
+
+    for (size_t i = 0; i < testCase->iter(); ++i)
+    {
+        sprintf(filename, "%s/folder-%d/IMG_%06d.jpg", dirname, i % kScanFolders, i);
+        unlink(filename);
+    }
+    for (size_t i = 0; i < kScanFolders; ++i)
+    {
+        sprintf(filename, "%s/folder-%d", dirname, i);
+        rmdir(filename);
+    }
+    rmdir(dirname);
+}
+
+// Lists every folder of the tree and stats each entry.
+bool scanTree(const char *dirname, TestCase *testCase)
+{
+    char folder[PATH_MAX];
+    char filename[PATH_MAX];
+    struct stat st;
+
+    for (size_t i = 0; i < kScanFolders; ++i)
+    {
+        sprintf(folder, "%s/folder-%d", dirname, i);
+        DIR *dir = opendir(folder);
+        if (!dir)
+        {
+            fprintf(stderr, "Opendir failed %d %s.", errno, strerror(errno));
+            return false;
+        }
+        struct dirent *de;
+        while ((de = readdir(dir)) != NULL)
+        {
+            if (de->d_name[0] == '.')
+            {
+                continue;
+            }
+            snprintf(filename, sizeof(filename), "%s/%s", folder, de->d_name);
+            testCase->statTimer()->start();
+            int res = lstat(filename, &st);
+            testCase->statTimer()->stop();
+            if (res < 0)
+            {
+                fprintf(stderr, "Stat failed %d %s.", errno, strerror(errno));
+                closedir(dir);
+                return false;
+            }
+        }
+        closedir(dir);
+    }
+    return true;
+}
+
+bool testScan(TestCase *testCase)
+{
+    char dirname[80] = {'\0',};
+    bool ok = true;
+
+    if (!createTree(dirname, testCase))
+    {
+        return false;
+    }
+
+    testCase->signalParentAndWait();
+    testCase->testTimer()->start();
+    for (int pass = 0; ok && pass < TestCase::kScanPasses; ++pass)
+    {
+        ok = scanTree(dirname, testCase);
+    }
+    testCase->testTimer()->stop();
+    removeTree(dirname, testCase);
+    return ok;
+}
+
 // ----------------------------------------------------------------------
 // OPEN CREATE TEST
 
@@ -583,6 +898,18 @@ int main(int argc, char **argv)
         case TestCase::READ_WRITE:
             testCase.mTestBody = testReadWrite;
             break;
+        case TestCase::READ_STAT:
+            testCase.mTestBody = testReadStat;
+            break;
+        case TestCase::LOOKUP:
+            testCase.mTestBody = testLookup;
+            break;
+        case TestCase::LIST_STAT:
+            testCase.mTestBody = testListStat;
+            break;
+        case TestCase::SCAN:
+            testCase.mTestBody = testScan;
+            break;
         default:
             fprintf(stderr, "Unknown test type %s", testCase.name());
             exit(EXIT_FAILURE);
@@ -105,6 +105,7 @@ bool TestCase::runTest()
             if(writeTimer()->used()) writeTimer()->sprint(&str, &size_left);
             if(syncTimer()->used()) syncTimer()->sprint(&str, &size_left);
             if(truncateTimer()->used()) truncateTimer()->sprint(&str, &size_left);
+            if(statTimer()->used()) statTimer()->sprint(&str, &size_left);
 
             write(mIpc[TestCase::WRITE_TO_PARENT], buffer, str - buffer);
 
@@ -163,6 +164,8 @@ void TestCase::createTimers()
     mSyncTimer = new StopWatch("sync", iter());
 
     mTruncateTimer = new StopWatch("truncate", iter());
+
+    mStatTimer = new StopWatch("stat", iter() * kScanPasses);
 }
 
 bool TestCase::setTypeFromName(const char *test_name)
@@ -172,6 +175,10 @@ bool TestCase::setTypeFromName(const char *test_name)
     if (strcmp(mName, "read") == 0) mType = READ;
     if (strcmp(mName, "read_write") == 0) mType = READ_WRITE;
     if (strcmp(mName, "open_create") == 0) mType = OPEN_CREATE;
+    if (strcmp(mName, "read_stat") == 0) mType = READ_STAT;
+    if (strcmp(mName, "lookup") == 0) mType = LOOKUP;
+    if (strcmp(mName, "list_stat") == 0) mType = LIST_STAT;
+    if (strcmp(mName, "scan") == 0) mType = SCAN;
 
     return UNKNOWN_TEST != mType;
 }
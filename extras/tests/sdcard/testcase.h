@@ -41,7 +41,8 @@ namespace android_test {
 
 class TestCase {
   public:
-    enum Type {UNKNOWN_TEST, WRITE, READ, OPEN_CREATE, READ_WRITE};
+    enum Type {UNKNOWN_TEST, WRITE, READ, OPEN_CREATE, READ_WRITE, READ_STAT,
+               LOOKUP, LIST_STAT, SCAN};
     enum Pipe {READ_FROM_CHILD = 0, WRITE_TO_PARENT, READ_FROM_PARENT, WRITE_TO_CHILD};
     enum Sync {NO_SYNC, FSYNC, SYNC};
 
@@ -50,6 +51,9 @@ class TestCase {
     // terminate roughly at the same time as the write tasks.
     const static int kReadWriteFactor = 5;
 
+    // Number of times the scan test walks its tree.
+    const static int kScanPasses = 3;
+
     TestCase(const char *appName);
 
     ~TestCase();
@@ -101,6 +105,7 @@ class TestCase {
     StopWatch *writeTimer() { return mWriteTimer; }
     StopWatch *syncTimer() { return mSyncTimer; }
     StopWatch *truncateTimer() { return mTruncateTimer; }
+    StopWatch *statTimer() { return mStatTimer; }
 
     // Fork the children, run the test and wait for them to complete.
     bool runTest();
@@ -156,6 +161,7 @@ private:
     StopWatch *mWriteTimer;  // Used to time the write calls.
     StopWatch *mSyncTimer;  // Used to time the sync/fsync calls.
     StopWatch *mTruncateTimer;  // Used to time the ftruncate calls.
+    StopWatch *mStatTimer;  // Used to time the stat calls.
 };
 
 }  // namespace android_test
@@ -10,6 +10,7 @@ LOCAL_SRC_FILES:=                                      \
                   NetdCommand.cpp                      \
                   NetlinkHandler.cpp                   \
                   NetlinkManager.cpp                   \
+                  NetlinkTransaction.cpp               \
                   PanController.cpp                    \
                   PppController.cpp                    \
                   ResolverController.cpp               \
@@ -70,3 +71,5 @@ LOCAL_CFLAGS :=
 LOCAL_SHARED_LIBRARIES := libcutils
 
 include $(BUILD_EXECUTABLE)
+
+include $(call all-makefiles-under,$(LOCAL_PATH))
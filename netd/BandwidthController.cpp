@@ -22,14 +22,18 @@
  * If they ever were to allow it, then netd/ would need some tweaking.
  */
 
+#include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include <unistd.h>
+
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 
@@ -51,14 +55,23 @@ const char BandwidthController::ALERT_IPT_TEMPLATE[] = "%s %s %s -m quota2 ! --q
 const int  BandwidthController::ALERT_RULE_POS_IN_COSTLY_CHAIN = 4;
 const char BandwidthController::ALERT_GLOBAL_NAME[] = "globalAlert";
 const char BandwidthController::IP6TABLES_PATH[] = "/system/bin/ip6tables";
+const char BandwidthController::IP6TABLES_RESTORE_PATH[] = "/system/bin/ip6tables-restore";
 const char BandwidthController::IPTABLES_PATH[] = "/system/bin/iptables";
+const char BandwidthController::IPTABLES_RESTORE_PATH[] = "/system/bin/iptables-restore";
 const int  BandwidthController::MAX_CMD_ARGS = 32;
 const int  BandwidthController::MAX_CMD_LEN = 1024;
 const int  BandwidthController::MAX_IFACENAME_LEN = 64;
 const int  BandwidthController::MAX_IPT_OUTPUT_LINE_LEN = 256;
+const int  BandwidthController::TETHER_STATS_CACHE_MS = 250;
 
 bool BandwidthController::useLogwrapCall = false;
 
+int BandwidthController::batchDepth = 0;
+std::list<std::string> BandwidthController::batchRules[2];
+
+std::list<BandwidthController::ForwardRuleStats> BandwidthController::fwdRuleStats;
+int64_t BandwidthController::fwdRuleStatsTimeMs = -1;
+
 /**
  * Some comments about the rules:
  *  * Ordering
@@ -182,6 +195,11 @@ int BandwidthController::runIptablesCmd(const char *cmd, IptRejectOp rejectHandl
         }
     }
 
+    if (batchDepth) {
+        batchRules[iptVer].push_back(fullCmd);
+        return 0;
+    }
+
     fullCmd.insert(0, " ");
     fullCmd.insert(0, iptVer == IptIpV4 ? IPTABLES_PATH : IP6TABLES_PATH);
 
@@ -211,6 +229,276 @@ int BandwidthController::runIptablesCmd(const char *cmd, IptRejectOp rejectHandl
     return res;
 }
 
+/*
+ * Splits "[-t <table> ]<op> <chain>[ <spec>]" at the op and the chain.
+ * The prefix keeps the "-t <table> " part.
+ */
+static void splitRule(const std::string &rule, std::string &prefix, std::string &op,
+                      std::string &chain, std::string &spec) {
+    size_t pos = 0, end;
+
+    if (!rule.compare(0, 3, "-t ")) {
+        pos = rule.find(' ', 3);
+        pos = pos == std::string::npos ? rule.size() : pos + 1;
+    }
+    prefix = rule.substr(0, pos);
+
+    end = rule.find(' ', pos);
+    op = rule.substr(pos, end == std::string::npos ? std::string::npos : end - pos);
+    pos = end == std::string::npos ? rule.size() : end + 1;
+
+    end = rule.find(' ', pos);
+    chain = rule.substr(pos, end == std::string::npos ? std::string::npos : end - pos);
+    spec = end == std::string::npos ? "" : rule.substr(end + 1);
+}
+
+static std::string ruleOp(const std::string &rule) {
+    std::string prefix, op, chain, spec;
+
+    splitRule(rule, prefix, op, chain, spec);
+    return op;
+}
+
+void BandwidthController::beginBatch(void) {
+    batchDepth++;
+}
+
+int BandwidthController::commitBatch(RunCmdErrHandling cmdErrHandling, BatchResult *result) {
+    std::list<std::string> rules[2];
+    std::list<std::string>::iterator it;
+    int res = 0;
+    int ver;
+
+    if (!batchDepth) {
+        LOGE("commitBatch() without beginBatch()");
+        return -1;
+    }
+    if (--batchDepth)
+        return 0;
+
+    for (ver = IptIpV4; ver <= IptIpV6; ver++) {
+        rules[ver].swap(batchRules[ver]);
+    }
+
+    for (ver = IptIpV4; ver <= IptIpV6; ver++) {
+        IptIpVer iptVer = (IptIpVer) ver;
+        const char *restorePath = iptVer == IptIpV4 ? IPTABLES_RESTORE_PATH : IP6TABLES_RESTORE_PATH;
+        int firstUnapplied = 0;
+        bool unknown = false;
+
+        if (rules[ver].empty())
+            continue;
+
+        if (!access(restorePath, X_OK) &&
+            !runIptablesRestore(iptVer, rules[ver], &firstUnapplied)) {
+            firstUnapplied = rules[ver].size();
+        }
+        if (firstUnapplied < 0) {
+            /*
+             * It failed without saying where, so any of its sections may
+             * have been committed.  Take the batch's rules back out before
+             * replaying all of it, rather than adding them twice.
+             */
+            LOGE("iptables-restore state unknown, replaying the batch");
+            clearBatch(iptVer, rules[ver]);
+            firstUnapplied = 0;
+            unknown = true;
+        }
+
+        it = rules[ver].begin();
+        for (int i = 0; i < firstUnapplied; i++, it++) {
+            if (result)
+                result->applied.push_back(std::make_pair(iptVer, *it));
+        }
+
+        /*
+         * No restore binary, or a transaction was rejected.  Each table
+         * section is all-or-nothing, so replay the rejected section and
+         * everything after it rule by rule to get the same partial-failure
+         * behavior as unbatched callers.
+         */
+        for (; it != rules[ver].end(); it++) {
+            if (!runIptablesCmd(it->c_str(), IptRejectNoAdd, iptVer)) {
+                if (result)
+                    result->applied.push_back(std::make_pair(iptVer, *it));
+                continue;
+            }
+            /* What the restore may already have deleted is gone either way */
+            if (unknown && (ruleOp(*it) == "-D" || ruleOp(*it) == "-X"))
+                continue;
+            if (result && !res) {
+                result->failedVer = iptVer;
+                result->failedRule = *it;
+            }
+            res = -1;
+            if (cmdErrHandling == RunCmdFailureBad)
+                break;
+        }
+    }
+    return cmdErrHandling == RunCmdFailureBad ? res : 0;
+}
+
+/*
+ * Undoes, as far as can be told from the rules alone, whatever part of
+ * a batch a failed iptables-restore may have committed: the rules it
+ * appends or inserts are deleted and the chains it creates removed, in
+ * reverse order.  Each of these fails harmlessly where nothing was
+ * committed.  Deletes and flushes can't be undone; replaying them is
+ * harmless.
+ */
+void BandwidthController::clearBatch(IptIpVer iptVer, std::list<std::string> &rules) {
+    std::list<std::string>::reverse_iterator it;
+    std::string prefix, op, chain, spec, undo;
+
+    for (it = rules.rbegin(); it != rules.rend(); it++) {
+        splitRule(*it, prefix, op, chain, spec);
+        if (op == "-I" && !spec.empty() && isdigit(spec[0])) {
+            size_t end = spec.find(' ');
+            spec = end == std::string::npos ? "" : spec.substr(end + 1);
+        }
+        if (op == "-A" || op == "-I") {
+            undo = prefix + "-D " + chain + (spec.empty() ? "" : " " + spec);
+        } else if (op == "-N") {
+            undo = prefix + "-X " + chain;
+        } else {
+            continue;
+        }
+        runIptablesCmd(undo.c_str(), IptRejectNoAdd, iptVer);
+    }
+}
+
+/*
+ * Feeds the rules to "iptables-restore --noflush" as one transaction per
+ * table and logs the first rule it rejected.  On failure *firstUnapplied
+ * is the index of the first rule of the section that was not committed,
+ * or -1 if that can't be told.
+ */
+int BandwidthController::runIptablesRestore(IptIpVer iptVer, std::list<std::string> &rules,
+                                            int *firstUnapplied) {
+    const char *restorePath = iptVer == IptIpV4 ? IPTABLES_RESTORE_PATH : IP6TABLES_RESTORE_PATH;
+    std::list<std::string>::iterator it;
+    /* For each input line: the rule on it (if any) and its section's first rule */
+    std::list<std::pair<std::string, int> > lineRules;
+    std::string input;
+    std::string table;
+    int inFd[2], errFd[2];
+    char errBuf[MAX_CMD_LEN];
+    int errLen = 0;
+    int ruleNum = 0;
+    int sectionStart = 0;
+    int status;
+    pid_t pid;
+
+    *firstUnapplied = 0;
+
+    /* Rules default to the filter table unless they start with "-t <table> " */
+    for (it = rules.begin(); it != rules.end(); it++) {
+        std::string rule = *it;
+        std::string ruleTable = "filter";
+
+        if (!rule.compare(0, 3, "-t ")) {
+            size_t end = rule.find(' ', 3);
+            ruleTable = rule.substr(3, end - 3);
+            rule = end == std::string::npos ? "" : rule.substr(end + 1);
+        }
+        if (ruleTable != table) {
+            if (!table.empty()) {
+                input += "COMMIT\n";
+                lineRules.push_back(std::make_pair(std::string(), sectionStart));
+            }
+            sectionStart = ruleNum;
+            input += "*" + ruleTable + "\n";
+            lineRules.push_back(std::make_pair(std::string(), sectionStart));
+            table = ruleTable;
+        }
+        input += rule + "\n";
+        lineRules.push_back(std::make_pair(*it, sectionStart));
+        ruleNum++;
+    }
+    input += "COMMIT\n";
+    lineRules.push_back(std::make_pair(std::string(), sectionStart));
+
+    /* A socket, so an early exit by the child gives EPIPE rather than SIGPIPE */
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, inFd)) {
+        LOGE("socketpair failed (%s)", strerror(errno));
+        return -1;
+    }
+    if (pipe(errFd)) {
+        LOGE("pipe failed (%s)", strerror(errno));
+        close(inFd[0]);
+        close(inFd[1]);
+        return -1;
+    }
+
+    pid = fork();
+    if (pid < 0) {
+        LOGE("fork failed (%s)", strerror(errno));
+        close(inFd[0]);
+        close(inFd[1]);
+        close(errFd[0]);
+        close(errFd[1]);
+        return -1;
+    }
+    if (!pid) {
+        dup2(inFd[1], STDIN_FILENO);
+        dup2(errFd[1], STDOUT_FILENO);
+        dup2(errFd[1], STDERR_FILENO);
+        close(inFd[0]);
+        close(inFd[1]);
+        close(errFd[0]);
+        close(errFd[1]);
+        execl(restorePath, restorePath, "--noflush", (char *) NULL);
+        _exit(127);
+    }
+    close(inFd[1]);
+    close(errFd[1]);
+
+    const char *p = input.data();
+    size_t left = input.size();
+    while (left) {
+        ssize_t rc = send(inFd[0], p, left, MSG_NOSIGNAL);
+        if (rc < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        p += rc;
+        left -= rc;
+    }
+    close(inFd[0]);
+
+    while (errLen < (int) sizeof(errBuf) - 1) {
+        ssize_t rc = TEMP_FAILURE_RETRY(read(errFd[0], errBuf + errLen, sizeof(errBuf) - 1 - errLen));
+        if (rc <= 0)
+            break;
+        errLen += rc;
+    }
+    errBuf[errLen] = '\0';
+    close(errFd[0]);
+
+    if (TEMP_FAILURE_RETRY(waitpid(pid, &status, 0)) < 0) {
+        LOGE("waitpid failed (%s)", strerror(errno));
+        *firstUnapplied = -1;
+        return -1;
+    }
+    if (WIFEXITED(status) && !WEXITSTATUS(status))
+        return 0;
+
+    const char *lineMsg = strstr(errBuf, "line ");
+    unsigned int line;
+    if (lineMsg && sscanf(lineMsg, "line %u failed", &line) == 1 &&
+        line >= 1 && line <= lineRules.size()) {
+        std::list<std::pair<std::string, int> >::iterator lineIt = lineRules.begin();
+        std::advance(lineIt, line - 1);
+        LOGE("%s: rule '%s' failed", restorePath, lineIt->first.c_str());
+        *firstUnapplied = lineIt->second;
+    } else {
+        LOGE("%s failed status=0x%x: %s", restorePath, status, errBuf);
+        *firstUnapplied = -1;
+    }
+    return -1;
+}
+
 int BandwidthController::enableBandwidthControl(void) {
     int res;
 
@@ -223,20 +511,29 @@ int BandwidthController::enableBandwidthControl(void) {
     sharedQuotaBytes = sharedAlertBytes = 0;
 
 
-    /* Some of the initialCommands are allowed to fail */
+    /*
+     * Some of the initialCommands are allowed to fail.  The cleanup ones
+     * usually do on a fresh boot, and would get a whole restore section
+     * rejected, so only the setup goes into a batch.
+     */
     runCommands(sizeof(IPT_CLEANUP_COMMANDS) / sizeof(char*),
             IPT_CLEANUP_COMMANDS, RunCmdFailureOk);
+    beginBatch();
     runCommands(sizeof(IPT_SETUP_COMMANDS) / sizeof(char*),
             IPT_SETUP_COMMANDS, RunCmdFailureOk);
-    res = runCommands(sizeof(IPT_BASIC_ACCOUNTING_COMMANDS) / sizeof(char*),
+    commitBatch(RunCmdFailureOk);
+
+    beginBatch();
+    runCommands(sizeof(IPT_BASIC_ACCOUNTING_COMMANDS) / sizeof(char*),
             IPT_BASIC_ACCOUNTING_COMMANDS, RunCmdFailureBad);
+    res = commitBatch(RunCmdFailureBad);
 
     return res;
 
 }
 
 int BandwidthController::disableBandwidthControl(void) {
-    /* The IPT_CLEANUP_COMMANDS are allowed to fail. */
+    /* The IPT_CLEANUP_COMMANDS are allowed to fail, so they are not batched. */
     runCommands(sizeof(IPT_CLEANUP_COMMANDS) / sizeof(char*),
             IPT_CLEANUP_COMMANDS, RunCmdFailureOk);
     return 0;
@@ -292,6 +589,8 @@ int BandwidthController::maninpulateNaughtyApps(int numUids, char *appStrUids[],
     IptOp op;
     int appUids[numUids];
     std::string naughtyCmd;
+    BatchResult batchRes;
+    std::list<std::pair<IptIpVer, std::string> >::iterator it;
 
     switch (appOp) {
     case NaughtyAppOpAdd:
@@ -312,19 +611,35 @@ int BandwidthController::maninpulateNaughtyApps(int numUids, char *appStrUids[],
         }
     }
 
+    /* All uids go to iptables in a single transaction per IP version. */
+    beginBatch();
     for (uidNum = 0; uidNum < numUids; uidNum++) {
         naughtyCmd = makeIptablesNaughtyCmd(op, appUids[uidNum]);
-        if (runIpxtablesCmd(naughtyCmd.c_str(), IptRejectAdd)) {
-            LOGE(failLogTemplate, appUids[uidNum]);
-            goto fail_with_uidNum;
-        }
+        runIpxtablesCmd(naughtyCmd.c_str(), IptRejectAdd);
+    }
+    if (commitBatch(RunCmdFailureBad, &batchRes)) {
+        goto fail_batch;
     }
     return 0;
 
-fail_with_uidNum:
-    /* Try to remove the uid that failed in any case*/
-    naughtyCmd = makeIptablesNaughtyCmd(IptOpDelete, appUids[uidNum]);
-    runIpxtablesCmd(naughtyCmd.c_str(), IptRejectAdd);
+fail_batch:
+    for (uidNum = 0; uidNum < numUids; uidNum++) {
+        naughtyCmd = makeIptablesNaughtyCmd(op, appUids[uidNum]) + " ";
+        if (!batchRes.failedRule.compare(0, naughtyCmd.size(), naughtyCmd)) {
+            LOGE(failLogTemplate, appUids[uidNum]);
+            break;
+        }
+    }
+    if (op == IptOpInsert) {
+        /* Take back the rules this call did add, and only those */
+        beginBatch();
+        for (it = batchRes.applied.begin(); it != batchRes.applied.end(); it++) {
+            std::string undo = it->second;
+            undo.replace(0, 2, "-D");
+            runIptablesCmd(undo.c_str(), IptRejectNoAdd, it->first);
+        }
+        commitBatch(RunCmdFailureOk);
+    }
 fail_parse:
     return -1;
 }
@@ -364,6 +679,7 @@ int BandwidthController::prepCostlyIface(const char *ifn, QuotaType quotaType) {
     std::string costString;
     const char *costCString;
 
+    beginBatch();
     /* The "-N costly" is created upfront, no need to handle it here. */
     switch (quotaType) {
     case QuotaUnique:
@@ -395,6 +711,7 @@ int BandwidthController::prepCostlyIface(const char *ifn, QuotaType quotaType) {
     res |= runIpxtablesCmd(cmd, IptRejectNoAdd);
     snprintf(cmd, sizeof(cmd), "-I OUTPUT %d -o %s --goto %s", ruleInsertPos, ifn, costCString);
     res |= runIpxtablesCmd(cmd, IptRejectNoAdd);
+    res |= commitBatch(RunCmdFailureBad);
     return res;
 }
 
@@ -415,6 +732,7 @@ int BandwidthController::cleanupCostlyIface(const char *ifn, QuotaType quotaType
         break;
     }
 
+    beginBatch();
     snprintf(cmd, sizeof(cmd), "-D INPUT -i %s --goto %s", ifn, costCString);
     res |= runIpxtablesCmd(cmd, IptRejectNoAdd);
     snprintf(cmd, sizeof(cmd), "-D OUTPUT -o %s --goto %s", ifn, costCString);
@@ -427,6 +745,7 @@ int BandwidthController::cleanupCostlyIface(const char *ifn, QuotaType quotaType
         snprintf(cmd, sizeof(cmd), "-X %s", costCString);
         res |= runIpxtablesCmd(cmd, IptRejectNoAdd);
     }
+    res |= commitBatch(RunCmdFailureBad);
     return res;
 }
 
@@ -921,57 +1240,54 @@ int BandwidthController::removeCostlyAlert(const char *costName, int64_t *alertB
  *        0        0 ACCEPT     all  --  wlan0  rmnet0  0.0.0.0/0            0.0.0.0/0
  *
  */
-int BandwidthController::parseForwardChainStats(TetherStats &stats, FILE *fp) {
-    int res;
+int BandwidthController::parseForwardChainStats(FILE *fp, std::list<ForwardRuleStats> &rules) {
     char lineBuffer[MAX_IPT_OUTPUT_LINE_LEN];
-    char iface0[MAX_IPT_OUTPUT_LINE_LEN];
-    char iface1[MAX_IPT_OUTPUT_LINE_LEN];
-    char rest[MAX_IPT_OUTPUT_LINE_LEN];
-
     char *buffPtr;
-    int64_t packets, bytes;
 
     while (NULL != (buffPtr = fgets(lineBuffer, MAX_IPT_OUTPUT_LINE_LEN, fp))) {
-        /* Clean up, so a failed parse can still print info */
-        iface0[0] = iface1[0] = rest[0] = packets = bytes = 0;
-        res = sscanf(buffPtr, "%lld %lld ACCEPT all -- %s %s 0.%s",
-                &packets, &bytes, iface0, iface1, rest);
-        LOGV("parse res=%d iface0=<%s> iface1=<%s> pkts=%lld bytes=%lld rest=<%s> orig line=<%s>", res,
-             iface0, iface1, packets, bytes, rest, buffPtr);
-        if (res != 5) {
+        const char *fields[6];
+        char *save;
+        char *end;
+        int64_t packets, bytes;
+        int n;
+
+        packets = strtoll(buffPtr, &end, 10);
+        if (end == buffPtr)
+            continue;
+        buffPtr = end;
+        bytes = strtoll(buffPtr, &end, 10);
+        if (end == buffPtr)
             continue;
+
+        /* target prot opt in out source */
+        for (n = 0; n < 6; n++) {
+            fields[n] = strtok_r(n ? NULL : end, " \t\n", &save);
+            if (!fields[n])
+                break;
         }
-        if ((stats.ifaceIn == iface0) && (stats.ifaceOut == iface1)) {
-            LOGV("iface_in=%s iface_out=%s rx_bytes=%lld rx_packets=%lld ", iface0, iface1, bytes, packets);
-            stats.rxPackets = packets;
-            stats.rxBytes = bytes;
-        } else if ((stats.ifaceOut == iface0) && (stats.ifaceIn == iface1)) {
-            LOGV("iface_in=%s iface_out=%s tx_bytes=%lld tx_packets=%lld ", iface1, iface0, bytes, packets);
-            stats.txPackets = packets;
-            stats.txBytes = bytes;
+        if (n != 6 || strcmp(fields[0], "ACCEPT") || strcmp(fields[1], "all") ||
+            strcmp(fields[2], "--") || strncmp(fields[5], "0.", 2)) {
+            continue;
         }
+        LOGV("iface0=<%s> iface1=<%s> pkts=%lld bytes=%lld", fields[3], fields[4],
+             packets, bytes);
+        rules.push_back(ForwardRuleStats(fields[3], fields[4], packets, bytes));
     }
-    /* Failure if rx or tx was not found */
-    return (stats.rxBytes == -1 || stats.txBytes == -1) ? -1 : 0;
-}
-
-
-char *BandwidthController::TetherStats::getStatsLine(void) {
-    char *msg;
-    asprintf(&msg, "%s %s %lld %lld %lld %lld", ifaceIn.c_str(), ifaceOut.c_str(),
-            rxBytes, rxPackets, txBytes, txPackets);
-    return msg;
+    return 0;
 }
 
-int BandwidthController::getTetherStats(TetherStats &stats) {
-    int res;
+int BandwidthController::refreshForwardChainStats(void) {
+    std::list<ForwardRuleStats> rules;
     std::string fullCmd;
     FILE *iptOutput;
-    const char *cmd;
+    struct timespec now;
+    int64_t nowMs;
+    int res;
 
-    if (stats.rxBytes != -1 || stats.txBytes != -1) {
-        LOGE("Unexpected input stats. Byte counts should be -1.");
-        return -1;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    nowMs = (int64_t) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+    if (fwdRuleStatsTimeMs >= 0 && nowMs - fwdRuleStatsTimeMs < TETHER_STATS_CACHE_MS) {
+        return 0;
     }
 
     /*
@@ -988,9 +1304,58 @@ int BandwidthController::getTetherStats(TetherStats &stats) {
             LOGE("Failed to run %s err=%s", fullCmd.c_str(), strerror(errno));
         return -1;
     }
-    res = parseForwardChainStats(stats, iptOutput);
+    res = parseForwardChainStats(iptOutput, rules);
     pclose(iptOutput);
+    if (res)
+        return res;
+
+    fwdRuleStats.swap(rules);
+    fwdRuleStatsTimeMs = nowMs;
+    return 0;
+}
+
+int BandwidthController::findTetherStats(TetherStats &stats) {
+    std::list<ForwardRuleStats>::iterator it;
+
+    for (it = fwdRuleStats.begin(); it != fwdRuleStats.end(); it++) {
+        if ((stats.ifaceIn == it->iface0) && (stats.ifaceOut == it->iface1)) {
+            LOGV("iface_in=%s iface_out=%s rx_bytes=%lld rx_packets=%lld ",
+                 it->iface0.c_str(), it->iface1.c_str(), it->bytes, it->packets);
+            stats.rxPackets = it->packets;
+            stats.rxBytes = it->bytes;
+        } else if ((stats.ifaceOut == it->iface0) && (stats.ifaceIn == it->iface1)) {
+            LOGV("iface_in=%s iface_out=%s tx_bytes=%lld tx_packets=%lld ",
+                 it->iface1.c_str(), it->iface0.c_str(), it->bytes, it->packets);
+            stats.txPackets = it->packets;
+            stats.txBytes = it->bytes;
+        }
+    }
+    /* Failure if rx or tx was not found */
+    return (stats.rxBytes == -1 || stats.txBytes == -1) ? -1 : 0;
+}
+
+
+char *BandwidthController::TetherStats::getStatsLine(void) {
+    char *msg;
+    asprintf(&msg, "%s %s %lld %lld %lld %lld", ifaceIn.c_str(), ifaceOut.c_str(),
+            rxBytes, rxPackets, txBytes, txPackets);
+    return msg;
+}
+
+int BandwidthController::getTetherStats(TetherStats &stats) {
+    if (stats.rxBytes != -1 || stats.txBytes != -1) {
+        LOGE("Unexpected input stats. Byte counts should be -1.");
+        return -1;
+    }
+
+    if (refreshForwardChainStats())
+        return -1;
 
     /* Currently NatController doesn't do ipv6 tethering, so we are done. */
-    return res;
+    return findTetherStats(stats);
+}
+
+void BandwidthController::invalidateTetherStats(void) {
+    fwdRuleStats.clear();
+    fwdRuleStatsTimeMs = -1;
 }
@@ -76,6 +76,8 @@ public:
      * Byte counts should be left to the default (-1).
      */
     int getTetherStats(TetherStats &stats);
+    /* To be called whenever the FORWARD chain changes */
+    static void invalidateTetherStats(void);
 
 protected:
     class QuotaInfo {
@@ -105,6 +107,25 @@ protected:
     int runIptablesAlertCmd(IptOp op, const char *alertName, int64_t bytes);
     int runIptablesAlertFwdCmd(IptOp op, const char *alertName, int64_t bytes);
 
+    /*
+     * While a batch is open, runIptablesCmd() only queues the rules.
+     * commitBatch() then applies them with one iptables-restore per IP
+     * version; each table section is applied atomically by the kernel.
+     * Batches nest; only the outermost commit touches iptables.
+     */
+    static void beginBatch(void);
+    /* What a failed commitBatch() managed to apply, so callers can undo it */
+    class BatchResult {
+    public:
+        IptIpVer failedVer;
+        std::string failedRule;  /* the first rule iptables rejected */
+        std::list<std::pair<IptIpVer, std::string> > applied;
+    };
+    static int commitBatch(RunCmdErrHandling cmdErrHandling, BatchResult *result = NULL);
+    static int runIptablesRestore(IptIpVer iptVer, std::list<std::string> &rules,
+                                  int *firstUnapplied);
+    static void clearBatch(IptIpVer iptVer, std::list<std::string> &rules);
+
     /* Runs for both ipv4 and ipv6 iptables */
     int runCommands(int numCommands, const char *commands[], RunCmdErrHandling cmdErrHandling);
     /* Runs for both ipv4 and ipv6 iptables, appends -j REJECT --reject-with ...  */
@@ -119,11 +140,28 @@ protected:
     int setCostlyAlert(const char *costName, int64_t bytes, int64_t *alertBytes);
     int removeCostlyAlert(const char *costName, int64_t *alertBytes);
 
+    /* Counters of one "ACCEPT all -- iface0 iface1 0.0.0.0/0 ..." FORWARD rule */
+    class ForwardRuleStats {
+    public:
+        ForwardRuleStats(std::string ifn0, std::string ifn1, int64_t p, int64_t b)
+                : iface0(ifn0), iface1(ifn1), packets(p), bytes(b) {};
+        std::string iface0;
+        std::string iface1;
+        int64_t packets;
+        int64_t bytes;
+    };
+
     /*
-     * stats should have ifaceIn and ifaceOut initialized.
      * fp should be a file to the FORWARD rules of iptables.
+     * Collects the counters of every tethering ACCEPT rule in one pass.
      */
-    static int parseForwardChainStats(TetherStats &stats, FILE *fp);
+    static int parseForwardChainStats(FILE *fp, std::list<ForwardRuleStats> &rules);
+    /* Refreshes fwdRuleStats unless it is younger than TETHER_STATS_CACHE_MS */
+    static int refreshForwardChainStats(void);
+    /*
+     * stats should have ifaceIn and ifaceOut initialized.
+     */
+    static int findTetherStats(TetherStats &stats);
 
     /*------------------*/
 
@@ -154,16 +192,27 @@ private:
     static const int  ALERT_RULE_POS_IN_COSTLY_CHAIN;
     static const char ALERT_GLOBAL_NAME[];
     static const char IP6TABLES_PATH[];
+    static const char IP6TABLES_RESTORE_PATH[];
     static const char IPTABLES_PATH[];
+    static const char IPTABLES_RESTORE_PATH[];
     static const int  MAX_CMD_ARGS;
     static const int  MAX_CMD_LEN;
     static const int  MAX_IFACENAME_LEN;
     static const int  MAX_IPT_OUTPUT_LINE_LEN;
+    static const int  TETHER_STATS_CACHE_MS;
 
     /*
      * When false, it will directly use system() instead of logwrap()
      */
     static bool useLogwrapCall;
+
+    /* Rules queued by runIptablesCmd() while a batch is open, per IptIpVer */
+    static int batchDepth;
+    static std::list<std::string> batchRules[2];
+
+    /* Last FORWARD chain listing, shared by all pairs of one stats poll */
+    static std::list<ForwardRuleStats> fwdRuleStats;
+    static int64_t fwdRuleStatsTimeMs;
 };
 
 #endif
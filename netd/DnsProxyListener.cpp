@@ -24,6 +24,7 @@
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <string.h>
+#include <time.h>
 
 #define LOG_TAG "DnsProxyListener"
 #define DBG 0
@@ -33,37 +34,104 @@
 
 #include "DnsProxyListener.h"
 
+pthread_mutex_t DnsProxyListener::sLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t DnsProxyListener::sQueueCond = PTHREAD_COND_INITIALIZER;
+std::list<DnsProxyListener::Job*> DnsProxyListener::sQueue;
+std::map<std::string, std::list<SocketClient*> > DnsProxyListener::sInFlight;
+std::map<std::string, DnsProxyListener::CachedAnswer> DnsProxyListener::sAnswers;
+unsigned DnsProxyListener::sCacheGeneration = 0;
+
 DnsProxyListener::DnsProxyListener() :
                  FrameworkListener("dnsproxyd") {
     registerCmd(new GetAddrInfoCmd());
     registerCmd(new GetHostByAddrCmd());
+    startWorkers();
 }
 
-DnsProxyListener::GetAddrInfoHandler::~GetAddrInfoHandler() {
-    free(mHost);
-    free(mService);
-    free(mHints);
+/*******************************************************
+ *                  Resolver threads                    *
+ *******************************************************/
+void DnsProxyListener::startWorkers() {
+    pthread_attr_t attr;
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    for (int i = 0; i < WORKER_THREADS; i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, &attr, DnsProxyListener::workerStart, NULL)) {
+            LOGE("Failed to start resolver thread (%s)", strerror(errno));
+        }
+    }
+    pthread_attr_destroy(&attr);
 }
 
-void DnsProxyListener::GetAddrInfoHandler::start() {
-    pthread_create(&mThread, NULL,
-                   DnsProxyListener::GetAddrInfoHandler::threadStart, this);
-}
+void* DnsProxyListener::workerStart(void* obj) {
+    while (true) {
+        pthread_mutex_lock(&sLock);
+        while (sQueue.empty()) {
+            pthread_cond_wait(&sQueueCond, &sLock);
+        }
+        Job* job = sQueue.front();
+        sQueue.pop_front();
+        pthread_mutex_unlock(&sLock);
 
-void* DnsProxyListener::GetAddrInfoHandler::threadStart(void* obj) {
-    GetAddrInfoHandler* handler = reinterpret_cast<GetAddrInfoHandler*>(obj);
-    handler->run();
-    delete handler;
-    pthread_exit(NULL);
+        job->run();
+        delete job;
+    }
     return NULL;
 }
 
+bool DnsProxyListener::queueJob(Job* job) {
+    pthread_mutex_lock(&sLock);
+    if (sQueue.size() >= (size_t) QUEUE_MAX) {
+        pthread_mutex_unlock(&sLock);
+        LOGW("Resolver queue full, dropping request");
+        return false;
+    }
+    sQueue.push_back(job);
+    pthread_cond_signal(&sQueueCond);
+    pthread_mutex_unlock(&sLock);
+    return true;
+}
+
+void DnsProxyListener::flushCache() {
+    pthread_mutex_lock(&sLock);
+    sAnswers.clear();
+    sCacheGeneration++;
+    pthread_mutex_unlock(&sLock);
+}
+
+int64_t DnsProxyListener::nowMs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Appends 4 bytes of big-endian length, followed by the data.
+static void appendLenAndData(std::string& out, const int len, const void* data) {
+    uint32_t len_be = htonl(len);
+    out.append((const char*) &len_be, 4);
+    if (len) {
+        out.append((const char*) data, len);
+    }
+}
+
 // Sends 4 bytes of big-endian length, followed by the data.
 // Returns true on success.
 static bool sendLenAndData(SocketClient *c, const int len, const void* data) {
-    uint32_t len_be = htonl(len);
-    return c->sendData(&len_be, 4) == 0 &&
-        (len == 0 || c->sendData(data, len) == 0);
+    std::string out;
+    appendLenAndData(out, len, data);
+    return c->sendData(out.data(), out.size()) == 0;
+}
+
+DnsProxyListener::GetAddrInfoHandler::~GetAddrInfoHandler() {
+    free(mHost);
+    free(mService);
+    free(mHints);
+}
+
+bool DnsProxyListener::GetAddrInfoHandler::start() {
+    return queueJob(this);
 }
 
 void DnsProxyListener::GetAddrInfoHandler::run() {
@@ -71,28 +139,64 @@ void DnsProxyListener::GetAddrInfoHandler::run() {
         LOGD("GetAddrInfoHandler, now for %s / %s", mHost, mService);
     }
 
+    pthread_mutex_lock(&sLock);
+    unsigned generation = sCacheGeneration;
+    pthread_mutex_unlock(&sLock);
+
+    // Build the whole reply up front so that it can be cached and goes
+    // out to each waiting client in a single write.
     struct addrinfo* result = NULL;
     int rv = getaddrinfo(mHost, mService, mHints, &result);
-    bool success = (mClient->sendData(&rv, sizeof(rv)) == 0);
+    std::string reply((const char*) &rv, sizeof(rv));
     if (rv == 0) {
-        struct addrinfo* ai = result;
-        while (ai && success) {
-            success = sendLenAndData(mClient, sizeof(struct addrinfo), ai)
-                && sendLenAndData(mClient, ai->ai_addrlen, ai->ai_addr)
-                && sendLenAndData(mClient,
-                                  ai->ai_canonname ? strlen(ai->ai_canonname) + 1 : 0,
-                                  ai->ai_canonname);
-            ai = ai->ai_next;
+        for (struct addrinfo* ai = result; ai; ai = ai->ai_next) {
+            appendLenAndData(reply, sizeof(struct addrinfo), ai);
+            appendLenAndData(reply, ai->ai_addrlen, ai->ai_addr);
+            appendLenAndData(reply,
+                             ai->ai_canonname ? strlen(ai->ai_canonname) + 1 : 0,
+                             ai->ai_canonname);
         }
-        success = success && sendLenAndData(mClient, 0, "");
+        appendLenAndData(reply, 0, "");
     }
     if (result) {
         freeaddrinfo(result);
     }
-    if (!success) {
-        LOGW("Error writing DNS result to client");
+
+    std::list<SocketClient*> waiters;
+    pthread_mutex_lock(&sLock);
+    std::map<std::string, std::list<SocketClient*> >::iterator it = sInFlight.find(mKey);
+    if (it != sInFlight.end()) {
+        waiters.swap(it->second);
+        sInFlight.erase(it);
+    }
+    if ((rv == 0 || rv == EAI_NONAME) && generation == sCacheGeneration) {
+        int64_t now = nowMs();
+        if (sAnswers.size() >= (size_t) CACHE_MAX) {
+            std::map<std::string, CachedAnswer>::iterator ait = sAnswers.begin();
+            while (ait != sAnswers.end()) {
+                if (ait->second.expiresMs <= now) {
+                    sAnswers.erase(ait++);
+                } else {
+                    ++ait;
+                }
+            }
+        }
+        if (sAnswers.size() < (size_t) CACHE_MAX) {
+            CachedAnswer& answer = sAnswers[mKey];
+            answer.data = reply;
+            answer.expiresMs = now + (rv == 0 ? POSITIVE_TTL_MS : NEGATIVE_TTL_MS);
+        }
+    }
+    pthread_mutex_unlock(&sLock);
+
+    while (!waiters.empty()) {
+        SocketClient* c = waiters.front();
+        waiters.pop_front();
+        if (c->sendData(reply.data(), reply.size())) {
+            LOGW("Error writing DNS result to client");
+        }
+        c->decRef();
     }
-    mClient->decRef();
 }
 
 DnsProxyListener::GetAddrInfoCmd::GetAddrInfoCmd() :
@@ -146,10 +250,66 @@ int DnsProxyListener::GetAddrInfoCmd::runCommand(SocketClient *cli,
              service ? service : "[nullservice]");
     }
 
+    // Identical lookups are answered from the cache, or piggy-back on the
+    // one already being resolved, rather than each costing a resolution.
+    std::string key;
+    key.append(argv[1]).append(1, '\0').append(argv[2]);
+    for (int i = 3; i < 7; i++) {
+        key.append(1, '\0').append(argv[i]);
+    }
+
+    pthread_mutex_lock(&sLock);
+    std::map<std::string, CachedAnswer>::iterator ait = sAnswers.find(key);
+    if (ait != sAnswers.end()) {
+        if (ait->second.expiresMs > nowMs()) {
+            std::string reply = ait->second.data;
+            pthread_mutex_unlock(&sLock);
+            free(name);
+            free(service);
+            free(hints);
+            if (cli->sendData(reply.data(), reply.size())) {
+                LOGW("Error writing DNS result to client");
+            }
+            return 0;
+        }
+        sAnswers.erase(ait);
+    }
+
     cli->incRef();
+    std::map<std::string, std::list<SocketClient*> >::iterator it = sInFlight.find(key);
+    if (it != sInFlight.end()) {
+        it->second.push_back(cli);
+        pthread_mutex_unlock(&sLock);
+        free(name);
+        free(service);
+        free(hints);
+        return 0;
+    }
+    sInFlight[key].push_back(cli);
+    pthread_mutex_unlock(&sLock);
+
     DnsProxyListener::GetAddrInfoHandler* handler =
-        new DnsProxyListener::GetAddrInfoHandler(cli, name, service, hints);
-    handler->start();
+        new DnsProxyListener::GetAddrInfoHandler(key, name, service, hints);
+    if (!handler->start()) {
+        delete handler;
+
+        std::list<SocketClient*> waiters;
+        pthread_mutex_lock(&sLock);
+        it = sInFlight.find(key);
+        if (it != sInFlight.end()) {
+            waiters.swap(it->second);
+            sInFlight.erase(it);
+        }
+        pthread_mutex_unlock(&sLock);
+
+        int rv = EAI_AGAIN;
+        while (!waiters.empty()) {
+            SocketClient* c = waiters.front();
+            waiters.pop_front();
+            c->sendData(&rv, sizeof(rv));
+            c->decRef();
+        }
+    }
 
     return 0;
 }
@@ -191,7 +351,11 @@ int DnsProxyListener::GetHostByAddrCmd::runCommand(SocketClient *cli,
     cli->incRef();
     DnsProxyListener::GetHostByAddrHandler* handler =
             new DnsProxyListener::GetHostByAddrHandler(cli, addr, addrLen, addrFamily);
-    handler->start();
+    if (!handler->start()) {
+        delete handler;
+        sendLenAndData(cli, 0, NULL);
+        cli->decRef();
+    }
 
     return 0;
 }
@@ -200,17 +364,8 @@ DnsProxyListener::GetHostByAddrHandler::~GetHostByAddrHandler() {
     free(mAddress);
 }
 
-void DnsProxyListener::GetHostByAddrHandler::start() {
-    pthread_create(&mThread, NULL,
-                   DnsProxyListener::GetHostByAddrHandler::threadStart, this);
-}
-
-void* DnsProxyListener::GetHostByAddrHandler::threadStart(void* obj) {
-    GetHostByAddrHandler* handler = reinterpret_cast<GetHostByAddrHandler*>(obj);
-    handler->run();
-    delete handler;
-    pthread_exit(NULL);
-    return NULL;
+bool DnsProxyListener::GetHostByAddrHandler::start() {
+    return queueJob(this);
 }
 
 void DnsProxyListener::GetHostByAddrHandler::run() {
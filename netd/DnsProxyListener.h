@@ -18,6 +18,9 @@
 #define _DNSPROXYLISTENER_H__
 
 #include <pthread.h>
+#include <list>
+#include <map>
+#include <string>
 #include <sysutils/FrameworkListener.h>
 
 #include "NetdCommand.h"
@@ -27,7 +30,50 @@ public:
     DnsProxyListener();
     virtual ~DnsProxyListener() {}
 
+    /* Drops every cached answer, for when the network or its DNS changes */
+    static void flushCache();
+
 private:
+    static const int WORKER_THREADS = 8;
+    static const int QUEUE_MAX = 256;
+    static const int CACHE_MAX = 256;
+    /*
+     * getaddrinfo() does not expose record TTLs, so answers are kept for
+     * much less than any sane TTL; bionic's res_cache underneath remains
+     * the authority on expiry.  This layer only absorbs request bursts.
+     */
+    static const int POSITIVE_TTL_MS = 5000;
+    static const int NEGATIVE_TTL_MS = 2000;
+
+    /* A unit of work run by one of the resolver threads. */
+    class Job {
+    public:
+        virtual ~Job() {}
+        virtual void run() = 0;
+    };
+
+    /* A serialized getaddrinfo reply and when it stops being valid. */
+    class CachedAnswer {
+    public:
+        std::string data;
+        int64_t expiresMs;
+    };
+
+    static pthread_mutex_t sLock;       // guards everything below
+    static pthread_cond_t sQueueCond;
+    static std::list<Job*> sQueue;
+    // Clients waiting on a lookup that is being resolved, by lookup key
+    static std::map<std::string, std::list<SocketClient*> > sInFlight;
+    static std::map<std::string, CachedAnswer> sAnswers;
+    // Bumped by flushCache(), so lookups begun before it aren't cached
+    static unsigned sCacheGeneration;
+
+    static void startWorkers();
+    static void* workerStart(void* obj);
+    // Returns false if the queue is full; the caller still owns the job.
+    static bool queueJob(Job* job);
+    static int64_t nowMs();
+
     class GetAddrInfoCmd : public NetdCommand {
     public:
         GetAddrInfoCmd();
@@ -35,26 +81,25 @@ private:
         int runCommand(SocketClient *c, int argc, char** argv);
     };
 
-    class GetAddrInfoHandler {
+    // Resolves one lookup key and answers every client waiting on it
+    class GetAddrInfoHandler : public Job {
     public:
         // Note: All of host, service, and hints may be NULL
-        GetAddrInfoHandler(SocketClient *c,
+        GetAddrInfoHandler(const std::string& key,
                            char* host,
                            char* service,
                            struct addrinfo* hints)
-            : mClient(c),
+            : mKey(key),
               mHost(host),
               mService(service),
               mHints(hints) {}
         ~GetAddrInfoHandler();
 
-        static void* threadStart(void* handler);
-        void start();
+        bool start();
+        void run();
 
     private:
-        void run();
-        pthread_t mThread;
-        SocketClient* mClient;  // ref counted
+        std::string mKey;
         char* mHost;    // owned
         char* mService; // owned
         struct addrinfo* mHints;  // owned
@@ -68,7 +113,7 @@ private:
         int runCommand(SocketClient *c, int argc, char** argv);
     };
 
-    class GetHostByAddrHandler {
+    class GetHostByAddrHandler : public Job {
     public:
         GetHostByAddrHandler(SocketClient *c,
                             void* address,
@@ -80,12 +125,10 @@ private:
               mAddressFamily(addressFamily) {}
         ~GetHostByAddrHandler();
 
-        static void* threadStart(void* handler);
-        void start();
+        bool start();
+        void run();
 
     private:
-        void run();
-        pthread_t mThread;
         SocketClient* mClient;  // ref counted
         void* mAddress;    // address to lookup; owned
         int   mAddressLen; // length of address to look up
@@ -27,13 +27,16 @@
 #define LOG_TAG "NatController"
 #include <cutils/log.h>
 
+#include "BandwidthController.h"
 #include "NatController.h"
+#include "NetlinkTransaction.h"
 #include "SecondaryTableController.h"
 
 extern "C" int system_nosh(const char *command);
 
 static char IPTABLES_PATH[] = "/system/bin/iptables";
 static char IP_PATH[] = "/system/bin/ip";
+static char ROUTE_FLUSH_PATH[] = "/proc/sys/net/ipv4/route/flush";
 
 NatController::NatController(SecondaryTableController *ctrl) {
     secondaryTableCtrl = ctrl;
@@ -66,6 +69,7 @@ int NatController::setDefaults() {
         return -1;
     if (runCmd(IPTABLES_PATH, "-P OUTPUT ACCEPT"))
         return -1;
+    BandwidthController::invalidateTetherStats();
     if (runCmd(IPTABLES_PATH, "-P FORWARD DROP"))
         return -1;
     if (runCmd(IPTABLES_PATH, "-F FORWARD"))
@@ -85,6 +89,90 @@ int NatController::setDefaults() {
     return 0;
 }
 
+/*
+ * Adds (or removes) the "from <addr> table N" rule and "<addr> dev intIface
+ * table N" route for each NATed address.  All of them go to the kernel
+ * in one rtnetlink transaction; the ip tool is only used as a fallback.
+ * Removal carries on past errors, since routes vanish with their iface.
+ */
+int NatController::modifyTetherRoutes(bool add, const char *intIface, int addrCount,
+                                      char **addrs, int table) {
+    NetlinkTransaction nl;
+    char cmd[255];
+    int ret = 0;
+    int i;
+
+    if (nl.isAvailable()) {
+        bool queued = true;
+        for (i = 0; i < addrCount && queued; i++) {
+            if (add) {
+                queued = nl.addRule(true, addrs[i], table) &&
+                        nl.addRoute(true, addrs[i], prefixOf(addrs[i]), NULL, intIface, table);
+            } else {
+                queued = nl.addRoute(false, addrs[i], prefixOf(addrs[i]), NULL, intIface, table) &&
+                        nl.addRule(false, addrs[i], table);
+            }
+        }
+        if (queued) {
+            int failed;
+            ret = nl.commit(&failed);
+            if (ret && add) {
+                LOGE("rtnetlink request %d of %d for %s failed: %s", failed + 1, 2 * addrCount,
+                        addrs[failed / 2], strerror(-ret));
+            }
+            flushRouteCache();
+            return add ? ret : 0;
+        }
+    }
+
+    for (i = 0; i < addrCount && (!add || ret == 0); i++) {
+        if (add) {
+            snprintf(cmd, sizeof(cmd), "%s rule add from %s table %d", getVersion(addrs[i]),
+                    addrs[i], table);
+            ret |= runCmd(IP_PATH, cmd);
+            if (ret) LOGE("IP rule %s got %d", cmd, ret);
+
+            snprintf(cmd, sizeof(cmd), "route add %s dev %s table %d", addrs[i], intIface,
+                    table);
+            ret |= runCmd(IP_PATH, cmd);
+            if (ret) LOGE("IP route %s got %d", cmd, ret);
+        } else {
+            snprintf(cmd, sizeof(cmd), "route del %s dev %s table %d", addrs[i], intIface,
+                    table);
+            // if the interface has gone down these will be gone already and give errors
+            // ignore them.
+            runCmd(IP_PATH, cmd);
+
+            snprintf(cmd, sizeof(cmd), "%s rule del from %s table %d", getVersion(addrs[i]),
+                    addrs[i], table);
+            runCmd(IP_PATH, cmd);
+        }
+    }
+    flushRouteCache();
+    return ret;
+}
+
+int NatController::prefixOf(const char *addr) {
+    unsigned char buf[16];
+    int prefixLen;
+
+    if (NetlinkTransaction::parsePrefix(addr, buf, &prefixLen) < 0)
+        return -1;
+    return prefixLen;
+}
+
+void NatController::flushRouteCache() {
+    int fd = open(ROUTE_FLUSH_PATH, O_WRONLY);
+
+    if (fd >= 0) {
+        int ok = write(fd, "1", 1) == 1;
+        close(fd);
+        if (ok)
+            return;
+    }
+    runCmd(IP_PATH, "route flush cache");
+}
+
 bool NatController::checkInterface(const char *iface) {
     if (strlen(iface) > MAX_IFACE_LENGTH) return false;
     return true;
@@ -102,7 +190,6 @@ const char *NatController::getVersion(const char *addr) {
 // nat enable intface extface addrcnt nated-ipaddr/prelength
 int NatController::enableNat(const int argc, char **argv) {
     char cmd[255];
-    int i;
     int addrCount = atoi(argv[4]);
     int ret = 0;
     const char *intIface = argv[2];
@@ -123,32 +210,14 @@ int NatController::enableNat(const int argc, char **argv) {
 
     tableNumber = secondaryTableCtrl->findTableNumber(extIface);
     if (tableNumber != -1) {
-        for(i = 0; i < addrCount && ret == 0; i++) {
-            snprintf(cmd, sizeof(cmd), "%s rule add from %s table %d", getVersion(argv[5+i]),
-                    argv[5+i], tableNumber + BASE_TABLE_NUMBER);
-            ret |= runCmd(IP_PATH, cmd);
-            if (ret) LOGE("IP rule %s got %d", cmd, ret);
-
-            snprintf(cmd, sizeof(cmd), "route add %s dev %s table %d", argv[5+i], intIface,
-                    tableNumber + BASE_TABLE_NUMBER);
-            ret |= runCmd(IP_PATH, cmd);
-            if (ret) LOGE("IP route %s got %d", cmd, ret);
-        }
-        runCmd(IP_PATH, "route flush cache");
+        ret = modifyTetherRoutes(true, intIface, addrCount, &argv[5],
+                tableNumber + BASE_TABLE_NUMBER);
     }
 
     if (ret != 0 || setForwardRules(true, intIface, extIface) != 0) {
         if (tableNumber != -1) {
-            for (i = 0; i < addrCount; i++) {
-                snprintf(cmd, sizeof(cmd), "route del %s dev %s table %d", argv[5+i], intIface,
-                        tableNumber + BASE_TABLE_NUMBER);
-                runCmd(IP_PATH, cmd);
-
-                snprintf(cmd, sizeof(cmd), "%s rule del from %s table %d", getVersion(argv[5+i]),
-                        argv[5+i], tableNumber + BASE_TABLE_NUMBER);
-                runCmd(IP_PATH, cmd);
-            }
-            runCmd(IP_PATH, "route flush cache");
+            modifyTetherRoutes(false, intIface, addrCount, &argv[5],
+                    tableNumber + BASE_TABLE_NUMBER);
         }
         LOGE("Error setting forward rules");
         errno = ENODEV;
@@ -162,10 +231,9 @@ int NatController::enableNat(const int argc, char **argv) {
         if (runCmd(IPTABLES_PATH, cmd)) {
             LOGE("Error seting postroute rule: %s", cmd);
             // unwind what's been done, but don't care about success - what more could we do?
-            for (i = 0; i < addrCount; i++) {
-                snprintf(cmd, sizeof(cmd), "route del %s dev %s table %d", argv[5+i], intIface,
+            if (tableNumber != -1) {
+                modifyTetherRoutes(false, intIface, addrCount, &argv[5],
                         tableNumber + BASE_TABLE_NUMBER);
-                runCmd(IP_PATH, cmd);
             }
             setDefaults();
             return -1;
@@ -178,6 +246,9 @@ int NatController::enableNat(const int argc, char **argv) {
 int NatController::setForwardRules(bool add, const char *intIface, const char * extIface) {
     char cmd[255];
 
+    /* The counters cached for tether stats go with the rules */
+    BandwidthController::invalidateTetherStats();
+
     snprintf(cmd, sizeof(cmd),
              "-%s FORWARD -i %s -o %s -m state --state ESTABLISHED,RELATED -j ACCEPT",
              (add ? "A" : "D"),
@@ -224,8 +295,6 @@ int NatController::setForwardRules(bool add, const char *intIface, const char *
 //  0    1       2       3       4            5
 // nat enable intface extface addrcnt nated-ipaddr/prelength
 int NatController::disableNat(const int argc, char **argv) {
-    char cmd[255];
-    int i;
     int addrCount = atoi(argv[4]);
     const char *intIface = argv[2];
     const char *extIface = argv[3];
@@ -247,19 +316,8 @@ int NatController::disableNat(const int argc, char **argv) {
 
     tableNumber = secondaryTableCtrl->findTableNumber(extIface);
     if (tableNumber != -1) {
-        for (i = 0; i < addrCount; i++) {
-            snprintf(cmd, sizeof(cmd), "route del %s dev %s table %d", argv[5+i], intIface,
-                    tableNumber + BASE_TABLE_NUMBER);
-            // if the interface has gone down these will be gone already and give errors
-            // ignore them.
-            runCmd(IP_PATH, cmd);
-
-            snprintf(cmd, sizeof(cmd), "%s rule del from %s table %d", getVersion(argv[5+i]),
-                    argv[5+i], tableNumber + BASE_TABLE_NUMBER);
-            runCmd(IP_PATH, cmd);
-        }
-
-        runCmd(IP_PATH, "route flush cache");
+        modifyTetherRoutes(false, intIface, addrCount, &argv[5],
+                tableNumber + BASE_TABLE_NUMBER);
     }
 
     if (--natCount <= 0) {
@@ -40,6 +40,10 @@ private:
     int runCmd(const char *path, const char *cmd);
     bool checkInterface(const char *iface);
     int setForwardRules(bool set, const char *intIface, const char *extIface);
+    int modifyTetherRoutes(bool add, const char *intIface, int addrCount, char **addrs,
+                           int table);
+    static int prefixOf(const char *addr);
+    void flushRouteCache();
     const char *getVersion(const char *addr);
 };
 
@@ -0,0 +1,297 @@
+/*
+ * Copyright (C) 2012 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+#include <sys/types.h>
+
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <linux/fib_rules.h>
+
+#define LOG_TAG "NetlinkTransaction"
+#include <cutils/log.h>
+
+#include "NetlinkTransaction.h"
+
+NetlinkTransaction::NetlinkTransaction() {
+    struct sockaddr_nl addr;
+
+    mLen = 0;
+    mCurrent = NULL;
+    mCount = 0;
+    mSeq = time(NULL);
+
+    mSock = socket(PF_NETLINK, SOCK_DGRAM, NETLINK_ROUTE);
+    if (mSock < 0) {
+        LOGE("Unable to create rtnetlink socket: %s", strerror(errno));
+        return;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.nl_family = AF_NETLINK;
+    if (bind(mSock, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        LOGE("Unable to bind rtnetlink socket: %s", strerror(errno));
+        close(mSock);
+        mSock = -1;
+    }
+}
+
+NetlinkTransaction::~NetlinkTransaction() {
+    if (mSock >= 0)
+        close(mSock);
+}
+
+bool NetlinkTransaction::addMessage(int type, int flags, const void *hdr, size_t hdrLen) {
+    size_t len = NLMSG_LENGTH(hdrLen);
+
+    if (mCount >= MAX_MESSAGES || mLen + NLMSG_ALIGN(len) > sizeof(mBuffer)) {
+        LOGE("Netlink transaction full");
+        return false;
+    }
+
+    mCurrent = (struct nlmsghdr *) (mBuffer + mLen);
+    memset(mCurrent, 0, NLMSG_ALIGN(len));
+    mCurrent->nlmsg_len = len;
+    mCurrent->nlmsg_type = type;
+    mCurrent->nlmsg_flags = flags | NLM_F_REQUEST | NLM_F_ACK;
+    mCurrent->nlmsg_seq = mSeq + mCount;
+    memcpy(NLMSG_DATA(mCurrent), hdr, hdrLen);
+
+    mLen += NLMSG_ALIGN(len);
+    mBestEffort[mCount] = false;
+    mCount++;
+    return true;
+}
+
+void NetlinkTransaction::setBestEffort() {
+    if (mCurrent)
+        mBestEffort[mCount - 1] = true;
+}
+
+bool NetlinkTransaction::addAttr(int type, const void *data, size_t len) {
+    size_t attrLen = RTA_LENGTH(len);
+    struct rtattr *rta;
+
+    if (!mCurrent || mLen + RTA_ALIGN(attrLen) > sizeof(mBuffer)) {
+        LOGE("Netlink transaction full");
+        return false;
+    }
+
+    rta = (struct rtattr *) (mBuffer + mLen);
+    rta->rta_type = type;
+    rta->rta_len = attrLen;
+    memcpy(RTA_DATA(rta), data, len);
+    memset((char *) RTA_DATA(rta) + len, 0, RTA_ALIGN(attrLen) - attrLen);
+
+    mLen += RTA_ALIGN(attrLen);
+    mCurrent->nlmsg_len = (mBuffer + mLen) - (char *) mCurrent;
+    return true;
+}
+
+bool NetlinkTransaction::addAttrU32(int type, uint32_t value) {
+    return addAttr(type, &value, sizeof(value));
+}
+
+struct rtattr *NetlinkTransaction::nestStart(int type) {
+    struct rtattr *nest = (struct rtattr *) (mBuffer + mLen);
+
+    if (!addAttr(type, NULL, 0))
+        return NULL;
+    return nest;
+}
+
+void NetlinkTransaction::nestEnd(struct rtattr *nest) {
+    if (nest)
+        nest->rta_len = (mBuffer + mLen) - (char *) nest;
+}
+
+void NetlinkTransaction::rollback(size_t len, int count) {
+    mLen = len;
+    mCount = count;
+    mCurrent = NULL;
+}
+
+bool NetlinkTransaction::addRoute(bool add, const char *dest, int prefixLen,
+                                  const char *gateway, const char *iface, int table) {
+    unsigned char dst[16], gw[16];
+    int family, gwFamily = -1;
+    int unused;
+    unsigned int ifindex;
+    struct rtmsg rtm;
+    size_t len = mLen;
+    int count = mCount;
+
+    family = parsePrefix(dest, dst, &unused);
+    if (family < 0 || prefixLen < 0 || prefixLen > (family == AF_INET ? 32 : 128))
+        return false;
+    if (gateway) {
+        gwFamily = parsePrefix(gateway, gw, &unused);
+        if (gwFamily != family)
+            return false;
+    }
+    if (!(ifindex = if_nametoindex(iface)))
+        return false;
+
+    memset(&rtm, 0, sizeof(rtm));
+    rtm.rtm_family = family;
+    rtm.rtm_dst_len = prefixLen;
+    rtm.rtm_table = table < 256 ? table : RT_TABLE_UNSPEC;
+    rtm.rtm_type = RTN_UNICAST;
+    if (add) {
+        rtm.rtm_protocol = RTPROT_BOOT;
+        rtm.rtm_scope = gateway ? RT_SCOPE_UNIVERSE : RT_SCOPE_LINK;
+    } else {
+        rtm.rtm_scope = RT_SCOPE_NOWHERE;
+    }
+
+    if (!addMessage(add ? RTM_NEWROUTE : RTM_DELROUTE,
+                    add ? NLM_F_CREATE | NLM_F_EXCL : 0, &rtm, sizeof(rtm)) ||
+        (prefixLen && !addAttr(RTA_DST, dst, family == AF_INET ? 4 : 16)) ||
+        (gateway && !addAttr(RTA_GATEWAY, gw, family == AF_INET ? 4 : 16)) ||
+        !addAttrU32(RTA_OIF, ifindex) ||
+        !addAttrU32(RTA_TABLE, table)) {
+        rollback(len, count);
+        return false;
+    }
+    return true;
+}
+
+bool NetlinkTransaction::addRule(bool add, const char *src, int table) {
+    unsigned char addr[16];
+    int family, prefixLen;
+    struct fib_rule_hdr frh;
+    size_t len = mLen;
+    int count = mCount;
+
+    family = parsePrefix(src, addr, &prefixLen);
+    if (family < 0)
+        return false;
+
+    memset(&frh, 0, sizeof(frh));
+    frh.family = family;
+    frh.src_len = prefixLen;
+    frh.table = table < 256 ? table : RT_TABLE_UNSPEC;
+    if (add)
+        frh.action = FR_ACT_TO_TBL;
+
+    if (!addMessage(add ? RTM_NEWRULE : RTM_DELRULE,
+                    add ? NLM_F_CREATE | NLM_F_EXCL : 0, &frh, sizeof(frh)) ||
+        (prefixLen && !addAttr(FRA_SRC, addr, family == AF_INET ? 4 : 16)) ||
+        !addAttrU32(FRA_TABLE, table)) {
+        rollback(len, count);
+        return false;
+    }
+    return true;
+}
+
+int NetlinkTransaction::commit(int *failedIndex) {
+    struct sockaddr_nl kernel;
+    char reply[4096];
+    int pending = mCount;
+    int res = 0;
+
+    if (failedIndex)
+        *failedIndex = -1;
+    if (!mCount)
+        return 0;
+    if (mSock < 0) {
+        res = -ENOTCONN;
+        goto out;
+    }
+
+    memset(&kernel, 0, sizeof(kernel));
+    kernel.nl_family = AF_NETLINK;
+    if (TEMP_FAILURE_RETRY(sendto(mSock, mBuffer, mLen, 0,
+            (struct sockaddr *) &kernel, sizeof(kernel))) < 0) {
+        res = -errno;
+        LOGE("Netlink send failed: %s", strerror(errno));
+        goto out;
+    }
+
+    while (pending > 0) {
+        ssize_t len = TEMP_FAILURE_RETRY(recv(mSock, reply, sizeof(reply), 0));
+        if (len < 0) {
+            res = -errno;
+            LOGE("Netlink receive failed: %s", strerror(errno));
+            goto out;
+        }
+
+        for (struct nlmsghdr *nh = (struct nlmsghdr *) reply; NLMSG_OK(nh, (size_t) len);
+                nh = NLMSG_NEXT(nh, len)) {
+            int index = nh->nlmsg_seq - mSeq;
+
+            if (nh->nlmsg_type != NLMSG_ERROR || index < 0 || index >= mCount)
+                continue;
+            pending--;
+
+            struct nlmsgerr *err = (struct nlmsgerr *) NLMSG_DATA(nh);
+            if (err->error && !res && !mBestEffort[index]) {
+                res = err->error;
+                if (failedIndex)
+                    *failedIndex = index;
+            }
+        }
+    }
+
+out:
+    mSeq += mCount;
+    mLen = 0;
+    mCurrent = NULL;
+    mCount = 0;
+    return res;
+}
+
+int NetlinkTransaction::parsePrefix(const char *str, unsigned char *addr, int *prefixLen) {
+    char buf[INET6_ADDRSTRLEN + 4];
+    char *slash;
+    int family;
+    int maxLen;
+
+    if (strlcpy(buf, str, sizeof(buf)) >= sizeof(buf))
+        return -1;
+
+    slash = strchr(buf, '/');
+    if (slash)
+        *slash = '\0';
+
+    if (inet_pton(AF_INET, buf, addr) == 1) {
+        family = AF_INET;
+        maxLen = 32;
+    } else if (inet_pton(AF_INET6, buf, addr) == 1) {
+        family = AF_INET6;
+        maxLen = 128;
+    } else {
+        return -1;
+    }
+
+    if (slash) {
+        char *end;
+        long len = strtol(slash + 1, &end, 10);
+        if (*end || end == slash + 1 || len < 0 || len > maxLen)
+            return -1;
+        *prefixLen = len;
+    } else {
+        *prefixLen = maxLen;
+    }
+    return family;
+}
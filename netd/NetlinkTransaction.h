@@ -0,0 +1,87 @@
+/*
+ * Copyright (C) 2012 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _NETLINK_TRANSACTION_H
+#define _NETLINK_TRANSACTION_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+
+/*
+ * Accumulates several rtnetlink requests and sends them to the kernel in
+ * a single sendmsg(), then collects one ACK per request.  The kernel
+ * handles the requests in order but independently, so a failure is
+ * reported for the offending request and the others still take effect.
+ */
+class NetlinkTransaction {
+public:
+    NetlinkTransaction();
+    virtual ~NetlinkTransaction();
+
+    /* False if no NETLINK_ROUTE socket could be opened */
+    bool isAvailable() { return mSock >= 0; }
+    int getCount() { return mCount; }
+
+    /* Starts a request of |type| with the family header |hdr| */
+    bool addMessage(int type, int flags, const void *hdr, size_t hdrLen);
+    /* Don't fail the transaction if the current request is rejected */
+    void setBestEffort();
+    bool addAttr(int type, const void *data, size_t len);
+    bool addAttrU32(int type, uint32_t value);
+    /* Nested attributes; nestEnd() fixes up the length of the nest */
+    struct rtattr *nestStart(int type);
+    void nestEnd(struct rtattr *nest);
+
+    /*
+     * Sends all queued requests and waits for their ACKs.  Returns 0 on
+     * success, or a negative errno of the first failing request whose
+     * index is stored in *failedIndex (if not NULL).  Resets the
+     * transaction either way.
+     */
+    int commit(int *failedIndex);
+
+    /*
+     * Queue RTM_NEWROUTE/RTM_DELROUTE for "dest/prefix [via gateway] dev
+     * iface table N" and RTM_NEWRULE/RTM_DELRULE for "from src table N".
+     * |gateway| may be NULL.  Return false if an argument can't be parsed
+     * or the transaction is full, leaving the transaction unchanged.
+     */
+    bool addRoute(bool add, const char *dest, int prefixLen, const char *gateway,
+                  const char *iface, int table);
+    bool addRule(bool add, const char *src, int table);
+
+    /* Parses "addr[/prefix]" into |addr| (16 bytes); returns the family or -1 */
+    static int parsePrefix(const char *str, unsigned char *addr, int *prefixLen);
+
+private:
+    void rollback(size_t len, int count);
+
+    static const int BUFFER_SIZE = 16 * 1024;
+    static const int MAX_MESSAGES = 64;
+
+    int mSock;
+    char mBuffer[BUFFER_SIZE];
+    size_t mLen;
+    struct nlmsghdr *mCurrent;
+    int mCount;
+    bool mBestEffort[MAX_MESSAGES];
+    uint32_t mSeq;
+};
+
+#endif
@@ -23,6 +23,7 @@
 #include <resolv.h>
 
 #include "ResolverController.h"
+#include "DnsProxyListener.h"
 
 int ResolverController::setDefaultInterface(const char* iface) {
     if (DBG) {
@@ -30,6 +31,7 @@ int ResolverController::setDefaultInterface(const char* iface) {
     }
 
     _resolv_set_default_iface(iface);
+    DnsProxyListener::flushCache();
 
     return 0;
 }
@@ -40,6 +42,7 @@ int ResolverController::setInterfaceDnsServers(const char* iface, char** servers
     }
 
     _resolv_set_nameservers_for_iface(iface, servers, numservers);
+    DnsProxyListener::flushCache();
 
     return 0;
 }
@@ -60,6 +63,7 @@ int ResolverController::flushDefaultDnsCache() {
     }
 
     _resolv_flush_cache_for_default_iface();
+    DnsProxyListener::flushCache();
 
     return 0;
 }
@@ -70,6 +74,7 @@ int ResolverController::flushInterfaceDnsCache(const char* iface) {
     }
 
     _resolv_flush_cache_for_iface(iface);
+    DnsProxyListener::flushCache();
 
     return 0;
 }
@@ -33,6 +33,7 @@
 
 extern "C" int system_nosh(const char *command);
 
+#include "NetlinkTransaction.h"
 #include "ResponseCode.h"
 #include "SecondaryTableController.h"
 
@@ -81,7 +82,26 @@ int SecondaryTableController::addRoute(SocketClient *cli, char *iface, char *des
 
 int SecondaryTableController::modifyRoute(SocketClient *cli, char *action, char *iface, char *dest,
         int prefix, char *gateway, int tableIndex) {
+    NetlinkTransaction nl;
     char *cmd;
+    int ret;
+
+    // Program the route directly over rtnetlink; fall back to the ip tool
+    // only when that is unavailable or it can't express the arguments.
+    if (nl.isAvailable() &&
+        nl.addRoute(strcmp(action, ADD) == 0, dest, prefix,
+                (strcmp("::", gateway) == 0) ? NULL : gateway,
+                iface, tableIndex + BASE_TABLE_NUMBER)) {
+        ret = nl.commit(NULL);
+        if (ret) {
+            LOGE("rtnetlink route %s %s/%d via %s dev %s table %d failed: %s", action,
+                    dest, prefix, gateway, iface, tableIndex+BASE_TABLE_NUMBER, strerror(-ret));
+            errno = ENODEV;
+            cli->sendMsg(ResponseCode::OperationFailed, "ip route modification failed", true);
+            return -1;
+        }
+        return routeModified(cli, action, tableIndex);
+    }
 
     if (strcmp("::", gateway) == 0) {
         //  IP tool doesn't like "::" - the equiv of 0.0.0.0 that it accepts for ipv4
@@ -99,7 +119,10 @@ int SecondaryTableController::modifyRoute(SocketClient *cli, char *action, char
         cli->sendMsg(ResponseCode::OperationFailed, "ip route modification failed", true);
         return -1;
     }
+    return routeModified(cli, action, tableIndex);
+}
 
+int SecondaryTableController::routeModified(SocketClient *cli, char *action, int tableIndex) {
     if (strcmp(action, ADD) == 0) {
         mInterfaceRuleCount[tableIndex]++;
     } else {
@@ -37,6 +37,7 @@ public:
 private:
     int modifyRoute(SocketClient *cli, char *action, char *iface, char *dest, int prefix,
             char *gateway, int tableIndex);
+    int routeModified(SocketClient *cli, char *action, int tableIndex);
 
     char mInterfaceTable[INTERFACES_TRACKED][MAX_IFACE_LENGTH];
     int mInterfaceRuleCount[INTERFACES_TRACKED];
@@ -14,6 +14,7 @@
  * limitations under the License.
  */
 
+#include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
 #include <fcntl.h>
@@ -24,17 +25,33 @@
 #include <sys/types.h>
 #include <sys/wait.h>
 
+#include <arpa/inet.h>
+#include <net/if.h>
+
+#include <linux/if_ether.h>
 #include <linux/netlink.h>
 #include <linux/rtnetlink.h>
+#include <linux/pkt_cls.h>
 #include <linux/pkt_sched.h>
+#include <linux/tc_act/tc_mirred.h>
 
 #define LOG_TAG "ThrottleController"
 #include <cutils/log.h>
 
 
+#include "NetlinkTransaction.h"
 #include "ThrottleController.h"
 
 static char TC_PATH[] = "/system/bin/tc";
+static char IFB_IFACE[] = "ifb0";
+
+/* Same defaults tc uses for "htb rate <n>kbit" */
+static const unsigned int HTB_MTU = 1600;
+static const unsigned int HTB_R2Q = 1000;
+static const unsigned int TIME_UNITS_PER_SEC = 1000000;
+
+double ThrottleController::sTickInUsec = 0;
+unsigned int ThrottleController::sHz = 0;
 
 extern "C" int system_nosh(const char *command);
 extern "C" int ifc_init(void);
@@ -58,6 +75,228 @@ int ThrottleController::runTcCmd(const char *cmd) {
     return res;
 }
 
+void ThrottleController::initPsched() {
+    unsigned int t2us, us2t, clockRes, hz;
+    FILE *fp;
+
+    if (sTickInUsec)
+        return;
+
+    sTickInUsec = 1;
+    sHz = 100;
+    fp = fopen("/proc/net/psched", "r");
+    if (!fp)
+        return;
+    if (fscanf(fp, "%08x%08x%08x%08x", &t2us, &us2t, &clockRes, &hz) == 4 && us2t) {
+        if (clockRes == 1000000000)
+            t2us = us2t;
+        sTickInUsec = (double) t2us / us2t * ((double) clockRes / TIME_UNITS_PER_SEC);
+        if (clockRes == 1000000)
+            sHz = hz;
+    }
+    fclose(fp);
+}
+
+/* Time in scheduler ticks to send |size| bytes at |rate| bytes/sec */
+unsigned int ThrottleController::calcXmitTime(unsigned int rate, unsigned int size) {
+    return (unsigned int) (TIME_UNITS_PER_SEC * ((double) size / rate) * sTickInUsec);
+}
+
+void ThrottleController::calcRateTable(unsigned int rate, unsigned char *cellLog,
+                                       unsigned int *rtab) {
+    unsigned int mtu = 2047;
+    int log = 0;
+
+    while ((mtu >> log) > 255)
+        log++;
+    for (int i = 0; i < 256; i++) {
+        rtab[i] = calcXmitTime(rate, (i + 1) << log);
+    }
+    *cellLog = log;
+}
+
+/*
+ * Equivalent of:
+ *   tc qdisc del dev <iface> root; tc qdisc del dev <iface> ingress
+ *   tc qdisc del dev ifb0 root
+ *   tc qdisc add dev <iface> root handle 1: htb default 1 r2q 1000
+ *   tc class add dev <iface> parent 1: classid 1:1 htb rate <tx>kbit
+ *   (the same two for ifb0 with <rx>kbit)
+ *   tc qdisc add dev <iface> ingress
+ *   tc filter add dev <iface> parent ffff: protocol ip prio 10 u32 match u32 0 0
+ *       flowid 1:1 action mirred egress redirect dev ifb0
+ * as a single rtnetlink transaction; the deletes are allowed to fail.
+ */
+int ThrottleController::setInterfaceThrottleNetlink(const char *iface, int rxKbps, int txKbps) {
+    NetlinkTransaction nl;
+    unsigned int ifindex = if_nametoindex(iface);
+    unsigned int ifbIndex = if_nametoindex(IFB_IFACE);
+    const char *devs[2] = { iface, IFB_IFACE };
+    unsigned int indexes[2] = { ifindex, ifbIndex };
+    int kbps[2] = { txKbps, rxKbps };
+    struct tcmsg tcm;
+    struct rtattr *opts, *acts, *act, *actOpts;
+    /* "match u32 0 0": a single all-zero key */
+    char selBuf[sizeof(struct tc_u32_sel) + sizeof(struct tc_u32_key)];
+    struct tc_u32_sel *sel = (struct tc_u32_sel *) selBuf;
+    struct tc_mirred mirred;
+    int failed;
+    int res;
+
+    if (!nl.isAvailable() || !ifindex || !ifbIndex)
+        return 1;
+    initPsched();
+
+    for (int i = 0; i < 2; i++) {
+        memset(&tcm, 0, sizeof(tcm));
+        tcm.tcm_family = AF_UNSPEC;
+        tcm.tcm_ifindex = indexes[i];
+        tcm.tcm_parent = TC_H_ROOT;
+        if (!nl.addMessage(RTM_DELQDISC, 0, &tcm, sizeof(tcm)))
+            goto overflow;
+        nl.setBestEffort();
+    }
+    memset(&tcm, 0, sizeof(tcm));
+    tcm.tcm_family = AF_UNSPEC;
+    tcm.tcm_ifindex = ifindex;
+    tcm.tcm_handle = TC_H_MAKE(TC_H_INGRESS, 0);
+    tcm.tcm_parent = TC_H_INGRESS;
+    if (!nl.addMessage(RTM_DELQDISC, 0, &tcm, sizeof(tcm)))
+        goto overflow;
+    nl.setBestEffort();
+
+    for (int i = 0; i < 2; i++) {
+        struct tc_htb_glob glob;
+        struct tc_htb_opt opt;
+        unsigned int rtab[256];
+        unsigned int rate = (unsigned int) kbps[i] * 1000 / 8;
+
+        if (!rate) {
+            LOGE("Invalid throttle rate for %s", devs[i]);
+            return -1;
+        }
+
+        memset(&tcm, 0, sizeof(tcm));
+        tcm.tcm_family = AF_UNSPEC;
+        tcm.tcm_ifindex = indexes[i];
+        tcm.tcm_handle = TC_H_MAKE(1 << 16, 0);
+        tcm.tcm_parent = TC_H_ROOT;
+        memset(&glob, 0, sizeof(glob));
+        glob.version = 3;
+        glob.rate2quantum = HTB_R2Q;
+        glob.defcls = 1;
+        if (!nl.addMessage(RTM_NEWQDISC, NLM_F_CREATE | NLM_F_EXCL, &tcm, sizeof(tcm)) ||
+            !nl.addAttr(TCA_KIND, "htb", 4) ||
+            !(opts = nl.nestStart(TCA_OPTIONS)) ||
+            !nl.addAttr(TCA_HTB_INIT, &glob, sizeof(glob)))
+            goto overflow;
+        nl.nestEnd(opts);
+
+        tcm.tcm_handle = TC_H_MAKE(1 << 16, 1);
+        tcm.tcm_parent = TC_H_MAKE(1 << 16, 0);
+        memset(&opt, 0, sizeof(opt));
+        opt.rate.rate = opt.ceil.rate = rate;
+        opt.buffer = opt.cbuffer = calcXmitTime(rate, rate / sHz + HTB_MTU);
+        calcRateTable(rate, &opt.rate.cell_log, rtab);
+        opt.rate.cell_align = opt.ceil.cell_align = -1;
+        opt.ceil.cell_log = opt.rate.cell_log;
+        if (!nl.addMessage(RTM_NEWTCLASS, NLM_F_CREATE | NLM_F_EXCL, &tcm, sizeof(tcm)) ||
+            !nl.addAttr(TCA_KIND, "htb", 4) ||
+            !(opts = nl.nestStart(TCA_OPTIONS)) ||
+            !nl.addAttr(TCA_HTB_PARMS, &opt, sizeof(opt)) ||
+            !nl.addAttr(TCA_HTB_RTAB, rtab, sizeof(rtab)) ||
+            !nl.addAttr(TCA_HTB_CTAB, rtab, sizeof(rtab)))
+            goto overflow;
+        nl.nestEnd(opts);
+    }
+
+    memset(&tcm, 0, sizeof(tcm));
+    tcm.tcm_family = AF_UNSPEC;
+    tcm.tcm_ifindex = ifindex;
+    tcm.tcm_handle = TC_H_MAKE(TC_H_INGRESS, 0);
+    tcm.tcm_parent = TC_H_INGRESS;
+    if (!nl.addMessage(RTM_NEWQDISC, NLM_F_CREATE | NLM_F_EXCL, &tcm, sizeof(tcm)) ||
+        !nl.addAttr(TCA_KIND, "ingress", 8))
+        goto overflow;
+
+    memset(selBuf, 0, sizeof(selBuf));
+    sel->flags = TC_U32_TERMINAL;
+    sel->nkeys = 1;
+    memset(&mirred, 0, sizeof(mirred));
+    mirred.action = TC_ACT_STOLEN;
+    mirred.eaction = TCA_EGRESS_REDIR;
+    mirred.ifindex = ifbIndex;
+
+    memset(&tcm, 0, sizeof(tcm));
+    tcm.tcm_family = AF_UNSPEC;
+    tcm.tcm_ifindex = ifindex;
+    tcm.tcm_parent = TC_H_MAKE(TC_H_INGRESS, 0);
+    tcm.tcm_info = TC_H_MAKE(10 << 16, htons(ETH_P_IP));
+    if (!nl.addMessage(RTM_NEWTFILTER, NLM_F_CREATE | NLM_F_EXCL, &tcm, sizeof(tcm)) ||
+        !nl.addAttr(TCA_KIND, "u32", 4) ||
+        !(opts = nl.nestStart(TCA_OPTIONS)) ||
+        !nl.addAttrU32(TCA_U32_CLASSID, TC_H_MAKE(1 << 16, 1)) ||
+        !nl.addAttr(TCA_U32_SEL, selBuf, sizeof(selBuf)) ||
+        !(acts = nl.nestStart(TCA_U32_ACT)) ||
+        !(act = nl.nestStart(1)) ||
+        !nl.addAttr(TCA_ACT_KIND, "mirred", 7) ||
+        !(actOpts = nl.nestStart(TCA_ACT_OPTIONS)) ||
+        !nl.addAttr(TCA_MIRRED_PARMS, &mirred, sizeof(mirred)))
+        goto overflow;
+    nl.nestEnd(actOpts);
+    nl.nestEnd(act);
+    nl.nestEnd(acts);
+    nl.nestEnd(opts);
+
+    res = nl.commit(&failed);
+    if (res) {
+        LOGE("Failed to program throttle for %s (request %d: %s)", iface, failed,
+             strerror(-res));
+        errno = -res;
+        return -1;
+    }
+    return 0;
+
+overflow:
+    /* Nothing has been sent; the transaction is dropped with nl */
+    LOGE("Throttle request for %s does not fit in one transaction", iface);
+    errno = ENOBUFS;
+    return -1;
+}
+
+int ThrottleController::resetNetlink(const char *iface) {
+    NetlinkTransaction nl;
+    unsigned int ifindex = if_nametoindex(iface);
+    unsigned int ifbIndex = if_nametoindex(IFB_IFACE);
+    struct tcmsg tcm;
+
+    if (!nl.isAvailable() || !ifindex)
+        return 1;
+
+    memset(&tcm, 0, sizeof(tcm));
+    tcm.tcm_family = AF_UNSPEC;
+    tcm.tcm_ifindex = ifindex;
+    tcm.tcm_parent = TC_H_ROOT;
+    if (!nl.addMessage(RTM_DELQDISC, 0, &tcm, sizeof(tcm)))
+        return -1;
+    nl.setBestEffort();
+    tcm.tcm_handle = TC_H_MAKE(TC_H_INGRESS, 0);
+    tcm.tcm_parent = TC_H_INGRESS;
+    if (!nl.addMessage(RTM_DELQDISC, 0, &tcm, sizeof(tcm)))
+        return -1;
+    nl.setBestEffort();
+    if (ifbIndex) {
+        tcm.tcm_ifindex = ifbIndex;
+        tcm.tcm_handle = 0;
+        tcm.tcm_parent = TC_H_ROOT;
+        if (!nl.addMessage(RTM_DELQDISC, 0, &tcm, sizeof(tcm)))
+            return -1;
+        nl.setBestEffort();
+    }
+    nl.commit(NULL);
+    return 0;
+}
+
 int ThrottleController::setInterfaceThrottle(const char *iface, int rxKbps, int txKbps) {
     char cmd[512];
     char ifn[65];
@@ -71,6 +310,24 @@ int ThrottleController::setInterfaceThrottle(const char *iface, int rxKbps, int
         return 0;
     }
 
+    /*
+     * The IFB device has to exist (and be up) before its index can be
+     * used by the redirect action.
+     */
+    ifc_init();
+    if (ifc_up("ifb0")) {
+        LOGE("Failed to up ifb0 (%s)", strerror(errno));
+        goto fail;
+    }
+
+    rc = setInterfaceThrottleNetlink(ifn, rxKbps, txKbps);
+    if (rc == 0) {
+        return 0;
+    } else if (rc < 0) {
+        goto fail;
+    }
+    LOGW("rtnetlink unavailable, falling back to %s", TC_PATH);
+
     /*
      *
      * Target interface configuration
@@ -95,15 +352,6 @@ int ThrottleController::setInterfaceThrottle(const char *iface, int rxKbps, int
         goto fail;
     }
 
-    /*
-     * Bring up the IFD device
-     */
-    ifc_init();
-    if (ifc_up("ifb0")) {
-        LOGE("Failed to up ifb0 (%s)", strerror(errno));
-        goto fail;
-    }
-
     /*
      * Add root qdisc for IFD
      */
@@ -150,6 +398,9 @@ fail:
 void ThrottleController::reset(const char *iface) {
     char cmd[128];
 
+    if (!resetNetlink(iface))
+        return;
+
     sprintf(cmd, "qdisc del dev %s root", iface);
     runTcCmd(cmd);
     sprintf(cmd, "qdisc del dev %s ingress", iface);
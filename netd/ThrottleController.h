@@ -26,6 +26,21 @@ public:
 private:
     static int runTcCmd(const char *cmd);
     static void reset(const char *iface);
+
+    /*
+     * rtnetlink backend: the whole shaping config of an interface is
+     * torn down and rebuilt in one NetlinkTransaction.  Returns 1 if
+     * rtnetlink is unusable and the tc binary must be used instead.
+     */
+    static int setInterfaceThrottleNetlink(const char *iface, int rxKbps, int txKbps);
+    static int resetNetlink(const char *iface);
+    static void initPsched();
+    static unsigned int calcXmitTime(unsigned int rate, unsigned int size);
+    static void calcRateTable(unsigned int rate, unsigned char *cellLog, unsigned int *rtab);
+
+    /* From /proc/net/psched, as used by tc to convert times to ticks */
+    static double sTickInUsec;
+    static unsigned int sHz;
 };
 
 #endif
@@ -0,0 +1,69 @@
+# Build the iptables batching benchmark.
+LOCAL_PATH := $(call my-dir)
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := bandwidth_bench.cpp \
+                   ../BandwidthController.cpp \
+                   ../logwrapper.c
+LOCAL_MODULE := bandwidth_bench
+LOCAL_MODULE_TAGS := tests
+LOCAL_C_INCLUDES := external/stlport/stlport bionic
+LOCAL_SHARED_LIBRARIES := libstlport libcutils
+
+include $(BUILD_EXECUTABLE)
+
+# Build the DNS proxy latency load generator.
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := dns_bench.cpp \
+                   ../DnsProxyListener.cpp \
+                   ../NetdCommand.cpp
+LOCAL_MODULE := dns_bench
+LOCAL_MODULE_TAGS := tests
+LOCAL_C_INCLUDES := external/stlport/stlport bionic
+LOCAL_SHARED_LIBRARIES := libstlport libsysutils libcutils
+
+include $(BUILD_EXECUTABLE)
+
+# Build the tether stats query benchmark.
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := tether_stats_bench.cpp \
+                   ../BandwidthController.cpp \
+                   ../logwrapper.c
+LOCAL_MODULE := tether_stats_bench
+LOCAL_MODULE_TAGS := tests
+LOCAL_C_INCLUDES := external/stlport/stlport bionic
+LOCAL_SHARED_LIBRARIES := libstlport libcutils
+
+include $(BUILD_EXECUTABLE)
+
+# Build the tether route/rule bring-up harness.
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := route_bench.cpp \
+                   ../BandwidthController.cpp \
+                   ../NatController.cpp \
+                   ../NetlinkTransaction.cpp \
+                   ../SecondaryTableController.cpp \
+                   ../logwrapper.c
+LOCAL_MODULE := route_bench
+LOCAL_MODULE_TAGS := tests
+LOCAL_C_INCLUDES := $(KERNEL_HEADERS) external/stlport/stlport bionic
+LOCAL_SHARED_LIBRARIES := libstlport libsysutils libcutils
+
+include $(BUILD_EXECUTABLE)
+
+# Build the interface throttling benchmark.
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := throttle_bench.cpp \
+                   ../NetlinkTransaction.cpp \
+                   ../ThrottleController.cpp \
+                   ../logwrapper.c
+LOCAL_MODULE := throttle_bench
+LOCAL_MODULE_TAGS := tests
+LOCAL_C_INCLUDES := $(KERNEL_HEADERS) external/stlport/stlport bionic
+LOCAL_SHARED_LIBRARIES := libstlport libcutils libnetutils
+
+include $(BUILD_EXECUTABLE)
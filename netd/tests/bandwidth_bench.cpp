@@ -0,0 +1,227 @@
+/*
+ * Copyright (C) 2012 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Times BandwidthController's iptables programming against stand-in
+ * iptables and iptables-restore binaries, once with iptables-restore
+ * there to batch through and once without it, one process per rule.
+ *
+ *   bandwidth_bench [uids [rounds]]
+ *
+ * Needs root: it runs in a private mount namespace, with a tmpfs over
+ * /system/bin holding nothing but copies of itself.  Run under the
+ * iptables names, those copies stand in for the real tools: they change
+ * nothing and only log how many rules each process was given.
+ *
+ * With BW_BENCH_FAIL=<text> in the environment, the stand-ins reject
+ * every rule containing <text>, as iptables would.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mount.h>
+#include <sys/stat.h>
+
+#include "../BandwidthController.h"
+
+#define BIN_DIR "/system/bin"
+#define LOG_FILE BIN_DIR "/.bandwidth_bench.log"
+
+static const char *STAND_INS[] = {
+    "iptables", "ip6tables", "iptables-restore", "ip6tables-restore",
+};
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void logRules(int rules) {
+    FILE *log = fopen(LOG_FILE, "a");
+    if (log) {
+        fprintf(log, "%d\n", rules);
+        fclose(log);
+    }
+}
+
+static bool rejected(const char *rule) {
+    const char *fail = getenv("BW_BENCH_FAIL");
+    return fail && *fail && strstr(rule, fail);
+}
+
+/* iptables <rule...> */
+static int iptablesStandIn(int argc, char **argv) {
+    std::string rule;
+
+    for (int i = 1; i < argc; i++) {
+        rule += i > 1 ? " " : "";
+        rule += argv[i];
+    }
+    logRules(1);
+    return rejected(rule.c_str()) ? 1 : 0;
+}
+
+/* iptables-restore --noflush < rules */
+static int restoreStandIn(const char *name) {
+    char line[1024];
+    int lineNum = 0, rules = 0;
+
+    while (fgets(line, sizeof(line), stdin)) {
+        lineNum++;
+        if (line[0] == '*' || !strncmp(line, "COMMIT", 6))
+            continue;
+        if (rejected(line)) {
+            fprintf(stderr, "%s: line %d failed\n", name, lineNum);
+            logRules(rules);
+            return 1;
+        }
+        rules++;
+    }
+    logRules(rules);
+    return 0;
+}
+
+/* Sums the log: processes run and rules they were given */
+static void readLog(int *procs, int *rules) {
+    FILE *log = fopen(LOG_FILE, "r");
+    int n;
+
+    *procs = *rules = 0;
+    if (!log)
+        return;
+    while (fscanf(log, "%d", &n) == 1) {
+        (*procs)++;
+        *rules += n;
+    }
+    fclose(log);
+    unlink(LOG_FILE);
+}
+
+static int installStandIns(const char *self, size_t len, bool restore) {
+    for (size_t i = 0; i < sizeof(STAND_INS) / sizeof(STAND_INS[0]); i++) {
+        char path[64];
+
+        snprintf(path, sizeof(path), BIN_DIR "/%s", STAND_INS[i]);
+        unlink(path);
+        if (!restore && strstr(STAND_INS[i], "restore"))
+            continue;
+
+        int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0755);
+        if (fd < 0 || write(fd, self, len) != (ssize_t) len) {
+            fprintf(stderr, "cannot write %s: %s\n", path, strerror(errno));
+            return -1;
+        }
+        close(fd);
+    }
+    return 0;
+}
+
+static void report(const char *what, double start, int res) {
+    double secs = now() - start;
+    int procs, rules;
+
+    readLog(&procs, &rules);
+    printf("  %-10s %6d rules %5d processes %8.3f s %9.0f rules/s%s\n",
+           what, rules, procs, secs, rules / secs, res ? "  (failed)" : "");
+}
+
+static void run(int numUids, int rounds) {
+    BandwidthController bc;
+    char *uids[numUids];
+    double start;
+    int res;
+
+    for (int i = 0; i < numUids; i++)
+        asprintf(&uids[i], "%d", 10000 + i);
+
+    start = now();
+    res = bc.enableBandwidthControl();
+    report("enable", start, res);
+
+    start = now();
+    res = 0;
+    for (int r = 0; r < rounds; r++) {
+        res |= bc.setInterfaceQuota("rmnet0", 1000000);
+        res |= bc.setInterfaceSharedQuota("rmnet1", 1000000);
+        res |= bc.removeInterfaceQuota("rmnet0");
+        res |= bc.removeInterfaceSharedQuota("rmnet1");
+    }
+    report("quota", start, res);
+
+    start = now();
+    res = 0;
+    for (int r = 0; r < rounds; r++) {
+        res |= bc.addNaughtyApps(numUids, uids);
+        res |= bc.removeNaughtyApps(numUids, uids);
+    }
+    report("naughty", start, res);
+
+    start = now();
+    res = bc.disableBandwidthControl();
+    report("disable", start, res);
+
+    for (int i = 0; i < numUids; i++)
+        free(uids[i]);
+}
+
+int main(int argc, char **argv) {
+    const char *name = strrchr(argv[0], '/') ? strrchr(argv[0], '/') + 1 : argv[0];
+
+    if (strstr(name, "tables-restore"))
+        return restoreStandIn(name);
+    if (strstr(name, "tables"))
+        return iptablesStandIn(argc, argv);
+
+    int numUids = argc > 1 ? atoi(argv[1]) : 50;
+    int rounds = argc > 2 ? atoi(argv[2]) : 5;
+
+    /* keep a copy of ourselves before /system/bin is covered up */
+    int fd = open("/proc/self/exe", O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st)) {
+        fprintf(stderr, "cannot open /proc/self/exe: %s\n", strerror(errno));
+        return 1;
+    }
+    char *self = (char *) malloc(st.st_size);
+    if (read(fd, self, st.st_size) != st.st_size) {
+        fprintf(stderr, "cannot read /proc/self/exe: %s\n", strerror(errno));
+        return 1;
+    }
+    close(fd);
+
+    if (unshare(CLONE_NEWNS) ||
+        mount(NULL, "/", NULL, MS_REC | MS_PRIVATE, NULL) ||
+        mount("tmpfs", BIN_DIR, "tmpfs", 0, "mode=0755")) {
+        fprintf(stderr, "cannot set up stand-ins: %s\n", strerror(errno));
+        return 1;
+    }
+
+    printf("%d uids, %d rounds\n", numUids, rounds);
+    for (int batched = 1; batched >= 0; batched--) {
+        if (installStandIns(self, st.st_size, batched))
+            return 1;
+        printf("%s:\n", batched ? "iptables-restore" : "one process per rule");
+        run(numUids, rounds);
+    }
+    return 0;
+}
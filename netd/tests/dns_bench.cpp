@@ -0,0 +1,352 @@
+/*
+ * Copyright (C) 2012 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Measures getaddrinfo latency through DnsProxyListener at a fixed
+ * request rate and reports p50/p99.
+ *
+ *   dns_bench [rate [seconds [names [delay_ms]]]]
+ *
+ * The listener runs in-process on a private socket, resolving against a
+ * stub DNS server on 127.0.0.1:53 (so it needs root).  The stub answers
+ * every A query for <n>.bench.test after delay_ms, with a zero TTL so
+ * that nothing below the listener caches it; one name in ten gets
+ * NXDOMAIN.  Requests cycle through the given number of names.
+ *
+ * Load is open loop: request i is due at start + i / rate, and its
+ * latency is counted from then, so a stalled proxy shows up in the
+ * percentiles rather than quietly lowering the rate.
+ */
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
+#include <resolv.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <algorithm>
+#include <list>
+#include <string>
+#include <vector>
+
+#include "../DnsProxyListener.h"
+
+#define CLIENT_THREADS 64
+#define STUB_IFACE "lo"
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void sleepUntil(double when) {
+    double delta = when - now();
+    if (delta > 0) {
+        struct timespec ts;
+        ts.tv_sec = (time_t) delta;
+        ts.tv_nsec = (long) ((delta - ts.tv_sec) * 1e9);
+        nanosleep(&ts, NULL);
+    }
+}
+
+/*------------------------------------------------------------------*/
+/* Stub DNS server                                                   */
+/*------------------------------------------------------------------*/
+
+static int stubFd = -1;
+static int stubDelayMs;
+static volatile int stubQueries;
+
+class PendingReply {
+public:
+    double due;
+    struct sockaddr_in to;
+    std::string data;
+};
+
+/* Builds the answer to one query; returns false for anything malformed */
+static bool stubAnswer(const unsigned char *q, size_t len, std::string &out) {
+    size_t pos = 12;
+    char name[256];
+    size_t nameLen = 0;
+
+    if (len < 12)
+        return false;
+    while (pos < len && q[pos]) {
+        size_t label = q[pos];
+        if (label > 63 || pos + 1 + label > len || nameLen + label + 1 >= sizeof(name))
+            return false;
+        memcpy(name + nameLen, q + pos + 1, label);
+        nameLen += label;
+        name[nameLen++] = '.';
+        pos += 1 + label;
+    }
+    if (pos + 5 > len)
+        return false;
+    name[nameLen] = '\0';
+    int qtype = (q[pos + 1] << 8) | q[pos + 2];
+    pos += 5;
+
+    int n = atoi(name);
+    bool nx = n % 10 == 9;
+    bool answer = !nx && qtype == 1;
+    unsigned char hdr[12];
+
+    memcpy(hdr, q, 12);
+    hdr[2] = 0x80 | (q[2] & 0x01);          /* QR, RD copied */
+    hdr[3] = 0x80 | (nx ? 3 : 0);           /* RA, NXDOMAIN */
+    hdr[4] = 0; hdr[5] = 1;                 /* QDCOUNT */
+    hdr[6] = 0; hdr[7] = answer ? 1 : 0;    /* ANCOUNT */
+    memset(hdr + 8, 0, 4);
+    out.assign((const char *) hdr, 12);
+    out.append((const char *) q + 12, pos - 12);
+    if (answer) {
+        const unsigned char rr[] = {
+            0xc0, 0x0c,                     /* name: the question's */
+            0x00, 0x01, 0x00, 0x01,         /* A, IN */
+            0x00, 0x00, 0x00, 0x00,         /* TTL 0 */
+            0x00, 0x04,
+            10, (unsigned char) (n >> 16), (unsigned char) (n >> 8), (unsigned char) n,
+        };
+        out.append((const char *) rr, sizeof(rr));
+    }
+    return true;
+}
+
+/* Answers queries after stubDelayMs, without serializing the delays */
+static void *stubThread(void *) {
+    std::list<PendingReply> pending;
+
+    while (true) {
+        int timeout = -1;
+        if (!pending.empty()) {
+            double wait = pending.front().due - now();
+            timeout = wait > 0 ? (int) (wait * 1000) + 1 : 0;
+        }
+
+        struct pollfd pfd;
+        pfd.fd = stubFd;
+        pfd.events = POLLIN;
+        if (poll(&pfd, 1, timeout) > 0) {
+            unsigned char buf[512];
+            PendingReply reply;
+            socklen_t alen = sizeof(reply.to);
+            ssize_t len = recvfrom(stubFd, buf, sizeof(buf), 0,
+                                   (struct sockaddr *) &reply.to, &alen);
+            if (len > 0 && stubAnswer(buf, len, reply.data)) {
+                stubQueries++;
+                reply.due = now() + stubDelayMs / 1000.0;
+                pending.push_back(reply);
+            }
+        }
+
+        double t = now();
+        while (!pending.empty() && pending.front().due <= t) {
+            PendingReply &reply = pending.front();
+            sendto(stubFd, reply.data.data(), reply.data.size(), 0,
+                   (struct sockaddr *) &reply.to, sizeof(reply.to));
+            pending.pop_front();
+        }
+    }
+    return NULL;
+}
+
+static int startStub() {
+    struct sockaddr_in addr;
+    pthread_t thread;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(53);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if ((stubFd = socket(AF_INET, SOCK_DGRAM, 0)) < 0 ||
+        bind(stubFd, (struct sockaddr *) &addr, sizeof(addr))) {
+        fprintf(stderr, "cannot bind the stub resolver: %s\n", strerror(errno));
+        return -1;
+    }
+    if (pthread_create(&thread, NULL, stubThread, NULL)) {
+        fprintf(stderr, "cannot start the stub resolver\n");
+        return -1;
+    }
+
+    char *servers[] = { (char *) "127.0.0.1" };
+    _resolv_set_nameservers_for_iface(STUB_IFACE, servers, 1);
+    _resolv_set_default_iface(STUB_IFACE);
+    return 0;
+}
+
+/*------------------------------------------------------------------*/
+/* Listener and clients                                              */
+/*------------------------------------------------------------------*/
+
+static struct sockaddr_un proxyAddr;
+static socklen_t proxyAddrLen;
+
+/* Hands DnsProxyListener a listening socket, as init would */
+static int startListener() {
+    char name[64];
+    char fd[16];
+    int sock;
+
+    memset(&proxyAddr, 0, sizeof(proxyAddr));
+    proxyAddr.sun_family = AF_UNIX;
+    snprintf(name, sizeof(name), "dns_bench.%d", getpid());
+    /* abstract namespace: leading NUL, nothing left behind on disk */
+    memcpy(proxyAddr.sun_path + 1, name, strlen(name));
+    proxyAddrLen = offsetof(struct sockaddr_un, sun_path) + 1 + strlen(name);
+
+    if ((sock = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 ||
+        bind(sock, (struct sockaddr *) &proxyAddr, proxyAddrLen)) {
+        fprintf(stderr, "cannot bind the proxy socket: %s\n", strerror(errno));
+        return -1;
+    }
+    snprintf(fd, sizeof(fd), "%d", sock);
+    setenv("ANDROID_SOCKET_dnsproxyd", fd, 1);
+
+    /* as netd does, so getaddrinfo() resolves rather than asks the proxy */
+    setenv("ANDROID_DNS_MODE", "local", 1);
+    DnsProxyListener *dpl = new DnsProxyListener();
+    if (dpl->startListener()) {
+        fprintf(stderr, "cannot start DnsProxyListener: %s\n", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+static bool readFully(int fd, void *buf, size_t len) {
+    char *p = (char *) buf;
+    while (len) {
+        ssize_t n = read(fd, p, len);
+        if (n <= 0)
+            return false;
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+/* One lookup, the way bionic's getaddrinfo() asks dnsproxyd */
+static int lookup(int n) {
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    char cmd[128];
+    int rv = -1;
+
+    if (sock < 0)
+        return -1;
+    int len = snprintf(cmd, sizeof(cmd), "getaddrinfo %d.bench.test ^ 0 %d %d 0",
+                       n, AF_INET, SOCK_STREAM);
+    if (connect(sock, (struct sockaddr *) &proxyAddr, proxyAddrLen) ||
+        write(sock, cmd, len + 1) != len + 1 ||
+        !readFully(sock, &rv, sizeof(rv))) {
+        close(sock);
+        return -1;
+    }
+    if (rv == 0) {
+        /* addrinfo, sockaddr and canonname per result, then a 0 length */
+        uint32_t be;
+        char buf[256];
+        int fields = 0;
+        while (readFully(sock, &be, sizeof(be))) {
+            uint32_t size = ntohl(be);
+            if (!size && fields % 3 == 0)
+                break;
+            if (size > sizeof(buf) || !readFully(sock, buf, size)) {
+                rv = -1;
+                break;
+            }
+            fields++;
+        }
+    }
+    close(sock);
+    return rv;
+}
+
+static pthread_mutex_t loadLock = PTHREAD_MUTEX_INITIALIZER;
+static int nextRequest;
+static int totalRequests;
+static int numNames;
+static double rate;
+static double startTime;
+static std::vector<double> latencies;
+static int failures;
+
+static void *clientThread(void *) {
+    while (true) {
+        pthread_mutex_lock(&loadLock);
+        int i = nextRequest++;
+        pthread_mutex_unlock(&loadLock);
+        if (i >= totalRequests)
+            break;
+
+        double due = startTime + i / rate;
+        sleepUntil(due);
+        int rv = lookup(i % numNames);
+        latencies[i] = now() - due;
+        if (rv != 0 && rv != EAI_NONAME) {
+            pthread_mutex_lock(&loadLock);
+            failures++;
+            pthread_mutex_unlock(&loadLock);
+        }
+    }
+    return NULL;
+}
+
+int main(int argc, char **argv) {
+    rate = argc > 1 ? atof(argv[1]) : 1000;
+    int seconds = argc > 2 ? atoi(argv[2]) : 10;
+    numNames = argc > 3 ? atoi(argv[3]) : 200;
+    stubDelayMs = argc > 4 ? atoi(argv[4]) : 5;
+    if (rate <= 0 || seconds <= 0 || numNames <= 0 || stubDelayMs < 0) {
+        fprintf(stderr, "usage: %s [rate [seconds [names [delay_ms]]]]\n", argv[0]);
+        return 1;
+    }
+
+    if (startStub() || startListener())
+        return 1;
+
+    totalRequests = (int) (rate * seconds);
+    latencies.resize(totalRequests);
+    printf("%d lookups at %.0f/s over %d names, stub delay %d ms\n",
+           totalRequests, rate, numNames, stubDelayMs);
+
+    pthread_t threads[CLIENT_THREADS];
+    startTime = now() + 0.1;
+    for (int i = 0; i < CLIENT_THREADS; i++)
+        pthread_create(&threads[i], NULL, clientThread, NULL);
+    for (int i = 0; i < CLIENT_THREADS; i++)
+        pthread_join(threads[i], NULL);
+    double secs = now() - startTime;
+
+    std::sort(latencies.begin(), latencies.end());
+    printf("  achieved   %9.0f lookups/s\n", totalRequests / secs);
+    printf("  p50        %9.3f ms\n", latencies[totalRequests / 2] * 1000);
+    printf("  p99        %9.3f ms\n", latencies[totalRequests * 99 / 100] * 1000);
+    printf("  max        %9.3f ms\n", latencies[totalRequests - 1] * 1000);
+    printf("  stub       %9d queries\n", stubQueries);
+    printf("  failed     %9d lookups\n", failures);
+    return failures ? 1 : 0;
+}
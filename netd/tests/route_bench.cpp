@@ -0,0 +1,332 @@
+/*
+ * Copyright (C) 2012 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Times the routes and rules of a tethered interface coming up and going
+ * down, inside a private network namespace.
+ *
+ *   route_bench [addrs [rounds]]
+ *
+ * Each round adds a default route for the upstream to its secondary
+ * table and enables NAT for |addrs| tethered subnets, which adds a rule
+ * and a route per subnet; then it undoes both.  The rounds run once
+ * through SecondaryTableController and NatController, which program
+ * routes and rules over rtnetlink, and once as the ip and iptables
+ * processes those controllers used to run for them (and still do as a
+ * fallback).  After every bring-up the rules and routes are read back
+ * with ip.
+ *
+ * Needs root.  It runs in its own network and mount namespaces, with
+ * "lo" standing in for both interfaces and a tmpfs over /system/bin
+ * holding the real ip (from $ROUTE_BENCH_IP, else /system/bin/ip) and a
+ * copy of itself as iptables, which changes nothing.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <net/if.h>
+#include <sched.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mount.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#include <sysutils/SocketClient.h>
+
+#include "../NatController.h"
+#include "../SecondaryTableController.h"
+
+extern "C" int system_nosh(const char *command);
+
+#define BIN_DIR "/system/bin"
+#define IFACE "lo"
+#define GATEWAY "10.99.0.2"
+#define TABLE (BASE_TABLE_NUMBER + 0)
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Reads a whole file; returns NULL on error */
+static char *slurp(const char *path, size_t *len) {
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    char *data;
+
+    if (fd < 0 || fstat(fd, &st)) {
+        fprintf(stderr, "cannot open %s: %s\n", path, strerror(errno));
+        return NULL;
+    }
+    data = (char *) malloc(st.st_size);
+    if (read(fd, data, st.st_size) != st.st_size) {
+        fprintf(stderr, "cannot read %s: %s\n", path, strerror(errno));
+        return NULL;
+    }
+    close(fd);
+    *len = st.st_size;
+    return data;
+}
+
+static int install(const char *name, const char *data, size_t len) {
+    char path[64];
+
+    snprintf(path, sizeof(path), BIN_DIR "/%s", name);
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0755);
+    if (fd < 0 || write(fd, data, len) != (ssize_t) len) {
+        fprintf(stderr, "cannot write %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    close(fd);
+    return 0;
+}
+
+static int runIp(const char *fmt, ...) {
+    char cmd[255];
+    va_list ap;
+
+    va_start(ap, fmt);
+    int len = snprintf(cmd, sizeof(cmd), BIN_DIR "/ip ");
+    vsnprintf(cmd + len, sizeof(cmd) - len, fmt, ap);
+    va_end(ap);
+    return system_nosh(cmd);
+}
+
+/* Counts the lines of "ip <what>" that contain |match| */
+static int countIp(const char *what, const char *match) {
+    char cmd[128], line[256];
+    int n = 0;
+
+    snprintf(cmd, sizeof(cmd), BIN_DIR "/ip %s", what);
+    FILE *fp = popen(cmd, "r");
+    if (!fp)
+        return -1;
+    while (fgets(line, sizeof(line), fp))
+        n += strstr(line, match) != NULL;
+    pclose(fp);
+    return n;
+}
+
+/* Whether the table and its rules hold exactly what one bring-up adds */
+static bool isUp(int numAddrs) {
+    char rules[16], routes[32];
+
+    snprintf(rules, sizeof(rules), "lookup %d", TABLE);
+    snprintf(routes, sizeof(routes), "route show table %d", TABLE);
+    return countIp("rule show", rules) == numAddrs &&
+           countIp(routes, "dev " IFACE) == numAddrs + 1;
+}
+
+class Round {
+public:
+    Round(int numAddrs) : mNumAddrs(numAddrs) {
+        mArgv = new char *[5 + numAddrs];
+        mArgv[0] = (char *) "nat";
+        mArgv[2] = (char *) IFACE;
+        mArgv[3] = (char *) IFACE;
+        asprintf(&mArgv[4], "%d", numAddrs);
+        for (int i = 0; i < numAddrs; i++)
+            asprintf(&mArgv[5 + i], "10.100.%d.0/24", i);
+    }
+    virtual ~Round() {}
+
+    virtual int up() = 0;
+    virtual int down() = 0;
+
+protected:
+    int mNumAddrs;
+    char **mArgv;
+};
+
+/* Through the controllers, as netd does now */
+class ControllerRound : public Round {
+public:
+    ControllerRound(int numAddrs, SocketClient *cli)
+        : Round(numAddrs), mCli(cli), mNat(&mSecondary) {}
+
+    int up() {
+        mArgv[1] = (char *) "enable";
+        if (mSecondary.addRoute(mCli, (char *) IFACE, (char *) "0.0.0.0", 0,
+                                (char *) GATEWAY))
+            return -1;
+        return mNat.enableNat(5 + mNumAddrs, mArgv);
+    }
+
+    int down() {
+        mArgv[1] = (char *) "disable";
+        int res = mNat.disableNat(5 + mNumAddrs, mArgv);
+        return mSecondary.removeRoute(mCli, (char *) IFACE, (char *) "0.0.0.0", 0,
+                                      (char *) GATEWAY) | res;
+    }
+
+private:
+    SocketClient *mCli;
+    SecondaryTableController mSecondary;
+    NatController mNat;
+};
+
+/* The processes the controllers ran for the same changes before rtnetlink */
+class ProcessRound : public Round {
+public:
+    ProcessRound(int numAddrs) : Round(numAddrs) {}
+
+    int up() {
+        int res = runIp("route add 0.0.0.0/0 via %s dev %s table %d", GATEWAY, IFACE, TABLE);
+        for (int i = 0; i < mNumAddrs; i++) {
+            res |= runIp("-4 rule add from %s table %d", mArgv[5 + i], TABLE);
+            res |= runIp("route add %s dev %s table %d", mArgv[5 + i], IFACE, TABLE);
+        }
+        res |= runIp("route flush cache");
+        return res | forwardRules('A') | runIptables("-t nat -A POSTROUTING -o " IFACE " -j MASQUERADE");
+    }
+
+    int down() {
+        int res = forwardRules('D');
+        for (int i = 0; i < mNumAddrs; i++) {
+            res |= runIp("route del %s dev %s table %d", mArgv[5 + i], IFACE, TABLE);
+            res |= runIp("-4 rule del from %s table %d", mArgv[5 + i], TABLE);
+        }
+        res |= runIp("route flush cache");
+        res |= setDefaults();
+        return res | runIp("route del 0.0.0.0/0 via %s dev %s table %d", GATEWAY, IFACE, TABLE);
+    }
+
+private:
+    static int runIptables(const char *args) {
+        char cmd[255];
+
+        snprintf(cmd, sizeof(cmd), BIN_DIR "/iptables %s", args);
+        return system_nosh(cmd);
+    }
+
+    static int forwardRules(char op) {
+        char cmd[128];
+        int res;
+
+        snprintf(cmd, sizeof(cmd), "-%c FORWARD -i %s -o %s -m state --state ESTABLISHED,RELATED -j ACCEPT",
+                 op, IFACE, IFACE);
+        res = runIptables(cmd);
+        snprintf(cmd, sizeof(cmd), "-%c FORWARD -i %s -o %s -m state --state INVALID -j DROP",
+                 op, IFACE, IFACE);
+        res |= runIptables(cmd);
+        snprintf(cmd, sizeof(cmd), "-%c FORWARD -i %s -o %s -j ACCEPT", op, IFACE, IFACE);
+        return res | runIptables(cmd);
+    }
+
+    /* NatController::setDefaults(), which the last disableNat() runs */
+    static int setDefaults() {
+        int res = runIptables("-P INPUT ACCEPT") | runIptables("-P OUTPUT ACCEPT") |
+                runIptables("-P FORWARD DROP") | runIptables("-F FORWARD") |
+                runIptables("-t nat -F");
+        res |= runIp("rule flush") | runIp("-6 rule flush");
+        res |= runIp("rule add from all lookup default prio 32767");
+        res |= runIp("rule add from all lookup main prio 32766");
+        res |= runIp("-6 rule add from all lookup default prio 32767");
+        res |= runIp("-6 rule add from all lookup main prio 32766");
+        return res | runIp("route flush cache");
+    }
+};
+
+static void run(const char *what, Round &round, int numAddrs, int rounds, int drainFd) {
+    double upSecs = 0, downSecs = 0, start;
+    int failed = 0;
+    char buf[256];
+
+    for (int r = 0; r < rounds; r++) {
+        start = now();
+        failed += round.up() != 0;
+        upSecs += now() - start;
+        failed += !isUp(numAddrs);
+
+        start = now();
+        failed += round.down() != 0;
+        downSecs += now() - start;
+
+        /* the controllers' replies to the command socket */
+        while (read(drainFd, buf, sizeof(buf)) > 0)
+            ;
+    }
+    printf("  %-10s up %8.3f ms  down %8.3f ms%s\n", what, upSecs * 1000 / rounds,
+           downSecs * 1000 / rounds, failed ? "  (failed)" : "");
+}
+
+int main(int argc, char **argv) {
+    const char *name = strrchr(argv[0], '/') ? strrchr(argv[0], '/') + 1 : argv[0];
+
+    if (strstr(name, "tables"))
+        return 0;
+
+    int numAddrs = argc > 1 ? atoi(argv[1]) : 4;
+    int rounds = argc > 2 ? atoi(argv[2]) : 20;
+    const char *ipPath = getenv("ROUTE_BENCH_IP") ? getenv("ROUTE_BENCH_IP") : BIN_DIR "/ip";
+    size_t selfLen, ipLen;
+
+    if (numAddrs < 1 || numAddrs > 255 || rounds < 1) {
+        fprintf(stderr, "usage: %s [addrs [rounds]]\n", argv[0]);
+        return 1;
+    }
+
+    /* keep copies of ourselves and ip before /system/bin is covered up */
+    char *self = slurp("/proc/self/exe", &selfLen);
+    char *ip = slurp(ipPath, &ipLen);
+    if (!self || !ip)
+        return 1;
+
+    if (unshare(CLONE_NEWNS | CLONE_NEWNET) ||
+        mount(NULL, "/", NULL, MS_REC | MS_PRIVATE, NULL) ||
+        mount("tmpfs", BIN_DIR, "tmpfs", 0, "mode=0755")) {
+        fprintf(stderr, "cannot set up the namespaces: %s\n", strerror(errno));
+        return 1;
+    }
+    if (install("ip", ip, ipLen) || install("iptables", self, selfLen) ||
+        install("ip6tables", self, selfLen))
+        return 1;
+
+    /* lo comes up down in a new namespace; give it a subnet to route via */
+    struct ifreq ifr;
+    int s = socket(AF_INET, SOCK_DGRAM, 0);
+    memset(&ifr, 0, sizeof(ifr));
+    strncpy(ifr.ifr_name, IFACE, IFNAMSIZ);
+    ifr.ifr_flags = IFF_UP;
+    if (s < 0 || ioctl(s, SIOCSIFFLAGS, &ifr) ||
+        runIp("addr add 10.99.0.1/24 dev %s", IFACE)) {
+        fprintf(stderr, "cannot bring up %s: %s\n", IFACE, strerror(errno));
+        return 1;
+    }
+    close(s);
+
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds)) {
+        fprintf(stderr, "cannot create the command socket: %s\n", strerror(errno));
+        return 1;
+    }
+    fcntl(fds[1], F_SETFL, O_NONBLOCK);
+    SocketClient cli(fds[0], false);
+
+    printf("%d tethered subnets, %d rounds\n", numAddrs, rounds);
+    ControllerRound controllers(numAddrs, &cli);
+    run("rtnetlink", controllers, numAddrs, rounds, fds[1]);
+    ProcessRound processes(numAddrs);
+    run("processes", processes, numAddrs, rounds, fds[1]);
+    return 0;
+}
@@ -0,0 +1,167 @@
+/*
+ * Copyright (C) 2012 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Times BandwidthController::getTetherStats() queries against a
+ * stand-in iptables that lists a FORWARD chain of tethering rules.
+ *
+ *   tether_stats_bench [pairs [polls]]
+ *
+ * Each poll asks for the stats of every pair, as the framework does.
+ * They are timed twice: with the FORWARD listing shared by all pairs of
+ * a poll, and with it dropped before every query, which costs what one
+ * listing per pair used to.
+ *
+ * Needs root: like bandwidth_bench it runs in a private mount namespace,
+ * with a tmpfs over /system/bin holding a copy of itself as iptables.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mount.h>
+#include <sys/stat.h>
+
+#include "../BandwidthController.h"
+
+#define BIN_DIR "/system/bin"
+#define LOG_FILE BIN_DIR "/.tether_stats_bench.log"
+#define UPSTREAM "rmnet0"
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* iptables -nvx -L FORWARD, with the three rules NatController adds per pair */
+static int iptablesStandIn() {
+    const char *env = getenv("TETHER_STATS_BENCH_PAIRS");
+    int pairs = env ? atoi(env) : 0;
+    FILE *log = fopen(LOG_FILE, "a");
+
+    if (log) {
+        fputs("1\n", log);
+        fclose(log);
+    }
+    printf("Chain FORWARD (policy ACCEPT 0 packets, 0 bytes)\n");
+    printf("    pkts      bytes target     prot opt in     out     source               destination\n");
+    for (int i = 0; i < pairs; i++) {
+        char iface[16];
+
+        snprintf(iface, sizeof(iface), "tether%d", i);
+        printf("%8d %10d ACCEPT     all  --  %-6s %-6s  0.0.0.0/0            0.0.0.0/0            state RELATED,ESTABLISHED\n",
+               1000 + i, 1000000 + i, UPSTREAM, iface);
+        printf("%8d %10d DROP       all  --  %-6s %-6s  0.0.0.0/0            0.0.0.0/0            state INVALID\n",
+               0, 0, iface, UPSTREAM);
+        printf("%8d %10d ACCEPT     all  --  %-6s %-6s  0.0.0.0/0            0.0.0.0/0\n",
+               500 + i, 500000 + i, iface, UPSTREAM);
+    }
+    return 0;
+}
+
+/* Counts and removes the log: one line per listing run */
+static int readLog() {
+    FILE *log = fopen(LOG_FILE, "r");
+    int n, listings = 0;
+
+    if (!log)
+        return 0;
+    while (fscanf(log, "%d", &n) == 1)
+        listings += n;
+    fclose(log);
+    unlink(LOG_FILE);
+    return listings;
+}
+
+static void run(const char *what, int pairs, int polls, bool shared) {
+    BandwidthController bc;
+    int queries = 0, failed = 0;
+    double start = now();
+
+    for (int p = 0; p < polls; p++) {
+        BandwidthController::invalidateTetherStats();
+        for (int i = 0; i < pairs; i++) {
+            BandwidthController::TetherStats stats;
+            char iface[16];
+
+            snprintf(iface, sizeof(iface), "tether%d", i);
+            stats.ifaceIn = iface;
+            stats.ifaceOut = UPSTREAM;
+            if (!shared)
+                BandwidthController::invalidateTetherStats();
+            if (bc.getTetherStats(stats) || stats.rxBytes != 500000 + i ||
+                stats.txBytes != 1000000 + i)
+                failed++;
+            queries++;
+        }
+    }
+
+    double secs = now() - start;
+    printf("  %-10s %6d queries %5d listings %8.3f s %9.0f queries/s%s\n",
+           what, queries, readLog(), secs, queries / secs, failed ? "  (failed)" : "");
+}
+
+int main(int argc, char **argv) {
+    const char *name = strrchr(argv[0], '/') ? strrchr(argv[0], '/') + 1 : argv[0];
+
+    if (!strcmp(name, "iptables"))
+        return iptablesStandIn();
+
+    int pairs = argc > 1 ? atoi(argv[1]) : 8;
+    int polls = argc > 2 ? atoi(argv[2]) : 100;
+    char env[16];
+
+    snprintf(env, sizeof(env), "%d", pairs);
+    setenv("TETHER_STATS_BENCH_PAIRS", env, 1);
+
+    /* keep a copy of ourselves before /system/bin is covered up */
+    int fd = open("/proc/self/exe", O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st)) {
+        fprintf(stderr, "cannot open /proc/self/exe: %s\n", strerror(errno));
+        return 1;
+    }
+    char *self = (char *) malloc(st.st_size);
+    if (read(fd, self, st.st_size) != st.st_size) {
+        fprintf(stderr, "cannot read /proc/self/exe: %s\n", strerror(errno));
+        return 1;
+    }
+    close(fd);
+
+    if (unshare(CLONE_NEWNS) ||
+        mount(NULL, "/", NULL, MS_REC | MS_PRIVATE, NULL) ||
+        mount("tmpfs", BIN_DIR, "tmpfs", 0, "mode=0755")) {
+        fprintf(stderr, "cannot set up the stand-in: %s\n", strerror(errno));
+        return 1;
+    }
+    fd = open(BIN_DIR "/iptables", O_WRONLY | O_CREAT | O_TRUNC, 0755);
+    if (fd < 0 || write(fd, self, st.st_size) != st.st_size) {
+        fprintf(stderr, "cannot write " BIN_DIR "/iptables: %s\n", strerror(errno));
+        return 1;
+    }
+    close(fd);
+
+    printf("%d pairs, %d polls\n", pairs, polls);
+    run("per poll", pairs, polls, true);
+    run("per pair", pairs, polls, false);
+    return 0;
+}
@@ -0,0 +1,258 @@
+/*
+ * Copyright (C) 2012 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Times ThrottleController programming the shaping of interfaces,
+ * inside a private network namespace.
+ *
+ *   throttle_bench [ifaces [rounds]]
+ *
+ * Each round throttles every interface in turn: it sets a throttle,
+ * replaces it with another rate, then resets it.  The rounds run once
+ * through ThrottleController, which does each step as one rtnetlink
+ * transaction, and once as the tc processes it used to run (and still
+ * does as a fallback), where a replace has to be a reset and a set.
+ * After every set and replace the qdiscs, classes and redirect filter
+ * are read back with tc.
+ *
+ * Needs root and the veth, ifb, htb, ingress, u32 and mirred kernel
+ * support.  It runs in its own network and mount namespaces, on veth
+ * pairs and an ifb0 of its own, with a tmpfs over /system/bin holding
+ * the real ip and tc (from $THROTTLE_BENCH_BIN, else /system/bin).
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mount.h>
+#include <sys/stat.h>
+
+#include "../ThrottleController.h"
+
+extern "C" int system_nosh(const char *command);
+
+#define BIN_DIR "/system/bin"
+#define RX_KBPS 20480
+#define TX_KBPS 10240
+
+static const char *TOOLS[] = { "ip", "tc" };
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int run(const char *tool, const char *fmt, ...) {
+    char cmd[255];
+    va_list ap;
+
+    va_start(ap, fmt);
+    int len = snprintf(cmd, sizeof(cmd), BIN_DIR "/%s ", tool);
+    vsnprintf(cmd + len, sizeof(cmd) - len, fmt, ap);
+    va_end(ap);
+    return system_nosh(cmd);
+}
+
+/* Whether the output of "tc <what>" contains |match| */
+static bool tcShows(const char *what, const char *match) {
+    char cmd[128], line[512];
+    bool found = false;
+
+    snprintf(cmd, sizeof(cmd), BIN_DIR "/tc %s", what);
+    FILE *fp = popen(cmd, "r");
+    if (!fp)
+        return false;
+    while (fgets(line, sizeof(line), fp))
+        found |= strstr(line, match) != NULL;
+    pclose(fp);
+    return found;
+}
+
+/* Whether |iface| and ifb0 are shaped to the given rates */
+static bool isThrottled(const char *iface, int rxKbps, int txKbps) {
+    char what[64], rx[32], tx[32];
+
+    snprintf(tx, sizeof(tx), "rate %dKbit", txKbps);
+    snprintf(rx, sizeof(rx), "rate %dKbit", rxKbps);
+    snprintf(what, sizeof(what), "class show dev %s", iface);
+    if (!tcShows(what, tx) || !tcShows("class show dev ifb0", rx))
+        return false;
+    snprintf(what, sizeof(what), "qdisc show dev %s", iface);
+    if (!tcShows(what, "ingress"))
+        return false;
+    snprintf(what, sizeof(what), "filter show dev %s parent ffff:", iface);
+    return tcShows(what, "ifb0");
+}
+
+class Shaper {
+public:
+    virtual ~Shaper() {}
+    virtual int set(const char *iface, int rxKbps, int txKbps) = 0;
+    virtual int replace(const char *iface, int rxKbps, int txKbps) = 0;
+    virtual int reset(const char *iface) = 0;
+};
+
+/* Through ThrottleController, as netd does now */
+class ControllerShaper : public Shaper {
+public:
+    int set(const char *iface, int rxKbps, int txKbps) {
+        return ThrottleController::setInterfaceThrottle(iface, rxKbps, txKbps);
+    }
+    int replace(const char *iface, int rxKbps, int txKbps) {
+        return ThrottleController::setInterfaceThrottle(iface, rxKbps, txKbps);
+    }
+    int reset(const char *iface) {
+        return ThrottleController::setInterfaceThrottle(iface, -1, -1);
+    }
+};
+
+/* The tc processes ThrottleController ran before rtnetlink */
+class ProcessShaper : public Shaper {
+public:
+    int set(const char *iface, int rxKbps, int txKbps) {
+        return run("tc", "qdisc add dev %s root handle 1: htb default 1 r2q 1000", iface) ||
+               run("tc", "class add dev %s parent 1: classid 1:1 htb rate %dkbit", iface, txKbps) ||
+               run("tc", "qdisc add dev ifb0 root handle 1: htb default 1 r2q 1000") ||
+               run("tc", "class add dev ifb0 parent 1: classid 1:1 htb rate %dkbit", rxKbps) ||
+               run("tc", "qdisc add dev %s ingress", iface) ||
+               run("tc", "filter add dev %s parent ffff: protocol ip prio 10 u32 match "
+                   "u32 0 0 flowid 1:1 action mirred egress redirect dev ifb0", iface);
+    }
+    int replace(const char *iface, int rxKbps, int txKbps) {
+        reset(iface);
+        return set(iface, rxKbps, txKbps);
+    }
+    int reset(const char *iface) {
+        run("tc", "qdisc del dev %s root", iface);
+        run("tc", "qdisc del dev %s ingress", iface);
+        run("tc", "qdisc del dev ifb0 root");
+        return 0;
+    }
+};
+
+static void measure(const char *what, Shaper &shaper, int numIfaces, int rounds) {
+    double setSecs = 0, replaceSecs = 0, resetSecs = 0, start;
+    int failed = 0;
+
+    for (int r = 0; r < rounds; r++) {
+        for (int i = 0; i < numIfaces; i++) {
+            char iface[16];
+
+            snprintf(iface, sizeof(iface), "veth%d", 2 * i);
+            start = now();
+            failed += shaper.set(iface, RX_KBPS, TX_KBPS) != 0;
+            setSecs += now() - start;
+            failed += !isThrottled(iface, RX_KBPS, TX_KBPS);
+
+            start = now();
+            failed += shaper.replace(iface, 2 * RX_KBPS, 2 * TX_KBPS) != 0;
+            replaceSecs += now() - start;
+            failed += !isThrottled(iface, 2 * RX_KBPS, 2 * TX_KBPS);
+
+            start = now();
+            failed += shaper.reset(iface) != 0;
+            resetSecs += now() - start;
+        }
+    }
+
+    int calls = numIfaces * rounds;
+    printf("  %-10s set %7.3f ms  replace %7.3f ms  reset %7.3f ms%s\n", what,
+           setSecs * 1000 / calls, replaceSecs * 1000 / calls, resetSecs * 1000 / calls,
+           failed ? "  (failed)" : "");
+}
+
+static int install(const char *name, const char *data, size_t len) {
+    char path[64];
+
+    snprintf(path, sizeof(path), BIN_DIR "/%s", name);
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0755);
+    if (fd < 0 || write(fd, data, len) != (ssize_t) len) {
+        fprintf(stderr, "cannot write %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    close(fd);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    int numIfaces = argc > 1 ? atoi(argv[1]) : 4;
+    int rounds = argc > 2 ? atoi(argv[2]) : 10;
+    const char *dir = getenv("THROTTLE_BENCH_BIN") ? getenv("THROTTLE_BENCH_BIN") : BIN_DIR;
+    char *tools[2];
+    size_t lens[2];
+
+    if (numIfaces < 1 || numIfaces > 64 || rounds < 1) {
+        fprintf(stderr, "usage: %s [ifaces [rounds]]\n", argv[0]);
+        return 1;
+    }
+
+    /* keep copies of ip and tc before /system/bin is covered up */
+    for (int i = 0; i < 2; i++) {
+        char path[256];
+        struct stat st;
+
+        snprintf(path, sizeof(path), "%s/%s", dir, TOOLS[i]);
+        int fd = open(path, O_RDONLY);
+        if (fd < 0 || fstat(fd, &st)) {
+            fprintf(stderr, "cannot open %s: %s\n", path, strerror(errno));
+            return 1;
+        }
+        tools[i] = (char *) malloc(st.st_size);
+        lens[i] = st.st_size;
+        if (read(fd, tools[i], lens[i]) != (ssize_t) lens[i]) {
+            fprintf(stderr, "cannot read %s: %s\n", path, strerror(errno));
+            return 1;
+        }
+        close(fd);
+    }
+
+    if (unshare(CLONE_NEWNS | CLONE_NEWNET) ||
+        mount(NULL, "/", NULL, MS_REC | MS_PRIVATE, NULL) ||
+        mount("tmpfs", BIN_DIR, "tmpfs", 0, "mode=0755")) {
+        fprintf(stderr, "cannot set up the namespaces: %s\n", strerror(errno));
+        return 1;
+    }
+    for (int i = 0; i < 2; i++) {
+        if (install(TOOLS[i], tools[i], lens[i]))
+            return 1;
+    }
+
+    if (run("ip", "link add ifb0 type ifb")) {
+        fprintf(stderr, "cannot create ifb0\n");
+        return 1;
+    }
+    for (int i = 0; i < numIfaces; i++) {
+        if (run("ip", "link add veth%d type veth peer name veth%d", 2 * i, 2 * i + 1) ||
+            run("ip", "link set veth%d up", 2 * i)) {
+            fprintf(stderr, "cannot create veth%d\n", 2 * i);
+            return 1;
+        }
+    }
+
+    printf("%d interfaces, %d rounds\n", numIfaces, rounds);
+    ControllerShaper controller;
+    measure("rtnetlink", controller, numIfaces, rounds);
+    ProcessShaper processes;
+    measure("processes", processes, numIfaces, rounds);
+    return 0;
+}
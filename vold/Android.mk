@@ -16,6 +16,7 @@ common_src_files := \
 	Hfsplus.cpp \
 	Iso9660.cpp \
 	Loop.cpp \
+	MountTable.cpp \
 	Devmapper.cpp \
 	ResponseCode.cpp \
 	Xwarp.cpp \
@@ -27,6 +28,7 @@ common_src_files := \
 common_c_includes := \
 	$(KERNEL_HEADERS) \
 	system/extras/ext4_utils \
+	system/core/toolbox \
 	external/openssl/include
 
 common_shared_libraries := \
@@ -36,6 +38,9 @@ common_shared_libraries := \
 	libhardware_legacy \
 	libcrypto
 
+common_static_libraries := \
+	libnewfs_msdos
+
 include $(CLEAR_VARS)
 
 LOCAL_MODULE := libvold
@@ -46,6 +51,8 @@ LOCAL_C_INCLUDES := $(common_c_includes)
 
 LOCAL_SHARED_LIBRARIES := $(common_shared_libraries)
 
+LOCAL_STATIC_LIBRARIES := $(common_static_libraries)
+
 LOCAL_MODULE_TAGS := eng tests
 
 include $(BUILD_STATIC_LIBRARY)
@@ -75,6 +82,8 @@ endif
 
 LOCAL_SHARED_LIBRARIES := $(common_shared_libraries)
 
+LOCAL_STATIC_LIBRARIES := $(common_static_libraries)
+
 include $(BUILD_EXECUTABLE)
 
 include $(CLEAR_VARS)
@@ -229,36 +229,18 @@ int CommandListener::StorageCmd::runCommand(SocketClient *cli,
     }
 
     if (!strcmp(argv[1], "users")) {
-        DIR *dir;
-        struct dirent *de;
+        ProcessUserCollection users;
 
-        if (!(dir = opendir("/proc"))) {
+        if (Process::findProcessesWithOpenFiles(argv[2], users)) {
             cli->sendMsg(ResponseCode::OperationFailed, "Failed to open /proc", true);
             return 0;
         }
 
-        while ((de = readdir(dir))) {
-            int pid = Process::getPid(de->d_name);
-
-            if (pid < 0) {
-                continue;
-            }
-
-            char processName[255];
-            Process::getProcessName(pid, processName, sizeof(processName));
-
-            if (Process::checkFileDescriptorSymLinks(pid, argv[2]) ||
-                Process::checkFileMaps(pid, argv[2]) ||
-                Process::checkSymLink(pid, argv[2], "cwd") ||
-                Process::checkSymLink(pid, argv[2], "root") ||
-                Process::checkSymLink(pid, argv[2], "exe")) {
-
-                char msg[1024];
-                snprintf(msg, sizeof(msg), "%d %s", pid, processName);
-                cli->sendMsg(ResponseCode::StorageUsersListResult, msg, false);
-            }
+        for (ProcessUserCollection::iterator it = users.begin(); it != users.end(); ++it) {
+            char msg[1024];
+            snprintf(msg, sizeof(msg), "%d %s", it->pid, it->name);
+            cli->sendMsg(ResponseCode::StorageUsersListResult, msg, false);
         }
-        closedir(dir);
         cli->sendMsg(ResponseCode::CommandOkay, "Storage user list complete", false);
     } else {
         cli->sendMsg(ResponseCode::CommandSyntaxError, "Unknown storage cmd", false);
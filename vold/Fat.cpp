@@ -15,6 +15,7 @@
  */
 
 #include <stdio.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <fcntl.h>
 #include <unistd.h>
@@ -38,20 +39,280 @@
 #include <cutils/properties.h>
 
 #include "Fat.h"
+#include "newfs_msdos.h"
 
 static char FSCK_MSDOS_PATH[] = "/system/bin/fsck_msdos";
 static char MKDOSFS_PATH[] = "/system/bin/newfs_msdos";
 extern "C" int logwrap(int argc, const char **argv, int background);
+
+// The FAT is read this much at a time
+#define FAT_READ_CHUNK (1024 * 1024)
+
+#define FAT16_CLEAN_SHUTDOWN 0x8000
+#define FAT16_NO_HARD_ERROR 0x4000
+#define FAT32_CLEAN_SHUTDOWN 0x08000000
+#define FAT32_NO_HARD_ERROR 0x04000000
+#define FAT_STATE_DIRTY 0x01
+
+static inline unsigned int getLe16(const unsigned char *p) {
+    return p[0] | (p[1] << 8);
+}
+
+static inline unsigned int getLe32(const unsigned char *p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int) p[3] << 24);
+}
+
+static inline bool testBit(const unsigned char *map, unsigned int bit) {
+    return map[bit / 8] & (1 << (bit % 8));
+}
+
+static inline void setBit(unsigned char *map, unsigned int bit) {
+    map[bit / 8] |= 1 << (bit % 8);
+}
+
+static int readFully(int fd, void *buf, size_t len, off64_t offset) {
+    char *p = (char *) buf;
+
+    while (len) {
+        ssize_t rc = TEMP_FAILURE_RETRY(pread64(fd, p, len, offset));
+        if (rc <= 0) {
+            if (rc == 0)
+                errno = EIO;
+            return -1;
+        }
+        p += rc;
+        offset += rc;
+        len -= rc;
+    }
+    return 0;
+}
+
+int Fat::fastCheck(const char *fsPath, Progress progress, void *cookie) {
+    unsigned char boot[512];
+    unsigned int bps, spc, res, nft, rde, totalSectors, spf, rootCluster = 0;
+    unsigned int dataStart, clusters, maxCluster, fatBits, entrySize;
+    unsigned char *fat = NULL, *copy = NULL, *referenced = NULL, *visited = NULL;
+    size_t fatBytes;
+    unsigned int chains = 0;
+    int lastPercent = -1;
+    int rc = -1;
+    int fd;
+
+    if ((fd = open(fsPath, O_RDONLY)) < 0) {
+        SLOGE("Unable to open %s (%s)", fsPath, strerror(errno));
+        return -1;
+    }
+
+    if (readFully(fd, boot, sizeof(boot), 0)) {
+        SLOGE("Unable to read boot sector of %s (%s)", fsPath, strerror(errno));
+        goto out;
+    }
+
+    bps = getLe16(boot + 11);
+    spc = boot[13];
+    res = getLe16(boot + 14);
+    nft = boot[16];
+    rde = getLe16(boot + 17);
+    totalSectors = getLe16(boot + 19) ? getLe16(boot + 19) : getLe32(boot + 32);
+    spf = getLe16(boot + 22) ? getLe16(boot + 22) : getLe32(boot + 36);
+
+    if (getLe16(boot + 510) != 0xaa55 || bps < 512 || bps > 4096 || (bps & (bps - 1)) ||
+            !spc || (spc & (spc - 1)) || !res || !nft || nft > 2 || !spf) {
+        SLOGI("%s: no FAT boot sector found", fsPath);
+        errno = ENODATA;
+        goto out;
+    }
+
+    dataStart = res + nft * spf + (rde * 32 + bps - 1) / bps;
+    if (dataStart >= totalSectors) {
+        errno = ENODATA;
+        goto out;
+    }
+    clusters = (totalSectors - dataStart) / spc;
+    maxCluster = clusters + 1;
+
+    if (clusters < 4085) {
+        // FAT12 volumes are tiny; leave them to fsck_msdos
+        errno = ENOTSUP;
+        goto out;
+    } else if (clusters < 65525) {
+        fatBits = 16;
+        if (boot[37] & FAT_STATE_DIRTY) {
+            SLOGI("%s was not cleanly unmounted", fsPath);
+            errno = EAGAIN;
+            goto out;
+        }
+    } else {
+        fatBits = 32;
+        rootCluster = getLe32(boot + 44);
+        if (boot[65] & FAT_STATE_DIRTY) {
+            SLOGI("%s was not cleanly unmounted", fsPath);
+            errno = EAGAIN;
+            goto out;
+        }
+    }
+    entrySize = fatBits / 8;
+
+    fatBytes = (size_t) (maxCluster + 1) * entrySize;
+    if (fatBytes > (size_t) spf * bps) {
+        SLOGE("%s: FAT too small for %u clusters", fsPath, clusters);
+        errno = EIO;
+        goto out;
+    }
+
+    fat = (unsigned char *) malloc(fatBytes);
+    copy = (unsigned char *) malloc(FAT_READ_CHUNK);
+    referenced = (unsigned char *) calloc(maxCluster / 8 + 1, 1);
+    visited = (unsigned char *) calloc(maxCluster / 8 + 1, 1);
+    if (!fat || !copy || !referenced || !visited) {
+        errno = ENOMEM;
+        goto out;
+    }
+
+    /*
+     * Read the first FAT in large sequential chunks, checking each chunk
+     * against the same range of the second copy as we go.
+     */
+    for (size_t done = 0; done < fatBytes; ) {
+        size_t len = fatBytes - done;
+        off64_t offset = (off64_t) res * bps + done;
+        int percent;
+
+        if (len > FAT_READ_CHUNK)
+            len = FAT_READ_CHUNK;
+        if (readFully(fd, fat + done, len, offset)) {
+            SLOGE("Unable to read FAT of %s (%s)", fsPath, strerror(errno));
+            goto out;
+        }
+        if (nft > 1) {
+            if (readFully(fd, copy, len, offset + (off64_t) spf * bps)) {
+                SLOGE("Unable to read FAT copy of %s (%s)", fsPath, strerror(errno));
+                goto out;
+            }
+            if (memcmp(fat + done, copy, len)) {
+                SLOGW("%s: FAT copies differ", fsPath);
+                errno = EIO;
+                goto out;
+            }
+        }
+        done += len;
+
+        // Reading is most of the work; chain validation is the last 10%
+        percent = (int) ((uint64_t) done * 90 / fatBytes);
+        if (progress && percent != lastPercent) {
+            progress(cookie, percent);
+            lastPercent = percent;
+        }
+    }
+
+    {
+        unsigned int entry1 = fatBits == 16 ? getLe16(fat + 2) : getLe32(fat + 4);
+        unsigned int clean = fatBits == 16 ? FAT16_CLEAN_SHUTDOWN | FAT16_NO_HARD_ERROR :
+                                             FAT32_CLEAN_SHUTDOWN | FAT32_NO_HARD_ERROR;
+        if ((entry1 & clean) != clean) {
+            SLOGI("%s is marked dirty in its FAT", fsPath);
+            errno = EAGAIN;
+            goto out;
+        }
+    }
+
+#define FAT_ENTRY(c) (fatBits == 16 ? getLe16(fat + (c) * 2) : \
+                      getLe32(fat + (size_t) (c) * 4) & 0x0fffffff)
+    {
+        unsigned int bad = fatBits == 16 ? 0xfff7 : 0x0ffffff7;
+
+        // Each cluster may be the successor of at most one other
+        for (unsigned int c = 2; c <= maxCluster; c++) {
+            unsigned int next = FAT_ENTRY(c);
+
+            if (next == 0 || next >= bad)
+                continue;
+            if (next < 2 || next > maxCluster) {
+                SLOGW("%s: cluster %u links outside the volume (%u)", fsPath, c, next);
+                errno = EIO;
+                goto out;
+            }
+            if (testBit(referenced, next)) {
+                SLOGW("%s: cluster %u is cross-linked", fsPath, next);
+                errno = EIO;
+                goto out;
+            }
+            setBit(referenced, next);
+        }
+
+        // Follow every chain from its head; each must end in an EOC mark
+        for (unsigned int c = 2; c <= maxCluster; c++) {
+            unsigned int next = FAT_ENTRY(c);
+
+            if (next == 0 || next == bad || testBit(referenced, c))
+                continue;
+            chains++;
+            for (unsigned int cur = c; ; cur = next) {
+                setBit(visited, cur);
+                next = FAT_ENTRY(cur);
+                if (next > bad)
+                    break;
+                if (next == 0 || next == bad) {
+                    SLOGW("%s: chain from cluster %u runs into a %s cluster", fsPath, c,
+                          next ? "bad" : "free");
+                    errno = EIO;
+                    goto out;
+                }
+            }
+        }
+
+        // Anything in use but not reached from a head is part of a loop
+        for (unsigned int c = 2; c <= maxCluster; c++) {
+            unsigned int next = FAT_ENTRY(c);
+
+            if (next != 0 && next != bad && !testBit(visited, c)) {
+                SLOGW("%s: cluster %u is part of a loop", fsPath, c);
+                errno = EIO;
+                goto out;
+            }
+        }
+
+        if (fatBits == 32 && (rootCluster < 2 || rootCluster > maxCluster ||
+                              testBit(referenced, rootCluster) ||
+                              !testBit(visited, rootCluster))) {
+            SLOGW("%s: bad root directory cluster %u", fsPath, rootCluster);
+            errno = EIO;
+            goto out;
+        }
+    }
+#undef FAT_ENTRY
+
+    if (progress)
+        progress(cookie, 100);
+    SLOGI("%s: FAT%u, %u clusters, %u chains OK", fsPath, fatBits, clusters, chains);
+    rc = 0;
+
+out:
+    free(fat);
+    free(copy);
+    free(referenced);
+    free(visited);
+    close(fd);
+    return rc;
+}
 extern "C" int mount(const char *, const char *, const char *, unsigned long, const void *);
 
-int Fat::check(const char *fsPath) {
+int Fat::check(const char *fsPath, Progress progress, void *cookie) {
 #if	1//ndef HAS_EXFAT
     bool rw = true;
+
     if (access(FSCK_MSDOS_PATH, X_OK)) {
         SLOGW("Skipping fs checks\n");
         return 0;
     }
 
+    /*
+     * The fast check only reports, early and with progress, what the
+     * FATs look like; the full fsck_msdos pass below runs either way.
+     */
+    if (fastCheck(fsPath, progress, cookie))
+        SLOGW("%s: FAT inconsistencies found, fsck_msdos will repair them", fsPath);
+
     int pass = 1;
     int rc = 0;
     do {
@@ -159,52 +420,54 @@ int Fat::doMount(const char *fsPath, const char *mountPoint,
     return rc;
 }
 
-int Fat::format(const char *fsPath, unsigned int numSectors, const char *label) {
-    int fd;
-    int argc;
+struct FormatProgress {
+    Fat::Progress progress;
+    void *cookie;
+    int lastPercent;
+};
+
+static void formatProgress(void *cookie, unsigned int done, unsigned int total) {
+    FormatProgress *fp = (FormatProgress *) cookie;
+    int percent = (int) ((uint64_t) done * 100 / total);
+
+    if (percent != fp->lastPercent) {
+        fp->progress(fp->cookie, percent);
+        fp->lastPercent = percent;
+    }
+}
+
+int Fat::format(const char *fsPath, unsigned int numSectors, const char *label,
+                Progress progress, void *cookie) {
+    int argc = 0;
     const char *args[13];
+    char size[32];
+    FormatProgress fp;
     int rc;
 
-    args[0] = MKDOSFS_PATH;
-    args[1] = "-F";
-    args[2] = "32";
-    args[3] = "-O";
-    args[4] = "android";
-    args[5] = "-c";
-    args[6] = "8";
-
+    args[argc++] = MKDOSFS_PATH;
+    args[argc++] = "-F";
+    args[argc++] = "32";
+    args[argc++] = "-O";
+    args[argc++] = "android";
+    args[argc++] = "-c";
+    args[argc++] = "8";
     if (numSectors) {
-        char tmp[32];
-        snprintf(tmp, sizeof(tmp), "%u", numSectors);
-        const char *size = tmp;
-        args[7] = "-s";
-        args[8] = size;
-        if (label == NULL) {
-            args[9] = fsPath;
-            args[10] = NULL;
-            argc = 11;
-        } else {
-            args[9] = "-L";
-            args[10] = label;
-            args[11] = fsPath;
-            args[12] = NULL;
-            argc = 13;
-        }
-        rc = logwrap(argc, args, 1);
-    } else {
-        if (label == NULL) {
-            args[7] = fsPath;
-            args[8] = NULL;
-            argc = 9;
-        } else {
-            args[7] = "-L";
-            args[8] = label;
-            args[9] = fsPath;
-            args[10] = NULL;
-            argc = 11;
-        }
-        rc = logwrap(argc, args, 1);
+        snprintf(size, sizeof(size), "%u", numSectors);
+        args[argc++] = "-s";
+        args[argc++] = size;
     }
+    if (label != NULL) {
+        args[argc++] = "-L";
+        args[argc++] = label;
+    }
+    args[argc++] = fsPath;
+    args[argc] = NULL;
+
+    // Formatting runs in-process; only the metadata gets written
+    fp.progress = progress;
+    fp.cookie = cookie;
+    fp.lastPercent = -1;
+    rc = newfs_msdos_format(argc, (char **) args, progress ? formatProgress : NULL, &fp);
 
     if (rc == 0) {
         SLOGI("Filesystem formatted OK");
@@ -21,13 +21,25 @@
 
 class Fat {
 public:
-    static int check(const char *fsPath);
+    /* Reports how far a check or format has got, in percent */
+    typedef void (*Progress)(void *cookie, int percent);
+
+    static int check(const char *fsPath, Progress progress = NULL, void *cookie = NULL);
     static int doMount(const char *fsPath, const char *mountPoint,
                        bool ro, bool remount, bool executable,
                        int ownerUid, int ownerGid, int permMask,
                        bool createLost);
     static int format(const char *fsPath, unsigned int numSectors,
-                       const char *label = NULL);
+                       const char *label = NULL,
+                       Progress progress = NULL, void *cookie = NULL);
+
+    /*
+     * Read-only consistency check of a cleanly unmounted FAT16/32 volume:
+     * both FAT copies must match and every cluster chain must be
+     * well formed.  Returns 0 if so.  check() runs it ahead of
+     * fsck_msdos to report problems and progress early.
+     */
+    static int fastCheck(const char *fsPath, Progress progress, void *cookie);
 };
 
 #endif
@@ -21,9 +21,12 @@
 #include <errno.h>
 #include <string.h>
 
+#include <malloc.h>
+#include <stdint.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/ioctl.h>
+#include <sys/syscall.h>
 
 #include <linux/kdev_t.h>
 
@@ -35,6 +38,13 @@
 #include "Loop.h"
 
 #define LOOP_MIN	1
+
+#ifndef LOOP_SET_DIRECT_IO
+#define LOOP_SET_DIRECT_IO	0x4C08
+#endif
+
+// Chunk size for zero-filling images where fallocate() is unsupported
+#define ZERO_FILL_CHUNK	(1024 * 1024)
 int Loop::dumpState(SocketClient *c) {
     int i;
     int fd;
@@ -201,6 +211,15 @@ int Loop::create(const char *id, const char *loopFile, char *loopDeviceBuffer, s
         return -1;
     }
 
+    /*
+     * Bypass the page cache of the backing file, so the data is not
+     * cached twice.  Older kernels don't know the ioctl, and it is
+     * refused if the backing filesystem can't do aligned direct I/O.
+     */
+    if (ioctl(fd, LOOP_SET_DIRECT_IO, 1) < 0) {
+        SLOGD("Direct I/O unavailable for %s (%s)", filename, strerror(errno));
+    }
+
     close(fd);
     close(file_fd);
 
@@ -232,18 +251,88 @@ int Loop::destroyByFile(const char *loopFile) {
 }
 
 int Loop::createImageFile(const char *file, unsigned int numSectors) {
+    return createImageFile(file, numSectors, false);
+}
+
+static int fallocateFile(int fd, off64_t len) {
+#ifdef __NR_fallocate
+#ifdef __LP64__
+    return syscall(__NR_fallocate, fd, 0, (off64_t) 0, len);
+#else
+    // 64-bit arguments are passed as low/high word pairs on 32-bit ABIs
+    return syscall(__NR_fallocate, fd, 0, 0, 0,
+                   (uint32_t) len, (uint32_t) (len >> 32));
+#endif
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+static int zeroFillFile(int fd, off64_t len) {
+    char *buffer = (char *) memalign(4096, ZERO_FILL_CHUNK);
+    off64_t done = 0;
+
+    if (!buffer) {
+        errno = ENOMEM;
+        return -1;
+    }
+    memset(buffer, 0, ZERO_FILL_CHUNK);
+
+    while (done < len) {
+        size_t chunk = ZERO_FILL_CHUNK;
+        if ((off64_t) chunk > len - done)
+            chunk = len - done;
+
+        ssize_t rc = TEMP_FAILURE_RETRY(write(fd, buffer, chunk));
+        if (rc < 0) {
+            free(buffer);
+            return -1;
+        }
+        done += rc;
+    }
+    free(buffer);
+    return fsync(fd);
+}
+
+int Loop::createImageFile(const char *file, unsigned int numSectors, bool preallocate) {
     int fd;
+    off64_t len = (off64_t) numSectors * 512;
 
     if ((fd = creat(file, 0600)) < 0) {
         SLOGE("Error creating imagefile (%s)", strerror(errno));
         return -1;
     }
 
-    if (ftruncate(fd, numSectors * 512) < 0) {
+    if (preallocate) {
+        /*
+         * Reserve all the blocks up front, so the image ends up in as
+         * few extents as the filesystem can manage instead of being
+         * scattered around as the container fills up.
+         */
+        if (fallocateFile(fd, len) < 0) {
+            if (errno != EOPNOTSUPP && errno != ENOSYS) {
+                SLOGE("Error preallocating imagefile (%s)", strerror(errno));
+                goto fail;
+            }
+            if (zeroFillFile(fd, len) < 0) {
+                SLOGE("Error zero-filling imagefile (%s)", strerror(errno));
+                goto fail;
+            }
+        }
+    }
+
+    if (ftruncate(fd, len) < 0) {
         SLOGE("Error truncating imagefile (%s)", strerror(errno));
-        close(fd);
-        return -1;
+        goto fail;
     }
     close(fd);
     return 0;
+
+fail:
+    int saved = errno;
+    close(fd);
+    unlink(file);
+    errno = saved;
+    return -1;
 }
@@ -31,6 +31,11 @@ public:
     static int destroyByDevice(const char *loopDevice);
     static int destroyByFile(const char *loopFile);
     static int createImageFile(const char *file, unsigned int numSectors);
+    /*
+     * With preallocate, every block of the image is allocated at creation,
+     * with fallocate() or by writing zeroes where that isn't supported.
+     */
+    static int createImageFile(const char *file, unsigned int numSectors, bool preallocate);
 
     static int dumpState(SocketClient *c);
 };
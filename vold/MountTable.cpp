@@ -0,0 +1,205 @@
+/*
+ * Copyright (C) 2012 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+
+#define LOG_TAG "Vold"
+
+#include <cutils/log.h>
+
+#include "MountTable.h"
+
+MountTable *MountTable::sInstance = NULL;
+static pthread_mutex_t sInstanceLock = PTHREAD_MUTEX_INITIALIZER;
+
+static int strHash(void *key) {
+    return hashmapHash(key, strlen((const char *) key));
+}
+
+static bool strEquals(void *keyA, void *keyB) {
+    return !strcmp((const char *) keyA, (const char *) keyB);
+}
+
+/* Called from the command and the netlink threads alike */
+MountTable *MountTable::Instance() {
+    pthread_mutex_lock(&sInstanceLock);
+    if (!sInstance)
+        sInstance = new MountTable("/proc/self/mounts");
+    pthread_mutex_unlock(&sInstanceLock);
+    return sInstance;
+}
+
+MountTable::MountTable(const char *path) {
+    pthread_mutex_init(&mLock, NULL);
+    mPath = strdup(path);
+    mFd = -1;
+    mLoaded = false;
+    mBufferSize = 16 * 1024;
+    mBuffer = (char *) malloc(mBufferSize);
+    mEntries = new MountEntryCollection();
+    mByMountPoint = NULL;
+}
+
+MountTable::~MountTable() {
+    clear();
+    delete mEntries;
+    free(mBuffer);
+    if (mFd >= 0)
+        close(mFd);
+    free(mPath);
+    pthread_mutex_destroy(&mLock);
+}
+
+void MountTable::clear() {
+    if (mByMountPoint) {
+        hashmapFree(mByMountPoint);
+        mByMountPoint = NULL;
+    }
+    mEntries->clear();
+    mLoaded = false;
+}
+
+/*
+ * The kernel raises POLLPRI (and POLLERR) on an open mounts file once
+ * after every change to the namespace's mount table.  Polling before
+ * reading means a change racing with the read is seen next time.
+ */
+int MountTable::refresh() {
+    if (mFd < 0) {
+        if ((mFd = open(mPath, O_RDONLY)) < 0) {
+            SLOGE("Error opening %s (%s)", mPath, strerror(errno));
+            return -1;
+        }
+        mLoaded = false;
+    }
+
+    struct pollfd pfd;
+    pfd.fd = mFd;
+    pfd.events = POLLPRI;
+    pfd.revents = 0;
+    if (poll(&pfd, 1, 0) > 0 && (pfd.revents & (POLLPRI | POLLERR)))
+        mLoaded = false;
+
+    if (mLoaded)
+        return 0;
+    return load();
+}
+
+int MountTable::load() {
+    size_t len = 0;
+    ssize_t rc;
+
+    clear();
+
+    if (lseek(mFd, 0, SEEK_SET) < 0) {
+        SLOGE("Error rewinding %s (%s)", mPath, strerror(errno));
+        return -1;
+    }
+    for (;;) {
+        if (len + 1 >= mBufferSize) {
+            char *buffer = (char *) realloc(mBuffer, mBufferSize * 2);
+            if (!buffer) {
+                SLOGE("Out of memory reading %s", mPath);
+                return -1;
+            }
+            mBuffer = buffer;
+            mBufferSize *= 2;
+        }
+        rc = TEMP_FAILURE_RETRY(read(mFd, mBuffer + len, mBufferSize - len - 1));
+        if (rc < 0) {
+            SLOGE("Error reading %s (%s)", mPath, strerror(errno));
+            return -1;
+        }
+        if (rc == 0)
+            break;
+        len += rc;
+    }
+    mBuffer[len] = '\0';
+
+    char *line = mBuffer;
+    char *next;
+    for (; *line; line = next) {
+        MountEntry entry;
+
+        next = strchr(line, '\n');
+        if (next)
+            *next++ = '\0';
+        else
+            next = line + strlen(line);
+
+        /*
+         * Should look like:
+         * /dev/block/loop0 /mnt/obb/fc99df1323fd36424f864dcb76b76d65 ...
+         */
+        if (sscanf(line, "%255s %255s", entry.device, entry.mountPoint) != 2)
+            continue;
+        mEntries->push_back(entry);
+    }
+
+    /*
+     * The list owns the entries; the map points into it.  Both are
+     * only rebuilt together, under mLock.
+     */
+    mByMountPoint = hashmapCreate(mEntries->size() + 1, strHash, strEquals);
+    if (!mByMountPoint) {
+        SLOGE("Out of memory indexing %s", mPath);
+        clear();
+        return -1;
+    }
+    for (MountEntryCollection::iterator it = mEntries->begin(); it != mEntries->end(); ++it) {
+        MountEntry *entry = &(*it);
+        hashmapPut(mByMountPoint, entry->mountPoint, entry);
+    }
+
+    mLoaded = true;
+    return 0;
+}
+
+bool MountTable::isMounted(const char *mountPoint) {
+    bool mounted = false;
+
+    pthread_mutex_lock(&mLock);
+    if (!refresh())
+        mounted = hashmapContainsKey(mByMountPoint, (void *) mountPoint);
+    pthread_mutex_unlock(&mLock);
+    return mounted;
+}
+
+int MountTable::getMountsUnder(const char *dir, MountEntryCollection &mounts) {
+    size_t dirLen = strlen(dir);
+
+    // Tolerate a trailing slash on dir
+    while (dirLen > 1 && dir[dirLen - 1] == '/')
+        dirLen--;
+
+    pthread_mutex_lock(&mLock);
+    if (refresh()) {
+        pthread_mutex_unlock(&mLock);
+        return -1;
+    }
+    for (MountEntryCollection::iterator it = mEntries->begin(); it != mEntries->end(); ++it) {
+        if (!strncmp(it->mountPoint, dir, dirLen) && it->mountPoint[dirLen] == '/')
+            mounts.push_back(*it);
+    }
+    pthread_mutex_unlock(&mLock);
+    return 0;
+}
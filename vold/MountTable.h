@@ -0,0 +1,67 @@
+/*
+ * Copyright (C) 2012 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _MOUNTTABLE_H
+#define _MOUNTTABLE_H
+
+#include <pthread.h>
+#include <utils/List.h>
+#include <cutils/hashmap.h>
+
+class MountEntry {
+public:
+    char device[256];
+    char mountPoint[256];
+};
+
+typedef android::List<MountEntry> MountEntryCollection;
+
+/*
+ * In-memory copy of the kernel mount table.  It is only re-read when
+ * the kernel flags a change with POLLPRI on the mounts file, so lookups
+ * between mount and unmount operations are plain hash table hits.
+ */
+class MountTable {
+private:
+    static MountTable *sInstance;
+
+    pthread_mutex_t mLock;
+    char *mPath;
+    int mFd;
+    bool mLoaded;
+    char *mBuffer;
+    size_t mBufferSize;
+    MountEntryCollection *mEntries;
+    Hashmap *mByMountPoint;
+
+public:
+    static MountTable *Instance();
+
+    /* path is the mounts file to track; tests use a plain file */
+    MountTable(const char *path);
+    virtual ~MountTable();
+
+    bool isMounted(const char *mountPoint);
+    /* Collects everything mounted below dir */
+    int getMountsUnder(const char *dir, MountEntryCollection &mounts);
+
+private:
+    int refresh();
+    int load();
+    void clear();
+};
+
+#endif
@@ -24,6 +24,7 @@
 #include <pwd.h>
 #include <stdlib.h>
 #include <poll.h>
+#include <pthread.h>
 #include <sys/stat.h>
 #include <signal.h>
 
@@ -32,6 +33,15 @@
 
 #include "Process.h"
 
+struct ProcessScan {
+    const char *mountPoint;
+    int *pids;
+    int count;
+    int next;
+    pthread_mutex_t lock;
+    ProcessUserCollection *users;
+};
+
 int Process::readSymLink(const char *path, char *link, size_t max) {
     struct stat s;
     int length;
@@ -49,6 +59,15 @@ int Process::readSymLink(const char *path, char *link, size_t max) {
     return 1;
 }
 
+int Process::readSymLinkAt(int dirfd, const char *name, char *link, size_t max) {
+    // readlinkat() fails with EINVAL on anything but a symlink
+    int length = readlinkat(dirfd, name, link, max - 1);
+    if (length <= 0)
+        return 0;
+    link[length] = 0;
+    return 1;
+}
+
 int Process::pathMatchesMountPoint(const char* path, const char* mountPoint) {
     int length = strlen(mountPoint);
     if (length > 1 && strncmp(path, mountPoint, length) == 0) {
@@ -171,56 +190,230 @@ int Process::getPid(const char *s) {
 }
 
 /*
- * Hunt down processes that have files open at the given mount point.
- * action = 0 to just warn,
- * action = 1 to SIGHUP,
- * action = 2 to SIGKILL
+ * Same checks, in the same order, as killProcessesWithOpenFiles() used to
+ * do with the path based helpers, but relative to one /proc/<pid> dirfd.
  */
-// hunt down and kill processes that have files open on the given mount point
-void Process::killProcessesWithOpenFiles(const char *path, int action) {
-    DIR*    dir;
-    struct dirent* de;
+bool Process::scanProcess(int pid, const char *mountPoint, ProcessUser *user) {
+    char path[32];
+    char link[PATH_MAX];
+    int procfd, fd;
+    bool found = false;
+
+    snprintf(path, sizeof(path), "/proc/%d", pid);
+    procfd = open(path, O_RDONLY | O_DIRECTORY);
+    if (procfd < 0)
+        return false;
+
+    user->pid = pid;
+    user->file[0] = 0;
+
+    fd = openat(procfd, "fd", O_RDONLY | O_DIRECTORY);
+    if (fd >= 0) {
+        DIR *dir = fdopendir(fd);
+        struct dirent *de;
+
+        if (!dir) {
+            close(fd);
+        } else {
+            while ((de = readdir(dir))) {
+                if (de->d_name[0] == '.')
+                    continue;
+                if (readSymLinkAt(dirfd(dir), de->d_name, link, sizeof(link)) &&
+                        pathMatchesMountPoint(link, mountPoint)) {
+                    strlcpy(user->file, link, sizeof(user->file));
+                    user->reason = ProcessUser::OpenFile;
+                    found = true;
+                    break;
+                }
+            }
+            closedir(dir);
+        }
+    }
+
+    if (!found && (fd = openat(procfd, "maps", O_RDONLY)) >= 0) {
+        FILE *file = fdopen(fd, "r");
+        char buffer[PATH_MAX + 100];
+
+        if (!file) {
+            close(fd);
+        } else {
+            while (fgets(buffer, sizeof(buffer), file)) {
+                const char *mapped = strchr(buffer, '/');
+                if (mapped && pathMatchesMountPoint(mapped, mountPoint)) {
+                    strlcpy(user->file, mapped, sizeof(user->file));
+                    user->file[strcspn(user->file, "\n")] = 0;
+                    user->reason = ProcessUser::FileMap;
+                    found = true;
+                    break;
+                }
+            }
+            fclose(file);
+        }
+    }
+
+    if (!found) {
+        static const struct {
+            const char *name;
+            ProcessUser::Reason reason;
+        } links[] = {
+            { "cwd", ProcessUser::Cwd },
+            { "root", ProcessUser::Root },
+            { "exe", ProcessUser::Exe },
+        };
+
+        for (size_t i = 0; i < sizeof(links) / sizeof(links[0]); i++) {
+            if (!readSymLinkAt(procfd, links[i].name, link, sizeof(link)))
+                continue;
+            if (pathMatchesMountPoint(link, mountPoint)) {
+                user->reason = links[i].reason;
+                found = true;
+                break;
+            }
+        }
+    }
+
+    if (found) {
+        fd = openat(procfd, "cmdline", O_RDONLY);
+        if (fd < 0) {
+            strcpy(user->name, "???");
+        } else {
+            int length = read(fd, user->name, sizeof(user->name) - 1);
+            user->name[length > 0 ? length : 0] = 0;
+            close(fd);
+        }
+    }
+
+    close(procfd);
+    return found;
+}
+
+void *Process::scanThread(void *arg) {
+    ProcessScan *scan = (ProcessScan *) arg;
+    ProcessUser *user = new ProcessUser;
+
+    for (;;) {
+        int index;
+
+        pthread_mutex_lock(&scan->lock);
+        index = scan->next++;
+        pthread_mutex_unlock(&scan->lock);
+        if (index >= scan->count)
+            break;
+
+        if (scanProcess(scan->pids[index], scan->mountPoint, user)) {
+            pthread_mutex_lock(&scan->lock);
+            scan->users->push_back(*user);
+            pthread_mutex_unlock(&scan->lock);
+        }
+    }
+
+    delete user;
+    return NULL;
+}
+
+int Process::findProcessesWithOpenFiles(const char *path, ProcessUserCollection &users) {
+    DIR *dir;
+    struct dirent *de;
+    ProcessScan scan;
+    pthread_t threads[SCAN_THREADS];
+    int nthreads = 0;
+    int capacity = 512;
 
     if (!(dir = opendir("/proc"))) {
         SLOGE("opendir failed (%s)", strerror(errno));
-        return;
+        return -1;
     }
 
-    while ((de = readdir(dir))) {
-        int killed = 0;
+    memset(&scan, 0, sizeof(scan));
+    scan.mountPoint = path;
+    scan.users = &users;
+    scan.pids = (int *) malloc(capacity * sizeof(int));
+    pthread_mutex_init(&scan.lock, NULL);
+
+    while (scan.pids && (de = readdir(dir))) {
         int pid = getPid(de->d_name);
-        char name[PATH_MAX];
 
         if (pid == -1)
             continue;
-        getProcessName(pid, name, sizeof(name));
+        if (scan.count == capacity) {
+            capacity *= 2;
+            int *pids = (int *) realloc(scan.pids, capacity * sizeof(int));
+            if (!pids) {
+                free(scan.pids);
+                scan.pids = NULL;
+                break;
+            }
+            scan.pids = pids;
+        }
+        scan.pids[scan.count++] = pid;
+    }
+    closedir(dir);
 
-        char openfile[PATH_MAX];
+    if (!scan.pids) {
+        SLOGE("Failed to allocate process list");
+        pthread_mutex_destroy(&scan.lock);
+        return -1;
+    }
 
-        if (checkFileDescriptorSymLinks(pid, path, openfile, sizeof(openfile))) {
-            SLOGE("Process %s (%d) has open file %s", name, pid, openfile);
-            if (!strcmp(name, "system_server")) {
+    for (int i = 0; i < SCAN_THREADS - 1 && i < scan.count; i++) {
+        if (pthread_create(&threads[nthreads], NULL, scanThread, &scan))
+            break;
+        nthreads++;
+    }
+    // The caller's thread takes part in the scan as well
+    scanThread(&scan);
+    for (int i = 0; i < nthreads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    free(scan.pids);
+    pthread_mutex_destroy(&scan.lock);
+    return 0;
+}
+
+/*
+ * Hunt down processes that have files open at the given mount point.
+ * action = 0 to just warn,
+ * action = 1 to SIGHUP,
+ * action = 2 to SIGKILL
+ */
+// hunt down and kill processes that have files open on the given mount point
+void Process::killProcessesWithOpenFiles(const char *path, int action) {
+    ProcessUserCollection users;
+
+    if (findProcessesWithOpenFiles(path, users))
+        return;
+
+    for (ProcessUserCollection::iterator it = users.begin(); it != users.end(); ++it) {
+        const ProcessUser &user = *it;
+
+        switch (user.reason) {
+        case ProcessUser::OpenFile:
+            SLOGE("Process %s (%d) has open file %s", user.name, user.pid, user.file);
+            if (!strcmp(user.name, "system_server")) {
                 SLOGW("Skipping system_server");
                 continue;
             }
-        } else if (checkFileMaps(pid, path, openfile, sizeof(openfile))) {
-            SLOGE("Process %s (%d) has open filemap for %s", name, pid, openfile);
-        } else if (checkSymLink(pid, path, "cwd")) {
-            SLOGE("Process %s (%d) has cwd within %s", name, pid, path);
-        } else if (checkSymLink(pid, path, "root")) {
-            SLOGE("Process %s (%d) has chroot within %s", name, pid, path);
-        } else if (checkSymLink(pid, path, "exe")) {
-            SLOGE("Process %s (%d) has executable path within %s", name, pid, path);
-        } else {
-            continue;
+            break;
+        case ProcessUser::FileMap:
+            SLOGE("Process %s (%d) has open filemap for %s", user.name, user.pid, user.file);
+            break;
+        case ProcessUser::Cwd:
+            SLOGE("Process %s (%d) has cwd within %s", user.name, user.pid, path);
+            break;
+        case ProcessUser::Root:
+            SLOGE("Process %s (%d) has chroot within %s", user.name, user.pid, path);
+            break;
+        case ProcessUser::Exe:
+            SLOGE("Process %s (%d) has executable path within %s", user.name, user.pid, path);
+            break;
         }
         if (action == 1) {
-            SLOGW("Sending SIGHUP to process %d", pid);
-            kill(pid, SIGTERM);
+            SLOGW("Sending SIGHUP to process %d", user.pid);
+            kill(user.pid, SIGTERM);
         } else if (action == 2) {
-            SLOGE("Sending SIGKILL to process %d", pid);
-            kill(pid, SIGKILL);
+            SLOGE("Sending SIGKILL to process %d", user.pid);
+            kill(user.pid, SIGKILL);
         }
     }
-    closedir(dir);
 }
@@ -17,9 +17,30 @@
 #ifndef _PROCESS_H
 #define _PROCESS_H
 
+#include <limits.h>
+#include <utils/List.h>
+
+class ProcessUser {
+public:
+    enum Reason { OpenFile, FileMap, Cwd, Root, Exe };
+
+    int pid;
+    Reason reason;
+    char name[256];
+    /* The matching path, for OpenFile and FileMap */
+    char file[PATH_MAX];
+};
+
+typedef android::List<ProcessUser> ProcessUserCollection;
+
 class Process {
 public:
     static void killProcessesWithOpenFiles(const char *path, int action);
+    /*
+     * Walks /proc once, on several threads, and collects every process
+     * that has something open under path.  Returns -1 if /proc can't be read.
+     */
+    static int findProcessesWithOpenFiles(const char *path, ProcessUserCollection &users);
     static int getPid(const char *s);
     static int checkSymLink(int pid, const char *path, const char *name);
     static int checkFileMaps(int pid, const char *path);
@@ -29,7 +50,13 @@ public:
     static void getProcessName(int pid, char *buffer, size_t max);
 private:
     static int readSymLink(const char *path, char *link, size_t max);
+    static int readSymLinkAt(int dirfd, const char *name, char *link, size_t max);
     static int pathMatchesMountPoint(const char *path, const char *mountPoint);
+
+    static void *scanThread(void *arg);
+    static bool scanProcess(int pid, const char *mountPoint, ProcessUser *user);
+
+    static const int SCAN_THREADS = 4;
 };
 
 #endif
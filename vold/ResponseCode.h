@@ -54,6 +54,7 @@ public:
     // 600 series - Unsolicited broadcasts
     static const int UnsolicitedInformational       = 600;
     static const int VolumeStateChange              = 605;
+    static const int VolumeProgress                 = 606;
     static const int VolumeMountFailedBlank         = 610;
     static const int VolumeMountFailedDamaged       = 611;
     static const int VolumeMountFailedNoMedia       = 612;
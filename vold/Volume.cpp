@@ -41,6 +41,7 @@
 #include <cutils/log.h>
 
 #include "Loop.h"
+#include "MountTable.h"
 #include "Volume.h"
 #include "VolumeManager.h"
 #include "ResponseCode.h"
@@ -256,6 +257,23 @@ void Volume::setVirtualSdcardState(int oldState, int newState) {
     
 }
 
+void Volume::sendProgress(const char *what, int percent) {
+    char msg[255];
+
+    snprintf(msg, sizeof(msg), "Volume %s %s %s %d%%", getLabel(),
+             getMountpoint(), what, percent);
+    mVm->getBroadcaster()->sendBroadcast(ResponseCode::VolumeProgress,
+                                         msg, false);
+}
+
+void Volume::checkProgress(void *cookie, int percent) {
+    ((Volume *) cookie)->sendProgress("checking", percent);
+}
+
+void Volume::formatProgress(void *cookie, int percent) {
+    ((Volume *) cookie)->sendProgress("formatting", percent);
+}
+
 int Volume::createDeviceNode(const char *path, int major, int minor) {
     mode_t mode = 0660 | S_IFBLK;
     dev_t dev = (major << 8) | minor;
@@ -319,7 +337,7 @@ int Volume::formatVol() {
     if (VOLUME_TYPE_FLASH == mVolumeType)
         label = RECOVERY_MEDIA_LABEL;
 #endif
-    if (Fat::format(devicePath, 0, label)) {
+    if (Fat::format(devicePath, 0, label, formatProgress, this)) {
         SLOGE("Failed to format (%s)", strerror(errno));
         goto err;
     }
@@ -331,29 +349,7 @@ err:
 }
 
 bool Volume::isMountpointMounted(const char *path) {
-    char device[256];
-    char mount_path[256];
-    char rest[256];
-    FILE *fp;
-    char line[1024];
-
-    if (!(fp = fopen("/proc/mounts", "r"))) {
-        SLOGE("Error opening /proc/mounts (%s)", strerror(errno));
-        return false;
-    }
-
-    while(fgets(line, sizeof(line), fp)) {
-        line[strlen(line)-1] = '\0';
-        sscanf(line, "%255s %255s %255s\n", device, mount_path, rest);
-        if (!strcmp(mount_path, path)) {
-            fclose(fp);
-            return true;
-        }
-
-    }
-
-    fclose(fp);
-    return false;
+    return MountTable::Instance()->isMounted(path);
 }
 
 int Volume::doFsCheck(const char *devicePath) {
@@ -364,7 +360,7 @@ int Volume::doFsCheck(const char *devicePath) {
 	 else if(errno == EIO)
 	 	return 0;		//in this case,volume is exfat,but fsck find error,don't need msdos fsck.
 #endif
-    if (Fat::check(devicePath)) {
+    if (Fat::check(devicePath, checkProgress, this)) {
         if (errno == ENODATA)
             SLOGW("%s does not contain a FAT filesystem\n", devicePath);
         if (Hfsplus::check(devicePath)) {
@@ -151,6 +151,9 @@ private:
     int doMoveMount(const char *src, const char *dst, bool force);
     void protectFromAutorunStupidity();
     int doFsCheck(const char *devicePath);
+    static void checkProgress(void *cookie, int percent);
+    static void formatProgress(void *cookie, int percent);
+    void sendProgress(const char *what, int percent);
     int doMount(const char *devicePath, const char *mountpoint);
 #ifndef 	FUNCTION_UMS_PARTITION		
     int unmountdisk(char * path);
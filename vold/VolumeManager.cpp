@@ -38,6 +38,7 @@
 #include "DirectVolume.h"
 #include "ResponseCode.h"
 #include "Loop.h"
+#include "MountTable.h"
 #include "Fat.h"
 #include "Devmapper.h"
 #include "Process.h"
@@ -546,7 +547,7 @@ int VolumeManager::createAsec(const char *id, unsigned int numSectors,
     }
 
     // Add +1 for our superblock which is at the end
-    if (Loop::createImageFile(asecFileName, numImgSectors + 1)) {
+    if (Loop::createImageFile(asecFileName, numImgSectors + 1, true)) {
         SLOGE("ASEC image file creation failed (%s)", strerror(errno));
         return -1;
     }
@@ -1173,47 +1174,27 @@ int VolumeManager::mountVolume(const char *label) {
 }
 
 int VolumeManager::listMountedObbs(SocketClient* cli) {
-    char device[256];
-    char mount_path[256];
-    char rest[256];
-    FILE *fp;
-    char line[1024];
+    MountEntryCollection mounts;
 
-    if (!(fp = fopen("/proc/mounts", "r"))) {
-        SLOGE("Error opening /proc/mounts (%s)", strerror(errno));
+    if (MountTable::Instance()->getMountsUnder(Volume::LOOPDIR, mounts)) {
         return -1;
     }
 
-    // Create a string to compare against that has a trailing slash
-    int loopDirLen = sizeof(Volume::LOOPDIR);
-    char loopDir[loopDirLen + 2];
-    strcpy(loopDir, Volume::LOOPDIR);
-    loopDir[loopDirLen++] = '/';
-    loopDir[loopDirLen] = '\0';
-
-    while(fgets(line, sizeof(line), fp)) {
-        line[strlen(line)-1] = '\0';
-
-        /*
-         * Should look like:
-         * /dev/block/loop0 /mnt/obb/fc99df1323fd36424f864dcb76b76d65 ...
-         */
-        sscanf(line, "%255s %255s %255s\n", device, mount_path, rest);
-
-        if (!strncmp(mount_path, loopDir, loopDirLen)) {
-            int fd = open(device, O_RDONLY);
-            if (fd >= 0) {
-                struct loop_info64 li;
-                if (ioctl(fd, LOOP_GET_STATUS64, &li) >= 0) {
-                    cli->sendMsg(ResponseCode::AsecListResult,
-                            (const char*) li.lo_file_name, false);
-                }
-                close(fd);
+    /*
+     * Should look like:
+     * /dev/block/loop0 /mnt/obb/fc99df1323fd36424f864dcb76b76d65 ...
+     */
+    for (MountEntryCollection::iterator it = mounts.begin(); it != mounts.end(); ++it) {
+        int fd = open(it->device, O_RDONLY);
+        if (fd >= 0) {
+            struct loop_info64 li;
+            if (ioctl(fd, LOOP_GET_STATUS64, &li) >= 0) {
+                cli->sendMsg(ResponseCode::AsecListResult,
+                        (const char*) li.lo_file_name, false);
             }
+            close(fd);
         }
     }
-
-    fclose(fp);
     return 0;
 }
 
@@ -1512,28 +1493,7 @@ Volume *VolumeManager::lookupVolume(const char *label) {
 
 bool VolumeManager::isMountpointMounted(const char *mp)
 {
-    char device[256];
-    char mount_path[256];
-    char rest[256];
-    FILE *fp;
-    char line[1024];
-
-    if (!(fp = fopen("/proc/mounts", "r"))) {
-        SLOGE("Error opening /proc/mounts (%s)", strerror(errno));
-        return false;
-    }
-
-    while(fgets(line, sizeof(line), fp)) {
-        line[strlen(line)-1] = '\0';
-        sscanf(line, "%255s %255s %255s\n", device, mount_path, rest);
-        if (!strcmp(mount_path, mp)) {
-            fclose(fp);
-            return true;
-        }
-    }
-
-    fclose(fp);
-    return false;
+    return MountTable::Instance()->isMounted(mp);
 }
 
 int VolumeManager::cleanupAsec(Volume *v, bool force) {
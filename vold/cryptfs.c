@@ -35,6 +35,8 @@
 #include <openssl/evp.h>
 #include <openssl/sha.h>
 #include <errno.h>
+#include <malloc.h>
+#include <pthread.h>
 #include <cutils/android_reboot.h>
 #include <ext4.h>
 #include <linux/kdev_t.h>
@@ -53,6 +55,7 @@
 #define IV_LEN_BYTES 16
 
 #define KEY_LOC_PROP   "ro.crypto.keyfile.userdata"
+#define SKIP_UNUSED_PROP "ro.crypto.inplace_skip_unused"
 #define KEY_IN_FOOTER  "footer"
 
 #define EXT4_FS 1
@@ -359,8 +362,8 @@ void convert_key_to_hex_ascii(unsigned char *master_key, unsigned int keysize,
 
 }
 
-static int create_crypto_blk_dev(struct crypt_mnt_ftr *crypt_ftr, unsigned char *master_key,
-                                    char *real_blk_name, char *crypto_blk_name, const char *name)
+int create_crypto_blk_dev(struct crypt_mnt_ftr *crypt_ftr, unsigned char *master_key,
+                          char *real_blk_name, char *crypto_blk_name, const char *name)
 {
   char buffer[DM_CRYPT_BUF_SIZE];
   char master_key_ascii[129]; /* Large enough to hold 512 bit key and null */
@@ -433,7 +436,7 @@ errout:
   return retval;
 }
 
-static int delete_crypto_blk_dev(char *name)
+int delete_crypto_blk_dev(char *name)
 {
   int fd;
   char buffer[DM_CRYPT_BUF_SIZE];
@@ -1020,95 +1023,465 @@ static int cryptfs_enable_wipe(char *crypto_blkdev, off64_t size, int type)
     return rc;
 }
 
-static inline int unix_read(int  fd, void*  buff, int  len)
+static int unix_pread_full(int fd, void *buff, size_t len, off64_t offset)
 {
-    int  ret;
-    do { ret = read(fd, buff, len); } while (ret < 0 && errno == EINTR);
-    return ret;
+    char *p = buff;
+    ssize_t ret;
+
+    while (len) {
+        do { ret = pread64(fd, p, len, offset); } while (ret < 0 && errno == EINTR);
+        if (ret <= 0) {
+            return -1;
+        }
+        p += ret;
+        offset += ret;
+        len -= ret;
+    }
+    return 0;
+}
+
+static int unix_pwrite_full(int fd, const void *buff, size_t len, off64_t offset)
+{
+    const char *p = buff;
+    ssize_t ret;
+
+    while (len) {
+        do { ret = pwrite64(fd, p, len, offset); } while (ret < 0 && errno == EINTR);
+        if (ret <= 0) {
+            return -1;
+        }
+        p += ret;
+        offset += ret;
+        len -= ret;
+    }
+    return 0;
+}
+
+/* In place encryption is a pipeline: one thread reads large chunks of
+ * the real block device into a ring of buffers, and several writers
+ * push them through dm-crypt so the kernel has multiple requests to
+ * encrypt at once.  The calling thread only reports progress.
+ */
+#define CRYPT_INPLACE_BUFSIZE (1024 * 1024)
+#define CRYPT_INPLACE_SLOTS 8
+#define CRYPT_INPLACE_WRITERS 4
+#define CRYPT_PROGRESS_UNIT 4096
+
+#define EXT4_SUPER_MAGIC 0xEF53
+
+#define SLOT_FREE 0
+#define SLOT_READING 1
+#define SLOT_FULL 2
+#define SLOT_WRITING 3
+
+struct inplace_slot {
+    char *buf;
+    off64_t offset;
+    size_t len;
+    int state;
+};
+
+struct inplace_ctx {
+    int realfd;
+    int cryptofd;
+    off64_t size_bytes;
+
+    /* One bit per filesystem block, set if the block must be copied.
+     * NULL if every block is copied. */
+    unsigned char *used_map;
+    unsigned int block_size;
+    off64_t blocks_count;
+    off64_t next_offset;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct inplace_slot slots[CRYPT_INPLACE_SLOTS];
+    off64_t bytes_done;
+    int eof;
+    int error;
+};
+
+/* Snapshot the ext4 block bitmaps of the real device, so blocks that
+ * hold no data can be skipped.  This has to happen before anything is
+ * written, as the bitmaps themselves get encrypted along the way.
+ * Groups whose bitmap was never initialized are copied in full.
+ */
+static int inplace_load_used_map(struct inplace_ctx *ctx)
+{
+    struct ext4_super_block sb;
+    unsigned int desc_size, blocks_per_group, groups, g;
+    off64_t gdt_offset;
+    unsigned char *bitmap = NULL;
+    char *desc_buf = NULL;
+    int gdt_csum;
+
+    if (unix_pread_full(ctx->realfd, &sb, sizeof(sb), 1024)) {
+        SLOGE("Cannot read superblock for inplace encrypt\n");
+        return -1;
+    }
+    if (sb.s_magic != EXT4_SUPER_MAGIC || !sb.s_blocks_per_group) {
+        SLOGW("No ext4 superblock found, encrypting every block\n");
+        return -1;
+    }
+
+    ctx->block_size = 1024 << sb.s_log_block_size;
+    ctx->blocks_count = ((off64_t)sb.s_blocks_count_hi << 32) + sb.s_blocks_count_lo;
+    blocks_per_group = sb.s_blocks_per_group;
+    groups = (ctx->blocks_count - sb.s_first_data_block + blocks_per_group - 1) /
+             blocks_per_group;
+    desc_size = (sb.s_feature_incompat & EXT4_FEATURE_INCOMPAT_64BIT) ?
+                sb.s_desc_size : EXT4_MIN_DESC_SIZE;
+    gdt_csum = sb.s_feature_ro_compat & EXT4_FEATURE_RO_COMPAT_GDT_CSUM;
+    gdt_offset = (off64_t)(sb.s_first_data_block + 1) * ctx->block_size;
+
+    ctx->used_map = calloc((ctx->blocks_count + 7) / 8, 1);
+    desc_buf = malloc((size_t)groups * desc_size);
+    bitmap = malloc(ctx->block_size);
+    if (!ctx->used_map || !desc_buf || !bitmap) {
+        SLOGE("Cannot allocate ext4 block map for inplace encrypt\n");
+        goto err;
+    }
+    if (unix_pread_full(ctx->realfd, desc_buf, (size_t)groups * desc_size, gdt_offset)) {
+        SLOGE("Cannot read ext4 group descriptors for inplace encrypt\n");
+        goto err;
+    }
+
+    /* Blocks ahead of the first group (the boot block on 1K filesystems) */
+    memset(ctx->used_map, 0xff, (sb.s_first_data_block + 7) / 8);
+
+    for (g = 0; g < groups; g++) {
+        struct ext4_group_desc *gd = (struct ext4_group_desc *) (desc_buf + g * desc_size);
+        off64_t first = sb.s_first_data_block + (off64_t)g * blocks_per_group;
+        off64_t bitmap_blk = gd->bg_block_bitmap_lo;
+        unsigned int n = blocks_per_group, i;
+
+        if (first + n > ctx->blocks_count) {
+            n = ctx->blocks_count - first;
+        }
+        if (desc_size >= EXT4_MIN_DESC_SIZE_64BIT) {
+            bitmap_blk |= (off64_t)gd->bg_block_bitmap_hi << 32;
+        }
+
+        if (gdt_csum && (gd->bg_flags & EXT4_BG_BLOCK_UNINIT)) {
+            memset(bitmap, 0xff, ctx->block_size);
+        } else if (unix_pread_full(ctx->realfd, bitmap, ctx->block_size,
+                                   bitmap_blk * ctx->block_size)) {
+            SLOGE("Cannot read block bitmap of group %u for inplace encrypt\n", g);
+            goto err;
+        }
+
+        for (i = 0; i < n; i++) {
+            if (bitmap[i / 8] & (1 << (i % 8))) {
+                off64_t blk = first + i;
+                ctx->used_map[blk / 8] |= 1 << (blk % 8);
+            }
+        }
+    }
+
+    free(desc_buf);
+    free(bitmap);
+    return 0;
+
+err:
+    free(ctx->used_map);
+    ctx->used_map = NULL;
+    free(desc_buf);
+    free(bitmap);
+    return -1;
+}
+
+static inline int inplace_block_used(struct inplace_ctx *ctx, off64_t offset)
+{
+    off64_t blk = offset / ctx->block_size;
+
+    /* Anything past the end of the filesystem is copied as is */
+    if (!ctx->used_map || blk >= ctx->blocks_count) {
+        return 1;
+    }
+    return ctx->used_map[blk / 8] & (1 << (blk % 8));
+}
+
+/* Find the next run of blocks to copy, at most CRYPT_INPLACE_BUFSIZE long.
+ * Returns the number of bytes skipped over to get there.
+ */
+static off64_t inplace_next_chunk(struct inplace_ctx *ctx, off64_t *offset, size_t *len)
+{
+    off64_t start = ctx->next_offset;
+    off64_t end;
+    off64_t skipped;
+
+    if (!ctx->used_map) {
+        end = start + CRYPT_INPLACE_BUFSIZE;
+        if (end > ctx->size_bytes) {
+            end = ctx->size_bytes;
+        }
+        *offset = start;
+        *len = end - start;
+        ctx->next_offset = end;
+        return 0;
+    }
+
+    while (start < ctx->size_bytes && !inplace_block_used(ctx, start)) {
+        start += ctx->block_size;
+    }
+    if (start > ctx->size_bytes) {
+        start = ctx->size_bytes;
+    }
+    skipped = start - ctx->next_offset;
+
+    end = start;
+    while (end < ctx->size_bytes && end - start < CRYPT_INPLACE_BUFSIZE &&
+           inplace_block_used(ctx, end)) {
+        end += ctx->block_size;
+    }
+    if (end > ctx->size_bytes) {
+        end = ctx->size_bytes;
+    }
+
+    *offset = start;
+    *len = end - start;
+    ctx->next_offset = end;
+    return skipped;
+}
+
+static void *inplace_reader(void *arg)
+{
+    struct inplace_ctx *ctx = arg;
+    struct inplace_slot *slot;
+    off64_t offset, skipped;
+    size_t len;
+    int i;
+
+    for (;;) {
+        pthread_mutex_lock(&ctx->lock);
+        for (;;) {
+            slot = NULL;
+            for (i = 0; i < CRYPT_INPLACE_SLOTS; i++) {
+                if (ctx->slots[i].state == SLOT_FREE) {
+                    slot = &ctx->slots[i];
+                    break;
+                }
+            }
+            if (slot || ctx->error) {
+                break;
+            }
+            pthread_cond_wait(&ctx->cond, &ctx->lock);
+        }
+        if (ctx->error) {
+            pthread_mutex_unlock(&ctx->lock);
+            return NULL;
+        }
+        slot->state = SLOT_READING;
+        pthread_mutex_unlock(&ctx->lock);
+
+        skipped = inplace_next_chunk(ctx, &offset, &len);
+
+        if (len && unix_pread_full(ctx->realfd, slot->buf, len, offset)) {
+            SLOGE("Error reading real_blkdev at %lld for inplace encrypt (%s)\n",
+                  offset, strerror(errno));
+            pthread_mutex_lock(&ctx->lock);
+            ctx->error = 1;
+            pthread_cond_broadcast(&ctx->cond);
+            pthread_mutex_unlock(&ctx->lock);
+            return NULL;
+        }
+
+        pthread_mutex_lock(&ctx->lock);
+        ctx->bytes_done += skipped;
+        if (len) {
+            slot->offset = offset;
+            slot->len = len;
+            slot->state = SLOT_FULL;
+        } else {
+            slot->state = SLOT_FREE;
+            ctx->eof = 1;
+        }
+        pthread_cond_broadcast(&ctx->cond);
+        pthread_mutex_unlock(&ctx->lock);
+
+        if (!len) {
+            return NULL;
+        }
+    }
+}
+
+static void *inplace_writer(void *arg)
+{
+    struct inplace_ctx *ctx = arg;
+    struct inplace_slot *slot;
+    int i;
+
+    for (;;) {
+        pthread_mutex_lock(&ctx->lock);
+        for (;;) {
+            slot = NULL;
+            for (i = 0; i < CRYPT_INPLACE_SLOTS; i++) {
+                if (ctx->slots[i].state == SLOT_FULL) {
+                    slot = &ctx->slots[i];
+                    break;
+                }
+            }
+            if (slot || ctx->eof || ctx->error) {
+                break;
+            }
+            pthread_cond_wait(&ctx->cond, &ctx->lock);
+        }
+        if (!slot || ctx->error) {
+            pthread_mutex_unlock(&ctx->lock);
+            return NULL;
+        }
+        slot->state = SLOT_WRITING;
+        pthread_mutex_unlock(&ctx->lock);
+
+        if (unix_pwrite_full(ctx->cryptofd, slot->buf, slot->len, slot->offset)) {
+            SLOGE("Error writing crypto_blkdev at %lld for inplace encrypt (%s)\n",
+                  slot->offset, strerror(errno));
+            pthread_mutex_lock(&ctx->lock);
+            ctx->error = 1;
+            pthread_cond_broadcast(&ctx->cond);
+            pthread_mutex_unlock(&ctx->lock);
+            return NULL;
+        }
+
+        pthread_mutex_lock(&ctx->lock);
+        ctx->bytes_done += slot->len;
+        slot->state = SLOT_FREE;
+        pthread_cond_broadcast(&ctx->cond);
+        pthread_mutex_unlock(&ctx->lock);
+    }
 }
 
-static inline int unix_write(int  fd, const void*  buff, int  len)
+static int inplace_busy(struct inplace_ctx *ctx)
 {
-    int  ret;
-    do { ret = write(fd, buff, len); } while (ret < 0 && errno == EINTR);
-    return ret;
+    int i;
+
+    if (!ctx->eof) {
+        return 1;
+    }
+    for (i = 0; i < CRYPT_INPLACE_SLOTS; i++) {
+        if (ctx->slots[i].state != SLOT_FREE) {
+            return 1;
+        }
+    }
+    return 0;
 }
 
-#define CRYPT_INPLACE_BUFSIZE 4096
-#define CRYPT_SECTORS_PER_BUFSIZE (CRYPT_INPLACE_BUFSIZE / 512)
-static int cryptfs_enable_inplace(char *crypto_blkdev, char *real_blkdev, off64_t size,
-                                  off64_t *size_already_done, off64_t tot_size)
+/* If skip_unused is set, the real device is expected to hold an ext4
+ * filesystem and only its allocated blocks are encrypted.  Free blocks
+ * are left as they are, in the clear, until they get rewritten.  It is
+ * only done when SKIP_UNUSED_PROP is set to 1.
+ */
+int cryptfs_enable_inplace(char *crypto_blkdev, char *real_blkdev, off64_t size,
+                           off64_t *size_already_done, off64_t tot_size,
+                           int skip_unused)
 {
-    int realfd, cryptofd;
-    char *buf[CRYPT_INPLACE_BUFSIZE];
+    struct inplace_ctx ctx;
+    pthread_t reader, writers[CRYPT_INPLACE_WRITERS];
+    int nwriters = 0;
     int rc = -1;
-    off64_t numblocks, i, remainder;
+    int i;
     off64_t one_pct, cur_pct, new_pct;
-    off64_t blocks_already_done, tot_numblocks;
+    off64_t units_already_done;
+
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.size_bytes = size * 512;
+    pthread_mutex_init(&ctx.lock, NULL);
+    pthread_cond_init(&ctx.cond, NULL);
 
-    if ( (realfd = open(real_blkdev, O_RDONLY)) < 0) { 
+    if ( (ctx.realfd = open(real_blkdev, O_RDONLY)) < 0) {
         SLOGE("Error opening real_blkdev %s for inplace encrypt\n", real_blkdev);
         return -1;
     }
 
-    if ( (cryptofd = open(crypto_blkdev, O_WRONLY)) < 0) { 
+    if ( (ctx.cryptofd = open(crypto_blkdev, O_WRONLY)) < 0) {
         SLOGE("Error opening crypto_blkdev %s for inplace encrypt\n", crypto_blkdev);
-        close(realfd);
+        close(ctx.realfd);
         return -1;
     }
 
-    /* This is pretty much a simple loop of reading 4K, and writing 4K.
-     * The size passed in is the number of 512 byte sectors in the filesystem.
-     * So compute the number of whole 4K blocks we should read/write,
-     * and the remainder.
-     */
-    numblocks = size / CRYPT_SECTORS_PER_BUFSIZE;
-    remainder = size % CRYPT_SECTORS_PER_BUFSIZE;
-    tot_numblocks = tot_size / CRYPT_SECTORS_PER_BUFSIZE;
-    blocks_already_done = *size_already_done / CRYPT_SECTORS_PER_BUFSIZE;
+    if (skip_unused && !inplace_load_used_map(&ctx)) {
+        SLOGI("Skipping unused ext4 blocks of %s\n", real_blkdev);
+    }
+
+    for (i = 0; i < CRYPT_INPLACE_SLOTS; i++) {
+        ctx.slots[i].buf = memalign(4096, CRYPT_INPLACE_BUFSIZE);
+        if (!ctx.slots[i].buf) {
+            SLOGE("Cannot allocate buffers for inplace encrypt\n");
+            goto errout;
+        }
+    }
 
     SLOGE("Encrypting filesystem in place...");
 
-    one_pct = tot_numblocks / 100;
-    cur_pct = 0;
-    /* process the majority of the filesystem in blocks */
-    for (i=0; i<numblocks; i++) {
-        new_pct = (i + blocks_already_done) / one_pct;
+    /* Progress is counted in 4K units, across all the volumes */
+    one_pct = tot_size / (CRYPT_PROGRESS_UNIT / 512) / 100;
+    if (!one_pct) {
+        one_pct = 1;
+    }
+    units_already_done = *size_already_done / (CRYPT_PROGRESS_UNIT / 512);
+    cur_pct = units_already_done / one_pct;
+
+    if (pthread_create(&reader, NULL, inplace_reader, &ctx)) {
+        SLOGE("Cannot start reader thread for inplace encrypt\n");
+        goto errout;
+    }
+    for (i = 0; i < CRYPT_INPLACE_WRITERS; i++) {
+        if (pthread_create(&writers[i], NULL, inplace_writer, &ctx)) {
+            break;
+        }
+        nwriters++;
+    }
+
+    pthread_mutex_lock(&ctx.lock);
+    if (!nwriters) {
+        SLOGE("Cannot start writer threads for inplace encrypt\n");
+        ctx.error = 1;
+        pthread_cond_broadcast(&ctx.cond);
+    }
+    while (!ctx.error && inplace_busy(&ctx)) {
+        pthread_cond_wait(&ctx.cond, &ctx.lock);
+
+        new_pct = (units_already_done + ctx.bytes_done / CRYPT_PROGRESS_UNIT) / one_pct;
         if (new_pct > cur_pct) {
             char buf[8];
 
             cur_pct = new_pct;
+            pthread_mutex_unlock(&ctx.lock);
             snprintf(buf, sizeof(buf), "%lld", cur_pct);
             property_set("vold.encrypt_progress", buf);
-        }
-        if (unix_read(realfd, buf, CRYPT_INPLACE_BUFSIZE) <= 0) {
-            SLOGE("Error reading real_blkdev %s for inplace encrypt\n", crypto_blkdev);
-            goto errout;
-        }
-        if (unix_write(cryptofd, buf, CRYPT_INPLACE_BUFSIZE) <= 0) {
-            SLOGE("Error writing crypto_blkdev %s for inplace encrypt\n", crypto_blkdev);
-            goto errout;
+            pthread_mutex_lock(&ctx.lock);
         }
     }
+    /* Wakes up the writers waiting for more work */
+    ctx.eof = 1;
+    pthread_cond_broadcast(&ctx.cond);
+    pthread_mutex_unlock(&ctx.lock);
 
-    /* Do any remaining sectors */
-    for (i=0; i<remainder; i++) {
-        if (unix_read(realfd, buf, 512) <= 0) {
-            SLOGE("Error reading rival sectors from real_blkdev %s for inplace encrypt\n", crypto_blkdev);
-            goto errout;
-        }
-        if (unix_write(cryptofd, buf, 512) <= 0) {
-            SLOGE("Error writing final sectors to crypto_blkdev %s for inplace encrypt\n", crypto_blkdev);
-            goto errout;
-        }
+    pthread_join(reader, NULL);
+    for (i = 0; i < nwriters; i++) {
+        pthread_join(writers[i], NULL);
+    }
+
+    if (ctx.error) {
+        goto errout;
+    }
+    if (fsync(ctx.cryptofd)) {
+        SLOGE("Error flushing crypto_blkdev %s for inplace encrypt\n", crypto_blkdev);
+        goto errout;
     }
 
     *size_already_done += size;
     rc = 0;
 
 errout:
-    close(realfd);
-    close(cryptofd);
+    for (i = 0; i < CRYPT_INPLACE_SLOTS; i++) {
+        free(ctx.slots[i].buf);
+    }
+    free(ctx.used_map);
+    pthread_cond_destroy(&ctx.cond);
+    pthread_mutex_destroy(&ctx.lock);
+    close(ctx.realfd);
+    close(ctx.cryptofd);
 
     return rc;
 }
@@ -1328,8 +1701,12 @@ int cryptfs_enable(char *howarg, char *passwd)
             }
         }
     } else if (how == CRYPTO_ENABLE_INPLACE) {
+        char skip_unused[PROPERTY_VALUE_MAX];
+
+        property_get(SKIP_UNUSED_PROP, skip_unused, "0");
         rc = cryptfs_enable_inplace(crypto_blkdev, real_blkdev, crypt_ftr.fs_size,
-                                    &cur_encryption_done, tot_encryption_size);
+                                    &cur_encryption_done, tot_encryption_size,
+                                    !strcmp(skip_unused, "1"));
         /* Encrypt all encryptable volumes handled by vold */
         if (!rc) {
             for (i=0; i<num_vols; i++) {
@@ -1337,7 +1714,7 @@ int cryptfs_enable(char *howarg, char *passwd)
                     rc = cryptfs_enable_inplace(vol_list[i].crypto_blkdev,
                                                 vol_list[i].blk_dev,
                                                 vol_list[i].crypt_ftr.fs_size,
-                                                &cur_encryption_done, tot_encryption_size);
+                                                &cur_encryption_done, tot_encryption_size, 0);
                 }
             }
         }
@@ -83,6 +83,14 @@ extern "C" {
                            char *crypto_dev_path, unsigned int max_pathlen,
                            int *new_major, int *new_minor);
   int cryptfs_revert_volume(const char *label);
+
+  /* Building blocks of cryptfs_enable(), exposed for the unit tests */
+  int create_crypto_blk_dev(struct crypt_mnt_ftr *crypt_ftr, unsigned char *master_key,
+                            char *real_blk_name, char *crypto_blk_name, const char *name);
+  int delete_crypto_blk_dev(char *name);
+  int cryptfs_enable_inplace(char *crypto_blkdev, char *real_blkdev, off64_t size,
+                             off64_t *size_already_done, off64_t tot_size,
+                             int skip_unused);
 #ifdef __cplusplus
 }
 #endif
@@ -3,19 +3,30 @@ LOCAL_PATH := $(call my-dir)
 include $(CLEAR_VARS)
 
 test_src_files := \
+	Cryptfs_test.cpp \
+	Fat_test.cpp \
+	Loop_test.cpp \
+	MountTable_test.cpp \
+	Process_test.cpp \
 	VolumeManager_test.cpp
 
 shared_libraries := \
+	libcutils \
+	libhardware_legacy \
 	liblog \
+	libsysutils \
 	libstlport \
 	libcrypto
 
 static_libraries := \
 	libvold \
+	libnewfs_msdos \
 	libgtest \
 	libgtest_main
 
 c_includes := \
+	$(KERNEL_HEADERS) \
+	system/extras/ext4_utils \
 	external/openssl/include \
 	bionic \
 	bionic/libstdc++/include \
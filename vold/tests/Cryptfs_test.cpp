@@ -0,0 +1,215 @@
+/*
+ * Copyright (C) 2012 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/param.h>
+#include <sys/stat.h>
+#include <linux/types.h>
+
+#define LOG_TAG "Cryptfs_test"
+#include <utils/Log.h>
+#include <ext4.h>
+#include "../Loop.h"
+#include "../cryptfs.h"
+
+#include <gtest/gtest.h>
+
+namespace android {
+
+static const unsigned int IMAGE_SECTORS = 16 * 1024 * 1024 / 512;
+static const int BLOCK_SIZE = 4096;
+static const int BLOCKS = IMAGE_SECTORS * 512 / BLOCK_SIZE;
+
+/* Layout of the minimal ext4 image: one group, descriptors in block 1,
+ * the block bitmap in block 2. */
+static const int GDT_BLOCK = 1;
+static const int BITMAP_BLOCK = 2;
+
+static const unsigned char KEY[16] = {
+    0x00, 0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77,
+    0x88, 0x99, 0xaa, 0xbb, 0xcc, 0xdd, 0xee, 0xff,
+};
+
+/* One block in four holds data, besides the metadata at the start */
+static bool isUsed(int block) {
+    return block <= BITMAP_BLOCK || block % 4 == 0;
+}
+
+class CryptfsTest : public testing::Test {
+protected:
+    char mImage[64];
+    char mLoopDev[255];
+    char mCryptoDev[MAXPATHLEN];
+    struct crypt_mnt_ftr mFtr;
+    char *mPlain;
+
+    virtual void SetUp() {
+        strcpy(mImage, "/data/local/tmp/cryptfs_test.img");
+        mLoopDev[0] = '\0';
+        mCryptoDev[0] = '\0';
+
+        memset(&mFtr, 0, sizeof(mFtr));
+        mFtr.keysize = sizeof(KEY);
+        mFtr.fs_size = IMAGE_SECTORS;
+        strcpy((char *) mFtr.crypto_type_name, "aes-cbc-essiv:sha256");
+
+        mPlain = new char[BLOCKS * BLOCK_SIZE];
+        for (int i = 0; i < BLOCKS; i++) {
+            unsigned int *words = (unsigned int *) (mPlain + i * BLOCK_SIZE);
+            for (unsigned int w = 0; w < BLOCK_SIZE / sizeof(*words); w++)
+                words[w] = (i << 16) ^ w ^ 0xa5a5a5a5;
+        }
+    }
+
+    virtual void TearDown() {
+        if (mCryptoDev[0])
+            delete_crypto_blk_dev((char *) "cryptfs_test");
+        if (mLoopDev[0])
+            Loop::destroyByDevice(mLoopDev);
+        unlink(mImage);
+        delete[] mPlain;
+    }
+
+    /* Turns the start of the plaintext into an ext4 superblock, group
+     * descriptor and block bitmap that mark the isUsed() blocks. */
+    void makeExt4() {
+        memset(mPlain, 0, (BITMAP_BLOCK + 1) * BLOCK_SIZE);
+
+        struct ext4_super_block *sb = (struct ext4_super_block *) (mPlain + 1024);
+        sb->s_magic = 0xEF53;
+        sb->s_log_block_size = 2;
+        sb->s_blocks_count_lo = BLOCKS;
+        sb->s_first_data_block = 0;
+        sb->s_blocks_per_group = BLOCK_SIZE * 8;
+
+        struct ext4_group_desc *gd =
+                (struct ext4_group_desc *) (mPlain + GDT_BLOCK * BLOCK_SIZE);
+        gd->bg_block_bitmap_lo = BITMAP_BLOCK;
+
+        unsigned char *bitmap = (unsigned char *) mPlain + BITMAP_BLOCK * BLOCK_SIZE;
+        for (int i = 0; i < BLOCKS; i++) {
+            if (isUsed(i))
+                bitmap[i / 8] |= 1 << (i % 8);
+        }
+    }
+
+    void writeImage() {
+        ASSERT_EQ(0, Loop::createImageFile(mImage, IMAGE_SECTORS));
+        int fd = open(mImage, O_WRONLY);
+        ASSERT_GE(fd, 0);
+        ASSERT_EQ(BLOCKS * BLOCK_SIZE, write(fd, mPlain, BLOCKS * BLOCK_SIZE));
+        fsync(fd);
+        close(fd);
+        ASSERT_EQ(0, Loop::create("cryptfs_test", mImage, mLoopDev, sizeof(mLoopDev)));
+    }
+
+    /* The device node is made by ueventd, so give it a moment */
+    void mapCryptoDev() {
+        ASSERT_EQ(0, create_crypto_blk_dev(&mFtr, (unsigned char *) KEY, mLoopDev,
+                                           mCryptoDev, "cryptfs_test"));
+        for (int i = 0; i < 50 && access(mCryptoDev, R_OK | W_OK); i++)
+            usleep(100000);
+        ASSERT_EQ(0, access(mCryptoDev, R_OK | W_OK));
+    }
+
+    void unmapCryptoDev() {
+        ASSERT_EQ(0, delete_crypto_blk_dev((char *) "cryptfs_test"));
+        mCryptoDev[0] = '\0';
+    }
+
+    void encrypt(int skipUnused) {
+        off64_t done = 0;
+
+        ASSERT_NO_FATAL_FAILURE(mapCryptoDev());
+        ASSERT_EQ(0, cryptfs_enable_inplace(mCryptoDev, mLoopDev, IMAGE_SECTORS,
+                                            &done, IMAGE_SECTORS, skipUnused));
+        EXPECT_EQ((off64_t) IMAGE_SECTORS, done);
+        unmapCryptoDev();
+    }
+
+    /* Reads the whole of |path| into a new buffer */
+    char *readAll(const char *path) {
+        char *buf = new char[BLOCKS * BLOCK_SIZE];
+        int fd = open(path, O_RDONLY);
+        ssize_t len = -1;
+
+        if (fd >= 0) {
+            len = pread(fd, buf, BLOCKS * BLOCK_SIZE, 0);
+            close(fd);
+        }
+        EXPECT_EQ(BLOCKS * BLOCK_SIZE, len) << path << ": " << strerror(errno);
+        return buf;
+    }
+
+    /* Blocks that decrypt to the plaintext through a fresh mapping, and
+     * blocks still in the clear on the image itself. */
+    void check(bool (*encrypted)(int)) {
+        ASSERT_NO_FATAL_FAILURE(mapCryptoDev());
+        char *decrypted = readAll(mCryptoDev);
+        char *raw = readAll(mImage);
+        int lost = 0, clear = 0, garbled = 0;
+
+        for (int i = 0; i < BLOCKS; i++) {
+            off_t off = (off_t) i * BLOCK_SIZE;
+            bool inClear = !memcmp(raw + off, mPlain + off, BLOCK_SIZE);
+
+            if (encrypted(i)) {
+                lost += memcmp(decrypted + off, mPlain + off, BLOCK_SIZE) != 0;
+                clear += inClear;
+            } else {
+                garbled += !inClear;
+            }
+        }
+        EXPECT_EQ(0, lost) << "encrypted blocks that did not decrypt to the plaintext";
+        EXPECT_EQ(0, clear) << "blocks left in the clear that should be encrypted";
+        EXPECT_EQ(0, garbled) << "skipped blocks that were written anyway";
+
+        delete[] raw;
+        delete[] decrypted;
+        unmapCryptoDev();
+    }
+
+    static bool every(int) {
+        return true;
+    }
+};
+
+TEST_F(CryptfsTest, EncryptsEveryBlock) {
+    makeExt4();
+    ASSERT_NO_FATAL_FAILURE(writeImage());
+    ASSERT_NO_FATAL_FAILURE(encrypt(0));
+    ASSERT_NO_FATAL_FAILURE(check(every));
+}
+
+TEST_F(CryptfsTest, SkipsUnusedBlocks) {
+    makeExt4();
+    ASSERT_NO_FATAL_FAILURE(writeImage());
+    ASSERT_NO_FATAL_FAILURE(encrypt(1));
+    ASSERT_NO_FATAL_FAILURE(check(isUsed));
+}
+
+TEST_F(CryptfsTest, SkipUnusedWithoutExt4EncryptsEveryBlock) {
+    ASSERT_NO_FATAL_FAILURE(writeImage());
+    ASSERT_NO_FATAL_FAILURE(encrypt(1));
+    ASSERT_NO_FATAL_FAILURE(check(every));
+}
+
+}
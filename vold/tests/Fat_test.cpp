@@ -0,0 +1,144 @@
+/*
+ * Copyright (C) 2012 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define LOG_TAG "Fat_test"
+#include <utils/Log.h>
+#include "../Fat.h"
+#include "newfs_msdos.h"
+
+#include <gtest/gtest.h>
+
+namespace android {
+
+// A 32GB card, kept sparse so the test needs little real space
+static const unsigned int IMAGE_SECTORS = 64 * 1024 * 1024;
+
+class FatTest : public testing::Test {
+protected:
+    char mImage[64];
+    int mLastPercent;
+
+    virtual void SetUp() {
+        strcpy(mImage, "/data/local/tmp/fat_test.img");
+        mLastPercent = -1;
+        int fd = open(mImage, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+        ASSERT_GE(fd, 0);
+        ASSERT_EQ(0, ftruncate64(fd, (off64_t) IMAGE_SECTORS * 512));
+        close(fd);
+    }
+
+    virtual void TearDown() {
+        unlink(mImage);
+    }
+
+    static void onProgress(void *cookie, int percent) {
+        FatTest *test = (FatTest *) cookie;
+        EXPECT_GE(percent, test->mLastPercent);
+        EXPECT_LE(percent, 100);
+        test->mLastPercent = percent;
+    }
+
+    /*
+     * Formats the image in-process the way Fat::format() does, with the
+     * geometry given explicitly since a plain file has none.
+     */
+    int format() {
+        char size[16];
+        const char *args[] = { "newfs_msdos", "-F", "32", "-O", "android", "-c", "8",
+                               "-S", "512", "-h", "255", "-u", "63", "-o", "0",
+                               "-s", size, mImage, NULL };
+
+        snprintf(size, sizeof(size), "%u", IMAGE_SECTORS);
+        return newfs_msdos_format(sizeof(args) / sizeof(args[0]) - 1, (char **) args,
+                                  NULL, NULL);
+    }
+
+    /* Overwrites a FAT32 entry in both copies of the FAT */
+    void setFatEntry(unsigned int cluster, unsigned int value) {
+        unsigned char boot[512];
+        unsigned char entry[4];
+        int fd = open(mImage, O_RDWR);
+
+        ASSERT_GE(fd, 0);
+        ASSERT_EQ((ssize_t) sizeof(boot), pread(fd, boot, sizeof(boot), 0));
+        unsigned int bps = boot[11] | (boot[12] << 8);
+        unsigned int res = boot[14] | (boot[15] << 8);
+        unsigned int spf = boot[36] | (boot[37] << 8) | (boot[38] << 16) | (boot[39] << 24);
+
+        entry[0] = value;
+        entry[1] = value >> 8;
+        entry[2] = value >> 16;
+        entry[3] = value >> 24;
+        for (int i = 0; i < 2; i++) {
+            off64_t offset = ((off64_t) res + (off64_t) i * spf) * bps + cluster * 4;
+            ASSERT_EQ(4, pwrite64(fd, entry, 4, offset));
+        }
+        close(fd);
+    }
+};
+
+TEST_F(FatTest, FreshVolumePassesFastCheck) {
+    struct timespec start, end;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    ASSERT_EQ(0, format());
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    LOGI("Formatted 32GB in %.2f s",
+         (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    EXPECT_EQ(0, Fat::fastCheck(mImage, onProgress, this));
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    EXPECT_EQ(100, mLastPercent);
+    LOGI("Fast check of 32GB took %.2f s",
+         (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9);
+}
+
+TEST_F(FatTest, CrossLinkFailsFastCheck) {
+    ASSERT_EQ(0, format());
+
+    // Two chains sharing cluster 5
+    setFatEntry(3, 5);
+    setFatEntry(4, 5);
+    setFatEntry(5, 0x0fffffff);
+    EXPECT_NE(0, Fat::fastCheck(mImage, NULL, NULL));
+}
+
+TEST_F(FatTest, LoopFailsFastCheck) {
+    ASSERT_EQ(0, format());
+
+    setFatEntry(3, 4);
+    setFatEntry(4, 3);
+    EXPECT_NE(0, Fat::fastCheck(mImage, NULL, NULL));
+}
+
+TEST_F(FatTest, DirtyVolumeFailsFastCheck) {
+    ASSERT_EQ(0, format());
+
+    // Clear the clean shutdown bit, as a mounted volume would have it
+    setFatEntry(1, 0x07ffffff);
+    EXPECT_NE(0, Fat::fastCheck(mImage, NULL, NULL));
+}
+
+}
@@ -0,0 +1,137 @@
+/*
+ * Copyright (C) 2012 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define LOG_TAG "Loop_test"
+#include <utils/Log.h>
+#include "../Loop.h"
+
+#include <gtest/gtest.h>
+
+namespace android {
+
+static const unsigned int IMAGE_SECTORS = 64 * 1024 * 1024 / 512;
+static const int BLOCK_SIZE = 4096;
+static const int BLOCKS = IMAGE_SECTORS * 512 / BLOCK_SIZE;
+
+class LoopTest : public testing::Test {
+protected:
+    char mSparse[64];
+    char mPrealloc[64];
+    char mOther[64];
+
+    virtual void SetUp() {
+        strcpy(mSparse, "/data/local/tmp/loop_sparse.img");
+        strcpy(mPrealloc, "/data/local/tmp/loop_prealloc.img");
+        strcpy(mOther, "/data/local/tmp/loop_other.img");
+    }
+
+    virtual void TearDown() {
+        unlink(mSparse);
+        unlink(mPrealloc);
+        unlink(mOther);
+    }
+
+    /*
+     * Fills the image in random block order, the way a container fills
+     * up over time.  Growing another file in step stands in for the
+     * rest of the filesystem.
+     */
+    void fillRandomly(const char *path) {
+        char block[BLOCK_SIZE];
+        int fd = open(path, O_WRONLY);
+        int other = open(mOther, O_WRONLY | O_CREAT | O_APPEND, 0600);
+        int *order = new int[BLOCKS];
+
+        ASSERT_GE(fd, 0);
+        ASSERT_GE(other, 0);
+        for (int i = 0; i < BLOCKS; i++)
+            order[i] = i;
+        srand(42);
+        for (int i = BLOCKS - 1; i > 0; i--) {
+            int j = rand() % (i + 1);
+            int t = order[i];
+            order[i] = order[j];
+            order[j] = t;
+        }
+
+        memset(block, 0x5a, sizeof(block));
+        for (int i = 0; i < BLOCKS; i++) {
+            ASSERT_EQ(BLOCK_SIZE, pwrite(fd, block, sizeof(block),
+                                         (off_t) order[i] * BLOCK_SIZE));
+            if (!(i % 16)) {
+                write(other, block, sizeof(block));
+                fdatasync(fd);
+            }
+        }
+        fsync(fd);
+        close(other);
+        close(fd);
+        delete[] order;
+    }
+
+    double randomReadMBps(const char *path) {
+        char block[BLOCK_SIZE];
+        struct timespec start, end;
+        int fd = open(path, O_RDONLY);
+
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        srand(7);
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (int i = 0; i < BLOCKS / 4; i++) {
+            pread(fd, block, sizeof(block), (off_t) (rand() % BLOCKS) * BLOCK_SIZE);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        close(fd);
+
+        double secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+        return (BLOCKS / 4) * (double) BLOCK_SIZE / (1024 * 1024) / secs;
+    }
+};
+
+TEST_F(LoopTest, PreallocatedImageIsFullyAllocated) {
+    struct stat st;
+
+    ASSERT_EQ(0, Loop::createImageFile(mSparse, IMAGE_SECTORS));
+    ASSERT_EQ(0, stat(mSparse, &st));
+    EXPECT_EQ((off_t) IMAGE_SECTORS * 512, st.st_size);
+    EXPECT_LT((off_t) st.st_blocks, (off_t) IMAGE_SECTORS);
+
+    ASSERT_EQ(0, Loop::createImageFile(mPrealloc, IMAGE_SECTORS, true));
+    ASSERT_EQ(0, stat(mPrealloc, &st));
+    EXPECT_EQ((off_t) IMAGE_SECTORS * 512, st.st_size);
+    EXPECT_GE((off_t) st.st_blocks, (off_t) IMAGE_SECTORS);
+}
+
+TEST_F(LoopTest, RandomReadThroughput) {
+    ASSERT_EQ(0, Loop::createImageFile(mSparse, IMAGE_SECTORS));
+    fillRandomly(mSparse);
+    ASSERT_EQ(0, Loop::createImageFile(mPrealloc, IMAGE_SECTORS, true));
+    fillRandomly(mPrealloc);
+
+    LOGI("Random 4K reads: sparse image %.1f MB/s, preallocated image %.1f MB/s",
+         randomReadMBps(mSparse), randomReadMBps(mPrealloc));
+}
+
+}
@@ -0,0 +1,130 @@
+/*
+ * Copyright (C) 2012 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define LOG_TAG "MountTable_test"
+#include <utils/Log.h>
+#include "../MountTable.h"
+
+#include <gtest/gtest.h>
+
+namespace android {
+
+static const int ASEC_COUNT = 4000;
+
+/*
+ * Feeds MountTable a mounts file shaped like a device with thousands of
+ * ASECs and OBBs mounted, each ASEC on its own dm device.
+ */
+class MountTableTest : public testing::Test {
+protected:
+    char mPath[64];
+    MountTable *mTable;
+
+    virtual void SetUp() {
+        strcpy(mPath, "/data/local/tmp/mountsXXXXXX");
+        int fd = mkstemp(mPath);
+        ASSERT_GE(fd, 0);
+        close(fd);
+        writeMounts(ASEC_COUNT);
+        mTable = new MountTable(mPath);
+    }
+
+    virtual void TearDown() {
+        delete mTable;
+        unlink(mPath);
+    }
+
+    void writeMounts(int asecs) {
+        FILE *fp = fopen(mPath, "w");
+        ASSERT_TRUE(fp != NULL);
+        fprintf(fp, "rootfs / rootfs ro,relatime 0 0\n");
+        fprintf(fp, "/dev/block/mmcblk0p3 /data ext4 rw,nosuid,nodev 0 0\n");
+        fprintf(fp, "/dev/block/vold/179:17 /mnt/sdcard vfat rw,dirsync 0 0\n");
+        for (int i = 0; i < asecs; i++) {
+            fprintf(fp, "/dev/block/dm-%d /mnt/asec/com.example.app%d-1 vfat ro,dirsync 0 0\n",
+                    i, i);
+        }
+        for (int i = 0; i < 8; i++) {
+            fprintf(fp, "/dev/block/loop%d /mnt/obb/%032x vfat ro,dirsync 0 0\n", i, i);
+        }
+        fclose(fp);
+    }
+};
+
+TEST_F(MountTableTest, LooksUpMountPoints) {
+    EXPECT_TRUE(mTable->isMounted("/data"));
+    EXPECT_TRUE(mTable->isMounted("/mnt/asec/com.example.app0-1"));
+    EXPECT_TRUE(mTable->isMounted("/mnt/asec/com.example.app3999-1"));
+    EXPECT_FALSE(mTable->isMounted("/mnt/asec/com.example.app4000-1"));
+    EXPECT_FALSE(mTable->isMounted("/mnt/asec"));
+}
+
+TEST_F(MountTableTest, ListsMountsUnderDirectory) {
+    MountEntryCollection obbs;
+    MountEntryCollection asecs;
+
+    ASSERT_EQ(0, mTable->getMountsUnder("/mnt/obb", obbs));
+    EXPECT_EQ(8, (int) obbs.size());
+    EXPECT_STREQ("/dev/block/loop0", obbs.begin()->device);
+
+    ASSERT_EQ(0, mTable->getMountsUnder("/mnt/asec/", asecs));
+    EXPECT_EQ(ASEC_COUNT, (int) asecs.size());
+}
+
+TEST_F(MountTableTest, RereadsOnlyWhenChanged) {
+    EXPECT_TRUE(mTable->isMounted("/mnt/asec/com.example.app10-1"));
+
+    // A plain file never raises POLLPRI, so the old table stays in use
+    writeMounts(10);
+    EXPECT_TRUE(mTable->isMounted("/mnt/asec/com.example.app10-1"));
+
+    MountTable fresh(mPath);
+    EXPECT_FALSE(fresh.isMounted("/mnt/asec/com.example.app10-1"));
+    EXPECT_TRUE(fresh.isMounted("/mnt/asec/com.example.app9-1"));
+}
+
+TEST_F(MountTableTest, ManyLookups) {
+    struct timespec start, end;
+    char mountPoint[256];
+
+    // Roughly what a cleanupAsec() pass over every container does
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < ASEC_COUNT; i++) {
+        snprintf(mountPoint, sizeof(mountPoint), "/mnt/asec/com.example.app%d-1", i);
+        ASSERT_TRUE(mTable->isMounted(mountPoint));
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    LOGI("%d lookups took %lld us", ASEC_COUNT,
+         (long long) (end.tv_sec - start.tv_sec) * 1000000 +
+         (end.tv_nsec - start.tv_nsec) / 1000);
+}
+
+TEST_F(MountTableTest, TracksProcMounts) {
+    MountTable table("/proc/self/mounts");
+
+    EXPECT_TRUE(table.isMounted("/"));
+    EXPECT_FALSE(table.isMounted("/no/such/mount/point"));
+}
+
+}
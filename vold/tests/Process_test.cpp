@@ -0,0 +1,146 @@
+/*
+ * Copyright (C) 2012 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#define LOG_TAG "Process_test"
+#include <utils/Log.h>
+#include "../Process.h"
+
+#include <gtest/gtest.h>
+
+namespace android {
+
+static const int USERS_PER_KIND = 8;
+static const int BYSTANDERS = 100;
+
+/*
+ * Forks a farm of idle processes, a third of which hold an fd, a mapping
+ * or their cwd inside a scratch directory.
+ */
+class ProcessTest : public testing::Test {
+protected:
+    char mDir[64];
+    char mFile[96];
+    pid_t mPids[3 * USERS_PER_KIND + BYSTANDERS];
+    int mCount;
+
+    virtual void SetUp() {
+        strcpy(mDir, "/data/local/tmp/proctestXXXXXX");
+        ASSERT_TRUE(mkdtemp(mDir) != NULL);
+        snprintf(mFile, sizeof(mFile), "%s/file", mDir);
+        int fd = open(mFile, O_CREAT | O_RDWR, 0600);
+        ASSERT_GE(fd, 0);
+        ASSERT_EQ(0, ftruncate(fd, 4096));
+        close(fd);
+
+        mCount = 0;
+        for (int i = 0; i < 3 * USERS_PER_KIND + BYSTANDERS; i++) {
+            pid_t pid = fork();
+            ASSERT_GE(pid, 0);
+            if (!pid) {
+                runChild(i < 3 * USERS_PER_KIND ? i % 3 : -1);
+            }
+            mPids[mCount++] = pid;
+        }
+        // Give the children time to get into place
+        usleep(500 * 1000);
+    }
+
+    virtual void TearDown() {
+        for (int i = 0; i < mCount; i++) {
+            kill(mPids[i], SIGKILL);
+            waitpid(mPids[i], NULL, 0);
+        }
+        unlink(mFile);
+        rmdir(mDir);
+    }
+
+    void runChild(int kind) {
+        int fd;
+
+        if (kind == ProcessUser::OpenFile) {
+            open(mFile, O_RDONLY);
+        } else if (kind == ProcessUser::FileMap) {
+            fd = open(mFile, O_RDONLY);
+            mmap(NULL, 4096, PROT_READ, MAP_SHARED, fd, 0);
+            close(fd);
+        } else if (kind == ProcessUser::Cwd) {
+            chdir(mDir);
+        }
+        for (;;) {
+            pause();
+        }
+    }
+};
+
+TEST_F(ProcessTest, FindsEveryUserOnce) {
+    ProcessUserCollection users;
+    int counts[ProcessUser::Exe + 1];
+
+    ASSERT_EQ(0, Process::findProcessesWithOpenFiles(mDir, users));
+    EXPECT_EQ(3 * USERS_PER_KIND, (int) users.size());
+
+    memset(counts, 0, sizeof(counts));
+    for (ProcessUserCollection::iterator it = users.begin(); it != users.end(); ++it) {
+        counts[it->reason]++;
+        if (it->reason == ProcessUser::OpenFile || it->reason == ProcessUser::FileMap) {
+            EXPECT_STREQ(mFile, it->file);
+        }
+    }
+    EXPECT_EQ(USERS_PER_KIND, counts[ProcessUser::OpenFile]);
+    EXPECT_EQ(USERS_PER_KIND, counts[ProcessUser::FileMap]);
+    EXPECT_EQ(USERS_PER_KIND, counts[ProcessUser::Cwd]);
+}
+
+TEST_F(ProcessTest, RepeatedScans) {
+    static const int SCANS = 10;
+    struct timespec start, end;
+
+    // Like the unmount retry loops, which rescan /proc after every attempt
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < SCANS; i++) {
+        ProcessUserCollection users;
+        ASSERT_EQ(0, Process::findProcessesWithOpenFiles(mDir, users));
+        EXPECT_EQ(3 * USERS_PER_KIND, (int) users.size());
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    LOGI("%d scans of /proc took %lld ms", SCANS,
+         (long long) (end.tv_sec - start.tv_sec) * 1000 +
+         (end.tv_nsec - start.tv_nsec) / 1000000);
+}
+
+TEST_F(ProcessTest, IgnoresOtherPaths) {
+    ProcessUserCollection users;
+    char other[96];
+
+    // A sibling sharing mDir as a prefix must not match
+    snprintf(other, sizeof(other), "%s-other", mDir);
+    ASSERT_EQ(0, Process::findProcessesWithOpenFiles(other, users));
+    EXPECT_EQ(0, (int) users.size());
+}
+
+}